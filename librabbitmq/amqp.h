@@ -948,6 +948,54 @@ AMQP_PUBLIC_FUNCTION
 void AMQP_CALL amqp_pool_alloc_bytes(amqp_pool_t *pool, size_t amount,
                                      amqp_bytes_t *output);
 
+/**
+ * Set the size of the calling thread's buffer cache
+ *
+ * By default memory pool pages and connection socket buffers are returned to
+ * the system allocator as soon as they are released. With a buffer cache in
+ * place, released blocks are kept by the releasing thread and handed out
+ * again by the next amqp_new_connection(), amqp_tune_connection() or pool
+ * allocation of the same size on that thread. This avoids the allocator
+ * entirely for applications that create and destroy many connections.
+ *
+ * The cache is per-thread and needs no locking. A thread should call this
+ * function with a max_bytes of 0 before exiting to release its cached memory.
+ *
+ * \param [in] max_bytes the maximum number of bytes held by the calling
+ *  thread's cache. 0 disables the cache and frees any memory it held.
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_UNSUPPORTED if the compiler
+ *  does not support thread-local storage.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_set_thread_buffer_cache(size_t max_bytes);
+
+/**
+ * Back connection buffers and memory pool pages with huge pages
+ *
+ * Once enabled, inbound socket buffers, outbound frame buffers and memory
+ * pool pages between 4KB and 2MB in size are carved out of 2MB huge page
+ * chunks instead of coming from malloc. This reduces TLB misses for
+ * applications using large frame_max values and many channels. Chunks are
+ * mapped with MAP_HUGETLB when huge pages are reserved on the system, and
+ * fall back to madvise(MADV_HUGEPAGE) (transparent huge pages) otherwise.
+ *
+ * Huge page backing applies process-wide and cannot be disabled again.
+ * Chunks are shared by all threads, a block may be released on any of them.
+ * Released blocks are kept for reuse, and a chunk is returned to the system
+ * once none of its blocks is in use. Buffers handed out before this is
+ * called, or while no chunk can be mapped, come from malloc and go back to
+ * it.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_UNSUPPORTED if the platform
+ *  doesn't support huge pages.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_enable_huge_page_buffers(void);
+
 /**
  * Wraps a c string in an amqp_bytes_t
  *
@@ -1314,6 +1362,38 @@ AMQP_PUBLIC_FUNCTION
 void AMQP_CALL amqp_maybe_release_buffers_on_channel(
     amqp_connection_state_t state, amqp_channel_t channel);
 
+/**
+ * Set the automatic buffer release policy of a connection
+ *
+ * When enabled the library recycles the memory associated with a channel by
+ * itself, so amqp_maybe_release_buffers() and
+ * amqp_maybe_release_buffers_on_channel() need not be called. The memory of a
+ * channel is recycled when a new frame arrives on that channel, none of the
+ * channel's frames are queued inside the library, and either threshold has
+ * been reached since the channel's memory was last recycled.
+ *
+ * \warning with a release policy in place, memory returned by the library for
+ *  a channel (e.g., the decoded method of amqp_simple_wait_frame() or the
+ *  reply of an RPC) is only valid until the next frame on that channel is
+ *  read. amqp_consume_message() and amqp_read_message() copy everything they
+ *  return and are not affected.
+ *
+ * \param [in] state the connection object
+ * \param [in] max_bytes recycle a channel once this many bytes of frame data
+ *  have been read on it. 0 disables this threshold.
+ * \param [in] max_frames recycle a channel once this many frames have been
+ *  read on it. 0 disables this threshold.
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ *  max_frames is negative.
+ *
+ * \sa amqp_maybe_release_buffers_on_channel()
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_set_buffer_release_policy(amqp_connection_state_t state,
+                                             size_t max_bytes, int max_frames);
+
 /**
  * Send a frame to the broker
  *
@@ -1948,7 +2028,8 @@ amqp_rpc_reply_t AMQP_CALL amqp_connection_close(amqp_connection_state_t state,
 /**
  * Acknowledges a message
  *
- * Does a basic.ack on a received message
+ * Does a basic.ack on a received message. On a channel with ack coalescing
+ * enabled the ack may only be recorded, see amqp_set_ack_coalescing().
  *
  * \param [in] state the connection object
  * \param [in] channel the channel identifier
@@ -2032,6 +2113,170 @@ AMQP_PUBLIC_FUNCTION
 int AMQP_CALL amqp_basic_nack(amqp_connection_state_t state,
                               amqp_channel_t channel, uint64_t delivery_tag,
                               amqp_boolean_t multiple, amqp_boolean_t requeue);
+
+/**
+ * Coalesce the acks sent on a channel
+ *
+ * Once enabled, amqp_basic_ack() only records the ack. Recorded acks are
+ * sent when max_acks of them have accumulated, when an ack is recorded
+ * max_delay after the first pending one, before the library waits for
+ * more data from the socket, and by amqp_flush_acks(). The acked deliveries
+ * that directly follow the last settled one are acknowledged with a single
+ * basic.ack with multiple set, the others with one basic.ack each, all in a
+ * single write where possible.
+ *
+ * Out of order acks are tracked in a window of 1024 delivery tags past the
+ * oldest unsettled delivery; acks further ahead are sent as they come.
+ * Rejects and nacks are sent straight away. Every delivery on the channel
+ * should be acked or rejected through the API, a delivery that never is,
+ * e.g. one from a consumer with no_ack set, stops acks after it from being
+ * combined.
+ *
+ * Recorded acks are sent before the channel or connection is closed by the
+ * client, and dropped if the broker closes it. Enable coalescing before
+ * the first delivery on the channel, e.g. right after amqp_channel_open().
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel
+ * \param [in] max_acks the most acks recorded before they are sent, 0 sends
+ *              the recorded acks and disables coalescing on the channel
+ * \param [in] max_delay the longest an ack is held back while acks are being
+ *              recorded, NULL for no limit
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if an
+ * argument is invalid, AMQP_STATUS_NO_MEMORY, or an error sending the
+ * recorded acks.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_set_ack_coalescing(amqp_connection_state_t state,
+                                      amqp_channel_t channel, int max_acks,
+                                      const struct timeval *max_delay);
+
+/**
+ * Send the acks recorded on every channel with ack coalescing enabled
+ *
+ * \param [in] state the connection object
+ * \return AMQP_STATUS_OK on success, or an amqp_status_enum value if
+ * sending failed.
+ *
+ * \sa amqp_set_ack_coalescing()
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_flush_acks(amqp_connection_state_t state);
+
+/**
+ * Tune the prefetch count of a channel to the rate deliveries are processed
+ *
+ * Sets a channel-wide prefetch count (basic.qos with global set) of
+ * min_prefetch, then keeps adjusting it between min_prefetch and
+ * max_prefetch. For deliveries read with amqp_consume_message() or
+ * amqp_consume_dispatch() the library measures how long the application
+ * takes from receiving a delivery to settling it with amqp_basic_ack(),
+ * amqp_basic_reject() or amqp_basic_nack(), and how many deliveries it
+ * holds at once; the round trip to the broker is measured on every
+ * basic.qos. The prefetch count aimed for covers the deliveries the
+ * application settles during a round trip plus the ones it holds, with a
+ * quarter on top. Slowdowns are followed faster than speedups.
+ *
+ * A changed prefetch count is sent at the start of the next
+ * amqp_consume_message() or amqp_consume_dispatch() call, at most every
+ * 100ms, and only if it differs by more than a quarter. That call then waits
+ * for the basic.qos-ok; deliveries arriving meanwhile are kept.
+ *
+ * Tuning stops when the channel or connection is closed.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel, it must be open
+ * \param [in] min_prefetch the smallest prefetch count, at least 1
+ * \param [in] max_prefetch the largest prefetch count, 0 stops tuning and
+ *              leaves the prefetch count as it is
+ * \return ret.reply_type == AMQP_RESPONSE_NORMAL on success. Otherwise the
+ * result of the basic.qos, or AMQP_RESPONSE_LIBRARY_EXCEPTION with
+ * AMQP_STATUS_INVALID_PARAMETER or AMQP_STATUS_NO_MEMORY.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL amqp_set_adaptive_prefetch(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    uint16_t min_prefetch, uint16_t max_prefetch);
+
+struct amqp_connection_info;
+
+/**
+ * Record the topology of a connection so it can be recovered
+ *
+ * From here on the connection records the exchanges, queues and bindings
+ * declared on it, and for each channel opened the last basic.qos,
+ * confirm.select and the consumers. Declarations are recorded once the
+ * broker confirms them; deletes, unbinds, cancels and closing a channel
+ * remove what they undo. Passive declares are not recorded.
+ *
+ * amqp_recover_connection() opens the connection's socket again, logs in
+ * with the credentials given here and replays what was recorded:
+ * exchanges and queues, then bindings, on a channel of their own, then each
+ * channel with its qos, confirm mode and consumers. The requests of each
+ * step are sent without waiting for the replies in between. Failed attempts
+ * are retried after 100ms, backing off up to 30s, until timeout passes.
+ *
+ * amqp_consume_message() recovers by itself when the connection fails or
+ * the broker closes it, and goes on waiting.
+ *
+ * After a recovery:
+ *  - delivery tags on a channel continue from the highest one received
+ *    before, whether from basic.deliver or basic.get-ok, and however the
+ *    frame was read. Acks, rejects and nacks for earlier deliveries are
+ *    dropped; the broker redelivers those.
+ *  - a server-named queue has a new name, which its bindings and consumers
+ *    follow. Consumers keep their tags.
+ *  - publisher confirm sequence numbers start over.
+ *  - frames and decoded data received before the failure are gone.
+ *
+ * Should be called right after logging in. Not supported on connections
+ * used through an amqp_mux_t. Acks and rejects sent by an amqp_worker_pool_t
+ * follow the same rules.
+ *
+ * \param [in] state the connection object, logged in over a socket that
+ *              can be opened again, e.g. from amqp_tcp_socket_new()
+ * \param [in] info the broker and credentials to log in with, copied. The
+ *              login uses the PLAIN mechanism and the channel_max,
+ *              frame_max and heartbeat currently negotiated. NULL stops
+ *              recording and forgets what was recorded.
+ * \param [in] timeout the longest time a recovery keeps trying, NULL to
+ *              try forever
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ * information is missing or the connection has no socket, or
+ * AMQP_STATUS_NO_MEMORY.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_set_recovery(amqp_connection_state_t state,
+                                const struct amqp_connection_info *info,
+                                const struct timeval *timeout);
+
+/**
+ * Reconnect and replay the topology recorded by amqp_set_recovery()
+ *
+ * For use after an API call failed because the connection was lost. Any
+ * connection still open is dropped first.
+ *
+ * \param [in] state the connection object
+ * \return ret.reply_type == AMQP_RESPONSE_NORMAL once recovered;
+ * AMQP_RESPONSE_SERVER_EXCEPTION with the channel.close if the broker
+ * refused to redeclare something, which isn't retried; otherwise the error
+ * of the last attempt, or AMQP_STATUS_INVALID_PARAMETER if recovery isn't
+ * set up.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL
+    amqp_recover_connection(amqp_connection_state_t state);
+
 /**
  * Check to see if there is data left in the receive buffer
  *
@@ -2259,6 +2504,126 @@ amqp_rpc_reply_t AMQP_CALL amqp_consume_message(amqp_connection_state_t state,
 AMQP_PUBLIC_FUNCTION
 void AMQP_CALL amqp_destroy_envelope(amqp_envelope_t *envelope);
 
+/**
+ * Callback invoked by amqp_consume_dispatch() for each delivery to a consumer
+ *
+ * The envelope and everything it points to belongs to the library and is
+ * only valid until the callback returns. The callback may use the connection,
+ * e.g., to acknowledge the message or to cancel the consumer.
+ *
+ * \param [in] state the connection object
+ * \param [in] envelope the delivery
+ * \param [in] user_data the pointer passed to amqp_basic_consume_cb()
+ *
+ * \since v0.11.0
+ */
+typedef void(AMQP_CALL *amqp_delivery_callback_t)(amqp_connection_state_t state,
+                                                  amqp_envelope_t *envelope,
+                                                  void *user_data);
+
+/**
+ * Callback invoked by amqp_consume_dispatch() when the broker cancels a
+ * consumer (e.g., because its queue was deleted)
+ *
+ * The consumer has been unregistered when the callback is invoked.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the consumer's channel
+ * \param [in] consumer_tag the consumer's tag, only valid during the callback
+ * \param [in] user_data the pointer passed to amqp_basic_consume_cb()
+ *
+ * \since v0.11.0
+ */
+typedef void(AMQP_CALL *amqp_consumer_cancel_callback_t)(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_bytes_t consumer_tag, void *user_data);
+
+/**
+ * Start a consumer whose deliveries are handed to a callback
+ *
+ * Does the same as amqp_basic_consume() and registers the callbacks under the
+ * consumer tag the broker confirmed. amqp_consume_dispatch() looks the
+ * handler up through a hash of channel and consumer tag, so the cost of
+ * routing a delivery does not depend on the number of consumers.
+ *
+ * The handler is unregistered, without calling on_cancel, once a
+ * channel.close or connection.close is read from the broker, or the reply
+ * to one sent by the client.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel to consume on
+ * \param [in] queue the queue to consume from
+ * \param [in] consumer_tag the consumer tag, amqp_empty_bytes lets the broker
+ *              pick one
+ * \param [in] no_local see amqp_basic_consume()
+ * \param [in] no_ack see amqp_basic_consume()
+ * \param [in] exclusive see amqp_basic_consume()
+ * \param [in] arguments see amqp_basic_consume()
+ * \param [in] on_delivery invoked for each delivery, must not be NULL
+ * \param [in] on_cancel invoked if the broker cancels the consumer, may be
+ *              NULL
+ * \param [in] user_data passed to the callbacks
+ * \return the basic.consume-ok reply on success, NULL on failure; the reason
+ * is available from amqp_get_rpc_reply().
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_basic_consume_ok_t *AMQP_CALL amqp_basic_consume_cb(
+    amqp_connection_state_t state, amqp_channel_t channel, amqp_bytes_t queue,
+    amqp_bytes_t consumer_tag, amqp_boolean_t no_local, amqp_boolean_t no_ack,
+    amqp_boolean_t exclusive, amqp_table_t arguments,
+    amqp_delivery_callback_t on_delivery,
+    amqp_consumer_cancel_callback_t on_cancel, void *user_data);
+
+/**
+ * Cancel a consumer started with amqp_basic_consume_cb()
+ *
+ * Does the same as amqp_basic_cancel(). Deliveries that arrived before the
+ * broker confirmed the cancel are still dispatched to the consumer's
+ * callback, after which it is unregistered.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the consumer's channel
+ * \param [in] consumer_tag the consumer's tag
+ * \return the basic.cancel-ok reply on success, NULL on failure; the reason
+ * is available from amqp_get_rpc_reply().
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_basic_cancel_ok_t *AMQP_CALL amqp_basic_cancel_cb(
+    amqp_connection_state_t state, amqp_channel_t channel,
+    amqp_bytes_t consumer_tag);
+
+/**
+ * Wait for and dispatch a delivery to its consumer's callback
+ *
+ * Reads the next frame. A basic.deliver for a consumer started with
+ * amqp_basic_consume_cb() is read in full and passed to the consumer's
+ * delivery callback; a basic.cancel from the broker for such a consumer is
+ * passed to its cancel callback. Neither the consumer tag, exchange nor
+ * routing key are copied to the heap.
+ *
+ * Any other frame, including deliveries to consumers started with
+ * amqp_basic_consume(), is put back and AMQP_STATUS_UNEXPECTED_STATE is
+ * returned, as with amqp_consume_message(). The caller should then read it
+ * with amqp_simple_wait_frame() or amqp_consume_message().
+ *
+ * \param [in] state the connection object
+ * \param [in] timeout the longest time to wait for a frame, NULL to wait
+ *              indefinitely
+ * \param [in] flags pass in 0. Currently unused.
+ * \returns ret.reply_type == AMQP_RESPONSE_NORMAL once a callback was
+ *          invoked. Otherwise as amqp_consume_message().
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL amqp_consume_dispatch(amqp_connection_state_t state,
+                                                 const struct timeval *timeout,
+                                                 int flags);
+
 /**
  * Parameters used to connect to the RabbitMQ broker
  *
@@ -2310,6 +2675,18 @@ void AMQP_CALL
  *  amqp_default_connection_info. For amqps: URLs the default port will be set
  *  to 5671 instead of 5672 for non-SSL URLs.
  *
+ * A broker listening on a Unix domain socket is given by its path:
+ *
+ * amqp+unix://[$USERNAME[:$PASSWORD]\@]$PATH[?vhost=$VHOST]
+ *
+ * Examples:
+ *  amqp+unix:///var/run/rabbitmq.sock
+ *  amqp+unix://guest:guest\@/var/run/rabbitmq.sock?vhost=myvhost
+ *
+ *  The path, which must be absolute, is returned as the host and the port
+ *  is set to 0. No other URL yields a host starting with '/', so such a
+ *  host with a port of 0 names a Unix domain socket.
+ *
  * \note This function modifies url parameter.
  *
  * \param [in] url URI to parse, note that this parameter is modified by the
@@ -2367,6 +2744,130 @@ AMQP_PUBLIC_FUNCTION
 int AMQP_CALL amqp_socket_open_noblock(amqp_socket_t *self, const char *host,
                                        int port, const struct timeval *timeout);
 
+/**
+ * Open a socket connection to whichever of several brokers answers first
+ *
+ * Like amqp_socket_open_noblock(), but the host names are all looked up
+ * and their addresses tried in turn without waiting for each attempt to
+ * time out: an attempt still pending after 250ms gets the next address
+ * tried alongside it, and an attempt that fails makes way for the next one
+ * straight away. The first connection established is kept and the rest are
+ * abandoned. The addresses of a host alternate between IPv6 and IPv4,
+ * starting with the family the resolver lists first; hosts are tried in the
+ * order given.
+ *
+ * amqp_socket_open() and amqp_socket_open_noblock() go through the
+ * addresses of their one host the same way.
+ *
+ * \param [in,out] self A socket object.
+ * \param [in] hosts The host names to connect to.
+ * \param [in] ports The port to connect to on each of the hosts.
+ * \param [in] count The number of hosts, at least 1.
+ * \param [in] timeout Max allowed time to spend on opening. If NULL - run in
+ *             blocking mode
+ * \param [out] connected The index of the host connected to, may be NULL
+ *
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum on failure.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_socket_open_any(amqp_socket_t *self,
+                                   const char *const *hosts, const int *ports,
+                                   int count, const struct timeval *timeout,
+                                   int *connected);
+
+/**
+ * Tuning applied to a TCP socket as it connects
+ *
+ * Initialize with amqp_socket_options_init() and change only the fields
+ * that matter; a field left at -1 leaves the system default alone. Options
+ * the platform lacks are refused by amqp_socket_set_options().
+ *
+ * Fields are only ever added at the end. struct_size tells the library which
+ * of them the application was built with; the ones it lacks keep their
+ * defaults.
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_socket_options_t_ {
+  size_t struct_size;   /**< sizeof(amqp_socket_options_t), set by
+                             amqp_socket_options_init() */
+  int send_buffer;      /**< SO_SNDBUF in bytes, capped by the system
+                             maximum */
+  int recv_buffer;      /**< SO_RCVBUF in bytes, capped by the system
+                             maximum. Set before connecting so the window
+                             scale fits it */
+  int busy_poll_us;     /**< SO_BUSY_POLL, microseconds a blocking read
+                             spins on the device queue */
+  int quick_ack;        /**< TCP_QUICKACK, 1 to acknowledge right away. The
+                             kernel may leave quick ack mode on its own */
+  int notsent_lowat;    /**< TCP_NOTSENT_LOWAT, bytes of unsent data above
+                             which the socket doesn't poll as writeable */
+  int user_timeout_ms;  /**< TCP_USER_TIMEOUT, how long sent data may go
+                             unacknowledged before the connection fails */
+  int priority;         /**< SO_PRIORITY, the queueing priority */
+  int tos;              /**< IP_TOS, or IPV6_TCLASS on IPv6 */
+  int incoming_cpu;     /**< SO_INCOMING_CPU, the CPU whose receive queue
+                             is preferred */
+} amqp_socket_options_t;
+
+/**
+ * Set all fields of an amqp_socket_options_t to -1, the system defaults, and
+ * struct_size to the size of the structure
+ *
+ * \param [out] options the options to initialize
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void AMQP_CALL amqp_socket_options_init(amqp_socket_options_t *options);
+
+/**
+ * Set the tuning applied to a socket when it next connects
+ *
+ * TCP_NODELAY and SO_KEEPALIVE are always set. The options are copied and
+ * apply to every later amqp_socket_open() and its variants, including
+ * reconnects; a socket that is already open is left as it is. Raising
+ * SO_BUSY_POLL above the net.core.busy_read sysctl needs CAP_NET_ADMIN, and
+ * connecting fails if it's refused.
+ *
+ * \param [in,out] self a socket object from amqp_tcp_socket_new(),
+ *              amqp_ssl_socket_new() or amqp_uring_socket_new().
+ * \param [in] options the options, NULL for the system defaults.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ * struct_size is too small or a size is negative other than -1,
+ * AMQP_STATUS_UNSUPPORTED if struct_size is larger than this version of the
+ * library knows, the platform lacks a requested option or the socket isn't a
+ * TCP socket.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_socket_set_options(amqp_socket_t *self,
+                                      const amqp_socket_options_t *options);
+
+/**
+ * Cache the addresses host names resolve to
+ *
+ * Sockets opened afterwards reuse the result of looking up a host name for
+ * ttl_seconds instead of asking the resolver every time. When none of the
+ * cached addresses of a host can be connected to, they are looked up again
+ * on the next attempt. The cache is shared by the whole process and off by
+ * default.
+ *
+ * \param [in] ttl_seconds how long a lookup is reused, 0 turns the cache off
+ *              and empties it
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ * ttl_seconds is negative.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_set_dns_cache_ttl(int ttl_seconds);
+
 /**
  * Get the socket descriptor in use by a socket object.
  *
@@ -2533,6 +3034,754 @@ AMQP_PUBLIC_FUNCTION
 int AMQP_CALL amqp_set_rpc_timeout(amqp_connection_state_t state,
                                    const struct timeval *timeout);
 
+/**
+ * Get the idle timeout
+ *
+ * \param [in] state the connection object
+ * \return a struct timeval representing the current idle timeout for the state
+ * object. A NULL value means idle buffer release is disabled. The memory
+ * returned is owned by the connection object.
+ *
+ * \sa amqp_set_idle_timeout()
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+struct timeval *AMQP_CALL amqp_get_idle_timeout(amqp_connection_state_t state);
+
+/**
+ * Set the idle timeout
+ *
+ * A connection that has been quiet for the idle timeout releases its socket
+ * buffers and the memory of its channels while it waits for the next frame.
+ * The memory is reacquired on the next read or write. This reduces the
+ * footprint of processes holding many mostly idle connections, which
+ * otherwise keep 128KB of inbound buffer plus a frame_max sized outbound
+ * buffer each. Combine with amqp_set_thread_buffer_cache() to recycle the
+ * released memory between connections.
+ *
+ * The default value is NULL, idle buffer release is disabled.
+ *
+ * \warning memory returned by the library (e.g., decoded frames) must not be
+ * used after the connection goes idle. amqp_consume_message() and
+ * amqp_read_message() copy everything they return and are not affected.
+ *
+ * \param [in] state the connection object
+ * \param [in] timeout a struct timeval* representing the quiet period after
+ * which memory is released. NULL disables idle buffer release. The value of
+ * timeout is copied internally.
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if timeout
+ * is negative.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_set_idle_timeout(amqp_connection_state_t state,
+                                    const struct timeval *timeout);
+
+/**
+ * Spin on the socket before blocking when waiting for input
+ *
+ * When a read finds no data, the connection keeps retrying the socket
+ * without blocking for up to spin_us microseconds before it sleeps in
+ * poll(2). A frame that arrives within that time is picked up without the
+ * scheduler having to wake the thread, which trims tens of microseconds
+ * off the latency, at the price of keeping the core busy. It suits threads
+ * pinned to cores of their own.
+ *
+ * The spin never outlasts the timeout of the call waiting. Polling calls
+ * such as amqp_try_recv() and the event loop don't spin.
+ *
+ * The default is 0, poll straight away.
+ *
+ * \param [in] state the connection object
+ * \param [in] spin_us how long to spin, in microseconds, 0 turns spinning
+ *              off
+ * \param [in] backoff when true the core is told it's spinning between
+ *              retries, with pause or yield instructions whose number
+ *              doubles up to 64 with every empty read. This frees the
+ *              pipeline for a sibling hyperthread and spares system calls,
+ *              but adds up to a few hundred nanoseconds before data is seen.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if
+ * spin_us is negative.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_set_busy_wait(amqp_connection_state_t state, int spin_us,
+                                 amqp_boolean_t backoff);
+
+/**
+ * An event loop waiting on many connections from a single thread
+ *
+ * \sa amqp_event_loop_new()
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_event_loop_t_ amqp_event_loop_t;
+
+/**
+ * Callback invoked by an event loop for a connection
+ *
+ * Called once for each frame received on the connection, with status set to
+ * AMQP_STATUS_OK. Heartbeat frames are handled by the loop and not passed on.
+ * The frame's memory belongs to the connection and follows the same rules as
+ * a frame returned by amqp_simple_wait_frame().
+ *
+ * When the connection fails (e.g., the socket is closed or the broker misses
+ * its heartbeats) the callback is invoked a last time with frame set to NULL
+ * and status set to the error. The connection has already been removed from
+ * the loop at that point.
+ *
+ * The callback may use any function on the connection it is called for,
+ * including amqp_event_loop_remove() and amqp_destroy_connection(). Blocking
+ * calls (e.g., RPCs) stall every other connection in the loop while they wait.
+ * A connection recovered with amqp_recover_connection() stays in the loop and
+ * is watched on its new socket.
+ *
+ * \param [in] loop the event loop
+ * \param [in] state the connection
+ * \param [in] frame the frame received, NULL when the connection failed
+ * \param [in] status AMQP_STATUS_OK, or the error the connection failed with
+ * \param [in] user_data the pointer passed to amqp_event_loop_add()
+ *
+ * \since v0.11.0
+ */
+typedef void(AMQP_CALL *amqp_event_loop_callback_t)(
+    amqp_event_loop_t *loop, amqp_connection_state_t state,
+    const amqp_frame_t *frame, int status, void *user_data);
+
+/**
+ * Create an event loop
+ *
+ * An event loop waits for input on any number of connections using a single
+ * epoll instance, and sends heartbeats, detects missed heartbeats and applies
+ * the idle timeout (see amqp_set_idle_timeout()) for all of them from one
+ * timer wheel. This replaces a thread per connection when a process holds
+ * many mostly idle connections.
+ *
+ * Connections are added once they are logged in and their channels are open.
+ * Sends remain synchronous and are made directly with the usual functions,
+ * from the callback or from the thread running the loop.
+ *
+ * \return a new event loop, or NULL if memory could not be allocated or the
+ * platform has no epoll support.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_event_loop_t *AMQP_CALL amqp_event_loop_new(void);
+
+/**
+ * Destroy an event loop
+ *
+ * Connections still in the loop are removed from it; they are not closed or
+ * destroyed. Must not be called from a callback.
+ *
+ * \param [in] loop the event loop, may be NULL
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void AMQP_CALL amqp_event_loop_destroy(amqp_event_loop_t *loop);
+
+/**
+ * Add a connection to an event loop
+ *
+ * A connection can be in at most one loop, and is removed from it
+ * automatically when it is destroyed. Frames already read by the connection
+ * are delivered on the next amqp_event_loop_run_once().
+ *
+ * \param [in] loop the event loop
+ * \param [in] state the connection, with an open socket
+ * \param [in] callback the function invoked for frames and errors on the
+ *              connection
+ * \param [in] user_data passed to the callback
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if an
+ * argument is NULL, the connection is already in a loop or its socket can't
+ * be polled (see amqp_uring_socket_new()), AMQP_STATUS_SOCKET_CLOSED if the connection has no socket,
+ * AMQP_STATUS_NO_MEMORY, AMQP_STATUS_SOCKET_ERROR if the socket could not be
+ * added to the epoll set, AMQP_STATUS_UNSUPPORTED if the platform has no
+ * epoll support.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_event_loop_add(amqp_event_loop_t *loop,
+                                  amqp_connection_state_t state,
+                                  amqp_event_loop_callback_t callback,
+                                  void *user_data);
+
+/**
+ * Remove a connection from an event loop
+ *
+ * The connection is left open and can be used with the blocking functions
+ * again.
+ *
+ * \param [in] loop the event loop
+ * \param [in] state the connection
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ * connection is not in this loop.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_event_loop_remove(amqp_event_loop_t *loop,
+                                     amqp_connection_state_t state);
+
+/**
+ * Run one iteration of an event loop
+ *
+ * Waits until at least one callback has been invoked, reading and dispatching
+ * input from every connection that becomes readable. Heartbeat and idle timers
+ * that expire while waiting are handled without returning.
+ *
+ * \param [in] loop the event loop
+ * \param [in] timeout the longest time to wait, NULL to wait indefinitely
+ * \return AMQP_STATUS_OK once callbacks were invoked, AMQP_STATUS_TIMEOUT if
+ * the timeout expired first, AMQP_STATUS_INVALID_PARAMETER if called from a
+ * callback, AMQP_STATUS_SOCKET_ERROR or AMQP_STATUS_TIMER_FAILURE on system
+ * errors. Errors on individual connections are reported to their callback.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_event_loop_run_once(amqp_event_loop_t *loop,
+                                       const struct timeval *timeout);
+
+/**
+ * A pool of threads processing the deliveries read from one connection
+ *
+ * \sa amqp_worker_pool_new()
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_worker_pool_t_ amqp_worker_pool_t;
+
+/**
+ * Callback invoked on a worker thread for each delivery
+ *
+ * The envelope belongs to the pool and is only valid until the callback
+ * returns. The connection is not thread-safe and must not be used from the
+ * callback; the delivery is settled with amqp_worker_pool_ack() or
+ * amqp_worker_pool_reject() instead.
+ *
+ * \param [in] pool the worker pool
+ * \param [in] envelope the delivery
+ * \param [in] user_data the pointer passed to amqp_worker_pool_new()
+ *
+ * \since v0.11.0
+ */
+typedef void(AMQP_CALL *amqp_worker_callback_t)(amqp_worker_pool_t *pool,
+                                                amqp_envelope_t *envelope,
+                                                void *user_data);
+
+/**
+ * Callback choosing the ordering key of a delivery
+ *
+ * Invoked on the thread calling amqp_worker_pool_dispatch(). Deliveries with
+ * equal keys are processed by the same worker, in the order they arrived.
+ * The returned bytes only need to be valid until the callback returns.
+ *
+ * \param [in] envelope the delivery
+ * \param [in] user_data the pointer passed to amqp_worker_pool_new()
+ * \return the key
+ *
+ * \since v0.11.0
+ */
+typedef amqp_bytes_t(AMQP_CALL *amqp_worker_key_callback_t)(
+    const amqp_envelope_t *envelope, void *user_data);
+
+/**
+ * Create a pool of worker threads for the deliveries on a connection
+ *
+ * The thread calling amqp_worker_pool_dispatch() keeps ownership of the
+ * connection and does all of its IO, while deliveries are processed on
+ * num_workers threads. Deliveries are handed to the workers, and settled
+ * deliveries handed back, through single-producer single-consumer rings, so
+ * neither side takes a lock while the other is busy.
+ *
+ * Each delivery is pinned to a worker by a hash of its routing key, or of the
+ * key returned by the key callback, so deliveries sharing a key are
+ * processed in order.
+ *
+ * \param [in] state the connection object, with its consumers started with
+ *              amqp_basic_consume()
+ * \param [in] num_workers the number of worker threads, at least 1
+ * \param [in] queue_depth the most deliveries queued for or held by one
+ *              worker, rounded up to a power of two; 0 picks a default of 64
+ * \param [in] on_delivery invoked on a worker for each delivery, must not be
+ *              NULL
+ * \param [in] key picks the ordering key of a delivery, NULL orders by
+ *              routing key
+ * \param [in] user_data passed to the callbacks
+ * \return a new worker pool, or NULL if an argument is invalid, memory could
+ * not be allocated, a thread could not be started or the platform has no
+ * support for it.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_worker_pool_t *AMQP_CALL amqp_worker_pool_new(
+    amqp_connection_state_t state, int num_workers, int queue_depth,
+    amqp_worker_callback_t on_delivery, amqp_worker_key_callback_t key,
+    void *user_data);
+
+/**
+ * Read the next delivery and hand it to a worker
+ *
+ * Sends the acks and rejects posted by the workers, then waits for a
+ * delivery as amqp_consume_message() does. While deliveries are being
+ * processed the wait is broken into short slices so that posted acks are
+ * sent promptly. If the chosen worker's queue is full, waits for it to
+ * make room.
+ *
+ * \param [in] pool the worker pool
+ * \param [in] timeout the longest time to wait for a delivery, NULL to wait
+ *              indefinitely
+ * \param [in] flags pass in 0. Currently unused.
+ * \returns ret.reply_type == AMQP_RESPONSE_NORMAL once a delivery was handed
+ *          to a worker. Otherwise as amqp_consume_message(); in particular
+ *          AMQP_STATUS_UNEXPECTED_STATE means a frame other than a delivery
+ *          was put back for the caller to read.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL amqp_worker_pool_dispatch(
+    amqp_worker_pool_t *pool, const struct timeval *timeout, int flags);
+
+/**
+ * Acknowledge a delivery from a worker callback
+ *
+ * Must be called from the worker callback the envelope was passed to. The
+ * basic.ack is sent by the thread running amqp_worker_pool_dispatch() after
+ * the callback returns; acks collected together are written to the socket
+ * at once.
+ *
+ * \param [in] pool the worker pool
+ * \param [in] envelope the envelope passed to the callback
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ * envelope was not passed by this pool.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_worker_pool_ack(amqp_worker_pool_t *pool,
+                                   amqp_envelope_t *envelope);
+
+/**
+ * Reject a delivery from a worker callback
+ *
+ * As amqp_worker_pool_ack(), but sends a basic.reject. The last of
+ * amqp_worker_pool_ack() and amqp_worker_pool_reject() called for a delivery
+ * wins.
+ *
+ * \param [in] pool the worker pool
+ * \param [in] envelope the envelope passed to the callback
+ * \param [in] requeue whether the broker should requeue the message
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ * envelope was not passed by this pool.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_worker_pool_reject(amqp_worker_pool_t *pool,
+                                      amqp_envelope_t *envelope,
+                                      amqp_boolean_t requeue);
+
+/**
+ * Send the acks and rejects posted by the workers so far
+ *
+ * Must be called from the thread owning the connection.
+ *
+ * \param [in] pool the worker pool
+ * \return AMQP_STATUS_OK on success, or the error sending failed with.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_worker_pool_flush(amqp_worker_pool_t *pool);
+
+/**
+ * Destroy a worker pool
+ *
+ * Waits for the workers to process the deliveries already handed to them,
+ * sends their acks and joins the threads. The connection is left open.
+ *
+ * \param [in] pool the worker pool, may be NULL
+ * \return AMQP_STATUS_OK on success, or the error sending the last acks
+ * failed with; the pool is destroyed either way.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_worker_pool_destroy(amqp_worker_pool_t *pool);
+
+/**
+ * A connection shared by many threads, with all IO done on a thread of its
+ * own
+ *
+ * \sa amqp_mux_new()
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_mux_t_ amqp_mux_t;
+
+/**
+ * A channel of a multiplexed connection, used by one thread at a time
+ *
+ * \sa amqp_mux_channel_new()
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_mux_channel_t_ amqp_mux_channel_t;
+
+/**
+ * Start an IO thread for a connection
+ *
+ * From here on only the IO thread reads from and writes to the connection,
+ * and it must not be used directly until amqp_mux_destroy() returns. Other
+ * threads each get a channel handle from amqp_mux_channel_new(). Requests
+ * are encoded on the thread making them and queued for the IO thread
+ * through a single-producer single-consumer ring per handle; the IO thread
+ * gathers the frames queued on all handles into as few writes as it can.
+ * Deliveries are queued the other way on the handle of their channel.
+ *
+ * The IO thread sends heartbeats and answers connection.close and
+ * channel.close from the broker. Returned messages are handed to the owner
+ * of their channel by amqp_mux_consume_message().
+ *
+ * \param [in] state a logged in connection object
+ * \return a new multiplexer, or NULL if the connection has no socket or one
+ * that can't be polled (see amqp_uring_socket_new()), memory could not be
+ * allocated, the thread could not be started or the platform has no support
+ * for it.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_mux_t *AMQP_CALL amqp_mux_new(amqp_connection_state_t state);
+
+/**
+ * Stop the IO thread
+ *
+ * All channel handles must have been destroyed. Requests already queued may
+ * not have been sent. The connection is handed back to the caller, who may
+ * close it with amqp_connection_close() if the IO thread stopped cleanly.
+ *
+ * \param [in] mux the multiplexer, may be NULL
+ * \return AMQP_STATUS_OK if the IO thread was running, otherwise the error
+ * that stopped it, e.g. AMQP_STATUS_CONNECTION_CLOSED if the broker closed
+ * the connection.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_mux_destroy(amqp_mux_t *mux);
+
+/**
+ * Create a handle for a channel of a multiplexed connection
+ *
+ * Only registers the channel, it's opened with amqp_mux_channel_open(). A
+ * handle may be passed between threads, but must not be used from two
+ * threads at once.
+ *
+ * \param [in] mux the multiplexer
+ * \param [in] channel the channel number, from 1 to the negotiated
+ *              channel_max
+ * \return a new handle, or NULL if the channel number is invalid or already
+ * has a handle, memory could not be allocated or the IO thread has stopped.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_mux_channel_t *AMQP_CALL amqp_mux_channel_new(amqp_mux_t *mux,
+                                                   amqp_channel_t channel);
+
+/**
+ * Destroy a channel handle
+ *
+ * Waits for the IO thread to let go of the handle. The channel is not
+ * closed; close it with amqp_mux_channel_close() first. Deliveries not yet
+ * consumed are freed without being acknowledged.
+ *
+ * \param [in] channel the handle, may be NULL
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void AMQP_CALL amqp_mux_channel_destroy(amqp_mux_channel_t *channel);
+
+/**
+ * Make a synchronous RPC on a channel of a multiplexed connection
+ *
+ * As amqp_simple_rpc(), but waits for the IO thread to read the reply. The
+ * decoded reply stays valid until the next call to amqp_mux_simple_rpc() on
+ * the handle.
+ *
+ * \param [in] channel the handle
+ * \param [in] request_id the method number of the request
+ * \param [in] decoded_request_method the request
+ * \param [in] expected_reply_ids a 0 terminated array of the acceptable
+ *              replies
+ * \return ret.reply_type == AMQP_RESPONSE_NORMAL with the reply in
+ * ret.reply, AMQP_RESPONSE_SERVER_EXCEPTION if the broker closed the
+ * channel, or AMQP_RESPONSE_LIBRARY_EXCEPTION with the error that stopped
+ * the IO thread.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL amqp_mux_simple_rpc(
+    amqp_mux_channel_t *channel, amqp_method_number_t request_id,
+    void *decoded_request_method,
+    const amqp_method_number_t *expected_reply_ids);
+
+/**
+ * Open the channel of a handle
+ *
+ * \param [in] channel the handle
+ * \return as amqp_mux_simple_rpc()
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL amqp_mux_channel_open(amqp_mux_channel_t *channel);
+
+/**
+ * Close the channel of a handle
+ *
+ * \param [in] channel the handle
+ * \param [in] code the reply code, e.g. AMQP_REPLY_SUCCESS
+ * \return as amqp_mux_simple_rpc()
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL amqp_mux_channel_close(amqp_mux_channel_t *channel,
+                                                  int code);
+
+/**
+ * Queue a method that has no reply on a multiplexed connection
+ *
+ * Returns once the method is encoded and queued; it's written to the socket
+ * later by the IO thread. If the handle's queue is full, waits for room.
+ *
+ * \param [in] channel the handle
+ * \param [in] method the method number
+ * \param [in] decoded the method
+ * \return AMQP_STATUS_OK once queued, AMQP_STATUS_UNEXPECTED_STATE if the
+ * channel is not open, AMQP_STATUS_NO_MEMORY, an encoding error, or the
+ * error that stopped the IO thread.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_mux_send_method(amqp_mux_channel_t *channel,
+                                   amqp_method_number_t method, void *decoded);
+
+/**
+ * Queue a basic.ack on a multiplexed connection
+ *
+ * \param [in] channel the handle the delivery was consumed from
+ * \param [in] delivery_tag the delivery tag
+ * \param [in] multiple whether all deliveries up to delivery_tag are
+ *              acknowledged
+ * \return as amqp_mux_send_method()
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_mux_basic_ack(amqp_mux_channel_t *channel,
+                                 uint64_t delivery_tag,
+                                 amqp_boolean_t multiple);
+
+/**
+ * Queue a message for publishing on a multiplexed connection
+ *
+ * As amqp_basic_publish(), but the method, header and body frames are
+ * encoded on the calling thread and written later by the IO thread. The
+ * body is copied, the caller may reuse it once this returns.
+ *
+ * \param [in] channel the handle
+ * \param [in] exchange the exchange to publish to
+ * \param [in] routing_key the routing key
+ * \param [in] mandatory the mandatory flag
+ * \param [in] immediate the immediate flag
+ * \param [in] properties the message properties, NULL for none
+ * \param [in] body the message body
+ * \return as amqp_mux_send_method()
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_mux_basic_publish(
+    amqp_mux_channel_t *channel, amqp_bytes_t exchange,
+    amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+    amqp_boolean_t immediate, struct amqp_basic_properties_t_ const *properties,
+    amqp_bytes_t body);
+
+/**
+ * Wait for a delivery on the channel of a handle
+ *
+ * As amqp_consume_message(), for the consumers started on this channel with
+ * amqp_mux_simple_rpc(), and for messages published on it with the
+ * mandatory flag that the broker returned. Those come with
+ * ret.reply.id == AMQP_BASIC_RETURN_METHOD and the amqp_basic_return_t in
+ * ret.reply.decoded, valid until the next call on the handle; their
+ * envelope has no consumer or delivery tag and must not be acknowledged.
+ *
+ * The IO thread reads deliveries as they arrive and holds on to the ones the
+ * owner hasn't taken yet, however many there are. Consumers on a
+ * multiplexed connection should set a prefetch count with basic.qos to bound
+ * that memory.
+ *
+ * \param [in] channel the handle
+ * \param [out] envelope the delivery, free it with amqp_destroy_envelope()
+ * \param [in] timeout the longest time to wait, NULL to wait indefinitely
+ * \param [in] flags pass in 0. Currently unused.
+ * \return ret.reply_type == AMQP_RESPONSE_NORMAL with a delivery, where
+ * ret.reply.id is AMQP_BASIC_DELIVER_METHOD or AMQP_BASIC_RETURN_METHOD,
+ * AMQP_RESPONSE_SERVER_EXCEPTION if the broker closed the channel, or
+ * AMQP_RESPONSE_LIBRARY_EXCEPTION with AMQP_STATUS_TIMEOUT,
+ * AMQP_STATUS_UNEXPECTED_STATE if the channel is not open, or the error that
+ * stopped the IO thread.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t AMQP_CALL amqp_mux_consume_message(
+    amqp_mux_channel_t *channel, amqp_envelope_t *envelope,
+    const struct timeval *timeout, int flags);
+
+/**
+ * A set of connections to one or more brokers for publishing
+ *
+ * \sa amqp_producer_pool_new()
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_producer_pool_t_ amqp_producer_pool_t;
+
+/**
+ * How a producer pool picks the channel for the next message
+ *
+ * \since v0.11.0
+ */
+typedef enum amqp_producer_pool_selection_enum_ {
+  AMQP_PRODUCER_POOL_ROUND_ROBIN = 0, /**< each channel in turn */
+  AMQP_PRODUCER_POOL_LEAST_OUTSTANDING /**< the channel with the fewest
+                                          publishes the broker hasn't
+                                          confirmed yet */
+} amqp_producer_pool_selection_enum;
+
+/**
+ * Create a pool of connections for publishing
+ *
+ * Opens num_connections connections, logs them in with the PLAIN mechanism
+ * and opens channels 1 to channels_per_connection on each, in confirm mode.
+ * The connections are spread over the brokers. Messages published with
+ * amqp_producer_pool_publish() go to the channel picked by selection;
+ * consecutive channels are on different connections.
+ *
+ * A connection that fails to connect or log in, fails a write, or that the
+ * broker closes, is dropped. It's replaced on the next broker in the list by
+ * a later amqp_producer_pool_publish(), at first after 100ms and backing off
+ * up to 30s while the attempts fail. Messages it hadn't confirmed are
+ * counted as nacked. A channel the broker closes, for example after a
+ * publish to an exchange that doesn't exist, is opened again on the same
+ * connection once the close is read; only the messages that channel hadn't
+ * confirmed are counted as nacked.
+ *
+ * Connections use the default frame size, no heartbeats and plain TCP.
+ * Connecting and logging in block the calling thread. The pool must only be
+ * used by one thread at a time.
+ *
+ * \param [in] brokers the brokers to connect to, copied. ssl must be 0
+ * \param [in] num_brokers the number of brokers
+ * \param [in] num_connections the number of connections, at least 1
+ * \param [in] channels_per_connection the number of channels on each
+ *              connection, from 1 to AMQP_DEFAULT_MAX_CHANNELS
+ * \param [in] selection how channels are picked
+ * \param [in] connect_timeout the longest time to wait for a TCP connection
+ *              to be established, NULL to wait as long as the system does
+ * \return a new pool, or NULL if a parameter is invalid or memory could not
+ * be allocated. Connections that could not be opened are retried later, so
+ * the pool is returned even if no broker is reachable.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_producer_pool_t *AMQP_CALL amqp_producer_pool_new(
+    const struct amqp_connection_info *brokers, int num_brokers,
+    int num_connections, int channels_per_connection,
+    amqp_producer_pool_selection_enum selection,
+    const struct timeval *connect_timeout);
+
+/**
+ * Publish a message on a channel of the pool
+ *
+ * As amqp_basic_publish() on the channel the pool's selection picks. The
+ * confirms the brokers sent meanwhile are read first, at most every
+ * millisecond. If the write fails, the connection is dropped and the message
+ * is published on the next one that is up.
+ *
+ * Messages returned by the broker are discarded.
+ *
+ * \param [in] pool the pool
+ * \param [in] exchange the exchange to publish to
+ * \param [in] routing_key the routing key
+ * \param [in] mandatory the mandatory flag
+ * \param [in] immediate the immediate flag
+ * \param [in] properties the message properties, NULL for none
+ * \param [in] body the message body
+ * \return AMQP_STATUS_OK once written, AMQP_STATUS_CONNECTION_CLOSED if no
+ * connection is up, or the error the last write failed with.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_producer_pool_publish(
+    amqp_producer_pool_t *pool, amqp_bytes_t exchange,
+    amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+    amqp_boolean_t immediate, struct amqp_basic_properties_t_ const *properties,
+    amqp_bytes_t body);
+
+/**
+ * Wait until the brokers have confirmed everything published on the pool
+ *
+ * \param [in] pool the pool
+ * \param [in] timeout the longest time to wait, NULL to wait indefinitely
+ * \param [out] nacked the number of messages nacked by the brokers or
+ *              lost with a connection since the last call, may be NULL. Only
+ *              set on success.
+ * \return AMQP_STATUS_OK once every message was acked, nacked or lost,
+ * AMQP_STATUS_TIMEOUT, or AMQP_STATUS_INVALID_PARAMETER.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_producer_pool_wait_confirms(amqp_producer_pool_t *pool,
+                                               const struct timeval *timeout,
+                                               uint64_t *nacked);
+
+/**
+ * Close the connections of a pool and destroy it
+ *
+ * Confirms not yet received are not waited for, see
+ * amqp_producer_pool_wait_confirms().
+ *
+ * \param [in] pool the pool, may be NULL
+ * \return AMQP_STATUS_OK, or the first error closing a connection failed
+ * with; the pool is destroyed either way.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_producer_pool_destroy(amqp_producer_pool_t *pool);
+
 AMQP_END_DECLS
 
 #endif /* AMQP_H */
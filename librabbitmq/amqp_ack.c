@@ -0,0 +1,419 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_socket.h"
+#include "amqp_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Delivery tags tracked past the highest tag below which every delivery is
+ * settled. Must be a multiple of 64. */
+#define AMQP_ACK_WINDOW_SIZE 1024
+#define AMQP_ACK_WINDOW_WORDS (AMQP_ACK_WINDOW_SIZE / 64)
+
+struct amqp_ack_window_t_ {
+  struct amqp_ack_window_t_ *next;
+  amqp_channel_t channel;
+
+  int max_acks;
+  struct timeval *max_delay;
+  struct timeval internal_max_delay;
+
+  /* Every delivery up to and including base is settled and its ack sent */
+  uint64_t base;
+  /* Acks recorded but not sent yet, and when the first of them was */
+  int pending;
+  amqp_time_t deadline;
+
+  /* Bit (tag % AMQP_ACK_WINDOW_SIZE), for base < tag <= base + window size.
+   * settled: acked or rejected by the application. unsent: acked but not
+   * sent yet, always a subset of settled. */
+  uint64_t settled[AMQP_ACK_WINDOW_WORDS];
+  uint64_t unsent[AMQP_ACK_WINDOW_WORDS];
+};
+
+/* Queues the acks of a flush so that all but the last are sent with
+ * AMQP_SF_MORE and leave in as few writes as possible */
+typedef struct amqp_ack_sender_t_ {
+  amqp_connection_state_t state;
+  int have;
+  amqp_channel_t channel;
+  amqp_basic_ack_t ack;
+} amqp_ack_sender_t;
+
+static int test_bit(const uint64_t *bits, uint64_t tag) {
+  size_t i = (size_t)(tag % AMQP_ACK_WINDOW_SIZE);
+  return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void set_bit(uint64_t *bits, uint64_t tag) {
+  size_t i = (size_t)(tag % AMQP_ACK_WINDOW_SIZE);
+  bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void clear_bit(uint64_t *bits, uint64_t tag) {
+  size_t i = (size_t)(tag % AMQP_ACK_WINDOW_SIZE);
+  bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static int in_window(const amqp_ack_window_t *window, uint64_t tag) {
+  return tag > window->base && tag - window->base <= AMQP_ACK_WINDOW_SIZE;
+}
+
+static void reset_window(amqp_ack_window_t *window) {
+  window->base = 0;
+  window->pending = 0;
+  memset(window->settled, 0, sizeof(window->settled));
+  memset(window->unsent, 0, sizeof(window->unsent));
+}
+
+/* Moves base up to tag, forgetting everything at or below it */
+static void advance_window(amqp_ack_window_t *window, uint64_t tag) {
+  if (tag <= window->base) {
+    return;
+  }
+  if (tag - window->base >= AMQP_ACK_WINDOW_SIZE) {
+    reset_window(window);
+  } else {
+    uint64_t t;
+    for (t = window->base + 1; t <= tag; ++t) {
+      if (test_bit(window->unsent, t)) {
+        window->pending--;
+      }
+      clear_bit(window->settled, t);
+      clear_bit(window->unsent, t);
+    }
+  }
+  window->base = tag;
+}
+
+static amqp_ack_window_t *find_window(amqp_connection_state_t state,
+                                      amqp_channel_t channel) {
+  amqp_ack_window_t *window;
+  for (window = state->ack_windows; NULL != window; window = window->next) {
+    if (window->channel == channel) {
+      return window;
+    }
+  }
+  return NULL;
+}
+
+static int sender_push(amqp_ack_sender_t *sender, amqp_channel_t channel,
+                       uint64_t tag, amqp_boolean_t multiple) {
+  int res = AMQP_STATUS_OK;
+  if (sender->have) {
+    res = amqp_send_method_inner(sender->state, sender->channel,
+                                 AMQP_BASIC_ACK_METHOD, &sender->ack,
+                                 AMQP_SF_MORE, amqp_time_infinite());
+  }
+  sender->have = 1;
+  sender->channel = channel;
+  sender->ack.delivery_tag = tag;
+  sender->ack.multiple = multiple;
+  return res;
+}
+
+static int sender_finish(amqp_ack_sender_t *sender) {
+  if (!sender->have) {
+    return AMQP_STATUS_OK;
+  }
+  sender->have = 0;
+  return amqp_send_method_inner(sender->state, sender->channel,
+                                AMQP_BASIC_ACK_METHOD, &sender->ack,
+                                AMQP_SF_NONE, amqp_time_infinite());
+}
+
+/* Sends every recorded ack of the window. The run of settled deliveries just
+ * past base collapses into a single ack with multiple set; acks past the
+ * first unsettled delivery are sent one by one. */
+static int flush_window(amqp_ack_window_t *window, amqp_ack_sender_t *sender) {
+  uint64_t tag;
+  uint64_t last = 0;
+  int covered = 0;
+  int res;
+
+  for (tag = window->base + 1;
+       in_window(window, tag) && test_bit(window->settled, tag); ++tag) {
+    if (test_bit(window->unsent, tag)) {
+      last = tag;
+      covered++;
+      clear_bit(window->unsent, tag);
+    }
+    clear_bit(window->settled, tag);
+  }
+  window->base = tag - 1;
+  window->pending -= covered;
+  if (0 != covered) {
+    /* The last acked tag must itself be unacknowledged at the broker, so it,
+     * and not base, is the one sent */
+    res = sender_push(sender, window->channel, last, covered > 1);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  for (++tag; 0 != window->pending && in_window(window, tag); ++tag) {
+    if (test_bit(window->unsent, tag)) {
+      clear_bit(window->unsent, tag);
+      window->pending--;
+      res = sender_push(sender, window->channel, tag, 0);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+static int flush_one(amqp_connection_state_t state,
+                     amqp_ack_window_t *window) {
+  amqp_ack_sender_t sender;
+  int res;
+
+  sender.state = state;
+  sender.have = 0;
+  res = flush_window(window, &sender);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  return sender_finish(&sender);
+}
+
+int amqp_flush_acks(amqp_connection_state_t state) {
+  amqp_ack_window_t *window;
+  amqp_ack_sender_t sender;
+  int res;
+
+  if (NULL == state) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  sender.state = state;
+  sender.have = 0;
+  for (window = state->ack_windows; NULL != window; window = window->next) {
+    if (0 != window->pending) {
+      res = flush_window(window, &sender);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+  return sender_finish(&sender);
+}
+
+int amqp_set_ack_coalescing(amqp_connection_state_t state,
+                            amqp_channel_t channel, int max_acks,
+                            const struct timeval *max_delay) {
+  amqp_ack_window_t *window;
+  amqp_ack_window_t **prev;
+  int res;
+
+  if (NULL == state || 0 == channel || max_acks < 0 ||
+      (NULL != max_delay &&
+       (max_delay->tv_sec < 0 || max_delay->tv_usec < 0))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  for (prev = &state->ack_windows; NULL != *prev; prev = &(*prev)->next) {
+    if ((*prev)->channel == channel) {
+      break;
+    }
+  }
+  window = *prev;
+
+  if (0 == max_acks) {
+    if (NULL == window) {
+      return AMQP_STATUS_OK;
+    }
+    res = flush_one(state, window);
+    *prev = window->next;
+    free(window);
+    return res;
+  }
+
+  if (NULL == window) {
+    window = calloc(1, sizeof(amqp_ack_window_t));
+    if (NULL == window) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    window->channel = channel;
+    window->next = state->ack_windows;
+    state->ack_windows = window;
+  }
+  window->max_acks = max_acks;
+  if (NULL == max_delay) {
+    window->max_delay = NULL;
+  } else {
+    window->internal_max_delay = *max_delay;
+    window->max_delay = &window->internal_max_delay;
+  }
+
+  if (window->pending >= max_acks) {
+    return flush_one(state, window);
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Sends an ack, reject or nack straight away and keeps the window in step:
+ * pending acks go out first if it covers more than one delivery */
+int amqp_ack_window_send(amqp_connection_state_t state, amqp_channel_t channel,
+                         amqp_method_number_t id, void *decoded,
+                         uint64_t delivery_tag, amqp_boolean_t multiple) {
+  amqp_ack_window_t *window = find_window(state, channel);
+  int res;
+
+  if (NULL != window && multiple) {
+    res = flush_one(state, window);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  res = amqp_send_method(state, channel, id, decoded);
+  if (AMQP_STATUS_OK != res || NULL == window) {
+    return res;
+  }
+
+  if (multiple) {
+    advance_window(window, delivery_tag);
+  } else if (in_window(window, delivery_tag)) {
+    set_bit(window->settled, delivery_tag);
+  }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_ack_window_ack(amqp_connection_state_t state, amqp_channel_t channel,
+                        uint64_t delivery_tag, amqp_boolean_t multiple) {
+  amqp_ack_window_t *window = find_window(state, channel);
+  amqp_basic_ack_t m;
+  int res;
+
+  m.delivery_tag = delivery_tag;
+  m.multiple = multiple;
+  if (NULL == window || multiple) {
+    return amqp_ack_window_send(state, channel, AMQP_BASIC_ACK_METHOD, &m,
+                                delivery_tag, multiple);
+  }
+
+  if (delivery_tag > window->base &&
+      delivery_tag - window->base > AMQP_ACK_WINDOW_SIZE) {
+    /* Settling what's already acked may move the window far enough */
+    res = flush_one(state, window);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  if (!in_window(window, delivery_tag) ||
+      test_bit(window->settled, delivery_tag)) {
+    /* Too far ahead of an unsettled delivery, or settled twice. Sent as
+     * is, a repeated tag gets the same answer from the broker as it would
+     * have without coalescing. */
+    return amqp_send_method(state, channel, AMQP_BASIC_ACK_METHOD, &m);
+  }
+
+  set_bit(window->settled, delivery_tag);
+  set_bit(window->unsent, delivery_tag);
+  if (1 == ++window->pending) {
+    res = amqp_time_from_now(&window->deadline, window->max_delay);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  if (window->pending >= window->max_acks) {
+    return flush_one(state, window);
+  }
+  res = amqp_time_has_past(window->deadline);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    return flush_one(state, window);
+  }
+  return res;
+}
+
+int amqp_ack_windows_before_method(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_method_number_t id) {
+  amqp_ack_window_t *window;
+  int res;
+
+  switch (id) {
+    case AMQP_CHANNEL_OPEN_METHOD:
+      /* Delivery tags start over on a new channel */
+      window = find_window(state, channel);
+      if (NULL != window) {
+        reset_window(window);
+      }
+      return AMQP_STATUS_OK;
+
+    case AMQP_CHANNEL_CLOSE_METHOD:
+      window = find_window(state, channel);
+      if (NULL == window) {
+        return AMQP_STATUS_OK;
+      }
+      res = flush_one(state, window);
+      reset_window(window);
+      return res;
+
+    case AMQP_CHANNEL_CLOSE_OK_METHOD:
+      /* The broker closed the channel, its deliveries are requeued and acks
+       * for them would be a protocol error */
+      window = find_window(state, channel);
+      if (NULL != window) {
+        reset_window(window);
+      }
+      return AMQP_STATUS_OK;
+
+    case AMQP_CONNECTION_CLOSE_METHOD:
+      res = amqp_flush_acks(state);
+      for (window = state->ack_windows; NULL != window;
+           window = window->next) {
+        reset_window(window);
+      }
+      return res;
+
+    case AMQP_CONNECTION_CLOSE_OK_METHOD:
+      for (window = state->ack_windows; NULL != window;
+           window = window->next) {
+        reset_window(window);
+      }
+      return AMQP_STATUS_OK;
+
+    default:
+      return AMQP_STATUS_OK;
+  }
+}
+
+void amqp_destroy_ack_windows(amqp_connection_state_t state) {
+  while (NULL != state->ack_windows) {
+    amqp_ack_window_t *window = state->ack_windows;
+    state->ack_windows = window->next;
+    free(window);
+  }
+}
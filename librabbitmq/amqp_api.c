@@ -318,6 +318,16 @@ amqp_rpc_reply_t amqp_connection_close(amqp_connection_state_t state,
 int amqp_basic_ack(amqp_connection_state_t state, amqp_channel_t channel,
                    uint64_t delivery_tag, amqp_boolean_t multiple) {
   amqp_basic_ack_t m;
+  if (NULL != state->prefetch) {
+    amqp_prefetch_settled(state, channel, delivery_tag, multiple);
+  }
+  if (NULL != state->recovery &&
+      !amqp_recovery_settle_tag(state, channel, &delivery_tag)) {
+    return AMQP_STATUS_OK;
+  }
+  if (NULL != state->ack_windows) {
+    return amqp_ack_window_ack(state, channel, delivery_tag, multiple);
+  }
   m.delivery_tag = delivery_tag;
   m.multiple = multiple;
   return amqp_send_method(state, channel, AMQP_BASIC_ACK_METHOD, &m);
@@ -343,6 +353,17 @@ int amqp_basic_reject(amqp_connection_state_t state, amqp_channel_t channel,
   amqp_basic_reject_t req;
   req.delivery_tag = delivery_tag;
   req.requeue = requeue;
+  if (NULL != state->prefetch) {
+    amqp_prefetch_settled(state, channel, delivery_tag, 0);
+  }
+  if (NULL != state->recovery &&
+      !amqp_recovery_settle_tag(state, channel, &req.delivery_tag)) {
+    return AMQP_STATUS_OK;
+  }
+  if (NULL != state->ack_windows) {
+    return amqp_ack_window_send(state, channel, AMQP_BASIC_REJECT_METHOD, &req,
+                                req.delivery_tag, 0);
+  }
   return amqp_send_method(state, channel, AMQP_BASIC_REJECT_METHOD, &req);
 }
 
@@ -353,6 +374,17 @@ int amqp_basic_nack(amqp_connection_state_t state, amqp_channel_t channel,
   req.delivery_tag = delivery_tag;
   req.multiple = multiple;
   req.requeue = requeue;
+  if (NULL != state->prefetch) {
+    amqp_prefetch_settled(state, channel, delivery_tag, multiple);
+  }
+  if (NULL != state->recovery &&
+      !amqp_recovery_settle_tag(state, channel, &req.delivery_tag)) {
+    return AMQP_STATUS_OK;
+  }
+  if (NULL != state->ack_windows) {
+    return amqp_ack_window_send(state, channel, AMQP_BASIC_NACK_METHOD, &req,
+                                req.delivery_tag, multiple);
+  }
   return amqp_send_method(state, channel, AMQP_BASIC_NACK_METHOD, &req);
 }
 
@@ -392,3 +424,32 @@ int amqp_set_rpc_timeout(amqp_connection_state_t state,
   }
   return AMQP_STATUS_OK;
 }
+
+struct timeval *amqp_get_idle_timeout(amqp_connection_state_t state) {
+  return state->idle_timeout;
+}
+
+int amqp_set_busy_wait(amqp_connection_state_t state, int spin_us,
+                       amqp_boolean_t backoff) {
+  if (0 > spin_us) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  state->busy_wait_ns = (uint64_t)spin_us * AMQP_NS_PER_US;
+  state->busy_wait_backoff = backoff;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_set_idle_timeout(amqp_connection_state_t state,
+                          const struct timeval *timeout) {
+  if (timeout) {
+    if (timeout->tv_sec < 0 || timeout->tv_usec < 0) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    state->idle_timeout = &state->internal_idle_timeout;
+    *state->idle_timeout = *timeout;
+    return amqp_idle_touch(state);
+  }
+  state->idle_timeout = NULL;
+  state->next_idle = amqp_time_infinite();
+  return AMQP_STATUS_OK;
+}
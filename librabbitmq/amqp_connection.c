@@ -97,13 +97,15 @@ amqp_connection_state_t amqp_new_connection(void) {
 
   state->sock_inbound_buffer.len = AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE;
   state->sock_inbound_buffer.bytes =
-      malloc(AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE);
+      amqp_buffer_cache_alloc(AMQP_INITIAL_INBOUND_SOCK_BUFFER_SIZE);
   if (state->sock_inbound_buffer.bytes == NULL) {
     goto out_nomem;
   }
 
   init_amqp_pool(&state->properties_pool, 512);
 
+  state->next_idle = amqp_time_infinite();
+
   /* Use address of the internal_handshake_timeout object by default. */
   state->internal_handshake_timeout.tv_sec = AMQP_DEFAULT_LOGIN_TIMEOUT_SEC;
   state->internal_handshake_timeout.tv_usec = 0;
@@ -112,7 +114,8 @@ amqp_connection_state_t amqp_new_connection(void) {
   return state;
 
 out_nomem:
-  free(state->sock_inbound_buffer.bytes);
+  amqp_buffer_cache_free(state->outbound_buffer.bytes,
+                         state->outbound_buffer.len);
   free(state);
   return NULL;
 }
@@ -164,12 +167,17 @@ int amqp_tune_connection(amqp_connection_state_t state, int channel_max,
     return res;
   }
 
-  state->outbound_buffer.len = frame_max;
-  newbuf = realloc(state->outbound_buffer.bytes, frame_max);
-  if (newbuf == NULL) {
-    return AMQP_STATUS_NO_MEMORY;
+  if (state->outbound_buffer.bytes == NULL ||
+      state->outbound_buffer.len != (size_t)frame_max) {
+    newbuf = amqp_buffer_cache_alloc(frame_max);
+    if (newbuf == NULL) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    amqp_buffer_cache_free(state->outbound_buffer.bytes,
+                           state->outbound_buffer.len);
+    state->outbound_buffer.bytes = newbuf;
+    state->outbound_buffer.len = frame_max;
   }
-  state->outbound_buffer.bytes = newbuf;
 
   return AMQP_STATUS_OK;
 }
@@ -190,18 +198,26 @@ int amqp_destroy_connection(amqp_connection_state_t state) {
   int status = AMQP_STATUS_OK;
   if (state) {
     int i;
+    amqp_event_loop_detach(state);
+    amqp_destroy_consumers(state);
+    amqp_destroy_ack_windows(state);
+    amqp_destroy_prefetch(state);
+    amqp_destroy_recovery(state);
     for (i = 0; i < POOL_TABLE_SIZE; ++i) {
       amqp_pool_table_entry_t *entry = state->pool_table[i];
       while (NULL != entry) {
         amqp_pool_table_entry_t *todelete = entry;
         empty_amqp_pool(&entry->pool);
+        empty_amqp_pool(&entry->header_pool);
         entry = entry->next;
         free(todelete);
       }
     }
 
-    free(state->outbound_buffer.bytes);
-    free(state->sock_inbound_buffer.bytes);
+    amqp_buffer_cache_free(state->outbound_buffer.bytes,
+                           state->outbound_buffer.len);
+    amqp_buffer_cache_free(state->sock_inbound_buffer.bytes,
+                           state->sock_inbound_buffer.len);
     amqp_socket_delete(state->socket);
     empty_amqp_pool(&state->properties_pool);
     free(state);
@@ -209,6 +225,41 @@ int amqp_destroy_connection(amqp_connection_state_t state) {
   return status;
 }
 
+int amqp_reset_connection(amqp_connection_state_t state) {
+  int i;
+  int res;
+
+  /* Queued frames live in the channel pools */
+  state->first_queued_frame = NULL;
+  state->last_queued_frame = NULL;
+  for (i = 0; i < POOL_TABLE_SIZE; ++i) {
+    amqp_pool_table_entry_t *entry;
+    for (entry = state->pool_table[i]; NULL != entry; entry = entry->next) {
+      entry->queued_frames = 0;
+      amqp_recycle_channel_pool_entry(entry);
+    }
+  }
+  recycle_amqp_pool(&state->properties_pool);
+  state->server_properties = amqp_empty_table;
+  state->client_properties = amqp_empty_table;
+  memset(&state->most_recent_api_result, 0,
+         sizeof(state->most_recent_api_result));
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
+
+  state->inbound_buffer.bytes = state->header_buffer;
+  state->inbound_buffer.len = sizeof(state->header_buffer);
+  state->inbound_offset = 0;
+  state->state = CONNECTION_STATE_IDLE;
+  res = amqp_tune_connection(state, 0, AMQP_INITIAL_FRAME_POOL_PAGE_SIZE, 0);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  state->state = CONNECTION_STATE_INITIAL;
+  state->target_size = 8;
+  return AMQP_STATUS_OK;
+}
+
 static void return_to_idle(amqp_connection_state_t state) {
   state->inbound_buffer.len = sizeof(state->header_buffer);
   state->inbound_buffer.bytes = state->header_buffer;
@@ -234,6 +285,19 @@ static size_t consume_data(amqp_connection_state_t state,
   return bytes_consumed;
 }
 
+static void maybe_auto_release_channel_pool(amqp_connection_state_t state,
+                                            amqp_pool_table_entry_t *entry) {
+  if (0 != entry->queued_frames) {
+    return;
+  }
+  if ((0 != state->release_max_frames &&
+       entry->frames_since_recycle >= state->release_max_frames) ||
+      (0 != state->release_max_bytes &&
+       entry->bytes_since_recycle >= state->release_max_bytes)) {
+    amqp_recycle_channel_pool_entry(entry);
+  }
+}
+
 int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
                       amqp_frame_t *decoded_frame) {
   size_t bytes_consumed;
@@ -286,7 +350,8 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
 
     case CONNECTION_STATE_HEADER: {
       amqp_channel_t channel;
-      amqp_pool_t *channel_pool;
+      amqp_pool_table_entry_t *entry;
+      amqp_pool_t *frame_pool;
       uint32_t frame_size;
 
       channel = amqp_d16(amqp_offset(raw_frame, 1));
@@ -306,17 +371,31 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
         return AMQP_STATUS_BAD_AMQP_DATA;
       }
 
-      channel_pool = amqp_get_or_create_channel_pool(state, channel);
-      if (NULL == channel_pool) {
+      entry = amqp_get_or_create_channel_pool_entry(state, channel);
+      if (NULL == entry) {
         return AMQP_STATUS_NO_MEMORY;
       }
 
-      amqp_pool_alloc_bytes(channel_pool, state->target_size,
+      maybe_auto_release_channel_pool(state, entry);
+      entry->frames_since_recycle++;
+      entry->bytes_since_recycle += state->target_size;
+
+      if (AMQP_FRAME_HEADER == amqp_d8(raw_frame)) {
+        frame_pool = &entry->header_pool;
+        entry->header_frames++;
+      } else {
+        frame_pool = &entry->pool;
+      }
+
+      amqp_pool_alloc_bytes(frame_pool, state->target_size,
                             &state->inbound_buffer);
       if (NULL == state->inbound_buffer.bytes) {
         return AMQP_STATUS_NO_MEMORY;
       }
-      memcpy(state->inbound_buffer.bytes, state->header_buffer, HEADER_SIZE);
+      /* Copy everything read so far: a first frame that isn't a protocol
+       * header has had a byte of its payload read into header_buffer */
+      memcpy(state->inbound_buffer.bytes, state->header_buffer,
+             state->inbound_offset);
       raw_frame = state->inbound_buffer.bytes;
 
       state->state = CONNECTION_STATE_BODY;
@@ -334,7 +413,7 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
     case CONNECTION_STATE_BODY: {
       amqp_bytes_t encoded;
       int res;
-      amqp_pool_t *channel_pool;
+      amqp_pool_table_entry_t *entry;
 
       /* Check frame end marker (footer) */
       if (amqp_d8(amqp_offset(raw_frame, state->target_size - 1)) !=
@@ -345,9 +424,9 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
       decoded_frame->frame_type = amqp_d8(amqp_offset(raw_frame, 0));
       decoded_frame->channel = amqp_d16(amqp_offset(raw_frame, 1));
 
-      channel_pool =
-          amqp_get_or_create_channel_pool(state, decoded_frame->channel);
-      if (NULL == channel_pool) {
+      entry =
+          amqp_get_or_create_channel_pool_entry(state, decoded_frame->channel);
+      if (NULL == entry) {
         return AMQP_STATUS_NO_MEMORY;
       }
 
@@ -359,7 +438,7 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
           encoded.len = state->target_size - HEADER_SIZE - 4 - FOOTER_SIZE;
 
           res = amqp_decode_method(decoded_frame->payload.method.id,
-                                   channel_pool, encoded,
+                                   &entry->pool, encoded,
                                    &decoded_frame->payload.method.decoded);
           if (res < 0) {
             return res;
@@ -378,7 +457,8 @@ int amqp_handle_input(amqp_connection_state_t state, amqp_bytes_t received_data,
           decoded_frame->payload.properties.raw = encoded;
 
           res = amqp_decode_properties(
-              decoded_frame->payload.properties.class_id, channel_pool, encoded,
+              decoded_frame->payload.properties.class_id, &entry->header_pool,
+              encoded,
               &decoded_frame->payload.properties.decoded);
           if (res < 0) {
             return res;
@@ -424,7 +504,9 @@ void amqp_release_buffers(amqp_connection_state_t state) {
     amqp_pool_table_entry_t *entry = state->pool_table[i];
 
     for (; NULL != entry; entry = entry->next) {
-      amqp_maybe_release_buffers_on_channel(state, entry->channel);
+      if (0 == entry->queued_frames) {
+        amqp_recycle_channel_pool_entry(entry);
+      }
     }
   }
 }
@@ -437,32 +519,76 @@ void amqp_maybe_release_buffers(amqp_connection_state_t state) {
 
 void amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state,
                                            amqp_channel_t channel) {
-  amqp_link_t *queued_link;
-  amqp_pool_t *pool;
+  amqp_pool_table_entry_t *entry;
   if (CONNECTION_STATE_IDLE != state->state) {
     return;
   }
 
-  queued_link = state->first_queued_frame;
+  entry = amqp_get_channel_pool_entry(state, channel);
 
-  while (NULL != queued_link) {
-    amqp_frame_t *frame = queued_link->data;
-    if (channel == frame->channel) {
-      return;
-    }
+  if (entry != NULL && 0 == entry->queued_frames) {
+    amqp_recycle_channel_pool_entry(entry);
+  }
+}
 
-    queued_link = queued_link->next;
+void amqp_release_idle_buffers(amqp_connection_state_t state) {
+  int i;
+  /* A full inbound buffer means the socket layer (e.g., SSL) may hold more
+   * data that poll() won't report, so keep the buffer in that case */
+  if (CONNECTION_STATE_IDLE != state->state || amqp_data_in_buffer(state) ||
+      state->sock_inbound_limit == state->sock_inbound_buffer.len) {
+    return;
   }
 
-  pool = amqp_get_channel_pool(state, channel);
+  for (i = 0; i < POOL_TABLE_SIZE; ++i) {
+    amqp_pool_table_entry_t *entry = state->pool_table[i];
+
+    for (; NULL != entry; entry = entry->next) {
+      if (0 == entry->queued_frames) {
+        empty_amqp_pool(&entry->pool);
+        empty_amqp_pool(&entry->header_pool);
+        entry->header_frames = 0;
+        entry->frames_since_recycle = 0;
+        entry->bytes_since_recycle = 0;
+      }
+    }
+  }
+
+  amqp_buffer_cache_free(state->sock_inbound_buffer.bytes,
+                         state->sock_inbound_buffer.len);
+  state->sock_inbound_buffer.bytes = NULL;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
+
+  amqp_buffer_cache_free(state->outbound_buffer.bytes,
+                         state->outbound_buffer.len);
+  state->outbound_buffer.bytes = NULL;
+}
+
+/* Reacquire the outbound buffer released by amqp_release_idle_buffers() */
+static int amqp_ensure_outbound_buffer(amqp_connection_state_t state) {
+  if (NULL == state->outbound_buffer.bytes) {
+    state->outbound_buffer.bytes =
+        amqp_buffer_cache_alloc(state->outbound_buffer.len);
+    if (NULL == state->outbound_buffer.bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
 
-  if (pool != NULL) {
-    recycle_amqp_pool(pool);
+int amqp_set_buffer_release_policy(amqp_connection_state_t state,
+                                   size_t max_bytes, int max_frames) {
+  if (max_frames < 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
   }
+  state->release_max_bytes = max_bytes;
+  state->release_max_frames = max_frames;
+  return AMQP_STATUS_OK;
 }
 
-static int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
-                               amqp_bytes_t *encoded) {
+int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
+                        amqp_bytes_t *encoded) {
   void *out_frame = buffer.bytes;
   size_t out_frame_len;
   int res;
@@ -546,20 +672,33 @@ int amqp_send_frame_inner(amqp_connection_state_t state,
                           const amqp_frame_t *frame, int flags,
                           amqp_time_t deadline) {
   int res;
-  ssize_t sent;
   amqp_bytes_t encoded;
-  amqp_time_t next_timeout;
 
   /* TODO: if the AMQP_SF_MORE socket optimization can be shown to work
    * correctly, then this could be un-done so that body-frames are sent as 3
    * send calls, getting rid of the copy of the body content, some testing
    * would need to be done to see if this would actually a win for performance.
    * */
+  res = amqp_ensure_outbound_buffer(state);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
   res = amqp_frame_to_bytes(frame, state->outbound_buffer, &encoded);
   if (AMQP_STATUS_OK != res) {
     return res;
   }
 
+  return amqp_send_encoded_inner(state, encoded, flags, deadline);
+}
+
+int amqp_send_encoded_inner(amqp_connection_state_t state,
+                            amqp_bytes_t encoded, int flags,
+                            amqp_time_t deadline) {
+  int res;
+  ssize_t sent;
+  amqp_time_t next_timeout;
+
 start_send:
 
   next_timeout = amqp_time_first(deadline, state->next_recv_heartbeat);
@@ -592,7 +731,10 @@ start_send:
 
   res = amqp_time_s_from_now(&state->next_send_heartbeat,
                              amqp_heartbeat_send(state));
-  return res;
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  return amqp_idle_touch(state);
 }
 
 amqp_table_t *amqp_get_server_properties(amqp_connection_state_t state) {
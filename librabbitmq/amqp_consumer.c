@@ -132,6 +132,23 @@ static int amqp_bytes_malloc_dup_failed(amqp_bytes_t bytes) {
   return 0;
 }
 
+/* Whether a wait for a frame ended because the connection failed or the
+ * broker is closing it */
+static int connection_lost(int res, amqp_frame_t *frame) {
+  switch (res) {
+    case AMQP_STATUS_OK:
+      return AMQP_FRAME_METHOD == frame->frame_type && 0 == frame->channel &&
+             AMQP_CONNECTION_CLOSE_METHOD == frame->payload.method.id;
+    case AMQP_STATUS_TIMEOUT:
+    case AMQP_STATUS_TIMER_FAILURE:
+    case AMQP_STATUS_NO_MEMORY:
+    case AMQP_STATUS_INVALID_PARAMETER:
+      return 0;
+    default:
+      return 1;
+  }
+}
+
 amqp_rpc_reply_t amqp_consume_message(amqp_connection_state_t state,
                                       amqp_envelope_t *envelope,
                                       const struct timeval *timeout,
@@ -144,7 +161,23 @@ amqp_rpc_reply_t amqp_consume_message(amqp_connection_state_t state,
   memset(&ret, 0, sizeof(ret));
   memset(envelope, 0, sizeof(*envelope));
 
+  if (NULL != state->prefetch) {
+    ret = amqp_prefetch_update(state);
+    if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+      return ret;
+    }
+  }
+
+retry:
   res = amqp_simple_wait_frame_noblock(state, &frame, timeout);
+  if (NULL != state->recovery && connection_lost(res, &frame)) {
+    /* The connection is replaced and the wait starts over */
+    ret = amqp_recover_connection(state);
+    if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+      goto error_out1;
+    }
+    goto retry;
+  }
   if (AMQP_STATUS_OK != res) {
     ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
     ret.library_error = res;
@@ -181,6 +214,9 @@ amqp_rpc_reply_t amqp_consume_message(amqp_connection_state_t state,
     goto error_out2;
   }
 
+  if (NULL != state->prefetch) {
+    amqp_prefetch_delivered(state, envelope->channel, envelope->delivery_tag);
+  }
   ret.reply_type = AMQP_RESPONSE_NORMAL;
   return ret;
 
@@ -231,14 +267,21 @@ amqp_rpc_reply_t amqp_read_message(amqp_connection_state_t state,
     goto error_out1;
   }
 
-  init_amqp_pool(&message->pool, 4096);
-  res = amqp_basic_properties_clone(frame.payload.properties.decoded,
-                                    &message->properties, &message->pool);
+  /* If the decoded properties are the only thing in the channel's header pool
+   * the message takes the pool over, otherwise they're copied */
+  if (amqp_take_header_pool(state, channel, &message->pool)) {
+    message->properties =
+        *(amqp_basic_properties_t *)frame.payload.properties.decoded;
+  } else {
+    init_amqp_pool(&message->pool, AMQP_HEADER_POOL_PAGE_SIZE);
+    res = amqp_basic_properties_clone(frame.payload.properties.decoded,
+                                      &message->properties, &message->pool);
 
-  if (AMQP_STATUS_OK != res) {
-    ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-    ret.library_error = res;
-    goto error_out3;
+    if (AMQP_STATUS_OK != res) {
+      ret.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+      ret.library_error = res;
+      goto error_out3;
+    }
   }
 
   if (0 == frame.payload.properties.body_size) {
@@ -305,3 +348,375 @@ error_out3:
 error_out1:
   return ret;
 }
+
+/* Longest shortstr, the type of consumer tags, exchanges and routing keys */
+#define AMQP_SHORTSTR_MAX 255
+
+#define AMQP_CONSUMER_TABLE_INITIAL_SIZE 16
+
+struct amqp_consumer_entry_t_ {
+  struct amqp_consumer_entry_t_ *next;
+  uint32_t hash;
+  amqp_channel_t channel;
+  amqp_delivery_callback_t on_delivery;
+  amqp_consumer_cancel_callback_t on_cancel;
+  void *user_data;
+  /* Deliveries still queued for a consumer the client cancelled, it is
+   * removed once they have been dispatched. -1 while the consumer is live. */
+  int draining;
+  size_t tag_len;
+  char tag[AMQP_SHORTSTR_MAX];
+};
+
+static uint32_t consumer_hash(amqp_channel_t channel, amqp_bytes_t tag) {
+  /* FNV-1a */
+  uint32_t hash = 2166136261u ^ channel;
+  size_t i;
+  for (i = 0; i < tag.len; ++i) {
+    hash ^= ((unsigned char *)tag.bytes)[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static amqp_consumer_entry_t **find_consumer(amqp_connection_state_t state,
+                                             amqp_channel_t channel,
+                                             amqp_bytes_t tag) {
+  uint32_t hash;
+  amqp_consumer_entry_t **cur;
+
+  if (0 == state->consumers_size) {
+    return NULL;
+  }
+  hash = consumer_hash(channel, tag);
+  for (cur = &state->consumers[hash & (state->consumers_size - 1)];
+       NULL != *cur; cur = &(*cur)->next) {
+    if ((*cur)->hash == hash && (*cur)->channel == channel &&
+        (*cur)->tag_len == tag.len &&
+        0 == memcmp((*cur)->tag, tag.bytes, tag.len)) {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+static void remove_consumer(amqp_connection_state_t state,
+                            amqp_consumer_entry_t **entry) {
+  amqp_consumer_entry_t *todelete = *entry;
+  *entry = todelete->next;
+  free(todelete);
+  state->consumers_count--;
+}
+
+static void grow_consumer_table(amqp_connection_state_t state) {
+  size_t size = state->consumers_size ? 2 * state->consumers_size
+                                      : AMQP_CONSUMER_TABLE_INITIAL_SIZE;
+  amqp_consumer_entry_t **table = calloc(size, sizeof(*table));
+  size_t i;
+
+  /* Without a bigger table the chains just get longer */
+  if (NULL == table) {
+    return;
+  }
+  for (i = 0; i < state->consumers_size; ++i) {
+    while (NULL != state->consumers[i]) {
+      amqp_consumer_entry_t *entry = state->consumers[i];
+      state->consumers[i] = entry->next;
+      entry->next = table[entry->hash & (size - 1)];
+      table[entry->hash & (size - 1)] = entry;
+    }
+  }
+  free(state->consumers);
+  state->consumers = table;
+  state->consumers_size = size;
+}
+
+static int add_consumer(amqp_connection_state_t state,
+                        amqp_consumer_entry_t *entry) {
+  amqp_consumer_entry_t **existing;
+  amqp_bytes_t tag;
+
+  tag.bytes = entry->tag;
+  tag.len = entry->tag_len;
+  entry->hash = consumer_hash(entry->channel, tag);
+
+  existing = find_consumer(state, entry->channel, tag);
+  if (NULL != existing) {
+    remove_consumer(state, existing);
+  }
+
+  if (state->consumers_count >= state->consumers_size) {
+    grow_consumer_table(state);
+    if (0 == state->consumers_size) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+
+  entry->next = state->consumers[entry->hash & (state->consumers_size - 1)];
+  state->consumers[entry->hash & (state->consumers_size - 1)] = entry;
+  state->consumers_count++;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_destroy_consumers(amqp_connection_state_t state) {
+  size_t i;
+  for (i = 0; i < state->consumers_size; ++i) {
+    while (NULL != state->consumers[i]) {
+      remove_consumer(state, &state->consumers[i]);
+    }
+  }
+  free(state->consumers);
+  state->consumers = NULL;
+  state->consumers_size = 0;
+}
+
+void amqp_consumers_received(amqp_connection_state_t state,
+                             const amqp_frame_t *frame) {
+  amqp_boolean_t all;
+  size_t i;
+
+  if (AMQP_FRAME_METHOD != frame->frame_type) {
+    return;
+  }
+  switch (frame->payload.method.id) {
+    case AMQP_CHANNEL_CLOSE_METHOD:
+    case AMQP_CHANNEL_CLOSE_OK_METHOD:
+      all = 0;
+      break;
+    case AMQP_CONNECTION_CLOSE_METHOD:
+    case AMQP_CONNECTION_CLOSE_OK_METHOD:
+      all = 1;
+      break;
+    default:
+      return;
+  }
+
+  /* Whichever side closed it, the channel's consumers are gone */
+  for (i = 0; i < state->consumers_size; ++i) {
+    amqp_consumer_entry_t **cur = &state->consumers[i];
+    while (NULL != *cur) {
+      if (all || (*cur)->channel == frame->channel) {
+        remove_consumer(state, cur);
+      } else {
+        cur = &(*cur)->next;
+      }
+    }
+  }
+}
+
+amqp_basic_consume_ok_t *amqp_basic_consume_cb(
+    amqp_connection_state_t state, amqp_channel_t channel, amqp_bytes_t queue,
+    amqp_bytes_t consumer_tag, amqp_boolean_t no_local, amqp_boolean_t no_ack,
+    amqp_boolean_t exclusive, amqp_table_t arguments,
+    amqp_delivery_callback_t on_delivery,
+    amqp_consumer_cancel_callback_t on_cancel, void *user_data) {
+  amqp_basic_consume_ok_t *ok;
+  amqp_consumer_entry_t *entry;
+  int res;
+
+  if (NULL == on_delivery || consumer_tag.len > AMQP_SHORTSTR_MAX) {
+    state->most_recent_api_result =
+        amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+    return NULL;
+  }
+
+  /* Allocated up front so a consumer is never left running without its
+   * handler */
+  entry = calloc(1, sizeof(amqp_consumer_entry_t));
+  if (NULL == entry) {
+    state->most_recent_api_result =
+        amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
+    return NULL;
+  }
+
+  ok = amqp_basic_consume(state, channel, queue, consumer_tag, no_local,
+                          no_ack, exclusive, arguments);
+  if (NULL == ok) {
+    free(entry);
+    return NULL;
+  }
+
+  entry->channel = channel;
+  entry->on_delivery = on_delivery;
+  entry->on_cancel = on_cancel;
+  entry->user_data = user_data;
+  entry->draining = -1;
+  entry->tag_len = ok->consumer_tag.len;
+  memcpy(entry->tag, ok->consumer_tag.bytes, entry->tag_len);
+
+  res = add_consumer(state, entry);
+  if (AMQP_STATUS_OK != res) {
+    free(entry);
+    amqp_basic_cancel(state, channel, ok->consumer_tag);
+    state->most_recent_api_result = amqp_rpc_reply_error(res);
+    return NULL;
+  }
+  return ok;
+}
+
+amqp_basic_cancel_ok_t *amqp_basic_cancel_cb(amqp_connection_state_t state,
+                                             amqp_channel_t channel,
+                                             amqp_bytes_t consumer_tag) {
+  amqp_basic_cancel_ok_t *ok;
+  amqp_consumer_entry_t **entry;
+  amqp_link_t *link;
+  int queued = 0;
+
+  ok = amqp_basic_cancel(state, channel, consumer_tag);
+  if (NULL == ok) {
+    return NULL;
+  }
+
+  entry = find_consumer(state, channel, consumer_tag);
+  if (NULL == entry) {
+    return ok;
+  }
+
+  /* Deliveries sent before the broker saw the cancel were queued while
+   * waiting for cancel-ok, they still go to the handler */
+  for (link = state->first_queued_frame; NULL != link; link = link->next) {
+    amqp_frame_t *frame = link->data;
+    if (AMQP_FRAME_METHOD == frame->frame_type &&
+        AMQP_BASIC_DELIVER_METHOD == frame->payload.method.id &&
+        channel == frame->channel &&
+        amqp_bytes_equal(consumer_tag,
+                         ((amqp_basic_deliver_t *)frame->payload.method.decoded)
+                             ->consumer_tag)) {
+      queued++;
+    }
+  }
+
+  if (0 == queued) {
+    remove_consumer(state, entry);
+  } else {
+    (*entry)->draining = queued;
+  }
+  return ok;
+}
+
+static amqp_rpc_reply_t dispatch_delivery(amqp_connection_state_t state,
+                                          amqp_frame_t *frame,
+                                          amqp_consumer_entry_t **entry) {
+  amqp_basic_deliver_t *delivery = frame->payload.method.decoded;
+  amqp_delivery_callback_t on_delivery = (*entry)->on_delivery;
+  void *user_data = (*entry)->user_data;
+  char consumer_tag[AMQP_SHORTSTR_MAX];
+  char exchange[AMQP_SHORTSTR_MAX];
+  char routing_key[AMQP_SHORTSTR_MAX];
+  amqp_envelope_t envelope;
+  amqp_rpc_reply_t ret;
+
+  if (delivery->exchange.len > AMQP_SHORTSTR_MAX ||
+      delivery->routing_key.len > AMQP_SHORTSTR_MAX) {
+    return amqp_rpc_reply_error(AMQP_STATUS_BAD_AMQP_DATA);
+  }
+
+  /* The decoded method lives in the channel's pool, which may be recycled
+   * while the rest of the message is read, and the handler may go away in
+   * the callback. The names are short, so they're copied to the stack. */
+  envelope.channel = frame->channel;
+  envelope.consumer_tag.bytes = consumer_tag;
+  envelope.consumer_tag.len = (*entry)->tag_len;
+  memcpy(consumer_tag, (*entry)->tag, (*entry)->tag_len);
+  envelope.delivery_tag = delivery->delivery_tag;
+  envelope.redelivered = delivery->redelivered;
+  envelope.exchange.bytes = exchange;
+  envelope.exchange.len = delivery->exchange.len;
+  memcpy(exchange, delivery->exchange.bytes, delivery->exchange.len);
+  envelope.routing_key.bytes = routing_key;
+  envelope.routing_key.len = delivery->routing_key.len;
+  memcpy(routing_key, delivery->routing_key.bytes, delivery->routing_key.len);
+
+  /* A cancelled consumer is dropped with its last queued delivery */
+  if ((*entry)->draining > 0 && 0 == --(*entry)->draining) {
+    remove_consumer(state, entry);
+  }
+
+  ret = amqp_read_message(state, envelope.channel, &envelope.message, 0);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  if (NULL != state->prefetch) {
+    amqp_prefetch_delivered(state, envelope.channel, envelope.delivery_tag);
+  }
+  on_delivery(state, &envelope, user_data);
+
+  amqp_destroy_message(&envelope.message);
+  return ret;
+}
+
+static amqp_rpc_reply_t dispatch_cancel(amqp_connection_state_t state,
+                                        amqp_frame_t *frame,
+                                        amqp_consumer_entry_t **entry) {
+  amqp_basic_cancel_t *cancel = frame->payload.method.decoded;
+  amqp_consumer_cancel_callback_t on_cancel = (*entry)->on_cancel;
+  void *user_data = (*entry)->user_data;
+  char consumer_tag[AMQP_SHORTSTR_MAX];
+  amqp_bytes_t tag;
+  amqp_rpc_reply_t ret;
+  int res;
+
+  memset(&ret, 0, sizeof(ret));
+  ret.reply_type = AMQP_RESPONSE_NORMAL;
+
+  tag.bytes = consumer_tag;
+  tag.len = (*entry)->tag_len;
+  memcpy(consumer_tag, (*entry)->tag, tag.len);
+  remove_consumer(state, entry);
+
+  if (!cancel->nowait) {
+    amqp_basic_cancel_ok_t ok;
+    ok.consumer_tag = tag;
+    res = amqp_send_method(state, frame->channel, AMQP_BASIC_CANCEL_OK_METHOD,
+                           &ok);
+    if (AMQP_STATUS_OK != res) {
+      return amqp_rpc_reply_error(res);
+    }
+  }
+
+  if (NULL != on_cancel) {
+    on_cancel(state, frame->channel, tag, user_data);
+  }
+  return ret;
+}
+
+amqp_rpc_reply_t amqp_consume_dispatch(amqp_connection_state_t state,
+                                       const struct timeval *timeout,
+                                       AMQP_UNUSED int flags) {
+  amqp_consumer_entry_t **entry = NULL;
+  amqp_frame_t frame;
+  amqp_rpc_reply_t ret;
+  int res;
+
+  if (NULL != state->prefetch) {
+    ret = amqp_prefetch_update(state);
+    if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+      return ret;
+    }
+  }
+
+  res = amqp_simple_wait_frame_noblock(state, &frame, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+
+  if (AMQP_FRAME_METHOD == frame.frame_type) {
+    if (AMQP_BASIC_DELIVER_METHOD == frame.payload.method.id) {
+      amqp_basic_deliver_t *delivery = frame.payload.method.decoded;
+      entry = find_consumer(state, frame.channel, delivery->consumer_tag);
+      if (NULL != entry) {
+        return dispatch_delivery(state, &frame, entry);
+      }
+    } else if (AMQP_BASIC_CANCEL_METHOD == frame.payload.method.id) {
+      amqp_basic_cancel_t *cancel = frame.payload.method.decoded;
+      entry = find_consumer(state, frame.channel, cancel->consumer_tag);
+      if (NULL != entry) {
+        return dispatch_cancel(state, &frame, entry);
+      }
+    }
+  }
+
+  amqp_put_back_frame(state, &frame);
+  return amqp_rpc_reply_error(AMQP_STATUS_UNEXPECTED_STATE);
+}
@@ -0,0 +1,313 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_driver.h"
+#include "amqp_private.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AMQP_DRIVER_INITIAL_OUTPUT 4096
+
+struct amqp_driver_socket_t {
+  const struct amqp_socket_class_t *klass;
+  int closed;
+
+  /* Encoded frames waiting to be written, output.len is the capacity */
+  amqp_bytes_t output;
+  size_t output_start;
+  size_t output_end;
+
+  /* Traffic since the last tick, and when it was last seen */
+  int clock_started;
+  int input_seen;
+  int output_seen;
+  uint64_t last_input_ms;
+  uint64_t last_output_ms;
+};
+
+static ssize_t amqp_driver_socket_send(void *base, const void *buf, size_t len,
+                                       AMQP_UNUSED int flags) {
+  struct amqp_driver_socket_t *self = (struct amqp_driver_socket_t *)base;
+
+  if (self->closed) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+  if (self->output_end + len > self->output.len) {
+    size_t pending = self->output_end - self->output_start;
+
+    if (pending + len > self->output.len) {
+      size_t size = self->output.len ? self->output.len
+                                     : AMQP_DRIVER_INITIAL_OUTPUT;
+      void *bytes;
+
+      while (size < pending + len) {
+        size *= 2;
+      }
+      bytes = malloc(size);
+      if (NULL == bytes) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      if (pending) {
+        memcpy(bytes, (char *)self->output.bytes + self->output_start,
+               pending);
+      }
+      free(self->output.bytes);
+      self->output.bytes = bytes;
+      self->output.len = size;
+    } else {
+      memmove(self->output.bytes,
+              (char *)self->output.bytes + self->output_start, pending);
+    }
+    self->output_start = 0;
+    self->output_end = pending;
+  }
+
+  memcpy((char *)self->output.bytes + self->output_end, buf, len);
+  self->output_end += len;
+  return (ssize_t)len;
+}
+
+static ssize_t amqp_driver_socket_recv(AMQP_UNUSED void *base,
+                                       AMQP_UNUSED void *buf,
+                                       AMQP_UNUSED size_t len,
+                                       AMQP_UNUSED int flags) {
+  /* Input is pushed in by the application */
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+static int amqp_driver_socket_open(AMQP_UNUSED void *base,
+                                   AMQP_UNUSED const char *const *hosts,
+                                   AMQP_UNUSED const int *ports,
+                                   AMQP_UNUSED int count,
+                                   AMQP_UNUSED const struct timeval *timeout,
+                                   AMQP_UNUSED int *connected) {
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+static int amqp_driver_socket_close(void *base,
+                                    AMQP_UNUSED amqp_socket_close_enum force) {
+  struct amqp_driver_socket_t *self = (struct amqp_driver_socket_t *)base;
+  if (self->closed) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+  self->closed = 1;
+  return AMQP_STATUS_OK;
+}
+
+static int amqp_driver_socket_get_sockfd(AMQP_UNUSED void *base) { return -1; }
+
+static void amqp_driver_socket_delete(void *base) {
+  struct amqp_driver_socket_t *self = (struct amqp_driver_socket_t *)base;
+
+  if (self) {
+    free(self->output.bytes);
+    free(self);
+  }
+}
+
+static const struct amqp_socket_class_t amqp_driver_socket_class = {
+    amqp_driver_socket_send,       /* send */
+    amqp_driver_socket_recv,       /* recv */
+    amqp_driver_socket_open,       /* open */
+    amqp_driver_socket_close,      /* close */
+    amqp_driver_socket_get_sockfd, /* get_sockfd */
+    amqp_driver_socket_delete,     /* delete */
+    NULL,                          /* wait */
+    NULL,                          /* get_options */
+    NULL                           /* recv_hint */
+};
+
+static struct amqp_driver_socket_t *get_driver(
+    amqp_connection_state_t state) {
+  if (NULL == state->socket ||
+      state->socket->klass != &amqp_driver_socket_class) {
+    return NULL;
+  }
+  return (struct amqp_driver_socket_t *)state->socket;
+}
+
+amqp_socket_t *amqp_driver_socket_new(amqp_connection_state_t state) {
+  struct amqp_driver_socket_t *self = calloc(1, sizeof(*self));
+  if (!self) {
+    return NULL;
+  }
+  self->klass = &amqp_driver_socket_class;
+
+  amqp_set_socket(state, (amqp_socket_t *)self);
+
+  /* Input is decoded straight from the application's buffers */
+  amqp_buffer_cache_free(state->sock_inbound_buffer.bytes,
+                         state->sock_inbound_buffer.len);
+  state->sock_inbound_buffer.bytes = NULL;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
+
+  return (amqp_socket_t *)self;
+}
+
+int amqp_driver_push_input(amqp_connection_state_t state, amqp_bytes_t data) {
+  struct amqp_driver_socket_t *self = get_driver(state);
+
+  if (NULL == self) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (self->closed) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+  if (data.len > 0) {
+    self->input_seen = 1;
+  }
+
+  while (data.len > 0) {
+    amqp_frame_t frame;
+    int res = amqp_handle_input(state, data, &frame);
+    if (res < 0) {
+      return res;
+    }
+    data.bytes = (char *)data.bytes + res;
+    data.len -= res;
+
+    if (AMQP_FRAME_HEARTBEAT == frame.frame_type) {
+      amqp_maybe_release_buffers_on_channel(state, 0);
+    } else if (0 != frame.frame_type) {
+      res = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_driver_pull_frames(amqp_connection_state_t state,
+                            amqp_frame_t *frames, int max_frames) {
+  int count = 0;
+
+  /* Only queued frames are taken, so this never reaches the socket */
+  while (count < max_frames && amqp_frames_enqueued(state)) {
+    if (AMQP_STATUS_OK != amqp_simple_wait_frame(state, &frames[count])) {
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+amqp_bytes_t amqp_driver_peek_output(amqp_connection_state_t state) {
+  struct amqp_driver_socket_t *self = get_driver(state);
+  amqp_bytes_t pending;
+
+  if (NULL == self) {
+    return amqp_empty_bytes;
+  }
+  pending.bytes = (char *)self->output.bytes + self->output_start;
+  pending.len = self->output_end - self->output_start;
+  return pending;
+}
+
+int amqp_driver_consume_output(amqp_connection_state_t state, size_t len) {
+  struct amqp_driver_socket_t *self = get_driver(state);
+
+  if (NULL == self || len > self->output_end - self->output_start) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (len > 0) {
+    self->output_seen = 1;
+  }
+  self->output_start += len;
+  if (self->output_start == self->output_end) {
+    self->output_start = 0;
+    self->output_end = 0;
+  }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_driver_tick(amqp_connection_state_t state, uint64_t now_ms,
+                     uint64_t *next_ms) {
+  struct amqp_driver_socket_t *self = get_driver(state);
+  uint64_t send_interval;
+  uint64_t recv_interval;
+  int res;
+
+  if (NULL == self) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (NULL != next_ms) {
+    *next_ms = UINT64_MAX;
+  }
+  if (self->closed) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+  if (!self->clock_started || self->input_seen) {
+    self->last_input_ms = now_ms;
+  }
+  if (!self->clock_started || self->output_seen) {
+    self->last_output_ms = now_ms;
+  }
+  self->clock_started = 1;
+  self->input_seen = 0;
+  self->output_seen = 0;
+
+  if (0 >= state->heartbeat) {
+    return AMQP_STATUS_OK;
+  }
+  send_interval = (uint64_t)amqp_heartbeat_send(state) * AMQP_MS_PER_S;
+  recv_interval = (uint64_t)amqp_heartbeat_recv(state) * AMQP_MS_PER_S;
+
+  if (now_ms - self->last_input_ms >= recv_interval) {
+    self->closed = 1;
+    return AMQP_STATUS_HEARTBEAT_TIMEOUT;
+  }
+
+  /* Output that hasn't been written yet will do as a heartbeat */
+  if (now_ms - self->last_output_ms >= send_interval &&
+      self->output_start == self->output_end) {
+    amqp_frame_t heartbeat;
+    heartbeat.channel = 0;
+    heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
+
+    res = amqp_send_frame(state, &heartbeat);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    self->last_output_ms = now_ms;
+  }
+
+  if (NULL != next_ms) {
+    *next_ms = self->last_output_ms + send_interval;
+    /* The heartbeat was held back by pending output, which goes out in its
+     * place once written. Until then ticking again can't make progress. */
+    if (*next_ms <= now_ms) {
+      *next_ms = now_ms + send_interval;
+    }
+    if (self->last_input_ms + recv_interval < *next_ms) {
+      *next_ms = self->last_input_ms + recv_interval;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
@@ -0,0 +1,157 @@
+/** \file */
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * A transport-agnostic connection driven by the application.
+ *
+ * The driver socket does no IO of its own. The application reads from its
+ * transport and pushes the bytes in with amqp_driver_push_input(), pulls the
+ * decoded frames with amqp_driver_pull_frames(), and writes out whatever
+ * amqp_driver_peek_output() returns. Frames are sent with the usual functions
+ * (amqp_send_header(), amqp_send_method(), amqp_basic_publish(), ...) which
+ * queue their bytes in the driver instead of writing to a socket. Heartbeats
+ * are driven by the clock the application passes to amqp_driver_tick().
+ *
+ * Functions that block waiting for a reply (amqp_login(), amqp_simple_rpc()
+ * and everything built on them) cannot be used with a driver socket; the
+ * handshake is done by exchanging the connection.start/tune/open methods as
+ * frames and applying the negotiated limits with amqp_tune_connection().
+ */
+
+#ifndef AMQP_DRIVER_H
+#define AMQP_DRIVER_H
+
+#include <amqp.h>
+
+AMQP_BEGIN_DECLS
+
+/**
+ * Create a new driver socket.
+ *
+ * The socket is assigned to the connection, replacing any existing socket.
+ *
+ * \param [in] state the connection object
+ * \return A new socket object or NULL if an error occurred.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_socket_t *AMQP_CALL amqp_driver_socket_new(amqp_connection_state_t state);
+
+/**
+ * Push bytes received from the transport into the connection
+ *
+ * All of data is decoded; complete frames are queued until pulled with
+ * amqp_driver_pull_frames(). The data is copied and may be reused once this
+ * returns.
+ *
+ * \param [in] state the connection object, using a driver socket
+ * \param [in] data the bytes received
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ * connection does not use a driver socket, AMQP_STATUS_SOCKET_CLOSED if the
+ * driver was closed, a decoding error (e.g., AMQP_STATUS_BAD_AMQP_DATA) or
+ * AMQP_STATUS_NO_MEMORY.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_driver_push_input(amqp_connection_state_t state,
+                                     amqp_bytes_t data);
+
+/**
+ * Pull decoded frames
+ *
+ * Heartbeat frames are handled by the driver and not returned. The memory of
+ * the frames returned follows the same rules as amqp_simple_wait_frame().
+ *
+ * \param [in] state the connection object
+ * \param [out] frames array filled in with the frames
+ * \param [in] max_frames the size of frames
+ * \return the number of frames stored in frames, 0 if none are pending.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_driver_pull_frames(amqp_connection_state_t state,
+                                      amqp_frame_t *frames, int max_frames);
+
+/**
+ * Get the bytes waiting to be written to the transport
+ *
+ * The bytes stay pending until amqp_driver_consume_output() is called. The
+ * memory returned is owned by the driver and is valid until the next call to
+ * a function that sends or consumes output on the connection.
+ *
+ * \param [in] state the connection object
+ * \return the pending bytes, empty if there are none or the connection does
+ * not use a driver socket.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_bytes_t AMQP_CALL amqp_driver_peek_output(amqp_connection_state_t state);
+
+/**
+ * Mark pending output as written to the transport
+ *
+ * \param [in] state the connection object
+ * \param [in] len the number of bytes from the start of
+ *             amqp_driver_peek_output() that were written
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if len is
+ * larger than the pending output or the connection does not use a driver
+ * socket.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_driver_consume_output(amqp_connection_state_t state,
+                                         size_t len);
+
+/**
+ * Advance the connection's clock
+ *
+ * Sends a heartbeat when nothing has been written for the negotiated
+ * heartbeat interval, and detects a broker that has been silent for twice the
+ * interval. Call it whenever the time returned in next_ms is reached, and may
+ * be called more often. now_ms may come from any monotonic clock, as long as
+ * the same clock is used on every call.
+ *
+ * \param [in] state the connection object
+ * \param [in] now_ms the current time in milliseconds
+ * \param [out] next_ms the time at which amqp_driver_tick() must be called
+ *              next, always later than now_ms, UINT64_MAX if heartbeats are
+ *              disabled. Pending output stands in for a heartbeat that is due,
+ *              so no deadline is reported for it until it has been written.
+ *              May be NULL.
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_HEARTBEAT_TIMEOUT if the
+ * broker missed its heartbeats (the driver is closed),
+ * AMQP_STATUS_INVALID_PARAMETER if the connection does not use a driver
+ * socket.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_driver_tick(amqp_connection_state_t state, uint64_t now_ms,
+                               uint64_t *next_ms);
+
+AMQP_END_DECLS
+
+#endif /* AMQP_DRIVER_H */
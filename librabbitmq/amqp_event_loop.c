@@ -0,0 +1,650 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp.h"
+#include "amqp_private.h"
+#include "amqp_socket.h"
+#include "amqp_time.h"
+
+#include <stdlib.h>
+
+#ifdef HAVE_EPOLL
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* Heartbeat and idle deadlines of all connections are kept on a hashed timer
+ * wheel. A connection is filed under the tick of its earliest deadline; when
+ * that tick comes round the real deadlines are checked and the connection is
+ * filed again, so deadlines moving later as traffic flows cost nothing. */
+#define AMQP_EVENT_LOOP_WHEEL_SLOTS 256
+#define AMQP_EVENT_LOOP_TICK_NS (100 * AMQP_NS_PER_MS)
+
+/* Number of epoll events collected per wait */
+#define AMQP_EVENT_LOOP_MAX_EVENTS 64
+
+/* Number of socket reads a connection gets per dispatch before the loop moves
+ * on to other connections */
+#define AMQP_EVENT_LOOP_READ_BUDGET 16
+
+typedef struct amqp_event_loop_conn_t_ {
+  amqp_event_loop_t *loop;
+  amqp_connection_state_t state;
+  amqp_event_loop_callback_t callback;
+  void *user_data;
+  int fd;
+  int removed;
+
+  /* all connections in the loop */
+  struct amqp_event_loop_conn_t_ *prev;
+  struct amqp_event_loop_conn_t_ *next;
+
+  /* timer wheel slot, timer_tick is 0 when not on the wheel */
+  uint64_t timer_tick;
+  struct amqp_event_loop_conn_t_ *timer_prev;
+  struct amqp_event_loop_conn_t_ *timer_next;
+
+  /* connections with input left over after using up their read budget, or
+   * with data that arrived outside of the loop */
+  int pending;
+  struct amqp_event_loop_conn_t_ *pending_next;
+
+  /* removed while the loop was dispatching, freed once it returns */
+  struct amqp_event_loop_conn_t_ *dead_next;
+} amqp_event_loop_conn_t;
+
+struct amqp_event_loop_t_ {
+  int epoll_fd;
+  int running;
+  /* number of callbacks invoked, to tell whether a wait did anything */
+  unsigned long callbacks;
+  amqp_event_loop_conn_t *connections;
+  amqp_event_loop_conn_t *pending;
+  amqp_event_loop_conn_t *dead;
+
+  uint64_t wheel_tick;
+  int timers;
+  amqp_event_loop_conn_t *wheel[AMQP_EVENT_LOOP_WHEEL_SLOTS];
+};
+
+static int current_tick(uint64_t *tick) {
+  uint64_t now_ns = amqp_get_monotonic_timestamp();
+  if (0 == now_ns) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+  *tick = now_ns / AMQP_EVENT_LOOP_TICK_NS;
+  return AMQP_STATUS_OK;
+}
+
+static void timer_unlink(amqp_event_loop_t *loop,
+                         amqp_event_loop_conn_t *conn) {
+  if (0 == conn->timer_tick) {
+    return;
+  }
+  if (NULL == conn->timer_prev) {
+    loop->wheel[conn->timer_tick % AMQP_EVENT_LOOP_WHEEL_SLOTS] =
+        conn->timer_next;
+  } else {
+    conn->timer_prev->timer_next = conn->timer_next;
+  }
+  if (NULL != conn->timer_next) {
+    conn->timer_next->timer_prev = conn->timer_prev;
+  }
+  conn->timer_tick = 0;
+  loop->timers--;
+}
+
+static void timer_link(amqp_event_loop_t *loop, amqp_event_loop_conn_t *conn,
+                       uint64_t tick) {
+  amqp_event_loop_conn_t **slot =
+      &loop->wheel[tick % AMQP_EVENT_LOOP_WHEEL_SLOTS];
+
+  conn->timer_tick = tick;
+  conn->timer_prev = NULL;
+  conn->timer_next = *slot;
+  if (NULL != *slot) {
+    (*slot)->timer_prev = conn;
+  }
+  *slot = conn;
+  loop->timers++;
+}
+
+/* File the connection under its earliest deadline. A connection already filed
+ * under an earlier tick is left alone, it is re-checked when that tick fires */
+static void timer_update(amqp_event_loop_t *loop,
+                         amqp_event_loop_conn_t *conn) {
+  amqp_connection_state_t state = conn->state;
+  amqp_time_t deadline;
+  uint64_t tick;
+
+  deadline = amqp_time_first(
+      amqp_time_first(state->next_send_heartbeat, state->next_recv_heartbeat),
+      state->next_idle);
+  if (amqp_time_equal(deadline, amqp_time_infinite())) {
+    return;
+  }
+
+  /* Round up so the deadline has passed by the time the tick fires */
+  tick = deadline.time_point_ns / AMQP_EVENT_LOOP_TICK_NS + 1;
+  if (tick <= loop->wheel_tick) {
+    tick = loop->wheel_tick + 1;
+  }
+  if (0 != conn->timer_tick && conn->timer_tick <= tick) {
+    return;
+  }
+  timer_unlink(loop, conn);
+  timer_link(loop, conn, tick);
+}
+
+static void pending_add(amqp_event_loop_t *loop,
+                        amqp_event_loop_conn_t *conn) {
+  if (conn->pending) {
+    return;
+  }
+  conn->pending = 1;
+  conn->pending_next = loop->pending;
+  loop->pending = conn;
+}
+
+static void pending_remove(amqp_event_loop_t *loop,
+                           amqp_event_loop_conn_t *conn) {
+  amqp_event_loop_conn_t **cur;
+
+  if (!conn->pending) {
+    return;
+  }
+  for (cur = &loop->pending; *cur != conn; cur = &(*cur)->pending_next) {
+  }
+  *cur = conn->pending_next;
+  conn->pending = 0;
+}
+
+static void fail_connection(amqp_event_loop_t *loop,
+                            amqp_event_loop_conn_t *conn, int status) {
+  amqp_connection_state_t state = conn->state;
+  amqp_event_loop_callback_t callback = conn->callback;
+  void *user_data = conn->user_data;
+
+  amqp_event_loop_remove(loop, state);
+  loop->callbacks++;
+  callback(loop, state, NULL, status, user_data);
+}
+
+/* Hand every frame that is already decoded, queued or sitting in the socket
+ * buffer to the callback */
+static int deliver_frames(amqp_event_loop_t *loop,
+                          amqp_event_loop_conn_t *conn) {
+  amqp_connection_state_t state = conn->state;
+  amqp_frame_t frame;
+  int res;
+
+  while (!conn->removed) {
+    if (amqp_frames_enqueued(state)) {
+      res = amqp_simple_wait_frame(state, &frame);
+    } else if (amqp_data_in_buffer(state)) {
+      res = amqp_consume_one_frame(state, &frame);
+    } else {
+      return AMQP_STATUS_OK;
+    }
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (AMQP_FRAME_HEARTBEAT == frame.frame_type) {
+      amqp_maybe_release_buffers_on_channel(state, 0);
+      continue;
+    }
+    if (0 != frame.frame_type) {
+      loop->callbacks++;
+      conn->callback(loop, state, &frame, AMQP_STATUS_OK, conn->user_data);
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Register the connection's current socket. Only readability is asked for:
+ * sends are synchronous, and errors and hang-ups are reported regardless and
+ * surface from the next read. A socket that is already registered is left
+ * as it is; the registration of a closed socket is dropped by the kernel. */
+static int arm(amqp_event_loop_t *loop, amqp_event_loop_conn_t *conn) {
+  struct epoll_event event;
+  int fd = amqp_get_sockfd(conn->state);
+
+  if (-1 == fd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = conn;
+  if (-1 == epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) &&
+      EEXIST != errno) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  conn->fd = fd;
+  return AMQP_STATUS_OK;
+}
+
+static void dispatch_input(amqp_event_loop_t *loop,
+                           amqp_event_loop_conn_t *conn) {
+  int i;
+  int res;
+
+  for (i = 0; i < AMQP_EVENT_LOOP_READ_BUDGET; ++i) {
+    res = deliver_frames(loop, conn);
+    if (conn->removed) {
+      return;
+    }
+    /* A callback may have put a new socket under the connection */
+    if (AMQP_STATUS_OK == res && amqp_get_sockfd(conn->state) != conn->fd) {
+      res = arm(loop, conn);
+    }
+    if (AMQP_STATUS_OK != res) {
+      fail_connection(loop, conn, res);
+      return;
+    }
+
+    /* Read until the socket runs dry rather than once per readiness event:
+     * TLS can hold decrypted data the fd no longer reports as readable */
+    res = amqp_recv_with_timeout(conn->state, amqp_time_immediate());
+    if (AMQP_STATUS_TIMEOUT == res) {
+      /* Acks recorded by the callbacks go out before the loop sleeps */
+      if (NULL != conn->state->ack_windows) {
+        res = amqp_flush_acks(conn->state);
+        if (AMQP_STATUS_OK != res) {
+          fail_connection(loop, conn, res);
+          return;
+        }
+      }
+      timer_update(loop, conn);
+      return;
+    }
+    if (AMQP_STATUS_OK != res) {
+      fail_connection(loop, conn, res);
+      return;
+    }
+  }
+
+  pending_add(loop, conn);
+  timer_update(loop, conn);
+}
+
+static void dispatch_timers(amqp_event_loop_t *loop,
+                            amqp_event_loop_conn_t *conn) {
+  amqp_connection_state_t state = conn->state;
+  int res;
+
+  res = amqp_time_has_past(state->next_send_heartbeat);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    amqp_frame_t heartbeat;
+    heartbeat.channel = 0;
+    heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
+
+    res = amqp_send_frame(state, &heartbeat);
+  }
+  if (AMQP_STATUS_OK != res) {
+    fail_connection(loop, conn, res);
+    return;
+  }
+
+  res = amqp_time_has_past(state->next_recv_heartbeat);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    amqp_socket_close(state->socket, AMQP_SC_FORCE);
+    fail_connection(loop, conn, AMQP_STATUS_HEARTBEAT_TIMEOUT);
+    return;
+  } else if (AMQP_STATUS_OK != res) {
+    fail_connection(loop, conn, res);
+    return;
+  }
+
+  res = amqp_time_has_past(state->next_idle);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    amqp_release_idle_buffers(state);
+    state->next_idle = amqp_time_infinite();
+  } else if (AMQP_STATUS_OK != res) {
+    fail_connection(loop, conn, res);
+    return;
+  }
+
+  timer_update(loop, conn);
+}
+
+static int run_timers(amqp_event_loop_t *loop) {
+  uint64_t now_tick;
+  uint64_t tick;
+  uint64_t last_tick;
+  int res;
+
+  res = current_tick(&now_tick);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  if (now_tick <= loop->wheel_tick) {
+    return AMQP_STATUS_OK;
+  }
+
+  /* Past a full turn of the wheel every slot is visited once */
+  tick = loop->wheel_tick + 1;
+  if (now_tick - loop->wheel_tick > AMQP_EVENT_LOOP_WHEEL_SLOTS) {
+    tick = now_tick - AMQP_EVENT_LOOP_WHEEL_SLOTS + 1;
+  }
+  last_tick = now_tick;
+  /* Connections refiled while the slots are walked land after now_tick */
+  loop->wheel_tick = now_tick;
+
+  for (; tick <= last_tick; ++tick) {
+    amqp_event_loop_conn_t *conn;
+
+    /* Callbacks may remove any connection, so the slot is scanned from the
+     * start after each one that was due. Entries left behind belong to a
+     * later turn of the wheel. */
+    for (;;) {
+      for (conn = loop->wheel[tick % AMQP_EVENT_LOOP_WHEEL_SLOTS];
+           NULL != conn && conn->timer_tick > now_tick;
+           conn = conn->timer_next) {
+      }
+      if (NULL == conn) {
+        break;
+      }
+      timer_unlink(loop, conn);
+      dispatch_timers(loop, conn);
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Time until the first tick that has a connection filed under it */
+static amqp_time_t next_timer(amqp_event_loop_t *loop) {
+  amqp_time_t deadline;
+  uint64_t i;
+
+  if (0 == loop->timers) {
+    return amqp_time_infinite();
+  }
+  for (i = 1; i < AMQP_EVENT_LOOP_WHEEL_SLOTS; ++i) {
+    if (NULL != loop->wheel[(loop->wheel_tick + i) %
+                            AMQP_EVENT_LOOP_WHEEL_SLOTS]) {
+      break;
+    }
+  }
+  deadline.time_point_ns = (loop->wheel_tick + i) * AMQP_EVENT_LOOP_TICK_NS;
+  return deadline;
+}
+
+static void free_dead(amqp_event_loop_t *loop) {
+  while (NULL != loop->dead) {
+    amqp_event_loop_conn_t *conn = loop->dead;
+    loop->dead = conn->dead_next;
+    free(conn);
+  }
+}
+
+amqp_event_loop_t *amqp_event_loop_new(void) {
+  amqp_event_loop_t *loop = calloc(1, sizeof(amqp_event_loop_t));
+  if (NULL == loop) {
+    return NULL;
+  }
+
+  if (AMQP_STATUS_OK != current_tick(&loop->wheel_tick)) {
+    free(loop);
+    return NULL;
+  }
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (-1 == loop->epoll_fd) {
+    free(loop);
+    return NULL;
+  }
+  return loop;
+}
+
+void amqp_event_loop_destroy(amqp_event_loop_t *loop) {
+  if (NULL == loop) {
+    return;
+  }
+  while (NULL != loop->connections) {
+    amqp_event_loop_remove(loop, loop->connections->state);
+  }
+  free_dead(loop);
+  close(loop->epoll_fd);
+  free(loop);
+}
+
+int amqp_event_loop_add(amqp_event_loop_t *loop, amqp_connection_state_t state,
+                        amqp_event_loop_callback_t callback, void *user_data) {
+  amqp_event_loop_conn_t *conn;
+  int res;
+
+  if (NULL == loop || NULL == state || NULL == callback ||
+      NULL != state->event_loop_conn) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  /* A socket with its own wait can't be polled on its descriptor */
+  if (NULL != state->socket && NULL != state->socket->klass->wait) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  conn = calloc(1, sizeof(amqp_event_loop_conn_t));
+  if (NULL == conn) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  conn->loop = loop;
+  conn->state = state;
+  conn->callback = callback;
+  conn->user_data = user_data;
+
+  res = arm(loop, conn);
+  if (AMQP_STATUS_OK != res) {
+    free(conn);
+    return res;
+  }
+
+  conn->next = loop->connections;
+  if (NULL != loop->connections) {
+    loop->connections->prev = conn;
+  }
+  loop->connections = conn;
+  state->event_loop_conn = conn;
+
+  /* Frames may have been read before the connection joined the loop */
+  pending_add(loop, conn);
+  timer_update(loop, conn);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_event_loop_remove(amqp_event_loop_t *loop,
+                           amqp_connection_state_t state) {
+  amqp_event_loop_conn_t *conn;
+
+  if (NULL == loop || NULL == state || NULL == state->event_loop_conn ||
+      loop != state->event_loop_conn->loop) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  conn = state->event_loop_conn;
+
+  /* The socket may already have been closed, which removes it from the epoll
+   * set on its own. Its descriptor may then belong to another connection. */
+  if (amqp_get_sockfd(state) == conn->fd) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  }
+
+  timer_unlink(loop, conn);
+  pending_remove(loop, conn);
+  if (NULL == conn->prev) {
+    loop->connections = conn->next;
+  } else {
+    conn->prev->next = conn->next;
+  }
+  if (NULL != conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  state->event_loop_conn = NULL;
+  conn->removed = 1;
+
+  if (loop->running) {
+    conn->dead_next = loop->dead;
+    loop->dead = conn;
+  } else {
+    free(conn);
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_event_loop_detach(amqp_connection_state_t state) {
+  if (NULL != state->event_loop_conn) {
+    amqp_event_loop_remove(state->event_loop_conn->loop, state);
+  }
+}
+
+int amqp_event_loop_rearm(amqp_connection_state_t state) {
+  if (NULL == state->event_loop_conn) {
+    return AMQP_STATUS_OK;
+  }
+  return arm(state->event_loop_conn->loop, state->event_loop_conn);
+}
+
+static int event_loop_wait(amqp_event_loop_t *loop, amqp_time_t deadline) {
+  struct epoll_event events[AMQP_EVENT_LOOP_MAX_EVENTS];
+  amqp_event_loop_conn_t *pending;
+  amqp_time_t wait_until;
+  unsigned long callbacks = loop->callbacks;
+  int timeout_ms;
+  int res;
+  int i;
+
+  for (;;) {
+    /* Connections that still had input get the first turn */
+    pending = loop->pending;
+    loop->pending = NULL;
+    while (NULL != pending) {
+      amqp_event_loop_conn_t *conn = pending;
+      pending = conn->pending_next;
+      conn->pending = 0;
+      dispatch_input(loop, conn);
+    }
+
+    if (NULL != loop->pending || callbacks != loop->callbacks) {
+      wait_until = amqp_time_immediate();
+    } else {
+      wait_until = amqp_time_first(deadline, next_timer(loop));
+    }
+    timeout_ms = amqp_time_ms_until(wait_until);
+    if (-1 > timeout_ms) {
+      return timeout_ms;
+    }
+
+    res = epoll_wait(loop->epoll_fd, events, AMQP_EVENT_LOOP_MAX_EVENTS,
+                     timeout_ms);
+    if (-1 == res) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return AMQP_STATUS_SOCKET_ERROR;
+    }
+
+    for (i = 0; i < res; ++i) {
+      amqp_event_loop_conn_t *conn = events[i].data.ptr;
+      /* An earlier callback in this batch may have removed it */
+      if (!conn->removed) {
+        dispatch_input(loop, conn);
+      }
+    }
+
+    res = run_timers(loop);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (callbacks != loop->callbacks) {
+      return AMQP_STATUS_OK;
+    }
+    res = amqp_time_has_past(deadline);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+}
+
+int amqp_event_loop_run_once(amqp_event_loop_t *loop,
+                             const struct timeval *timeout) {
+  amqp_time_t deadline;
+  int res;
+
+  if (NULL == loop || loop->running) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  loop->running = 1;
+  res = event_loop_wait(loop, deadline);
+  loop->running = 0;
+  free_dead(loop);
+  return res;
+}
+
+#else /* HAVE_EPOLL */
+
+amqp_event_loop_t *amqp_event_loop_new(void) { return NULL; }
+
+void amqp_event_loop_destroy(amqp_event_loop_t *loop) { (void)loop; }
+
+int amqp_event_loop_add(amqp_event_loop_t *loop, amqp_connection_state_t state,
+                        amqp_event_loop_callback_t callback, void *user_data) {
+  (void)loop;
+  (void)state;
+  (void)callback;
+  (void)user_data;
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int amqp_event_loop_remove(amqp_event_loop_t *loop,
+                           amqp_connection_state_t state) {
+  (void)loop;
+  (void)state;
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int amqp_event_loop_run_once(amqp_event_loop_t *loop,
+                             const struct timeval *timeout) {
+  (void)loop;
+  (void)timeout;
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+void amqp_event_loop_detach(amqp_connection_state_t state) { (void)state; }
+
+int amqp_event_loop_rearm(amqp_connection_state_t state) {
+  (void)state;
+  return AMQP_STATUS_OK;
+}
+
+#endif /* HAVE_EPOLL */
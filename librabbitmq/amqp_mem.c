@@ -45,6 +45,15 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "amqp_ring.h"
+
+#ifdef AMQP_HAVE_THREADS
+#include <sys/mman.h>
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+#define AMQP_HAVE_HUGE_PAGES
+#endif
+#endif
+
 char const *amqp_version(void) { return AMQP_VERSION_STRING; }
 
 uint32_t amqp_version_number(void) { return AMQP_VERSION; }
@@ -63,12 +72,294 @@ void init_amqp_pool(amqp_pool_t *pool, size_t pagesize) {
   pool->alloc_used = 0;
 }
 
-static void empty_blocklist(amqp_pool_blocklist_t *x) {
+#ifndef AMQP_BUFFER_CACHE_BINS
+#define AMQP_BUFFER_CACHE_BINS 8
+#endif
+
+/* Free blocks of one size, linked through their first bytes */
+typedef struct amqp_buffer_cache_bin_t_ {
+  size_t size;
+  void *head;
+} amqp_buffer_cache_bin_t;
+
+typedef struct amqp_buffer_cache_t_ {
+  size_t max_bytes;
+  size_t cached_bytes;
+  amqp_buffer_cache_bin_t bins[AMQP_BUFFER_CACHE_BINS];
+} amqp_buffer_cache_t;
+
+#ifdef AMQP_THREAD_LOCAL
+static AMQP_THREAD_LOCAL amqp_buffer_cache_t buffer_cache;
+#endif
+
+#ifdef AMQP_HAVE_HUGE_PAGES
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define AMQP_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/* Smaller blocks are left to malloc, they'd only fragment the arena */
+#define AMQP_HUGE_PAGE_MIN_BLOCK 4096
+/* Block sizes a chunk keeps released blocks of */
+#define AMQP_HUGE_PAGE_BINS 8
+
+/* At the start of every chunk. Chunks are aligned on their size, so a block
+ * finds its chunk from its address, and goes back to it from whichever
+ * thread releases it. Released blocks are kept in per-size bins, and a
+ * chunk none of whose blocks are in use any more is unmapped. */
+typedef struct amqp_huge_page_chunk_t_ {
+  struct amqp_huge_page_chunk_t_ *next;
+  size_t used;
+  size_t live;
+  amqp_buffer_cache_bin_t bins[AMQP_HUGE_PAGE_BINS];
+} amqp_huge_page_chunk_t;
+
+#define AMQP_HUGE_PAGE_HEADER \
+  ((sizeof(amqp_huge_page_chunk_t) + 63) & ~(size_t)63)
+
+static int huge_pages_enabled;
+static pthread_mutex_t huge_page_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Blocks are carved from the first chunk */
+static amqp_huge_page_chunk_t *huge_page_chunks;
+
+static int is_huge_page_size(size_t size) {
+  return amqp_atomic_load(&huge_pages_enabled) &&
+         size >= AMQP_HUGE_PAGE_MIN_BLOCK &&
+         size <= AMQP_HUGE_PAGE_SIZE - AMQP_HUGE_PAGE_HEADER;
+}
+
+static amqp_huge_page_chunk_t *map_huge_page_chunk(void) {
+  char *region;
+  uintptr_t aligned;
+  size_t head;
+
+#ifdef MAP_HUGETLB
+  region = mmap(NULL, AMQP_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (region != MAP_FAILED) {
+    return (amqp_huge_page_chunk_t *)region;
+  }
+#endif
+
+  /* No reserved huge pages are available: map an aligned region and ask for
+   * it to be backed by transparent huge pages instead */
+  region = mmap(NULL, 2 * AMQP_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    return NULL;
+  }
+  aligned = ((uintptr_t)region + AMQP_HUGE_PAGE_SIZE - 1) &
+            ~(uintptr_t)(AMQP_HUGE_PAGE_SIZE - 1);
+  head = aligned - (uintptr_t)region;
+  if (head != 0) {
+    munmap(region, head);
+  }
+  munmap((char *)aligned + AMQP_HUGE_PAGE_SIZE, AMQP_HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+  madvise((void *)aligned, AMQP_HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+#endif
+  return (amqp_huge_page_chunk_t *)aligned;
+}
+
+static void reset_huge_page_chunk(amqp_huge_page_chunk_t *chunk) {
+  chunk->used = AMQP_HUGE_PAGE_HEADER;
+  chunk->live = 0;
+  memset(chunk->bins, 0, sizeof(chunk->bins));
+}
+
+static void *huge_page_alloc(size_t size) {
+  /* keep blocks cache line aligned */
+  size_t rounded = (size + 63) & ~(size_t)63;
+  amqp_huge_page_chunk_t *chunk;
+  void *block = NULL;
+  int i;
+
+  pthread_mutex_lock(&huge_page_lock);
+  for (chunk = huge_page_chunks; chunk != NULL && block == NULL;
+       chunk = chunk->next) {
+    for (i = 0; i < AMQP_HUGE_PAGE_BINS; i++) {
+      amqp_buffer_cache_bin_t *bin = &chunk->bins[i];
+      if (bin->size == size && bin->head != NULL) {
+        block = bin->head;
+        memcpy(&bin->head, block, sizeof(void *));
+        chunk->live++;
+        break;
+      }
+    }
+  }
+
+  if (block == NULL) {
+    chunk = huge_page_chunks;
+    if (chunk == NULL || chunk->used + rounded > AMQP_HUGE_PAGE_SIZE) {
+      chunk = map_huge_page_chunk();
+      if (chunk != NULL) {
+        reset_huge_page_chunk(chunk);
+        chunk->next = huge_page_chunks;
+        huge_page_chunks = chunk;
+      }
+    }
+    if (chunk != NULL) {
+      block = (char *)chunk + chunk->used;
+      chunk->used += rounded;
+      chunk->live++;
+    }
+  }
+  pthread_mutex_unlock(&huge_page_lock);
+  return block;
+}
+
+/* Returns 0 if the block isn't in any chunk: it came from malloc, before
+ * huge pages were enabled or when no chunk could be mapped */
+static int huge_page_free(void *block, size_t size) {
+  amqp_huge_page_chunk_t *chunk =
+      (amqp_huge_page_chunk_t *)((uintptr_t)block &
+                                 ~(uintptr_t)(AMQP_HUGE_PAGE_SIZE - 1));
+  amqp_huge_page_chunk_t **link;
+  amqp_buffer_cache_bin_t *bin = NULL;
+  int i;
+
+  pthread_mutex_lock(&huge_page_lock);
+  for (link = &huge_page_chunks; *link != NULL && *link != chunk;
+       link = &(*link)->next) {
+  }
+  if (*link == NULL) {
+    pthread_mutex_unlock(&huge_page_lock);
+    return 0;
+  }
+
+  if (--chunk->live == 0) {
+    if (chunk == huge_page_chunks) {
+      /* Carved again from the start */
+      reset_huge_page_chunk(chunk);
+    } else {
+      *link = chunk->next;
+      munmap(chunk, AMQP_HUGE_PAGE_SIZE);
+    }
+    pthread_mutex_unlock(&huge_page_lock);
+    return 1;
+  }
+
+  for (i = 0; i < AMQP_HUGE_PAGE_BINS; i++) {
+    if (chunk->bins[i].size == size) {
+      bin = &chunk->bins[i];
+      break;
+    }
+    if (bin == NULL && chunk->bins[i].head == NULL) {
+      bin = &chunk->bins[i];
+    }
+  }
+  /* Without a bin, the block is only reclaimed with its whole chunk */
+  if (bin != NULL) {
+    bin->size = size;
+    memcpy(block, &bin->head, sizeof(void *));
+    bin->head = block;
+  }
+  pthread_mutex_unlock(&huge_page_lock);
+  return 1;
+}
+#endif
+
+int amqp_enable_huge_page_buffers(void) {
+#ifdef AMQP_HAVE_HUGE_PAGES
+  amqp_atomic_store(&huge_pages_enabled, 1);
+  return AMQP_STATUS_OK;
+#else
+  return AMQP_STATUS_UNSUPPORTED;
+#endif
+}
+
+void *amqp_buffer_cache_alloc(size_t size) {
+#ifdef AMQP_THREAD_LOCAL
+  int i;
+#endif
+#ifdef AMQP_HAVE_HUGE_PAGES
+  if (is_huge_page_size(size)) {
+    void *block = huge_page_alloc(size);
+    if (block != NULL) {
+      return block;
+    }
+  }
+#endif
+#ifdef AMQP_THREAD_LOCAL
+  for (i = 0; i < AMQP_BUFFER_CACHE_BINS && buffer_cache.cached_bytes; i++) {
+    amqp_buffer_cache_bin_t *bin = &buffer_cache.bins[i];
+    if (bin->size == size && bin->head != NULL) {
+      void *block = bin->head;
+      memcpy(&bin->head, block, sizeof(void *));
+      buffer_cache.cached_bytes -= size;
+      return block;
+    }
+  }
+#endif
+  return malloc(size);
+}
+
+void amqp_buffer_cache_free(void *block, size_t size) {
+#ifdef AMQP_HAVE_HUGE_PAGES
+  /* Blocks of these sizes handed out before huge pages were enabled came
+   * from malloc, the chunk list tells them apart */
+  if (block != NULL && is_huge_page_size(size) &&
+      huge_page_free(block, size)) {
+    return;
+  }
+#endif
+#ifdef AMQP_THREAD_LOCAL
+  if (block != NULL && size >= sizeof(void *) &&
+      buffer_cache.cached_bytes + size <= buffer_cache.max_bytes) {
+    amqp_buffer_cache_bin_t *bin = NULL;
+    int i;
+    for (i = 0; i < AMQP_BUFFER_CACHE_BINS; i++) {
+      if (buffer_cache.bins[i].size == size) {
+        bin = &buffer_cache.bins[i];
+        break;
+      }
+      if (bin == NULL && buffer_cache.bins[i].head == NULL) {
+        bin = &buffer_cache.bins[i];
+      }
+    }
+    if (bin != NULL) {
+      bin->size = size;
+      memcpy(block, &bin->head, sizeof(void *));
+      bin->head = block;
+      buffer_cache.cached_bytes += size;
+      return;
+    }
+  }
+#else
+  (void)size;
+#endif
+  free(block);
+}
+
+int amqp_set_thread_buffer_cache(size_t max_bytes) {
+#ifdef AMQP_THREAD_LOCAL
+  int i;
+  buffer_cache.max_bytes = max_bytes;
+  for (i = 0; i < AMQP_BUFFER_CACHE_BINS; i++) {
+    amqp_buffer_cache_bin_t *bin = &buffer_cache.bins[i];
+    while (bin->head != NULL && buffer_cache.cached_bytes > max_bytes) {
+      void *block = bin->head;
+      memcpy(&bin->head, block, sizeof(void *));
+      buffer_cache.cached_bytes -= bin->size;
+      free(block);
+    }
+  }
+  return AMQP_STATUS_OK;
+#else
+  return 0 == max_bytes ? AMQP_STATUS_OK : AMQP_STATUS_UNSUPPORTED;
+#endif
+}
+
+static void empty_blocklist(amqp_pool_blocklist_t *x, size_t blocksize) {
   int i;
 
   if (x->blocklist != NULL) {
     for (i = 0; i < x->num_blocks; i++) {
-      free(x->blocklist[i]);
+      if (blocksize) {
+        amqp_buffer_cache_free(x->blocklist[i], blocksize);
+      } else {
+        free(x->blocklist[i]);
+      }
     }
     free(x->blocklist);
   }
@@ -77,7 +368,7 @@ static void empty_blocklist(amqp_pool_blocklist_t *x) {
 }
 
 void recycle_amqp_pool(amqp_pool_t *pool) {
-  empty_blocklist(&pool->large_blocks);
+  empty_blocklist(&pool->large_blocks, 0);
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
@@ -85,7 +376,7 @@ void recycle_amqp_pool(amqp_pool_t *pool) {
 
 void empty_amqp_pool(amqp_pool_t *pool) {
   recycle_amqp_pool(pool);
-  empty_blocklist(&pool->pages);
+  empty_blocklist(&pool->pages, pool->pagesize);
 }
 
 /* Returns 1 on success, 0 on failure */
@@ -140,11 +431,13 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
   }
 
   if (pool->next_page >= pool->pages.num_blocks) {
-    pool->alloc_block = calloc(1, pool->pagesize);
+    pool->alloc_block = amqp_buffer_cache_alloc(pool->pagesize);
     if (pool->alloc_block == NULL) {
       return NULL;
     }
     if (!record_pool_block(&pool->pages, pool->alloc_block)) {
+      amqp_buffer_cache_free(pool->alloc_block, pool->pagesize);
+      pool->alloc_block = NULL;
       return NULL;
     }
     pool->next_page = pool->pages.num_blocks;
@@ -190,20 +483,17 @@ amqp_bytes_t amqp_bytes_malloc(size_t amount) {
 
 void amqp_bytes_free(amqp_bytes_t bytes) { free(bytes.bytes); }
 
-amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state,
-                                             amqp_channel_t channel) {
+amqp_pool_table_entry_t *amqp_get_or_create_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel) {
   amqp_pool_table_entry_t *entry;
   size_t index = channel % POOL_TABLE_SIZE;
 
-  entry = state->pool_table[index];
-
-  for (; NULL != entry; entry = entry->next) {
-    if (channel == entry->channel) {
-      return &entry->pool;
-    }
+  entry = amqp_get_channel_pool_entry(state, channel);
+  if (NULL != entry) {
+    return entry;
   }
 
-  entry = malloc(sizeof(amqp_pool_table_entry_t));
+  entry = calloc(1, sizeof(amqp_pool_table_entry_t));
   if (NULL == entry) {
     return NULL;
   }
@@ -213,12 +503,13 @@ amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state,
   state->pool_table[index] = entry;
 
   init_amqp_pool(&entry->pool, state->frame_max);
+  init_amqp_pool(&entry->header_pool, AMQP_HEADER_POOL_PAGE_SIZE);
 
-  return &entry->pool;
+  return entry;
 }
 
-amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
-                                   amqp_channel_t channel) {
+amqp_pool_table_entry_t *amqp_get_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel) {
   amqp_pool_table_entry_t *entry;
   size_t index = channel % POOL_TABLE_SIZE;
 
@@ -226,13 +517,40 @@ amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
 
   for (; NULL != entry; entry = entry->next) {
     if (channel == entry->channel) {
-      return &entry->pool;
+      return entry;
     }
   }
 
   return NULL;
 }
 
+amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state,
+                                             amqp_channel_t channel) {
+  amqp_pool_table_entry_t *entry =
+      amqp_get_or_create_channel_pool_entry(state, channel);
+  return entry ? &entry->pool : NULL;
+}
+
+amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
+                                   amqp_channel_t channel) {
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(state, channel);
+  return entry ? &entry->pool : NULL;
+}
+
+int amqp_take_header_pool(amqp_connection_state_t state, amqp_channel_t channel,
+                          amqp_pool_t *pool) {
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(state, channel);
+
+  if (NULL == entry || 1 != entry->header_frames) {
+    return 0;
+  }
+
+  *pool = entry->header_pool;
+  init_amqp_pool(&entry->header_pool, AMQP_HEADER_POOL_PAGE_SIZE);
+  entry->header_frames = 0;
+  return 1;
+}
+
 int amqp_bytes_equal(amqp_bytes_t r, amqp_bytes_t l) {
   if (r.len == l.len &&
       (r.bytes == l.bytes || 0 == memcmp(r.bytes, l.bytes, r.len))) {
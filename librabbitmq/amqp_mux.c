@@ -0,0 +1,1286 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp.h"
+#include "amqp_private.h"
+#include "amqp_ring.h"
+#include "amqp_socket.h"
+#include "amqp_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(AMQP_HAVE_THREADS) && defined(HAVE_POLL)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+/* Requests a channel handle can queue before its owner waits for the IO
+ * thread */
+#define AMQP_MUX_REQUEST_RING_SIZE 256
+/* Deliveries queued for a channel handle before the IO thread holds them
+ * back */
+#define AMQP_MUX_DELIVERY_RING_SIZE 256
+/* Requests from all channels are gathered into writes of up to this size */
+#define AMQP_MUX_WRITE_BATCH (64 * 1024)
+/* Socket reads between looking at the requests */
+#define AMQP_MUX_READ_BUDGET 16
+
+enum { AMQP_MUX_SEND, AMQP_MUX_RPC, AMQP_MUX_UNREGISTER };
+
+/* AMQP_MUX_SEND requests are allocated together with their frames and freed
+ * by the IO thread. The others live on the stack of the submitting thread,
+ * which waits for them to complete. */
+typedef struct amqp_mux_request_t_ {
+  int type;
+  const amqp_method_number_t *expected_replies;
+  amqp_bytes_t encoded;
+} amqp_mux_request_t;
+
+/* A basic.deliver, or a basic.return when returned is set. The exchange and
+ * routing key of a return are those of the envelope, its reply text is
+ * owned here. */
+typedef struct amqp_mux_delivery_t_ {
+  amqp_envelope_t envelope;
+  amqp_basic_return_t *returned;
+  struct amqp_mux_delivery_t_ *next;
+} amqp_mux_delivery_t;
+
+struct amqp_mux_channel_t_ {
+  amqp_mux_t *mux;
+  amqp_channel_t channel;
+  amqp_spsc_ring_t requests;   /* owner -> IO thread */
+  amqp_spsc_ring_t deliveries; /* IO thread -> owner */
+  amqp_waiter_t waiter;        /* the owner sleeps here */
+  amqp_bytes_t scratch;        /* owner, room to encode two frames */
+  /* Owner, the return last handed out, whose method the owner may read
+   * until the next delivery */
+  amqp_mux_delivery_t *last_return;
+
+  /* Written by the IO thread, published through the flags */
+  int rpc_done;
+  amqp_rpc_reply_t rpc_reply;
+  int open;
+  amqp_rpc_reply_t close_reply;
+  int unregistered;
+  int overflowing;
+
+  /* IO thread only */
+  const amqp_method_number_t *pending_rpc;
+  int reply_held; /* the owner may still read the last reply */
+  size_t active_index;
+  amqp_mux_delivery_t *overflow_first;
+  amqp_mux_delivery_t *overflow_last;
+
+  /* Under the mux lock until the IO thread picks the handle up */
+  struct amqp_mux_channel_t_ *next_pending;
+};
+
+struct amqp_mux_t_ {
+  amqp_connection_state_t state;
+  pthread_t thread;
+  int wake_fds[2];
+  int io_sleeping;
+  int stopping;
+  /* Set once the IO thread has stopped touching the channel handles */
+  int io_done;
+  int error;
+  int has_pending;
+  int channel_max;
+
+  pthread_mutex_t lock;
+  amqp_mux_channel_t *pending;
+  unsigned char in_use[65536 / 8];
+
+  /* IO thread only */
+  amqp_mux_channel_t **channels;
+  amqp_mux_channel_t **active;
+  size_t num_active;
+  size_t size_active;
+  char *out;
+  size_t out_len;
+};
+
+static void mux_wake(amqp_mux_t *mux) {
+  amqp_atomic_fence();
+  if (amqp_atomic_load(&mux->io_sleeping) &&
+      amqp_atomic_exchange(&mux->io_sleeping, 0)) {
+    char c = 0;
+    /* A full pipe is readable already */
+    if (write(mux->wake_fds[1], &c, 1) < 0) {
+      return;
+    }
+  }
+}
+
+static int mux_error(amqp_mux_t *mux) {
+  return AMQP_STATUS_OK != mux->error ? mux->error
+                                      : AMQP_STATUS_CONNECTION_CLOSED;
+}
+
+static int is_expected(const amqp_method_number_t *expected,
+                       amqp_method_number_t id) {
+  for (; 0 != *expected; ++expected) {
+    if (*expected == id) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void release_channel(amqp_mux_t *mux, amqp_channel_t channel) {
+  amqp_mux_channel_t *ch =
+      channel <= mux->channel_max ? mux->channels[channel] : NULL;
+  if (NULL == ch || !ch->reply_held) {
+    amqp_maybe_release_buffers_on_channel(mux->state, channel);
+  }
+}
+
+static void complete_rpc(amqp_mux_channel_t *ch, amqp_rpc_reply_t reply) {
+  ch->pending_rpc = NULL;
+  ch->rpc_reply = reply;
+  ch->reply_held = 1;
+  amqp_atomic_store(&ch->rpc_done, 1);
+  amqp_waiter_wake(&ch->waiter);
+}
+
+static int flush_out(amqp_mux_t *mux) {
+  amqp_bytes_t encoded;
+  if (0 == mux->out_len) {
+    return AMQP_STATUS_OK;
+  }
+  encoded.bytes = mux->out;
+  encoded.len = mux->out_len;
+  mux->out_len = 0;
+  return amqp_send_encoded_inner(mux->state, encoded, AMQP_SF_NONE,
+                                 amqp_time_infinite());
+}
+
+/* Frames from every channel are gathered so many small publishes and acks
+ * leave in one write */
+static int append_out(amqp_mux_t *mux, amqp_bytes_t encoded) {
+  int res;
+  if (mux->out_len + encoded.len > AMQP_MUX_WRITE_BATCH) {
+    res = flush_out(mux);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  if (encoded.len > AMQP_MUX_WRITE_BATCH) {
+    return amqp_send_encoded_inner(mux->state, encoded, AMQP_SF_NONE,
+                                   amqp_time_infinite());
+  }
+  memcpy(mux->out + mux->out_len, encoded.bytes, encoded.len);
+  mux->out_len += encoded.len;
+  return AMQP_STATUS_OK;
+}
+
+static int flush_overflow(amqp_mux_channel_t *ch) {
+  int moved = 0;
+  while (NULL != ch->overflow_first &&
+         amqp_spsc_ring_push(&ch->deliveries, ch->overflow_first)) {
+    ch->overflow_first = ch->overflow_first->next;
+    moved = 1;
+  }
+  if (NULL == ch->overflow_first) {
+    amqp_atomic_store(&ch->overflowing, 0);
+  }
+  if (moved) {
+    amqp_waiter_wake(&ch->waiter);
+  }
+  return moved;
+}
+
+static void queue_delivery(amqp_mux_channel_t *ch,
+                           amqp_mux_delivery_t *delivery) {
+  delivery->next = NULL;
+  if (NULL == ch->overflow_first &&
+      amqp_spsc_ring_push(&ch->deliveries, delivery)) {
+    amqp_waiter_wake(&ch->waiter);
+    return;
+  }
+  /* The owner isn't keeping up, prefetch bounds how far behind it gets */
+  if (NULL == ch->overflow_first) {
+    ch->overflow_first = delivery;
+  } else {
+    ch->overflow_last->next = delivery;
+  }
+  ch->overflow_last = delivery;
+  amqp_atomic_store(&ch->overflowing, 1);
+}
+
+static int dup_failed(amqp_bytes_t bytes) {
+  return 0 != bytes.len && NULL == bytes.bytes;
+}
+
+/* Frees a delivery whose envelope was handed out */
+static void free_handed_out(amqp_mux_delivery_t *delivery) {
+  if (NULL != delivery->returned) {
+    amqp_bytes_free(delivery->returned->reply_text);
+    free(delivery->returned);
+  }
+  free(delivery);
+}
+
+static void free_delivery(amqp_mux_delivery_t *delivery) {
+  amqp_destroy_envelope(&delivery->envelope);
+  free_handed_out(delivery);
+}
+
+static void free_overflow(amqp_mux_channel_t *ch) {
+  while (NULL != ch->overflow_first) {
+    amqp_mux_delivery_t *delivery = ch->overflow_first;
+    ch->overflow_first = delivery->next;
+    free_delivery(delivery);
+  }
+}
+
+static int handle_frame(amqp_mux_t *mux, amqp_frame_t *frame);
+
+/* A failed content read reports a channel or connection close as a server
+ * exception, it's handled as if the close had arrived on its own. Any other
+ * method in place of the content header was put back and is read next. */
+static int handle_content_error(amqp_mux_t *mux, amqp_channel_t channel,
+                                amqp_rpc_reply_t ret) {
+  amqp_frame_t frame;
+  if (AMQP_RESPONSE_SERVER_EXCEPTION != ret.reply_type) {
+    return AMQP_STATUS_UNEXPECTED_STATE == ret.library_error
+               ? AMQP_STATUS_OK
+               : ret.library_error;
+  }
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel =
+      AMQP_CONNECTION_CLOSE_METHOD == ret.reply.id ? 0 : channel;
+  frame.payload.method = ret.reply;
+  return handle_frame(mux, &frame);
+}
+
+static int handle_delivery(amqp_mux_t *mux, amqp_mux_channel_t *ch,
+                           amqp_frame_t *frame) {
+  amqp_channel_t channel = frame->channel;
+  amqp_mux_delivery_t *delivery;
+  amqp_rpc_reply_t ret;
+  int res;
+
+  delivery = malloc(sizeof(amqp_mux_delivery_t));
+  if (NULL == delivery) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  delivery->returned = NULL;
+  /* The content frames follow the method directly, the whole message is read
+   * and copied out of the connection's buffers */
+  res = amqp_put_back_frame(mux->state, frame);
+  if (AMQP_STATUS_OK != res) {
+    free(delivery);
+    return res;
+  }
+  ret = amqp_consume_message(mux->state, &delivery->envelope, NULL, 0);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    free(delivery);
+    return handle_content_error(mux, channel, ret);
+  }
+
+  if (NULL == ch) {
+    free_delivery(delivery);
+  } else {
+    queue_delivery(ch, delivery);
+  }
+  release_channel(mux, channel);
+  return AMQP_STATUS_OK;
+}
+
+/* Returned messages are queued for the channel's owner with the
+ * deliveries */
+static int handle_return(amqp_mux_t *mux, amqp_mux_channel_t *ch,
+                         amqp_frame_t *frame) {
+  amqp_channel_t channel = frame->channel;
+  amqp_basic_return_t *m = frame->payload.method.decoded;
+  amqp_mux_delivery_t *delivery;
+  amqp_envelope_t *envelope;
+  amqp_rpc_reply_t ret;
+
+  delivery = calloc(1, sizeof(amqp_mux_delivery_t));
+  if (NULL == delivery) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  delivery->returned = calloc(1, sizeof(amqp_basic_return_t));
+  envelope = &delivery->envelope;
+  envelope->channel = channel;
+  envelope->exchange = amqp_bytes_malloc_dup(m->exchange);
+  envelope->routing_key = amqp_bytes_malloc_dup(m->routing_key);
+  if (NULL == delivery->returned ||
+      dup_failed(envelope->exchange) ||
+      dup_failed(envelope->routing_key)) {
+    free_delivery(delivery);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  delivery->returned->reply_code = m->reply_code;
+  delivery->returned->reply_text = amqp_bytes_malloc_dup(m->reply_text);
+  delivery->returned->exchange = envelope->exchange;
+  delivery->returned->routing_key = envelope->routing_key;
+  if (dup_failed(delivery->returned->reply_text)) {
+    free_delivery(delivery);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  ret = amqp_read_message(mux->state, channel, &envelope->message, 0);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    free_delivery(delivery);
+    return handle_content_error(mux, channel, ret);
+  }
+
+  if (NULL == ch) {
+    free_delivery(delivery);
+  } else {
+    queue_delivery(ch, delivery);
+  }
+  release_channel(mux, channel);
+  return AMQP_STATUS_OK;
+}
+
+static int handle_frame(amqp_mux_t *mux, amqp_frame_t *frame) {
+  amqp_mux_channel_t *ch = frame->channel <= mux->channel_max
+                               ? mux->channels[frame->channel]
+                               : NULL;
+  amqp_method_number_t id;
+  int res;
+
+  if (AMQP_FRAME_METHOD != frame->frame_type) {
+    /* Heartbeats, or content without a method */
+    release_channel(mux, frame->channel);
+    return AMQP_STATUS_OK;
+  }
+
+  id = frame->payload.method.id;
+  if (0 == frame->channel) {
+    if (AMQP_CONNECTION_CLOSE_METHOD == id) {
+      amqp_connection_close_ok_t ok;
+      amqp_send_method(mux->state, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &ok);
+      return AMQP_STATUS_CONNECTION_CLOSED;
+    }
+    release_channel(mux, 0);
+    return AMQP_STATUS_OK;
+  }
+
+  switch (id) {
+    case AMQP_BASIC_DELIVER_METHOD:
+      return handle_delivery(mux, ch, frame);
+
+    case AMQP_BASIC_RETURN_METHOD:
+      return handle_return(mux, ch, frame);
+
+    case AMQP_CHANNEL_CLOSE_METHOD: {
+      amqp_channel_close_ok_t ok;
+      res = amqp_send_method(mux->state, frame->channel,
+                             AMQP_CHANNEL_CLOSE_OK_METHOD, &ok);
+      if (NULL != ch) {
+        ch->close_reply.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+        ch->close_reply.reply = frame->payload.method;
+        ch->close_reply.library_error = 0;
+        ch->reply_held = 1;
+        amqp_atomic_store(&ch->open, 0);
+        if (NULL != ch->pending_rpc) {
+          complete_rpc(ch, ch->close_reply);
+        } else {
+          amqp_waiter_wake(&ch->waiter);
+        }
+      }
+      return res;
+    }
+
+    default:
+      if (NULL != ch && NULL != ch->pending_rpc &&
+          is_expected(ch->pending_rpc, id)) {
+        amqp_rpc_reply_t reply;
+        if (AMQP_CHANNEL_OPEN_OK_METHOD == id) {
+          ch->close_reply.reply_type = 0;
+          amqp_atomic_store(&ch->open, 1);
+        } else if (AMQP_CHANNEL_CLOSE_OK_METHOD == id) {
+          ch->close_reply.reply_type = 0;
+          amqp_atomic_store(&ch->open, 0);
+        }
+        reply.reply_type = AMQP_RESPONSE_NORMAL;
+        reply.reply = frame->payload.method;
+        reply.library_error = 0;
+        complete_rpc(ch, reply);
+        return AMQP_STATUS_OK;
+      }
+      /* e.g. publisher confirms, which aren't tracked */
+      release_channel(mux, frame->channel);
+      return AMQP_STATUS_OK;
+  }
+}
+
+static int process_input(amqp_mux_t *mux, int *busy) {
+  amqp_connection_state_t state = mux->state;
+  amqp_frame_t frame;
+  int i;
+  int res;
+
+  for (i = 0; i < AMQP_MUX_READ_BUDGET; ++i) {
+    for (;;) {
+      if (amqp_frames_enqueued(state)) {
+        res = amqp_simple_wait_frame(state, &frame);
+      } else if (amqp_data_in_buffer(state)) {
+        res = amqp_consume_one_frame(state, &frame);
+      } else {
+        break;
+      }
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+      if (0 != frame.frame_type) {
+        *busy = 1;
+        res = handle_frame(mux, &frame);
+        if (AMQP_STATUS_OK != res) {
+          return res;
+        }
+      }
+    }
+
+    res = amqp_recv_with_timeout(state, amqp_time_immediate());
+    if (AMQP_STATUS_TIMEOUT == res) {
+      return AMQP_STATUS_OK;
+    }
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  /* There's more to read, but the requests get their turn first */
+  *busy = 1;
+  return AMQP_STATUS_OK;
+}
+
+static void take_registrations(amqp_mux_t *mux) {
+  amqp_mux_channel_t *ch;
+
+  if (!amqp_atomic_load(&mux->has_pending)) {
+    return;
+  }
+  pthread_mutex_lock(&mux->lock);
+  while (NULL != (ch = mux->pending)) {
+    mux->pending = ch->next_pending;
+    if (mux->num_active == mux->size_active) {
+      size_t size = mux->size_active ? 2 * mux->size_active : 16;
+      amqp_mux_channel_t **active =
+          realloc(mux->active, size * sizeof(amqp_mux_channel_t *));
+      if (NULL == active) {
+        /* Picked up on a later pass */
+        ch->next_pending = mux->pending;
+        mux->pending = ch;
+        break;
+      }
+      mux->active = active;
+      mux->size_active = size;
+    }
+    ch->active_index = mux->num_active;
+    mux->active[mux->num_active++] = ch;
+    mux->channels[ch->channel] = ch;
+  }
+  amqp_atomic_store(&mux->has_pending, NULL != mux->pending);
+  pthread_mutex_unlock(&mux->lock);
+}
+
+static void unregister(amqp_mux_t *mux, amqp_mux_channel_t *ch) {
+  amqp_mux_channel_t *last = mux->active[--mux->num_active];
+  last->active_index = ch->active_index;
+  mux->active[ch->active_index] = last;
+  mux->channels[ch->channel] = NULL;
+  free_overflow(ch);
+  if (!ch->reply_held) {
+    amqp_maybe_release_buffers_on_channel(mux->state, ch->channel);
+  }
+  /* The owner frees the handle as soon as it sees this, the flag is set
+   * under the waiter's mutex so that it can't see it before the mutex is
+   * released for the last time */
+  pthread_mutex_lock(&ch->waiter.mutex);
+  amqp_atomic_store(&ch->unregistered, 1);
+  pthread_cond_signal(&ch->waiter.cond);
+  pthread_mutex_unlock(&ch->waiter.mutex);
+}
+
+static int process_requests(amqp_mux_t *mux, int *busy) {
+  size_t i = 0;
+  int res = AMQP_STATUS_OK;
+
+  while (i < mux->num_active) {
+    amqp_mux_channel_t *ch = mux->active[i];
+    amqp_mux_request_t *request;
+    int drained = 0;
+    int removed = 0;
+
+    while (!removed &&
+           NULL != (request = amqp_spsc_ring_pop(&ch->requests))) {
+      drained = 1;
+      switch (request->type) {
+        case AMQP_MUX_SEND:
+          /* Frames for a channel the broker closed would close the
+           * connection */
+          if (AMQP_STATUS_OK == res && amqp_atomic_load(&ch->open)) {
+            res = append_out(mux, request->encoded);
+          }
+          free(request);
+          break;
+
+        case AMQP_MUX_RPC:
+          /* The owner is done with the previous reply */
+          ch->reply_held = 0;
+          amqp_maybe_release_buffers_on_channel(mux->state, ch->channel);
+          ch->pending_rpc = request->expected_replies;
+          if (AMQP_STATUS_OK == res) {
+            res = append_out(mux, request->encoded);
+          }
+          break;
+
+        case AMQP_MUX_UNREGISTER:
+          unregister(mux, ch);
+          removed = 1;
+          break;
+      }
+    }
+    if (drained) {
+      *busy = 1;
+      if (!removed) {
+        /* The owner may be waiting for room */
+        amqp_waiter_wake(&ch->waiter);
+      }
+    }
+    if (!removed) {
+      /* Deliveries held back move on as soon as the owner makes room, even
+       * while the IO thread never gets to sleep */
+      if (NULL != ch->overflow_first) {
+        flush_overflow(ch);
+      }
+      ++i;
+    }
+  }
+
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  return flush_out(mux);
+}
+
+static int run_timers(amqp_mux_t *mux) {
+  amqp_connection_state_t state = mux->state;
+  int res;
+
+  res = amqp_time_has_past(state->next_send_heartbeat);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    amqp_frame_t heartbeat;
+    heartbeat.channel = 0;
+    heartbeat.frame_type = AMQP_FRAME_HEARTBEAT;
+
+    res = amqp_send_frame(state, &heartbeat);
+  }
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = amqp_time_has_past(state->next_recv_heartbeat);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    amqp_socket_close(state->socket, AMQP_SC_FORCE);
+    return AMQP_STATUS_HEARTBEAT_TIMEOUT;
+  } else if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = amqp_time_has_past(state->next_idle);
+  if (AMQP_STATUS_TIMEOUT == res) {
+    amqp_release_idle_buffers(state);
+    state->next_idle = amqp_time_infinite();
+    res = AMQP_STATUS_OK;
+  }
+  return res;
+}
+
+/* Checked after announcing the IO thread is about to sleep, so anything
+ * submitted from here on wakes it */
+static int has_work(amqp_mux_t *mux) {
+  int work = 0;
+  size_t i;
+
+  if (amqp_atomic_load(&mux->has_pending) ||
+      amqp_atomic_load(&mux->stopping) ||
+      amqp_frames_enqueued(mux->state) || amqp_data_in_buffer(mux->state)) {
+    return 1;
+  }
+  for (i = 0; i < mux->num_active; ++i) {
+    amqp_mux_channel_t *ch = mux->active[i];
+    if (!amqp_spsc_ring_is_empty(&ch->requests)) {
+      work = 1;
+    }
+    if (NULL != ch->overflow_first) {
+      flush_overflow(ch);
+    }
+  }
+  return work;
+}
+
+static int io_sleep(amqp_mux_t *mux) {
+  amqp_connection_state_t state = mux->state;
+  struct pollfd pfd[2];
+  amqp_time_t deadline;
+  int timeout;
+  char drain[64];
+
+  amqp_atomic_store(&mux->io_sleeping, 1);
+  amqp_atomic_fence();
+  if (has_work(mux)) {
+    amqp_atomic_store(&mux->io_sleeping, 0);
+    return AMQP_STATUS_OK;
+  }
+
+  deadline =
+      amqp_time_first(state->next_send_heartbeat, state->next_recv_heartbeat);
+  deadline = amqp_time_first(deadline, state->next_idle);
+  timeout = amqp_time_ms_until(deadline);
+  if (AMQP_STATUS_TIMEOUT == timeout) {
+    timeout = 0;
+  } else if (timeout < -1) {
+    amqp_atomic_store(&mux->io_sleeping, 0);
+    return timeout;
+  }
+
+  pfd[0].fd = amqp_get_sockfd(state);
+  pfd[0].events = POLLIN;
+  pfd[0].revents = 0;
+  pfd[1].fd = mux->wake_fds[0];
+  pfd[1].events = POLLIN;
+  pfd[1].revents = 0;
+  if (poll(pfd, 2, timeout) < 0 && EINTR != errno) {
+    amqp_atomic_store(&mux->io_sleeping, 0);
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  amqp_atomic_store(&mux->io_sleeping, 0);
+
+  if (pfd[1].revents & POLLIN) {
+    while (read(mux->wake_fds[0], drain, sizeof(drain)) > 0) {
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+static void io_shutdown(amqp_mux_t *mux, int res) {
+  amqp_mux_channel_t *ch;
+  size_t i;
+
+  /* Owners that see io_done take the lock before freeing their handle, so
+   * nothing here can race with that */
+  pthread_mutex_lock(&mux->lock);
+  mux->error = res;
+  for (i = 0; i < mux->num_active; ++i) {
+    free_overflow(mux->active[i]);
+  }
+  amqp_atomic_store(&mux->io_done, 1);
+  for (i = 0; i < mux->num_active; ++i) {
+    amqp_waiter_wake(&mux->active[i]->waiter);
+  }
+  for (ch = mux->pending; NULL != ch; ch = ch->next_pending) {
+    amqp_waiter_wake(&ch->waiter);
+  }
+  pthread_mutex_unlock(&mux->lock);
+}
+
+static void *io_main(void *arg) {
+  amqp_mux_t *mux = arg;
+  int res;
+
+  for (;;) {
+    int busy = 0;
+
+    take_registrations(mux);
+    res = process_input(mux, &busy);
+    if (AMQP_STATUS_OK != res) {
+      break;
+    }
+    res = process_requests(mux, &busy);
+    if (AMQP_STATUS_OK != res) {
+      break;
+    }
+    res = run_timers(mux);
+    if (AMQP_STATUS_OK != res || amqp_atomic_load(&mux->stopping)) {
+      break;
+    }
+    if (!busy) {
+      res = io_sleep(mux);
+      if (AMQP_STATUS_OK != res) {
+        break;
+      }
+    }
+  }
+  io_shutdown(mux, res);
+  return NULL;
+}
+
+amqp_mux_t *amqp_mux_new(amqp_connection_state_t state) {
+  amqp_mux_t *mux;
+  int i;
+
+  if (NULL == state || -1 == amqp_get_sockfd(state) ||
+      NULL != state->event_loop_conn) {
+    return NULL;
+  }
+  /* A socket with its own wait can't be polled on its descriptor */
+  if (NULL != state->socket->klass->wait) {
+    return NULL;
+  }
+
+  mux = calloc(1, sizeof(amqp_mux_t));
+  if (NULL == mux) {
+    return NULL;
+  }
+  mux->state = state;
+  mux->channel_max = state->channel_max ? state->channel_max : UINT16_MAX;
+  mux->channels = calloc(mux->channel_max + 1, sizeof(amqp_mux_channel_t *));
+  mux->out = malloc(AMQP_MUX_WRITE_BATCH);
+  if (NULL == mux->channels || NULL == mux->out) {
+    goto error1;
+  }
+  if (0 != pipe(mux->wake_fds)) {
+    goto error1;
+  }
+  for (i = 0; i < 2; ++i) {
+    if (-1 == fcntl(mux->wake_fds[i], F_SETFL,
+                    fcntl(mux->wake_fds[i], F_GETFL) | O_NONBLOCK) ||
+        -1 == fcntl(mux->wake_fds[i], F_SETFD, FD_CLOEXEC)) {
+      goto error2;
+    }
+  }
+  if (0 != pthread_mutex_init(&mux->lock, NULL)) {
+    goto error2;
+  }
+  if (0 != pthread_create(&mux->thread, NULL, io_main, mux)) {
+    pthread_mutex_destroy(&mux->lock);
+    goto error2;
+  }
+  return mux;
+
+error2:
+  close(mux->wake_fds[0]);
+  close(mux->wake_fds[1]);
+error1:
+  free(mux->out);
+  free(mux->channels);
+  free(mux);
+  return NULL;
+}
+
+int amqp_mux_destroy(amqp_mux_t *mux) {
+  int res;
+  if (NULL == mux) {
+    return AMQP_STATUS_OK;
+  }
+  amqp_atomic_store(&mux->stopping, 1);
+  mux_wake(mux);
+  pthread_join(mux->thread, NULL);
+
+  res = mux->error;
+  pthread_mutex_destroy(&mux->lock);
+  close(mux->wake_fds[0]);
+  close(mux->wake_fds[1]);
+  free(mux->active);
+  free(mux->out);
+  free(mux->channels);
+  free(mux);
+  return res;
+}
+
+static void free_channel(amqp_mux_channel_t *ch) {
+  amqp_spsc_ring_destroy(&ch->requests);
+  amqp_spsc_ring_destroy(&ch->deliveries);
+  amqp_waiter_destroy(&ch->waiter);
+  free(ch->scratch.bytes);
+  free(ch);
+}
+
+amqp_mux_channel_t *amqp_mux_channel_new(amqp_mux_t *mux,
+                                         amqp_channel_t channel) {
+  amqp_mux_channel_t *ch;
+  int registered = 0;
+
+  if (NULL == mux || 0 == channel || channel > mux->channel_max) {
+    return NULL;
+  }
+  ch = calloc(1, sizeof(amqp_mux_channel_t));
+  if (NULL == ch) {
+    return NULL;
+  }
+  ch->mux = mux;
+  ch->channel = channel;
+  ch->scratch.len = 2 * (size_t)mux->state->frame_max;
+  ch->scratch.bytes = malloc(ch->scratch.len);
+  if (NULL == ch->scratch.bytes) {
+    free(ch);
+    return NULL;
+  }
+  if (AMQP_STATUS_OK !=
+      amqp_spsc_ring_init(&ch->requests, AMQP_MUX_REQUEST_RING_SIZE)) {
+    goto error1;
+  }
+  if (AMQP_STATUS_OK !=
+      amqp_spsc_ring_init(&ch->deliveries, AMQP_MUX_DELIVERY_RING_SIZE)) {
+    goto error2;
+  }
+  if (AMQP_STATUS_OK != amqp_waiter_init(&ch->waiter)) {
+    goto error3;
+  }
+
+  pthread_mutex_lock(&mux->lock);
+  if (!mux->io_done && !(mux->in_use[channel / 8] & (1 << (channel % 8)))) {
+    mux->in_use[channel / 8] |= 1 << (channel % 8);
+    ch->next_pending = mux->pending;
+    mux->pending = ch;
+    amqp_atomic_store(&mux->has_pending, 1);
+    registered = 1;
+  }
+  pthread_mutex_unlock(&mux->lock);
+
+  if (!registered) {
+    free_channel(ch);
+    return NULL;
+  }
+  mux_wake(mux);
+  return ch;
+
+error3:
+  amqp_spsc_ring_destroy(&ch->deliveries);
+error2:
+  amqp_spsc_ring_destroy(&ch->requests);
+error1:
+  free(ch->scratch.bytes);
+  free(ch);
+  return NULL;
+}
+
+static int has_room(void *arg) {
+  amqp_mux_channel_t *ch = arg;
+  return !amqp_spsc_ring_is_full(&ch->requests) ||
+         amqp_atomic_load(&ch->mux->io_done);
+}
+
+static int submit(amqp_mux_channel_t *ch, amqp_mux_request_t *request) {
+  amqp_mux_t *mux = ch->mux;
+
+  while (!amqp_spsc_ring_push(&ch->requests, request)) {
+    mux_wake(mux);
+    amqp_waiter_wait(&ch->waiter, has_room, ch, amqp_time_infinite());
+    if (amqp_atomic_load(&mux->io_done)) {
+      return mux_error(mux);
+    }
+  }
+  mux_wake(mux);
+  return AMQP_STATUS_OK;
+}
+
+static int is_unregistered(void *arg) {
+  amqp_mux_channel_t *ch = arg;
+  return amqp_atomic_load(&ch->unregistered) ||
+         amqp_atomic_load(&ch->mux->io_done);
+}
+
+void amqp_mux_channel_destroy(amqp_mux_channel_t *ch) {
+  amqp_mux_t *mux;
+  amqp_mux_request_t request;
+  amqp_mux_request_t *left;
+  amqp_mux_delivery_t *delivery;
+
+  if (NULL == ch) {
+    return;
+  }
+  mux = ch->mux;
+
+  if (!amqp_atomic_load(&mux->io_done)) {
+    request.type = AMQP_MUX_UNREGISTER;
+    if (AMQP_STATUS_OK == submit(ch, &request)) {
+      amqp_waiter_wait(&ch->waiter, is_unregistered, ch, amqp_time_infinite());
+    }
+  }
+
+  /* Either the IO thread let go of the handle, or it has stopped and is
+   * finished with it once the lock is free */
+  pthread_mutex_lock(&mux->lock);
+  mux->in_use[ch->channel / 8] &= ~(1 << (ch->channel % 8));
+  pthread_mutex_unlock(&mux->lock);
+
+  while (NULL != (left = amqp_spsc_ring_pop(&ch->requests))) {
+    if (AMQP_MUX_SEND == left->type) {
+      free(left);
+    }
+  }
+  while (NULL != (delivery = amqp_spsc_ring_pop(&ch->deliveries))) {
+    free_delivery(delivery);
+  }
+  if (NULL != ch->last_return) {
+    free_handed_out(ch->last_return);
+  }
+  free_channel(ch);
+}
+
+static int encode_method(amqp_mux_channel_t *ch, amqp_method_number_t method,
+                         void *decoded, amqp_bytes_t *encoded) {
+  amqp_frame_t frame;
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = ch->channel;
+  frame.payload.method.id = method;
+  frame.payload.method.decoded = decoded;
+  return amqp_frame_to_bytes(&frame, ch->scratch, encoded);
+}
+
+static int rpc_ready(void *arg) {
+  amqp_mux_channel_t *ch = arg;
+  return amqp_atomic_load(&ch->rpc_done) ||
+         amqp_atomic_load(&ch->mux->io_done);
+}
+
+amqp_rpc_reply_t amqp_mux_simple_rpc(
+    amqp_mux_channel_t *ch, amqp_method_number_t request_id,
+    void *decoded_request_method,
+    const amqp_method_number_t *expected_reply_ids) {
+  amqp_mux_request_t request;
+  int res;
+
+  if (NULL == ch || NULL == expected_reply_ids) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+  if (amqp_atomic_load(&ch->mux->io_done)) {
+    return amqp_rpc_reply_error(mux_error(ch->mux));
+  }
+
+  res = encode_method(ch, request_id, decoded_request_method,
+                      &request.encoded);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  request.type = AMQP_MUX_RPC;
+  request.expected_replies = expected_reply_ids;
+
+  amqp_atomic_store(&ch->rpc_done, 0);
+  res = submit(ch, &request);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  amqp_waiter_wait(&ch->waiter, rpc_ready, ch, amqp_time_infinite());
+  if (amqp_atomic_load(&ch->rpc_done)) {
+    return ch->rpc_reply;
+  }
+  return amqp_rpc_reply_error(mux_error(ch->mux));
+}
+
+amqp_rpc_reply_t amqp_mux_channel_open(amqp_mux_channel_t *ch) {
+  amqp_method_number_t replies[2] = {AMQP_CHANNEL_OPEN_OK_METHOD, 0};
+  amqp_channel_open_t req;
+  req.out_of_band = amqp_empty_bytes;
+  return amqp_mux_simple_rpc(ch, AMQP_CHANNEL_OPEN_METHOD, &req, replies);
+}
+
+amqp_rpc_reply_t amqp_mux_channel_close(amqp_mux_channel_t *ch, int code) {
+  amqp_method_number_t replies[2] = {AMQP_CHANNEL_CLOSE_OK_METHOD, 0};
+  amqp_channel_close_t req;
+
+  if (code < 0 || code > UINT16_MAX) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+  req.reply_code = (uint16_t)code;
+  req.reply_text = amqp_empty_bytes;
+  req.class_id = 0;
+  req.method_id = 0;
+  return amqp_mux_simple_rpc(ch, AMQP_CHANNEL_CLOSE_METHOD, &req, replies);
+}
+
+/* Asynchronous requests are only accepted on an open channel */
+static int check_sendable(amqp_mux_channel_t *ch) {
+  if (NULL == ch) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (amqp_atomic_load(&ch->mux->io_done)) {
+    return mux_error(ch->mux);
+  }
+  if (!amqp_atomic_load(&ch->open)) {
+    return AMQP_STATUS_UNEXPECTED_STATE;
+  }
+  return AMQP_STATUS_OK;
+}
+
+int amqp_mux_send_method(amqp_mux_channel_t *ch, amqp_method_number_t method,
+                         void *decoded) {
+  amqp_mux_request_t *request;
+  amqp_bytes_t encoded;
+  int res;
+
+  res = check_sendable(ch);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  res = encode_method(ch, method, decoded, &encoded);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  request = malloc(sizeof(amqp_mux_request_t) + encoded.len);
+  if (NULL == request) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  request->type = AMQP_MUX_SEND;
+  request->encoded.bytes = request + 1;
+  request->encoded.len = encoded.len;
+  memcpy(request->encoded.bytes, encoded.bytes, encoded.len);
+
+  res = submit(ch, request);
+  if (AMQP_STATUS_OK != res) {
+    free(request);
+  }
+  return res;
+}
+
+int amqp_mux_basic_ack(amqp_mux_channel_t *ch, uint64_t delivery_tag,
+                       amqp_boolean_t multiple) {
+  amqp_basic_ack_t m;
+  m.delivery_tag = delivery_tag;
+  m.multiple = multiple;
+  return amqp_mux_send_method(ch, AMQP_BASIC_ACK_METHOD, &m);
+}
+
+int amqp_mux_basic_publish(amqp_mux_channel_t *ch, amqp_bytes_t exchange,
+                           amqp_bytes_t routing_key, amqp_boolean_t mandatory,
+                           amqp_boolean_t immediate,
+                           const amqp_basic_properties_t *properties,
+                           amqp_bytes_t body) {
+  amqp_basic_properties_t default_properties;
+  amqp_basic_publish_t m;
+  amqp_mux_request_t *request;
+  amqp_bytes_t method_encoded;
+  amqp_bytes_t header_encoded;
+  amqp_bytes_t half;
+  amqp_frame_t f;
+  size_t body_payload;
+  size_t body_frames;
+  size_t offset;
+  char *out;
+  int res;
+
+  res = check_sendable(ch);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  /* Everything is encoded on the calling thread, the IO thread only copies
+   * bytes to the socket */
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
+
+  half.bytes = ch->scratch.bytes;
+  half.len = ch->scratch.len / 2;
+  f.frame_type = AMQP_FRAME_METHOD;
+  f.channel = ch->channel;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
+  res = amqp_frame_to_bytes(&f, half, &method_encoded);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (NULL == properties) {
+    memset(&default_properties, 0, sizeof(default_properties));
+    properties = &default_properties;
+  }
+  half.bytes = (char *)ch->scratch.bytes + half.len;
+  f.frame_type = AMQP_FRAME_HEADER;
+  f.payload.properties.class_id = AMQP_BASIC_CLASS;
+  f.payload.properties.body_size = body.len;
+  f.payload.properties.decoded = (void *)properties;
+  res = amqp_frame_to_bytes(&f, half, &header_encoded);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  body_payload = ch->scratch.len / 2 - (HEADER_SIZE + FOOTER_SIZE);
+  body_frames = (body.len + body_payload - 1) / body_payload;
+  request = malloc(sizeof(amqp_mux_request_t) + method_encoded.len +
+                   header_encoded.len + body.len +
+                   body_frames * (HEADER_SIZE + FOOTER_SIZE));
+  if (NULL == request) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  out = (char *)(request + 1);
+  memcpy(out, method_encoded.bytes, method_encoded.len);
+  out += method_encoded.len;
+  memcpy(out, header_encoded.bytes, header_encoded.len);
+  out += header_encoded.len;
+
+  f.frame_type = AMQP_FRAME_BODY;
+  for (offset = 0; offset < body.len; offset += body_payload) {
+    amqp_bytes_t dest;
+    amqp_bytes_t encoded;
+    f.payload.body_fragment.bytes = amqp_offset(body.bytes, offset);
+    f.payload.body_fragment.len =
+        body.len - offset < body_payload ? body.len - offset : body_payload;
+    dest.bytes = out;
+    dest.len = f.payload.body_fragment.len + HEADER_SIZE + FOOTER_SIZE;
+    amqp_frame_to_bytes(&f, dest, &encoded);
+    out += encoded.len;
+  }
+
+  request->type = AMQP_MUX_SEND;
+  request->encoded.bytes = request + 1;
+  request->encoded.len = out - (char *)(request + 1);
+
+  res = submit(ch, request);
+  if (AMQP_STATUS_OK != res) {
+    free(request);
+  }
+  return res;
+}
+
+static int delivery_ready(void *arg) {
+  amqp_mux_channel_t *ch = arg;
+  return !amqp_spsc_ring_is_empty(&ch->deliveries) ||
+         !amqp_atomic_load(&ch->open) || amqp_atomic_load(&ch->mux->io_done);
+}
+
+amqp_rpc_reply_t amqp_mux_consume_message(amqp_mux_channel_t *ch,
+                                          amqp_envelope_t *envelope,
+                                          const struct timeval *timeout,
+                                          AMQP_UNUSED int flags) {
+  amqp_mux_delivery_t *delivery;
+  amqp_rpc_reply_t ret;
+  amqp_time_t deadline;
+  int res;
+
+  if (NULL == ch || NULL == envelope) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  if (NULL != ch->last_return) {
+    free_handed_out(ch->last_return);
+    ch->last_return = NULL;
+  }
+
+  for (;;) {
+    delivery = amqp_spsc_ring_pop(&ch->deliveries);
+    if (NULL != delivery) {
+      if (amqp_atomic_load(&ch->overflowing)) {
+        mux_wake(ch->mux);
+      }
+      *envelope = delivery->envelope;
+      memset(&ret, 0, sizeof(ret));
+      ret.reply_type = AMQP_RESPONSE_NORMAL;
+      if (NULL != delivery->returned) {
+        ret.reply.id = AMQP_BASIC_RETURN_METHOD;
+        ret.reply.decoded = delivery->returned;
+        ch->last_return = delivery;
+      } else {
+        ret.reply.id = AMQP_BASIC_DELIVER_METHOD;
+        free_handed_out(delivery);
+      }
+      return ret;
+    }
+    if (amqp_atomic_load(&ch->mux->io_done)) {
+      return amqp_rpc_reply_error(mux_error(ch->mux));
+    }
+    if (!amqp_atomic_load(&ch->open)) {
+      if (AMQP_RESPONSE_SERVER_EXCEPTION == ch->close_reply.reply_type) {
+        return ch->close_reply;
+      }
+      return amqp_rpc_reply_error(AMQP_STATUS_UNEXPECTED_STATE);
+    }
+    res = amqp_waiter_wait(&ch->waiter, delivery_ready, ch, deadline);
+    if (AMQP_STATUS_OK != res) {
+      return amqp_rpc_reply_error(res);
+    }
+  }
+}
+
+#else
+
+amqp_mux_t *amqp_mux_new(AMQP_UNUSED amqp_connection_state_t state) {
+  return NULL;
+}
+
+int amqp_mux_destroy(AMQP_UNUSED amqp_mux_t *mux) { return AMQP_STATUS_OK; }
+
+amqp_mux_channel_t *amqp_mux_channel_new(AMQP_UNUSED amqp_mux_t *mux,
+                                         AMQP_UNUSED amqp_channel_t channel) {
+  return NULL;
+}
+
+void amqp_mux_channel_destroy(AMQP_UNUSED amqp_mux_channel_t *ch) {}
+
+amqp_rpc_reply_t amqp_mux_simple_rpc(
+    AMQP_UNUSED amqp_mux_channel_t *ch,
+    AMQP_UNUSED amqp_method_number_t request_id,
+    AMQP_UNUSED void *decoded_request_method,
+    AMQP_UNUSED const amqp_method_number_t *expected_reply_ids) {
+  return amqp_rpc_reply_error(AMQP_STATUS_UNSUPPORTED);
+}
+
+amqp_rpc_reply_t amqp_mux_channel_open(AMQP_UNUSED amqp_mux_channel_t *ch) {
+  return amqp_rpc_reply_error(AMQP_STATUS_UNSUPPORTED);
+}
+
+amqp_rpc_reply_t amqp_mux_channel_close(AMQP_UNUSED amqp_mux_channel_t *ch,
+                                        AMQP_UNUSED int code) {
+  return amqp_rpc_reply_error(AMQP_STATUS_UNSUPPORTED);
+}
+
+int amqp_mux_send_method(AMQP_UNUSED amqp_mux_channel_t *ch,
+                         AMQP_UNUSED amqp_method_number_t method,
+                         AMQP_UNUSED void *decoded) {
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int amqp_mux_basic_ack(AMQP_UNUSED amqp_mux_channel_t *ch,
+                       AMQP_UNUSED uint64_t delivery_tag,
+                       AMQP_UNUSED amqp_boolean_t multiple) {
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int amqp_mux_basic_publish(
+    AMQP_UNUSED amqp_mux_channel_t *ch, AMQP_UNUSED amqp_bytes_t exchange,
+    AMQP_UNUSED amqp_bytes_t routing_key,
+    AMQP_UNUSED amqp_boolean_t mandatory, AMQP_UNUSED amqp_boolean_t immediate,
+    AMQP_UNUSED const amqp_basic_properties_t *properties,
+    AMQP_UNUSED amqp_bytes_t body) {
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+amqp_rpc_reply_t amqp_mux_consume_message(
+    AMQP_UNUSED amqp_mux_channel_t *ch, AMQP_UNUSED amqp_envelope_t *envelope,
+    AMQP_UNUSED const struct timeval *timeout, AMQP_UNUSED int flags) {
+  return amqp_rpc_reply_error(AMQP_STATUS_UNSUPPORTED);
+}
+#endif
@@ -35,6 +35,7 @@
 #include "amqp_openssl_bio.h"
 #include "amqp_openssl_hostname_validation.h"
 #include "amqp_private.h"
+#include "amqp_ring.h"
 #include "amqp_socket.h"
 #include "amqp_ssl_socket.h"
 #include "amqp_time.h"
@@ -46,23 +47,46 @@
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Kernel TLS, OpenSSL hands the keys to the kernel once the handshake is
+ * done. Offloaded sockets use OpenSSL's own socket BIO, which knows how to
+ * send and receive the records that aren't application data. */
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(OPENSSL_NO_KTLS) && \
+    defined(__linux__)
+#define AMQP_OPENSSL_KTLS
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#endif
 
 static int initialize_ssl_and_increment_connections(void);
 static int decrement_ssl_connections(void);
 
+#ifndef AMQP_OPENSSL_V110
 static unsigned long ssl_threadid_callback(void);
 static void ssl_locking_callback(int mode, int n, const char *file, int line);
 static pthread_mutex_t *amqp_openssl_lockarray = NULL;
+#endif
 
 static pthread_mutex_t openssl_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 static amqp_boolean_t do_initialize_openssl = 1;
 static amqp_boolean_t openssl_initialized = 0;
 static amqp_boolean_t openssl_bio_initialized = 0;
 static int openssl_connections = 0;
+/* Set once OpenSSL and the BIO are set up, sockets created after that only
+ * count themselves in openssl_connections without taking the mutex */
+static int openssl_ready = 0;
 
 #define CHECK_SUCCESS(condition)                                            \
   do {                                                                      \
@@ -73,36 +97,262 @@ static int openssl_connections = 0;
     }                                                                       \
   } while (0)
 
+/* A session to resume, kept encoded so it can be written out as it is */
+typedef struct amqp_ssl_session_entry_t_ {
+  struct amqp_ssl_session_entry_t_ *next;
+  char *host;
+  int port;
+  long expires; /* seconds since the epoch, as SSL_SESSION_get_time() */
+  unsigned char *der;
+  int der_len;
+} amqp_ssl_session_entry_t;
+
+struct amqp_ssl_session_cache_t_ {
+  pthread_mutex_t mutex;
+  /* One for the application, one for each socket using the cache */
+  int refcount;
+  amqp_ssl_session_entry_t *entries;
+};
+
 struct amqp_ssl_socket_t {
   const struct amqp_socket_class_t *klass;
   SSL_CTX *ctx;
+  /* ctx belongs to an amqp_ssl_context_t, the socket mustn't change it */
+  amqp_boolean_t shared_ctx;
   int sockfd;
   SSL *ssl;
   amqp_boolean_t verify_peer;
   amqp_boolean_t verify_hostname;
   int internal_error;
+  amqp_ssl_session_cache_t *session_cache;
+  /* The broker connected to, what new sessions are filed under */
+  char *session_host;
+  int session_port;
+  amqp_boolean_t ktls;
+  /* Frames sent with AMQP_SF_MORE, written out as one record */
+  char *stage;
+  size_t staged;
+  /* How much of the stage SSL_write() has taken */
+  size_t stage_sent;
+  /* Bytes of a frame sent without AMQP_SF_MORE at the end of the stage, the
+   * send is retried until the stage is out */
+  size_t stage_owed;
+  amqp_socket_options_t options;
 };
 
+/* The most a TLS record holds */
+#define AMQP_SSL_STAGE_SIZE 16384
+
+#ifdef AMQP_OPENSSL_KTLS
+/* Once the kernel encrypts the records, application data takes the same
+ * path as on a plain TCP socket */
+static ssize_t ktls_send(struct amqp_ssl_socket_t *self, const void *buf,
+                         size_t len, int flags) {
+  ssize_t res;
+  int flagz = MSG_NOSIGNAL;
+
+  if (flags & AMQP_SF_MORE) {
+    flagz |= MSG_MORE;
+  }
+
+start:
+  res = send(self->sockfd, buf, len, flagz);
+  if (res < 0) {
+    switch (errno) {
+      case EINTR:
+        goto start;
+      case EWOULDBLOCK:
+#if defined(EAGAIN) && EAGAIN != EWOULDBLOCK
+      case EAGAIN:
+#endif
+        self->internal_error = SSL_ERROR_WANT_WRITE;
+        return AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE;
+      default:
+        self->internal_error = SSL_ERROR_SYSCALL;
+        return AMQP_STATUS_SOCKET_ERROR;
+    }
+  }
+  self->internal_error = 0;
+  return res;
+}
+
+/* Returns AMQP_STATUS_SSL_ERROR when the next record isn't application
+ * data, which only SSL_read() can handle */
+static ssize_t ktls_recv(struct amqp_ssl_socket_t *self, void *buf,
+                         size_t len) {
+  ssize_t res;
+
+start:
+  res = recv(self->sockfd, buf, len, 0);
+  if (res < 0) {
+    switch (errno) {
+      case EINTR:
+        goto start;
+      case EWOULDBLOCK:
+#if defined(EAGAIN) && EAGAIN != EWOULDBLOCK
+      case EAGAIN:
+#endif
+        self->internal_error = SSL_ERROR_WANT_READ;
+        return AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD;
+      case EIO:
+        return AMQP_STATUS_SSL_ERROR;
+      default:
+        self->internal_error = SSL_ERROR_SYSCALL;
+        return AMQP_STATUS_SOCKET_ERROR;
+    }
+  }
+  if (0 == res) {
+    return AMQP_STATUS_CONNECTION_CLOSED;
+  }
+  self->internal_error = 0;
+  return res;
+}
+
+/* OpenSSL's socket BIO writes without MSG_NOSIGNAL, a broker that went away
+ * would raise SIGPIPE. It is blocked while OpenSSL may write and one raised
+ * meanwhile is taken back, so the application's handling stays as it was. */
+typedef struct ktls_sigpipe_t_ {
+  sigset_t saved;
+  int blocked;
+  int was_pending;
+} ktls_sigpipe_t;
+
+static void ktls_block_sigpipe(struct amqp_ssl_socket_t *self,
+                               ktls_sigpipe_t *guard) {
+  sigset_t sigpipe;
+  sigset_t pending;
+
+  guard->blocked = 0;
+  if (!self->ktls) {
+    return;
+  }
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  sigemptyset(&pending);
+  sigpending(&pending);
+  guard->was_pending = sigismember(&pending, SIGPIPE);
+  guard->blocked = 0 == pthread_sigmask(SIG_BLOCK, &sigpipe, &guard->saved);
+}
+
+static void ktls_unblock_sigpipe(ktls_sigpipe_t *guard) {
+  sigset_t sigpipe;
+  sigset_t pending;
+  struct timespec zero = {0, 0};
+
+  if (!guard->blocked) {
+    return;
+  }
+  sigemptyset(&pending);
+  sigpending(&pending);
+  if (!guard->was_pending && sigismember(&pending, SIGPIPE)) {
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    while (-1 == sigtimedwait(&sigpipe, NULL, &zero) && EINTR == errno) {
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &guard->saved, NULL);
+}
+#else
+typedef int ktls_sigpipe_t;
+#define ktls_block_sigpipe(self, guard) ((void)(self), (void)(guard))
+#define ktls_unblock_sigpipe(guard) ((void)(guard))
+#endif
+
+static ssize_t ssl_write(struct amqp_ssl_socket_t *self, const void *buf,
+                         size_t len);
+
+/* Writes out what's left of the stage */
+static int flush_stage(struct amqp_ssl_socket_t *self) {
+  while (self->stage_sent < self->staged) {
+    ssize_t res = ssl_write(self, self->stage + self->stage_sent,
+                            self->staged - self->stage_sent);
+    if (res < 0) {
+      return (int)res;
+    }
+    self->stage_sent += (size_t)res;
+  }
+  self->staged = 0;
+  self->stage_sent = 0;
+  return AMQP_STATUS_OK;
+}
+
 static ssize_t amqp_ssl_socket_send(void *base, const void *buf, size_t len,
-                                    AMQP_UNUSED int flags) {
+                                    int flags) {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
-  int res;
+  ssize_t res;
   if (-1 == self->sockfd) {
     return AMQP_STATUS_SOCKET_CLOSED;
   }
 
+#ifdef AMQP_OPENSSL_KTLS
+  if (self->ktls && BIO_get_ktls_send(SSL_get_wbio(self->ssl))) {
+    return ktls_send(self, buf, len, flags);
+  }
+#endif
+
   /* SSL_write takes an int for length of buffer, protect against len being
    * larger than larger than what SSL_write can take */
   if (len > INT_MAX) {
     return AMQP_STATUS_INVALID_PARAMETER;
   }
 
+  if (0 != self->stage_owed) {
+    /* Retrying a send whose frame went into the stage */
+    size_t owed = self->stage_owed;
+    res = flush_stage(self);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    self->stage_owed = 0;
+    return (ssize_t)(owed < len ? owed : len);
+  }
+
+  if (0 != self->staged &&
+      (0 != self->stage_sent || self->staged + len > AMQP_SSL_STAGE_SIZE)) {
+    res = flush_stage(self);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
+  if ((0 != self->staged || flags & AMQP_SF_MORE) &&
+      len < AMQP_SSL_STAGE_SIZE) {
+    if (NULL == self->stage) {
+      self->stage = malloc(AMQP_SSL_STAGE_SIZE);
+      if (NULL == self->stage) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+    }
+    memcpy(self->stage + self->staged, buf, len);
+    self->staged += len;
+    if (flags & AMQP_SF_MORE) {
+      return (ssize_t)len;
+    }
+    self->stage_owed = len;
+    res = flush_stage(self);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    self->stage_owed = 0;
+    return (ssize_t)len;
+  }
+
+  return ssl_write(self, buf, len);
+}
+
+static ssize_t ssl_write(struct amqp_ssl_socket_t *self, const void *buf,
+                         size_t len) {
+  int res;
+  ktls_sigpipe_t sigpipe;
+
   ERR_clear_error();
   self->internal_error = 0;
 
   /* This will only return on error, or once the whole buffer has been
    * written to the SSL stream. See SSL_MODE_ENABLE_PARTIAL_WRITE */
+  ktls_block_sigpipe(self, &sigpipe);
   res = SSL_write(self->ssl, buf, (int)len);
+  ktls_unblock_sigpipe(&sigpipe);
   if (0 >= res) {
     self->internal_error = SSL_get_error(self->ssl, res);
     /* TODO: Close connection if it isn't already? */
@@ -132,20 +382,44 @@ static ssize_t amqp_ssl_socket_recv(void *base, void *buf, size_t len,
                                     AMQP_UNUSED int flags) {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
   int received;
+  ktls_sigpipe_t sigpipe;
   if (-1 == self->sockfd) {
     return AMQP_STATUS_SOCKET_CLOSED;
   }
 
+  /* Frames held back for more to come must not wait on the broker's reply
+   * to them */
+  if (0 != self->staged) {
+    received = flush_stage(self);
+    if (AMQP_STATUS_OK != received) {
+      return received;
+    }
+  }
+
   /* SSL_read takes an int for length of buffer, protect against len being
    * larger than larger than what SSL_read can take */
   if (len > INT_MAX) {
     return AMQP_STATUS_INVALID_PARAMETER;
   }
 
+#ifdef AMQP_OPENSSL_KTLS
+  /* Records OpenSSL already read have to be handed out first */
+  if (self->ktls && BIO_get_ktls_recv(SSL_get_rbio(self->ssl)) &&
+      !SSL_has_pending(self->ssl)) {
+    ssize_t res = ktls_recv(self, buf, len);
+    if (AMQP_STATUS_SSL_ERROR != res) {
+      return res;
+    }
+  }
+#endif
+
   ERR_clear_error();
   self->internal_error = 0;
 
+  /* Reading may answer the broker, such as with a key update */
+  ktls_block_sigpipe(self, &sigpipe);
   received = SSL_read(self->ssl, buf, (int)len);
+  ktls_unblock_sigpipe(&sigpipe);
   if (0 >= received) {
     self->internal_error = SSL_get_error(self->ssl, received);
     switch (self->internal_error) {
@@ -167,14 +441,141 @@ static ssize_t amqp_ssl_socket_recv(void *base, void *buf, size_t len,
   return (ssize_t)received;
 }
 
-static int amqp_ssl_socket_open(void *base, const char *host, int port,
-                                const struct timeval *timeout) {
+static void free_session_entry(amqp_ssl_session_entry_t *entry) {
+  free(entry->host);
+  OPENSSL_free(entry->der);
+  free(entry);
+}
+
+static long session_expiry(SSL_SESSION *session) {
+  return SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+}
+
+/* Files a session under host and port, replacing the one there was. Takes
+ * the cache's mutex. */
+static int store_session(amqp_ssl_session_cache_t *cache, const char *host,
+                         int port, SSL_SESSION *session) {
+  amqp_ssl_session_entry_t *entry;
+  amqp_ssl_session_entry_t **prev;
+
+  entry = calloc(1, sizeof(amqp_ssl_session_entry_t));
+  if (NULL == entry) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  entry->host = strdup(host);
+  entry->port = port;
+  entry->expires = session_expiry(session);
+  entry->der_len = i2d_SSL_SESSION(session, &entry->der);
+  if (NULL == entry->host || entry->der_len <= 0) {
+    free_session_entry(entry);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  CHECK_SUCCESS(pthread_mutex_lock(&cache->mutex));
+  for (prev = &cache->entries; NULL != *prev; prev = &(*prev)->next) {
+    if (port == (*prev)->port && 0 == strcmp(host, (*prev)->host)) {
+      amqp_ssl_session_entry_t *old = *prev;
+      *prev = old->next;
+      free_session_entry(old);
+      break;
+    }
+  }
+  entry->next = cache->entries;
+  cache->entries = entry;
+  CHECK_SUCCESS(pthread_mutex_unlock(&cache->mutex));
+  return AMQP_STATUS_OK;
+}
+
+/* Takes the cache's mutex */
+static void forget_session(amqp_ssl_session_cache_t *cache, const char *host,
+                           int port) {
+  amqp_ssl_session_entry_t **prev;
+
+  CHECK_SUCCESS(pthread_mutex_lock(&cache->mutex));
+  for (prev = &cache->entries; NULL != *prev; prev = &(*prev)->next) {
+    if (port == (*prev)->port && 0 == strcmp(host, (*prev)->host)) {
+      amqp_ssl_session_entry_t *entry = *prev;
+      *prev = entry->next;
+      free_session_entry(entry);
+      break;
+    }
+  }
+  CHECK_SUCCESS(pthread_mutex_unlock(&cache->mutex));
+}
+
+/* The session to offer a broker, NULL if there is none that's current */
+static SSL_SESSION *find_session(amqp_ssl_session_cache_t *cache,
+                                 const char *host, int port) {
+  amqp_ssl_session_entry_t **prev;
+  SSL_SESSION *session = NULL;
+  long now = (long)time(NULL);
+
+  CHECK_SUCCESS(pthread_mutex_lock(&cache->mutex));
+  for (prev = &cache->entries; NULL != *prev; prev = &(*prev)->next) {
+    amqp_ssl_session_entry_t *entry = *prev;
+    if (port == entry->port && 0 == strcmp(host, entry->host)) {
+      if (entry->expires <= now) {
+        *prev = entry->next;
+        free_session_entry(entry);
+      } else {
+        const unsigned char *der = entry->der;
+        session = d2i_SSL_SESSION(NULL, &der, entry->der_len);
+      }
+      break;
+    }
+  }
+  CHECK_SUCCESS(pthread_mutex_unlock(&cache->mutex));
+  return session;
+}
+
+/* Called by OpenSSL whenever the broker hands out a session, during the
+ * handshake or, with TLS 1.3, any time after it */
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+  struct amqp_ssl_socket_t *self = SSL_get_app_data(ssl);
+
+  if (NULL != self && NULL != self->session_cache &&
+      NULL != self->session_host) {
+    store_session(self->session_cache, self->session_host, self->session_port,
+                  session);
+  }
+  /* The session was copied, OpenSSL keeps ownership */
+  return 0;
+}
+
+static int offer_session(struct amqp_ssl_socket_t *self, const char *host,
+                         int port) {
+  SSL_SESSION *session;
+
+  free(self->session_host);
+  self->session_host = strdup(host);
+  if (NULL == self->session_host) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  self->session_port = port;
+  SSL_set_app_data(self->ssl, self);
+
+  session = find_session(self->session_cache, host, port);
+  if (NULL != session) {
+    /* A session the broker no longer knows means a full handshake */
+    SSL_set_session(self->ssl, session);
+    SSL_SESSION_free(session);
+  }
+  return AMQP_STATUS_OK;
+}
+
+static int amqp_ssl_socket_open(void *base, const char *const *hosts,
+                                const int *ports, int count,
+                                const struct timeval *timeout,
+                                int *connected) {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
   long result;
   int status;
+  int winner = 0;
+  const char *host;
   amqp_time_t deadline;
   X509 *cert;
   BIO *bio;
+  ktls_sigpipe_t sigpipe;
   if (-1 != self->sockfd) {
     return AMQP_STATUS_SOCKET_INUSE;
   }
@@ -192,21 +593,38 @@ static int amqp_ssl_socket_open(void *base, const char *host, int port,
     return status;
   }
 
-  self->sockfd = amqp_open_socket_inner(host, port, deadline);
+  self->sockfd = amqp_open_socket_any(hosts, ports, count, deadline, &winner,
+                                      &self->options);
   if (0 > self->sockfd) {
     status = self->sockfd;
     self->internal_error = amqp_os_socket_error();
     self->sockfd = -1;
     goto error_out1;
   }
+  /* The certificate is checked against the host that answered */
+  host = hosts[winner];
+  if (NULL != connected) {
+    *connected = winner;
+  }
 
-  bio = BIO_new(amqp_openssl_bio());
+#ifdef AMQP_OPENSSL_KTLS
+  if (self->ktls) {
+    /* The socket BIO attaches the tls module to the socket. Without it the
+     * handshake goes on and the records stay with OpenSSL */
+    bio = BIO_new_socket(self->sockfd, BIO_NOCLOSE);
+    SSL_set_options(self->ssl, SSL_OP_ENABLE_KTLS);
+  } else
+#endif
+  {
+    bio = BIO_new(amqp_openssl_bio());
+    if (bio) {
+      BIO_set_fd(bio, self->sockfd, BIO_NOCLOSE);
+    }
+  }
   if (!bio) {
     status = AMQP_STATUS_NO_MEMORY;
     goto error_out2;
   }
-
-  BIO_set_fd(bio, self->sockfd, BIO_NOCLOSE);
   SSL_set_bio(self->ssl, bio, bio);
 
   status = SSL_set_tlsext_host_name(self->ssl, host);
@@ -216,8 +634,17 @@ static int amqp_ssl_socket_open(void *base, const char *host, int port,
     goto error_out2;
   }
 
+  if (NULL != self->session_cache) {
+    status = offer_session(self, host, ports[winner]);
+    if (AMQP_STATUS_OK != status) {
+      goto error_out2;
+    }
+  }
+
 start_connect:
+  ktls_block_sigpipe(self, &sigpipe);
   status = SSL_connect(self->ssl);
+  ktls_unblock_sigpipe(&sigpipe);
   if (status != 1) {
     self->internal_error = SSL_get_error(self->ssl, status);
     switch (self->internal_error) {
@@ -276,7 +703,14 @@ exit:
 error_out4:
   X509_free(cert);
 error_out3:
+  /* Nor is a session with a broker that failed verification resumed */
+  if (NULL != self->session_cache) {
+    forget_session(self->session_cache, self->session_host,
+                   self->session_port);
+  }
+  ktls_block_sigpipe(self, &sigpipe);
   SSL_shutdown(self->ssl);
+  ktls_unblock_sigpipe(&sigpipe);
 error_out2:
   amqp_os_socket_close(self->sockfd);
   self->sockfd = -1;
@@ -288,6 +722,7 @@ error_out1:
 
 static int amqp_ssl_socket_close(void *base, amqp_socket_close_enum force) {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  ktls_sigpipe_t sigpipe;
 
   if (-1 == self->sockfd) {
     return AMQP_STATUS_SOCKET_CLOSED;
@@ -295,11 +730,16 @@ static int amqp_ssl_socket_close(void *base, amqp_socket_close_enum force) {
 
   if (AMQP_SC_NONE == force) {
     /* don't try too hard to shutdown the connection */
+    ktls_block_sigpipe(self, &sigpipe);
     SSL_shutdown(self->ssl);
+    ktls_unblock_sigpipe(&sigpipe);
   }
 
   SSL_free(self->ssl);
   self->ssl = NULL;
+  self->staged = 0;
+  self->stage_sent = 0;
+  self->stage_owed = 0;
 
   if (amqp_os_socket_close(self->sockfd)) {
     return AMQP_STATUS_SOCKET_ERROR;
@@ -314,6 +754,11 @@ static int amqp_ssl_socket_get_sockfd(void *base) {
   return self->sockfd;
 }
 
+static amqp_socket_options_t *amqp_ssl_socket_get_options(void *base) {
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  return &self->options;
+}
+
 static void amqp_ssl_socket_delete(void *base) {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
 
@@ -321,21 +766,55 @@ static void amqp_ssl_socket_delete(void *base) {
     amqp_ssl_socket_close(self, AMQP_SC_NONE);
 
     SSL_CTX_free(self->ctx);
+    amqp_ssl_session_cache_free(self->session_cache);
+    free(self->session_host);
+    free(self->stage);
     free(self);
   }
   decrement_ssl_connections();
 }
 
 static const struct amqp_socket_class_t amqp_ssl_socket_class = {
-    amqp_ssl_socket_send,       /* send */
-    amqp_ssl_socket_recv,       /* recv */
-    amqp_ssl_socket_open,       /* open */
-    amqp_ssl_socket_close,      /* close */
-    amqp_ssl_socket_get_sockfd, /* get_sockfd */
-    amqp_ssl_socket_delete      /* delete */
+    amqp_ssl_socket_send,        /* send */
+    amqp_ssl_socket_recv,        /* recv */
+    amqp_ssl_socket_open,        /* open */
+    amqp_ssl_socket_close,       /* close */
+    amqp_ssl_socket_get_sockfd,  /* get_sockfd */
+    amqp_ssl_socket_delete,      /* delete */
+    NULL,                        /* wait */
+    amqp_ssl_socket_get_options, /* get_options */
+    NULL                         /* recv_hint */
 };
 
-amqp_socket_t *amqp_ssl_socket_new(amqp_connection_state_t state) {
+struct amqp_ssl_context_t_ {
+  SSL_CTX *ctx;
+  amqp_boolean_t verify_peer;
+  amqp_boolean_t verify_hostname;
+};
+
+static SSL_CTX *new_ssl_ctx(void) {
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+  if (!ctx) {
+    return NULL;
+  }
+  /* Disable SSLv2 and SSLv3 */
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+  /* OpenSSL v1.1.1 turns this on by default, which makes the non-blocking
+   * logic not behave as expected, so turn this back off */
+  SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+
+  /* Sessions are handed to the socket's amqp_ssl_session_cache_t, if it has
+   * one, OpenSSL's own client cache would only hold them for this context */
+  SSL_CTX_set_session_cache_mode(
+      ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+  return ctx;
+}
+
+static amqp_socket_t *new_ssl_socket(amqp_connection_state_t state,
+                                     amqp_ssl_context_t *context) {
   struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
   int status;
   if (!self) {
@@ -346,23 +825,30 @@ amqp_socket_t *amqp_ssl_socket_new(amqp_connection_state_t state) {
   self->klass = &amqp_ssl_socket_class;
   self->verify_peer = 1;
   self->verify_hostname = 1;
+  amqp_socket_options_init(&self->options);
 
   status = initialize_ssl_and_increment_connections();
   if (status) {
-    goto error;
+    free(self);
+    return NULL;
   }
 
-  self->ctx = SSL_CTX_new(SSLv23_client_method());
-  if (!self->ctx) {
-    goto error;
+  if (NULL != context) {
+#ifdef AMQP_OPENSSL_V110
+    SSL_CTX_up_ref(context->ctx);
+#else
+    CRYPTO_add(&context->ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif
+    self->ctx = context->ctx;
+    self->shared_ctx = 1;
+    self->verify_peer = context->verify_peer;
+    self->verify_hostname = context->verify_hostname;
+  } else {
+    self->ctx = new_ssl_ctx();
+    if (!self->ctx) {
+      goto error;
+    }
   }
-  /* Disable SSLv2 and SSLv3 */
-  SSL_CTX_set_options(self->ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-
-  SSL_CTX_set_mode(self->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
-  /* OpenSSL v1.1.1 turns this on by default, which makes the non-blocking
-   * logic not behave as expected, so turn this back off */
-  SSL_CTX_clear_mode(self->ctx, SSL_MODE_AUTO_RETRY);
 
   amqp_set_socket(state, (amqp_socket_t *)self);
 
@@ -372,6 +858,18 @@ error:
   return NULL;
 }
 
+amqp_socket_t *amqp_ssl_socket_new(amqp_connection_state_t state) {
+  return new_ssl_socket(state, NULL);
+}
+
+amqp_socket_t *amqp_ssl_socket_new_with_context(amqp_connection_state_t state,
+                                                amqp_ssl_context_t *context) {
+  if (NULL == context) {
+    return NULL;
+  }
+  return new_ssl_socket(state, context);
+}
+
 void *amqp_ssl_socket_get_context(amqp_socket_t *base) {
   if (base->klass != &amqp_ssl_socket_class) {
     amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
@@ -379,33 +877,29 @@ void *amqp_ssl_socket_get_context(amqp_socket_t *base) {
   return ((struct amqp_ssl_socket_t *)base)->ctx;
 }
 
-int amqp_ssl_socket_set_cacert(amqp_socket_t *base, const char *cacert) {
-  int status;
-  struct amqp_ssl_socket_t *self;
+static struct amqp_ssl_socket_t *ssl_socket(amqp_socket_t *base) {
   if (base->klass != &amqp_ssl_socket_class) {
     amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
   }
-  self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_load_verify_locations(self->ctx, cacert, NULL);
+  return (struct amqp_ssl_socket_t *)base;
+}
+
+static int ctx_set_cacert(SSL_CTX *ctx, const char *cacert) {
+  int status;
+  status = SSL_CTX_load_verify_locations(ctx, cacert, NULL);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
   return AMQP_STATUS_OK;
 }
 
-int amqp_ssl_socket_set_key(amqp_socket_t *base, const char *cert,
-                            const char *key) {
+static int ctx_set_key(SSL_CTX *ctx, const char *cert, const char *key) {
   int status;
-  struct amqp_ssl_socket_t *self;
-  if (base->klass != &amqp_ssl_socket_class) {
-    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
-  }
-  self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_use_certificate_chain_file(self->ctx, cert);
+  status = SSL_CTX_use_certificate_chain_file(ctx, cert);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
-  status = SSL_CTX_use_PrivateKey_file(self->ctx, key, SSL_FILETYPE_PEM);
+  status = SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
@@ -417,20 +911,15 @@ static int password_cb(AMQP_UNUSED char *buffer, AMQP_UNUSED int length,
   amqp_abort("rabbitmq-c does not support password protected keys");
 }
 
-int amqp_ssl_socket_set_key_buffer(amqp_socket_t *base, const char *cert,
-                                   const void *key, size_t n) {
+static int ctx_set_key_buffer(SSL_CTX *ctx, const char *cert,
+                              const void *key, size_t n) {
   int status = AMQP_STATUS_OK;
   BIO *buf = NULL;
   RSA *rsa = NULL;
-  struct amqp_ssl_socket_t *self;
-  if (base->klass != &amqp_ssl_socket_class) {
-    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
-  }
   if (n > INT_MAX) {
     return AMQP_STATUS_INVALID_PARAMETER;
   }
-  self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_use_certificate_chain_file(self->ctx, cert);
+  status = SSL_CTX_use_certificate_chain_file(ctx, cert);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
@@ -442,7 +931,7 @@ int amqp_ssl_socket_set_key_buffer(amqp_socket_t *base, const char *cert,
   if (!rsa) {
     goto error;
   }
-  status = SSL_CTX_use_RSAPrivateKey(self->ctx, rsa);
+  status = SSL_CTX_use_RSAPrivateKey(ctx, rsa);
   if (1 != status) {
     goto error;
   }
@@ -455,20 +944,57 @@ error:
   goto exit;
 }
 
-int amqp_ssl_socket_set_cert(amqp_socket_t *base, const char *cert) {
+static int ctx_set_cert(SSL_CTX *ctx, const char *cert) {
   int status;
-  struct amqp_ssl_socket_t *self;
-  if (base->klass != &amqp_ssl_socket_class) {
-    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
-  }
-  self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_use_certificate_chain_file(self->ctx, cert);
+  status = SSL_CTX_use_certificate_chain_file(ctx, cert);
   if (1 != status) {
     return AMQP_STATUS_SSL_ERROR;
   }
   return AMQP_STATUS_OK;
 }
 
+/* The context of a socket made from an amqp_ssl_context_t is set up through
+ * that, changing it here would change every socket sharing it. NULL if the
+ * socket shares its context. */
+static SSL_CTX *own_ctx(amqp_socket_t *base) {
+  struct amqp_ssl_socket_t *self = ssl_socket(base);
+  return self->shared_ctx ? NULL : self->ctx;
+}
+
+int amqp_ssl_socket_set_cacert(amqp_socket_t *base, const char *cacert) {
+  SSL_CTX *ctx = own_ctx(base);
+  if (NULL == ctx) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  return ctx_set_cacert(ctx, cacert);
+}
+
+int amqp_ssl_socket_set_key(amqp_socket_t *base, const char *cert,
+                            const char *key) {
+  SSL_CTX *ctx = own_ctx(base);
+  if (NULL == ctx) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  return ctx_set_key(ctx, cert, key);
+}
+
+int amqp_ssl_socket_set_key_buffer(amqp_socket_t *base, const char *cert,
+                                   const void *key, size_t n) {
+  SSL_CTX *ctx = own_ctx(base);
+  if (NULL == ctx) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  return ctx_set_key_buffer(ctx, cert, key, n);
+}
+
+int amqp_ssl_socket_set_cert(amqp_socket_t *base, const char *cert) {
+  SSL_CTX *ctx = own_ctx(base);
+  if (NULL == ctx) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  return ctx_set_cert(ctx, cert);
+}
+
 void amqp_ssl_socket_set_verify(amqp_socket_t *base, amqp_boolean_t verify) {
   amqp_ssl_socket_set_verify_peer(base, verify);
   amqp_ssl_socket_set_verify_hostname(base, verify);
@@ -494,15 +1020,31 @@ void amqp_ssl_socket_set_verify_hostname(amqp_socket_t *base,
   self->verify_hostname = verify;
 }
 
-int amqp_ssl_socket_set_ssl_versions(amqp_socket_t *base,
-                                     amqp_tls_version_t min,
-                                     amqp_tls_version_t max) {
-  struct amqp_ssl_socket_t *self;
-  if (base->klass != &amqp_ssl_socket_class) {
-    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+int amqp_ssl_socket_set_ktls(amqp_socket_t *base, amqp_boolean_t enable) {
+  struct amqp_ssl_socket_t *self = ssl_socket(base);
+#ifndef AMQP_OPENSSL_KTLS
+  if (enable) {
+    return AMQP_STATUS_UNSUPPORTED;
   }
-  self = (struct amqp_ssl_socket_t *)base;
+#endif
+  self->ktls = enable;
+  return AMQP_STATUS_OK;
+}
+
+amqp_boolean_t amqp_ssl_socket_get_ktls(amqp_socket_t *base) {
+  struct amqp_ssl_socket_t *self = ssl_socket(base);
+#ifdef AMQP_OPENSSL_KTLS
+  if (self->ktls && NULL != self->ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(self->ssl));
+  }
+#else
+  (void)self;
+#endif
+  return 0;
+}
 
+static int ctx_set_ssl_versions(SSL_CTX *ctx, amqp_tls_version_t min,
+                                amqp_tls_version_t max) {
   {
     long clear_options;
     long set_options = 0;
@@ -547,22 +1089,295 @@ int amqp_ssl_socket_set_ssl_versions(amqp_socket_t *base,
       set_options |= SSL_OP_NO_TLSv1_2;
     }
 #endif
-    SSL_CTX_clear_options(self->ctx, clear_options);
-    SSL_CTX_set_options(self->ctx, set_options);
+    SSL_CTX_clear_options(ctx, clear_options);
+    SSL_CTX_set_options(ctx, set_options);
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_ssl_socket_set_ssl_versions(amqp_socket_t *base,
+                                     amqp_tls_version_t min,
+                                     amqp_tls_version_t max) {
+  SSL_CTX *ctx = own_ctx(base);
+  if (NULL == ctx) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  return ctx_set_ssl_versions(ctx, min, max);
+}
+
+amqp_ssl_context_t *amqp_ssl_context_new(void) {
+  amqp_ssl_context_t *context = calloc(1, sizeof(*context));
+  if (NULL == context) {
+    return NULL;
+  }
+  if (initialize_ssl_and_increment_connections()) {
+    free(context);
+    return NULL;
+  }
+  context->ctx = new_ssl_ctx();
+  if (NULL == context->ctx) {
+    amqp_ssl_context_free(context);
+    return NULL;
+  }
+  context->verify_peer = 1;
+  context->verify_hostname = 1;
+  return context;
+}
+
+void amqp_ssl_context_free(amqp_ssl_context_t *context) {
+  if (NULL == context) {
+    return;
+  }
+  /* Sockets created from it hold their own reference */
+  SSL_CTX_free(context->ctx);
+  free(context);
+  decrement_ssl_connections();
+}
+
+void *amqp_ssl_context_get_context(amqp_ssl_context_t *context) {
+  return context->ctx;
+}
+
+int amqp_ssl_context_set_cacert(amqp_ssl_context_t *context,
+                                const char *cacert) {
+  return ctx_set_cacert(context->ctx, cacert);
+}
+
+int amqp_ssl_context_set_key(amqp_ssl_context_t *context, const char *cert,
+                             const char *key) {
+  return ctx_set_key(context->ctx, cert, key);
+}
+
+int amqp_ssl_context_set_key_buffer(amqp_ssl_context_t *context,
+                                    const char *cert, const void *key,
+                                    size_t n) {
+  return ctx_set_key_buffer(context->ctx, cert, key, n);
+}
+
+int amqp_ssl_context_set_cert(amqp_ssl_context_t *context, const char *cert) {
+  return ctx_set_cert(context->ctx, cert);
+}
+
+int amqp_ssl_context_set_ssl_versions(amqp_ssl_context_t *context,
+                                      amqp_tls_version_t min,
+                                      amqp_tls_version_t max) {
+  return ctx_set_ssl_versions(context->ctx, min, max);
+}
+
+int amqp_ssl_context_set_ciphers(amqp_ssl_context_t *context,
+                                 const char *ciphers) {
+  if (NULL == ciphers) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (1 != SSL_CTX_set_cipher_list(context->ctx, ciphers)) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_ssl_context_set_verify_peer(amqp_ssl_context_t *context,
+                                      amqp_boolean_t verify) {
+  context->verify_peer = verify;
+}
+
+void amqp_ssl_context_set_verify_hostname(amqp_ssl_context_t *context,
+                                          amqp_boolean_t verify) {
+  context->verify_hostname = verify;
+}
+
+amqp_ssl_session_cache_t *amqp_ssl_session_cache_new(void) {
+  amqp_ssl_session_cache_t *cache = calloc(1, sizeof(*cache));
+  if (NULL == cache) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&cache->mutex, NULL)) {
+    free(cache);
+    return NULL;
+  }
+  cache->refcount = 1;
+  return cache;
+}
+
+void amqp_ssl_session_cache_free(amqp_ssl_session_cache_t *cache) {
+  int refcount;
+
+  if (NULL == cache) {
+    return;
   }
+  CHECK_SUCCESS(pthread_mutex_lock(&cache->mutex));
+  refcount = --cache->refcount;
+  CHECK_SUCCESS(pthread_mutex_unlock(&cache->mutex));
+  if (0 != refcount) {
+    return;
+  }
+  while (NULL != cache->entries) {
+    amqp_ssl_session_entry_t *entry = cache->entries;
+    cache->entries = entry->next;
+    free_session_entry(entry);
+  }
+  pthread_mutex_destroy(&cache->mutex);
+  free(cache);
+}
 
+int amqp_ssl_socket_set_session_cache(amqp_socket_t *base,
+                                      amqp_ssl_session_cache_t *cache) {
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+
+  if (NULL != cache) {
+    CHECK_SUCCESS(pthread_mutex_lock(&cache->mutex));
+    cache->refcount++;
+    CHECK_SUCCESS(pthread_mutex_unlock(&cache->mutex));
+  }
+  amqp_ssl_session_cache_free(self->session_cache);
+  self->session_cache = cache;
   return AMQP_STATUS_OK;
 }
 
+/* Opens a file only its owner can read, it holds session secrets */
+static FILE *open_private_file(const char *path) {
+#ifdef _WIN32
+  return fopen(path, "w");
+#else
+  FILE *file;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (-1 == fd) {
+    return NULL;
+  }
+  file = fdopen(fd, "w");
+  if (NULL == file) {
+    close(fd);
+  }
+  return file;
+#endif
+}
+
+/* Each session is a line with the host and port it belongs to, followed by
+ * the session in PEM */
+int amqp_ssl_session_cache_save(amqp_ssl_session_cache_t *cache,
+                                const char *path) {
+  amqp_ssl_session_entry_t *entry;
+  FILE *file;
+  BIO *bio;
+  int status = AMQP_STATUS_OK;
+  long now = (long)time(NULL);
+
+  if (NULL == cache || NULL == path) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  file = open_private_file(path);
+  if (NULL == file) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  bio = BIO_new_fp(file, BIO_CLOSE);
+  if (NULL == bio) {
+    fclose(file);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  CHECK_SUCCESS(pthread_mutex_lock(&cache->mutex));
+  for (entry = cache->entries; NULL != entry; entry = entry->next) {
+    const unsigned char *der = entry->der;
+    SSL_SESSION *session;
+
+    if (entry->expires <= now) {
+      continue;
+    }
+    session = d2i_SSL_SESSION(NULL, &der, entry->der_len);
+    if (NULL == session) {
+      continue;
+    }
+    if (BIO_printf(bio, "%s %d\n", entry->host, entry->port) <= 0 ||
+        !PEM_write_bio_SSL_SESSION(bio, session)) {
+      status = AMQP_STATUS_SSL_ERROR;
+    }
+    SSL_SESSION_free(session);
+    if (AMQP_STATUS_OK != status) {
+      break;
+    }
+  }
+  CHECK_SUCCESS(pthread_mutex_unlock(&cache->mutex));
+
+  if (1 != BIO_flush(bio)) {
+    status = AMQP_STATUS_SSL_ERROR;
+  }
+  BIO_free(bio);
+  return status;
+}
+
+int amqp_ssl_session_cache_load(amqp_ssl_session_cache_t *cache,
+                                const char *path) {
+  char line[512];
+  BIO *bio;
+  int status = AMQP_STATUS_OK;
+  long now = (long)time(NULL);
+
+  if (NULL == cache || NULL == path) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  bio = BIO_new_file(path, "r");
+  if (NULL == bio) {
+    /* Nothing saved yet */
+    ERR_clear_error();
+    return AMQP_STATUS_OK;
+  }
+
+  while (BIO_gets(bio, line, sizeof(line)) > 0) {
+    char host[256];
+    int port;
+    SSL_SESSION *session;
+
+    if (2 != sscanf(line, "%255s %d", host, &port)) {
+      status = AMQP_STATUS_SSL_ERROR;
+      break;
+    }
+    session = PEM_read_bio_SSL_SESSION(bio, NULL, NULL, NULL);
+    if (NULL == session) {
+      status = AMQP_STATUS_SSL_ERROR;
+      break;
+    }
+    if (session_expiry(session) > now) {
+      status = store_session(cache, host, port, session);
+    }
+    SSL_SESSION_free(session);
+    if (AMQP_STATUS_OK != status) {
+      break;
+    }
+  }
+  ERR_clear_error();
+  BIO_free(bio);
+  return status;
+}
+
+#ifdef AMQP_HAVE_ATOMICS
+#define connections_add(n) amqp_atomic_add_fetch(&openssl_connections, (n))
+#define connections_get() amqp_atomic_load(&openssl_connections)
+#define set_ready(v)                       \
+  do {                                     \
+    amqp_atomic_store(&openssl_ready, v);  \
+    amqp_atomic_fence();                   \
+  } while (0)
+#else
+/* Only ever used with openssl_init_mutex held */
+#define connections_add(n) (openssl_connections += (n))
+#define connections_get() openssl_connections
+#define set_ready(v) (openssl_ready = (v))
+#endif
+
 void amqp_set_initialize_ssl_library(amqp_boolean_t do_initialize) {
   CHECK_SUCCESS(pthread_mutex_lock(&openssl_init_mutex));
 
-  if (openssl_connections == 0 && !openssl_initialized) {
+  if (connections_get() == 0 && !openssl_initialized) {
     do_initialize_openssl = do_initialize;
   }
   CHECK_SUCCESS(pthread_mutex_unlock(&openssl_init_mutex));
 }
 
+#ifndef AMQP_OPENSSL_V110
 static unsigned long ssl_threadid_callback(void) {
   return (unsigned long)pthread_self();
 }
@@ -575,10 +1390,13 @@ static void ssl_locking_callback(int mode, int n, AMQP_UNUSED const char *file,
     CHECK_SUCCESS(pthread_mutex_unlock(&amqp_openssl_lockarray[n]));
   }
 }
+#endif
 
 static int setup_openssl(void) {
   int status;
 
+#ifndef AMQP_OPENSSL_V110
+  /* OpenSSL 1.1.0 and later lock internally and ignore these callbacks */
   int i;
   amqp_openssl_lockarray = calloc(CRYPTO_num_locks(), sizeof(pthread_mutex_t));
   if (!amqp_openssl_lockarray) {
@@ -598,6 +1416,7 @@ static int setup_openssl(void) {
   }
   CRYPTO_set_id_callback(ssl_threadid_callback);
   CRYPTO_set_locking_callback(ssl_locking_callback);
+#endif
 
 #ifdef AMQP_OPENSSL_V110
   if (CONF_modules_load_file(
@@ -635,8 +1454,20 @@ out:
   return status;
 }
 
-static int initialize_ssl_and_increment_connections() {
+static int initialize_ssl_and_increment_connections(void) {
   int status;
+
+#ifdef AMQP_HAVE_ATOMICS
+  /* Counted first, so amqp_uninitialize_ssl_library() either sees this
+   * socket or has cleared openssl_ready before it is read */
+  connections_add(1);
+  amqp_atomic_fence();
+  if (amqp_atomic_load(&openssl_ready)) {
+    return AMQP_STATUS_OK;
+  }
+  connections_add(-1);
+#endif
+
   CHECK_SUCCESS(pthread_mutex_lock(&openssl_init_mutex));
 
   if (do_initialize_openssl && !openssl_initialized) {
@@ -655,7 +1486,8 @@ static int initialize_ssl_and_increment_connections() {
     openssl_bio_initialized = 1;
   }
 
-  openssl_connections += 1;
+  connections_add(1);
+  set_ready(1);
   status = AMQP_STATUS_OK;
 exit:
   CHECK_SUCCESS(pthread_mutex_unlock(&openssl_init_mutex));
@@ -663,6 +1495,9 @@ exit:
 }
 
 static int decrement_ssl_connections(void) {
+#ifdef AMQP_HAVE_ATOMICS
+  connections_add(-1);
+#else
   CHECK_SUCCESS(pthread_mutex_lock(&openssl_init_mutex));
 
   if (openssl_connections > 0) {
@@ -670,6 +1505,7 @@ static int decrement_ssl_connections(void) {
   }
 
   CHECK_SUCCESS(pthread_mutex_unlock(&openssl_init_mutex));
+#endif
   return AMQP_STATUS_OK;
 }
 
@@ -677,7 +1513,10 @@ int amqp_uninitialize_ssl_library(void) {
   int status;
   CHECK_SUCCESS(pthread_mutex_lock(&openssl_init_mutex));
 
-  if (openssl_connections > 0) {
+  /* Sockets being created from here on wait for the mutex */
+  set_ready(0);
+  if (connections_get() > 0) {
+    set_ready(openssl_bio_initialized);
     status = AMQP_STATUS_SOCKET_INUSE;
     goto out;
   }
@@ -689,10 +1528,12 @@ int amqp_uninitialize_ssl_library(void) {
   ERR_remove_state(0);
 #endif
 
-#ifndef LIBRESSL_VERSION_NUMBER
+#if !defined(LIBRESSL_VERSION_NUMBER) && \
+    (OPENSSL_VERSION_NUMBER < 0x30000000L)
   FIPS_mode_set(0);
 #endif
 
+#ifndef AMQP_OPENSSL_V110
   CRYPTO_set_locking_callback(NULL);
   CRYPTO_set_id_callback(NULL);
   {
@@ -702,6 +1543,7 @@ int amqp_uninitialize_ssl_library(void) {
     }
     free(amqp_openssl_lockarray);
   }
+#endif
 
   ENGINE_cleanup();
   CONF_modules_free();
@@ -0,0 +1,316 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Deliveries whose hand-off time is remembered, a power of two. Deliveries
+ * that outlive their slot just don't contribute a sample. */
+#define AMQP_PREFETCH_SLOTS 256
+/* Settled deliveries needed before the prefetch is reconsidered */
+#define AMQP_PREFETCH_MIN_SAMPLES 4
+/* Shortest time between two basic.qos */
+#define AMQP_PREFETCH_MIN_INTERVAL_NS (100 * (uint64_t)AMQP_NS_PER_MS)
+
+typedef struct amqp_prefetch_slot_t_ {
+  uint64_t delivery_tag; /* 0 when free */
+  uint64_t handed_ns;
+} amqp_prefetch_slot_t;
+
+struct amqp_prefetch_t_ {
+  struct amqp_prefetch_t_ *next;
+  amqp_channel_t channel;
+  uint16_t min_prefetch;
+  uint16_t max_prefetch;
+  uint16_t current;
+  /* A basic.qos with target is sent at the next safe point */
+  int due;
+  uint16_t target;
+
+  /* Moving averages, 0 until the first sample: broker round trip, time from
+   * handing a delivery to the application until it's settled, and number of
+   * deliveries the application holds at once */
+  double rtt_ns;
+  double service_ns;
+  double concurrency;
+
+  uint64_t last_tag;
+  int outstanding;
+  int samples;
+  uint64_t next_update_ns;
+  amqp_prefetch_slot_t slots[AMQP_PREFETCH_SLOTS];
+};
+
+static amqp_prefetch_t *find_prefetch(amqp_connection_state_t state,
+                                      amqp_channel_t channel) {
+  amqp_prefetch_t *prefetch;
+  for (prefetch = state->prefetch; NULL != prefetch; prefetch = prefetch->next) {
+    if (prefetch->channel == channel) {
+      return prefetch;
+    }
+  }
+  return NULL;
+}
+
+static void average(double *avg, double sample, int fast) {
+  if (0 == *avg) {
+    *avg = sample;
+  } else if (fast) {
+    *avg += (sample - *avg) / 2;
+  } else {
+    *avg += (sample - *avg) / 8;
+  }
+}
+
+/* Enough prefetch to keep the application busy for a broker round trip:
+ * deliveries settle at concurrency / service time per second, and each is
+ * unacknowledged at the broker for a round trip plus its service time. A
+ * quarter is added on top to ride out jitter. */
+static uint16_t compute_target(amqp_prefetch_t *prefetch) {
+  double target;
+
+  if (prefetch->service_ns <= 0) {
+    return prefetch->max_prefetch;
+  }
+  target = 1.25 * prefetch->concurrency *
+           (prefetch->rtt_ns + prefetch->service_ns) / prefetch->service_ns;
+  if (target >= prefetch->max_prefetch) {
+    return prefetch->max_prefetch;
+  }
+  if (target <= prefetch->min_prefetch) {
+    return prefetch->min_prefetch;
+  }
+  return (uint16_t)(target + 0.5);
+}
+
+static void consider_update(amqp_prefetch_t *prefetch, uint64_t now) {
+  uint16_t target;
+  uint32_t current = prefetch->current;
+
+  if (prefetch->samples < AMQP_PREFETCH_MIN_SAMPLES ||
+      now < prefetch->next_update_ns) {
+    return;
+  }
+  prefetch->samples = 0;
+  target = compute_target(prefetch);
+  /* Small changes aren't worth a round trip */
+  if (4 * (uint32_t)target > 5 * current ||
+      4 * (uint32_t)target < 3 * current ||
+      (target != current && (target == prefetch->min_prefetch ||
+                             target == prefetch->max_prefetch))) {
+    prefetch->target = target;
+    prefetch->due = 1;
+  }
+}
+
+void amqp_prefetch_delivered(amqp_connection_state_t state,
+                             amqp_channel_t channel, uint64_t delivery_tag) {
+  amqp_prefetch_t *prefetch = find_prefetch(state, channel);
+  amqp_prefetch_slot_t *slot;
+
+  if (NULL == prefetch) {
+    return;
+  }
+  slot = &prefetch->slots[delivery_tag & (AMQP_PREFETCH_SLOTS - 1)];
+  slot->delivery_tag = delivery_tag;
+  slot->handed_ns = amqp_get_monotonic_timestamp();
+  prefetch->last_tag = delivery_tag;
+  prefetch->outstanding++;
+}
+
+void amqp_prefetch_settled(amqp_connection_state_t state,
+                           amqp_channel_t channel, uint64_t delivery_tag,
+                           amqp_boolean_t multiple) {
+  amqp_prefetch_t *prefetch = find_prefetch(state, channel);
+  amqp_prefetch_slot_t *slot;
+  uint64_t now;
+
+  if (NULL == prefetch) {
+    return;
+  }
+  slot = &prefetch->slots[delivery_tag & (AMQP_PREFETCH_SLOTS - 1)];
+  if (slot->delivery_tag != delivery_tag || 0 == delivery_tag) {
+    return;
+  }
+  slot->delivery_tag = 0;
+  now = amqp_get_monotonic_timestamp();
+
+  /* Held deliveries, counting this one */
+  average(&prefetch->concurrency, prefetch->outstanding, 0);
+  /* A slowdown is followed quickly, the messages hoarded meanwhile are
+   * costlier than a little lost throughput */
+  average(&prefetch->service_ns, (double)(now - slot->handed_ns),
+          (double)(now - slot->handed_ns) > prefetch->service_ns);
+
+  if (multiple) {
+    uint64_t after = prefetch->last_tag - delivery_tag;
+    if ((uint64_t)prefetch->outstanding > after) {
+      prefetch->outstanding = (int)after;
+    }
+  } else if (prefetch->outstanding > 0) {
+    prefetch->outstanding--;
+  }
+
+  prefetch->samples++;
+  consider_update(prefetch, now);
+}
+
+static amqp_rpc_reply_t send_qos(amqp_connection_state_t state,
+                                 amqp_prefetch_t *prefetch, uint16_t count) {
+  amqp_method_number_t replies[2] = {AMQP_BASIC_QOS_OK_METHOD, 0};
+  amqp_basic_qos_t req;
+  amqp_rpc_reply_t ret;
+  uint64_t start;
+  uint64_t now;
+
+  /* Per channel: a per-consumer limit only applies to consumers started
+   * after it's set */
+  req.prefetch_size = 0;
+  req.prefetch_count = count;
+  req.global = 1;
+
+  /* Not retried if it fails, the channel is likely gone */
+  prefetch->due = 0;
+  start = amqp_get_monotonic_timestamp();
+  ret = amqp_simple_rpc(state, prefetch->channel, AMQP_BASIC_QOS_METHOD,
+                        replies, &req);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+  now = amqp_get_monotonic_timestamp();
+
+  average(&prefetch->rtt_ns, (double)(now - start), 0);
+  prefetch->current = count;
+  prefetch->samples = 0;
+  prefetch->next_update_ns = now + AMQP_PREFETCH_MIN_INTERVAL_NS;
+  return ret;
+}
+
+amqp_rpc_reply_t amqp_prefetch_update(amqp_connection_state_t state) {
+  amqp_prefetch_t *prefetch;
+  amqp_rpc_reply_t ret;
+
+  memset(&ret, 0, sizeof(ret));
+  ret.reply_type = AMQP_RESPONSE_NORMAL;
+  for (prefetch = state->prefetch; NULL != prefetch; prefetch = prefetch->next) {
+    if (prefetch->due) {
+      ret = send_qos(state, prefetch, prefetch->target);
+      if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+        return ret;
+      }
+    }
+  }
+  return ret;
+}
+
+static void remove_prefetch(amqp_connection_state_t state,
+                            amqp_channel_t channel) {
+  amqp_prefetch_t **prev;
+  for (prev = &state->prefetch; NULL != *prev; prev = &(*prev)->next) {
+    if ((*prev)->channel == channel) {
+      amqp_prefetch_t *prefetch = *prev;
+      *prev = prefetch->next;
+      free(prefetch);
+      return;
+    }
+  }
+}
+
+amqp_rpc_reply_t amqp_set_adaptive_prefetch(amqp_connection_state_t state,
+                                            amqp_channel_t channel,
+                                            uint16_t min_prefetch,
+                                            uint16_t max_prefetch) {
+  amqp_prefetch_t *prefetch;
+  amqp_rpc_reply_t ret;
+
+  if (NULL == state || 0 == channel) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+  if (0 == max_prefetch) {
+    remove_prefetch(state, channel);
+    memset(&ret, 0, sizeof(ret));
+    ret.reply_type = AMQP_RESPONSE_NORMAL;
+    return ret;
+  }
+  if (0 == min_prefetch || min_prefetch > max_prefetch) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+
+  prefetch = find_prefetch(state, channel);
+  if (NULL == prefetch) {
+    prefetch = calloc(1, sizeof(amqp_prefetch_t));
+    if (NULL == prefetch) {
+      return amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
+    }
+    prefetch->channel = channel;
+    prefetch->next = state->prefetch;
+    state->prefetch = prefetch;
+  }
+  prefetch->min_prefetch = min_prefetch;
+  prefetch->max_prefetch = max_prefetch;
+
+  /* The first measurement of the round trip comes with setting the
+   * starting point */
+  ret = send_qos(state, prefetch, min_prefetch);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    remove_prefetch(state, channel);
+  }
+  return ret;
+}
+
+void amqp_prefetch_before_method(amqp_connection_state_t state,
+                                 amqp_channel_t channel,
+                                 amqp_method_number_t id) {
+  switch (id) {
+    case AMQP_CHANNEL_CLOSE_METHOD:
+    case AMQP_CHANNEL_CLOSE_OK_METHOD:
+      remove_prefetch(state, channel);
+      break;
+
+    case AMQP_CONNECTION_CLOSE_METHOD:
+    case AMQP_CONNECTION_CLOSE_OK_METHOD:
+      amqp_destroy_prefetch(state);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void amqp_destroy_prefetch(amqp_connection_state_t state) {
+  while (NULL != state->prefetch) {
+    amqp_prefetch_t *prefetch = state->prefetch;
+    state->prefetch = prefetch->next;
+    free(prefetch);
+  }
+}
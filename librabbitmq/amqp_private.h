@@ -83,6 +83,12 @@
 #define AMQP_PRIVATE
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#define AMQP_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define AMQP_THREAD_LOCAL __declspec(thread)
+#endif
+
 char *amqp_os_error_string(int err);
 
 #ifdef WITH_SSL
@@ -146,6 +152,22 @@ typedef struct amqp_pool_table_entry_t_ {
   struct amqp_pool_table_entry_t_ *next;
   amqp_pool_t pool;
   amqp_channel_t channel;
+
+  /* Header (properties) frames are decoded into their own pool, so that
+   * amqp_read_message() can take its pages over instead of cloning the
+   * decoded properties. header_frames counts the frames decoded into it since
+   * it was last recycled. */
+  amqp_pool_t header_pool;
+  int header_frames;
+
+  /* Number of frames on this channel currently sitting in the connection's
+   * queued frame list. The pool may only be recycled when this is 0. */
+  int queued_frames;
+
+  /* Frames and bytes of frame data decoded into pool since it was last
+   * recycled, used by the automatic buffer release policy. */
+  int frames_since_recycle;
+  size_t bytes_since_recycle;
 } amqp_pool_table_entry_t;
 
 struct amqp_connection_state_t_ {
@@ -193,13 +215,83 @@ struct amqp_connection_state_t_ {
   struct timeval internal_handshake_timeout;
   struct timeval *rpc_timeout;
   struct timeval internal_rpc_timeout;
+
+  /* Automatic buffer release thresholds. A channel pool is recycled when a new
+   * frame arrives for it, none of its frames are queued and either threshold
+   * has been reached. 0 disables the respective threshold. */
+  size_t release_max_bytes;
+  int release_max_frames;
+
+  /* When set, socket buffers and channel pools are released after the
+   * connection has seen no traffic for this long, see
+   * amqp_release_idle_buffers(). next_idle is infinite when disabled or when
+   * the buffers have already been released. */
+  struct timeval *idle_timeout;
+  struct timeval internal_idle_timeout;
+  amqp_time_t next_idle;
+
+  /* How long to keep retrying the socket before polling it when waiting for
+   * input, 0 to poll straight away. See amqp_set_busy_wait(). */
+  uint64_t busy_wait_ns;
+  amqp_boolean_t busy_wait_backoff;
+
+  /* Consumers started with amqp_basic_consume_cb(), hashed on channel and
+   * consumer tag. consumers_size is 0 or a power of 2. */
+  struct amqp_consumer_entry_t_ **consumers;
+  size_t consumers_size;
+  size_t consumers_count;
+
+  /* Registration in an amqp_event_loop_t, NULL if not in one */
+  struct amqp_event_loop_conn_t_ *event_loop_conn;
+
+  /* Channels with ack coalescing enabled, see amqp_set_ack_coalescing() */
+  struct amqp_ack_window_t_ *ack_windows;
+
+  /* Channels whose prefetch is tuned, see amqp_set_adaptive_prefetch() */
+  struct amqp_prefetch_t_ *prefetch;
+
+  /* Recorded topology, see amqp_set_recovery() */
+  struct amqp_recovery_t_ *recovery;
 };
 
+amqp_pool_table_entry_t *amqp_get_or_create_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel);
+amqp_pool_table_entry_t *amqp_get_channel_pool_entry(
+    amqp_connection_state_t state, amqp_channel_t channel);
 amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t connection,
                                              amqp_channel_t channel);
 amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
                                    amqp_channel_t channel);
 
+/* Get a block of memory of exactly size bytes, taken from the calling
+ * thread's buffer cache when possible. The contents are undefined. */
+void *amqp_buffer_cache_alloc(size_t size);
+
+/* Release a block obtained from amqp_buffer_cache_alloc() of size bytes,
+ * keeping it in the calling thread's buffer cache if there is room. */
+void amqp_buffer_cache_free(void *block, size_t size);
+
+/* Recycle the entry's pool and reset its automatic release counters. The
+ * caller must ensure no queued frames reference the pool. */
+static inline void amqp_recycle_channel_pool_entry(
+    amqp_pool_table_entry_t *entry) {
+  recycle_amqp_pool(&entry->pool);
+  recycle_amqp_pool(&entry->header_pool);
+  entry->header_frames = 0;
+  entry->frames_since_recycle = 0;
+  entry->bytes_since_recycle = 0;
+}
+
+/* Page size of the pool header frames are decoded into, this pool ends up as
+ * the pool of an amqp_message_t */
+#define AMQP_HEADER_POOL_PAGE_SIZE 4096
+
+/* Move the pages holding the decoded header frame of channel into pool,
+ * which must not be initialized. Returns 0 if other frames still reference
+ * those pages, in which case nothing is moved. */
+int amqp_take_header_pool(amqp_connection_state_t state, amqp_channel_t channel,
+                          amqp_pool_t *pool);
+
 static inline int amqp_heartbeat_send(amqp_connection_state_t state) {
   return state->heartbeat;
 }
@@ -210,6 +302,121 @@ static inline int amqp_heartbeat_recv(amqp_connection_state_t state) {
 
 int amqp_try_recv(amqp_connection_state_t state);
 
+/* Decode the next frame from the socket buffer. frame_type is 0 if the buffer
+ * ran out before a frame was complete. */
+int amqp_consume_one_frame(amqp_connection_state_t state,
+                           amqp_frame_t *decoded_frame);
+
+/* Read whatever is available from the socket into the socket buffer, waiting
+ * up to deadline for it to become readable. */
+int amqp_recv_with_timeout(amqp_connection_state_t state,
+                           amqp_time_t deadline);
+
+/* Wait for the next frame from the socket, ignoring the queued frames */
+int amqp_wait_frame_unqueued(amqp_connection_state_t state,
+                             amqp_frame_t *decoded_frame,
+                             amqp_time_t deadline);
+
+typedef struct amqp_consumer_entry_t_ amqp_consumer_entry_t;
+
+/* Free the handlers registered with amqp_basic_consume_cb() */
+void amqp_destroy_consumers(amqp_connection_state_t state);
+
+/* Drop the handlers of the channels a received frame closes */
+void amqp_consumers_received(amqp_connection_state_t state,
+                             const amqp_frame_t *frame);
+
+/* Take the connection out of the event loop it was added to, if any */
+void amqp_event_loop_detach(amqp_connection_state_t state);
+
+/* Register the connection's socket with its event loop again after it was
+ * reopened, since the new socket may reuse the old descriptor number */
+int amqp_event_loop_rearm(amqp_connection_state_t state);
+
+typedef struct amqp_ack_window_t_ amqp_ack_window_t;
+
+/* Record an ack on a channel with coalescing enabled, or send it */
+int amqp_ack_window_ack(amqp_connection_state_t state, amqp_channel_t channel,
+                        uint64_t delivery_tag, amqp_boolean_t multiple);
+
+/* Send a basic.ack, basic.reject or basic.nack for delivery_tag, keeping the
+ * channel's recorded acks in order with it */
+int amqp_ack_window_send(amqp_connection_state_t state, amqp_channel_t channel,
+                         amqp_method_number_t id, void *decoded,
+                         uint64_t delivery_tag, amqp_boolean_t multiple);
+
+/* Flush or drop recorded acks when a method opens or closes a channel or the
+ * connection. Called before the method is sent. */
+int amqp_ack_windows_before_method(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_method_number_t id);
+
+void amqp_destroy_ack_windows(amqp_connection_state_t state);
+
+typedef struct amqp_prefetch_t_ amqp_prefetch_t;
+
+/* A delivery was handed to the application */
+void amqp_prefetch_delivered(amqp_connection_state_t state,
+                             amqp_channel_t channel, uint64_t delivery_tag);
+
+/* The application acked, rejected or nacked a delivery */
+void amqp_prefetch_settled(amqp_connection_state_t state,
+                           amqp_channel_t channel, uint64_t delivery_tag,
+                           amqp_boolean_t multiple);
+
+/* Send the basic.qos decided on since the last call. Only called where an
+ * RPC may be made before reading the next delivery. */
+amqp_rpc_reply_t amqp_prefetch_update(amqp_connection_state_t state);
+
+/* Stop tuning a channel that is being closed. Called before the method is
+ * sent. */
+void amqp_prefetch_before_method(amqp_connection_state_t state,
+                                 amqp_channel_t channel,
+                                 amqp_method_number_t id);
+
+void amqp_destroy_prefetch(amqp_connection_state_t state);
+
+/* Forget everything read from and queued for the socket and go back to the
+ * state of a new connection, so the socket can be opened again */
+int amqp_reset_connection(amqp_connection_state_t state);
+
+typedef struct amqp_recovery_t_ amqp_recovery_t;
+
+/* Record or forget topology for a method about to be sent */
+int amqp_recovery_before_method(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_method_number_t id, void *decoded);
+
+/* Commit what a request recorded once the broker replied to it */
+void amqp_recovery_after_rpc(amqp_connection_state_t state,
+                             amqp_channel_t channel, amqp_method_t *reply);
+
+/* Number the delivery in a basic.deliver or basic.get-ok just decoded on
+ * from the ones received before the connection was replaced */
+void amqp_recovery_received(amqp_connection_state_t state,
+                            amqp_frame_t *frame);
+
+/* Translate the tag of an ack, reject or nack to the current connection.
+ * Returns 0 if the delivery came on a connection since replaced, which must
+ * not be settled. */
+int amqp_recovery_settle_tag(amqp_connection_state_t state,
+                             amqp_channel_t channel, uint64_t *delivery_tag);
+
+void amqp_destroy_recovery(amqp_connection_state_t state);
+
+/* Restart the idle timer after traffic on the connection */
+static inline int amqp_idle_touch(amqp_connection_state_t state) {
+  if (NULL == state->idle_timeout) {
+    return AMQP_STATUS_OK;
+  }
+  return amqp_time_from_now(&state->next_idle, state->idle_timeout);
+}
+
+/* Give the socket buffers and unused channel pool pages of an idle connection
+ * back to the allocator. They are reacquired on the next read or write.
+ * Does nothing if a frame is partially read or decoded data is pending. */
+void amqp_release_idle_buffers(amqp_connection_state_t state);
+
 static inline void *amqp_offset(void *data, size_t offset) {
   return (char *)data + offset;
 }
@@ -371,4 +578,14 @@ static inline amqp_rpc_reply_t amqp_rpc_reply_error(amqp_status_enum status) {
 int amqp_send_frame_inner(amqp_connection_state_t state,
                           const amqp_frame_t *frame, int flags,
                           amqp_time_t deadline);
+
+/* Encodes frame into buffer, which must have room for a frame of frame_max
+ * bytes. encoded is set to the part of buffer that was used. */
+int amqp_frame_to_bytes(const amqp_frame_t *frame, amqp_bytes_t buffer,
+                        amqp_bytes_t *encoded);
+
+/* Sends frames already encoded with amqp_frame_to_bytes() */
+int amqp_send_encoded_inner(amqp_connection_state_t state,
+                            amqp_bytes_t encoded, int flags,
+                            amqp_time_t deadline);
 #endif
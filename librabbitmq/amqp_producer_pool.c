@@ -0,0 +1,569 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_tcp_socket.h"
+#include "amqp_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Wait before the first attempt to replace a failed connection, doubled on
+ * every failed attempt up to the maximum */
+#define AMQP_PRODUCER_POOL_MIN_BACKOFF_MS 100
+#define AMQP_PRODUCER_POOL_MAX_BACKOFF_MS 30000
+/* Shortest time between reading the confirms of all connections */
+#define AMQP_PRODUCER_POOL_DRAIN_INTERVAL_NS (uint64_t)AMQP_NS_PER_MS
+
+typedef struct amqp_producer_pool_channel_t_ {
+  uint64_t published;
+  /* Highest sequence number acked or nacked by the broker */
+  uint64_t confirmed;
+} amqp_producer_pool_channel_t;
+
+typedef struct amqp_producer_pool_member_t_ {
+  amqp_connection_state_t state; /* NULL while down */
+  int broker;
+  uint64_t retry_at_ns;
+  int backoff_ms;
+  amqp_producer_pool_channel_t *channels;
+} amqp_producer_pool_member_t;
+
+struct amqp_producer_pool_t_ {
+  struct amqp_connection_info *brokers;
+  int num_brokers;
+  amqp_producer_pool_member_t *members;
+  int num_members;
+  int num_channels;
+  amqp_producer_pool_selection_enum selection;
+  struct timeval connect_timeout;
+  struct timeval *connect_timeout_ptr;
+  /* Next channel to consider, counted across all members */
+  unsigned int cursor;
+  uint64_t next_drain_ns;
+  uint64_t nacked;
+};
+
+static void member_down(amqp_producer_pool_t *pool,
+                        amqp_producer_pool_member_t *member) {
+  int i;
+
+  /* Whatever wasn't confirmed yet may or may not have been routed */
+  for (i = 0; i < pool->num_channels; i++) {
+    amqp_producer_pool_channel_t *channel = &member->channels[i];
+    pool->nacked += channel->published - channel->confirmed;
+    channel->published = 0;
+    channel->confirmed = 0;
+  }
+  if (NULL != member->state) {
+    amqp_destroy_connection(member->state);
+    member->state = NULL;
+  }
+
+  /* Next time around try another broker */
+  member->broker = (member->broker + 1) % pool->num_brokers;
+  member->retry_at_ns = amqp_get_monotonic_timestamp() +
+                        (uint64_t)member->backoff_ms * AMQP_NS_PER_MS;
+  member->backoff_ms *= 2;
+  if (member->backoff_ms > AMQP_PRODUCER_POOL_MAX_BACKOFF_MS) {
+    member->backoff_ms = AMQP_PRODUCER_POOL_MAX_BACKOFF_MS;
+  }
+}
+
+/* Opens a channel in confirm mode. Returns AMQP_STATUS_OK, or an error if
+ * the member has to be replaced */
+static int open_channel(amqp_producer_pool_member_t *member,
+                        amqp_channel_t channel) {
+  amqp_rpc_reply_t ret;
+
+  if (NULL != amqp_channel_open(member->state, channel) &&
+      NULL != amqp_confirm_select(member->state, channel)) {
+    return AMQP_STATUS_OK;
+  }
+  ret = amqp_get_rpc_reply(member->state);
+  return AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type
+             ? ret.library_error
+             : AMQP_STATUS_CONNECTION_CLOSED;
+}
+
+static int member_up(amqp_producer_pool_t *pool,
+                     amqp_producer_pool_member_t *member) {
+  struct amqp_connection_info *broker = &pool->brokers[member->broker];
+  amqp_socket_t *socket;
+  amqp_rpc_reply_t ret;
+  int res;
+  int i;
+
+  member->state = amqp_new_connection();
+  if (NULL == member->state) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  socket = amqp_tcp_socket_new(member->state);
+  if (NULL == socket) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  res = amqp_socket_open_noblock(socket, broker->host, broker->port,
+                                 pool->connect_timeout_ptr);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  ret = amqp_login(member->state, broker->vhost, 0, AMQP_DEFAULT_FRAME_SIZE,
+                   0, AMQP_SASL_METHOD_PLAIN, broker->user, broker->password);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type
+               ? ret.library_error
+               : AMQP_STATUS_CONNECTION_CLOSED;
+  }
+
+  for (i = 0; i < pool->num_channels; i++) {
+    res = open_channel(member, (amqp_channel_t)(i + 1));
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Replaces the members whose wait since failing is over */
+static void revive_members(amqp_producer_pool_t *pool) {
+  uint64_t now = 0;
+  int i;
+
+  for (i = 0; i < pool->num_members; i++) {
+    amqp_producer_pool_member_t *member = &pool->members[i];
+    if (NULL != member->state) {
+      continue;
+    }
+    if (0 == now) {
+      now = amqp_get_monotonic_timestamp();
+    }
+    if (now < member->retry_at_ns) {
+      continue;
+    }
+    if (AMQP_STATUS_OK == member_up(pool, member)) {
+      member->backoff_ms = AMQP_PRODUCER_POOL_MIN_BACKOFF_MS;
+    } else {
+      member_down(pool, member);
+    }
+    now = 0;
+  }
+}
+
+static void confirm(amqp_producer_pool_t *pool,
+                    amqp_producer_pool_channel_t *channel,
+                    uint64_t delivery_tag, amqp_boolean_t multiple,
+                    int nack) {
+  if (delivery_tag > channel->published) {
+    return;
+  }
+  if (nack) {
+    pool->nacked += multiple && delivery_tag > channel->confirmed
+                        ? delivery_tag - channel->confirmed
+                        : 1;
+  }
+  /* Confirms are counted from the highest one seen; one that overtakes
+   * another makes the channel look a little less busy than it is */
+  if (delivery_tag > channel->confirmed) {
+    channel->confirmed = delivery_tag;
+  }
+}
+
+/* Acknowledges the broker closing a channel and opens it again, the rest of
+ * the member's channels carry on. Whatever the channel hadn't confirmed may
+ * or may not have been routed, and a new channel numbers its confirms from
+ * the start. */
+static int reopen_channel(amqp_producer_pool_t *pool,
+                          amqp_producer_pool_member_t *member,
+                          amqp_channel_t id) {
+  amqp_producer_pool_channel_t *channel = &member->channels[id - 1];
+  amqp_channel_close_ok_t close_ok;
+  int res;
+
+  pool->nacked += channel->published - channel->confirmed;
+  channel->published = 0;
+  channel->confirmed = 0;
+  res = amqp_send_method(member->state, id, AMQP_CHANNEL_CLOSE_OK_METHOD,
+                         &close_ok);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  return open_channel(member, id);
+}
+
+/* Handles one frame read from a member. Returns AMQP_STATUS_OK, or an error
+ * if the member has to be replaced */
+static int handle_frame(amqp_producer_pool_t *pool,
+                        amqp_producer_pool_member_t *member,
+                        amqp_frame_t *frame) {
+  amqp_producer_pool_channel_t *channel;
+
+  if (AMQP_FRAME_METHOD != frame->frame_type) {
+    return AMQP_STATUS_OK;
+  }
+  switch (frame->payload.method.id) {
+    case AMQP_BASIC_ACK_METHOD: {
+      amqp_basic_ack_t *m = (amqp_basic_ack_t *)frame->payload.method.decoded;
+      if (frame->channel < 1 || frame->channel > pool->num_channels) {
+        return AMQP_STATUS_UNEXPECTED_STATE;
+      }
+      channel = &member->channels[frame->channel - 1];
+      confirm(pool, channel, m->delivery_tag, m->multiple, 0);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_BASIC_NACK_METHOD: {
+      amqp_basic_nack_t *m = (amqp_basic_nack_t *)frame->payload.method.decoded;
+      if (frame->channel < 1 || frame->channel > pool->num_channels) {
+        return AMQP_STATUS_UNEXPECTED_STATE;
+      }
+      channel = &member->channels[frame->channel - 1];
+      confirm(pool, channel, m->delivery_tag, m->multiple, 1);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_BASIC_RETURN_METHOD: {
+      /* Unroutable mandatory messages are dropped, their confirm follows */
+      amqp_message_t message;
+      amqp_rpc_reply_t ret =
+          amqp_read_message(member->state, frame->channel, &message, 0);
+      if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+        return AMQP_STATUS_UNEXPECTED_STATE;
+      }
+      amqp_destroy_message(&message);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_CHANNEL_CLOSE_METHOD:
+      if (frame->channel < 1 || frame->channel > pool->num_channels) {
+        return AMQP_STATUS_UNEXPECTED_STATE;
+      }
+      return reopen_channel(pool, member, frame->channel);
+
+    case AMQP_CONNECTION_CLOSE_METHOD:
+      return AMQP_STATUS_CONNECTION_CLOSED;
+
+    default:
+      return AMQP_STATUS_OK;
+  }
+}
+
+/* Reads the frames a member has received so far, waiting until deadline for
+ * the first one. Returns AMQP_STATUS_OK if frames were read or
+ * AMQP_STATUS_TIMEOUT if none came while the member is still up. */
+static int read_member(amqp_producer_pool_t *pool,
+                       amqp_producer_pool_member_t *member,
+                       amqp_time_t deadline) {
+  struct timeval zero = {0, 0};
+  struct timeval tv;
+  struct timeval *timeout = &zero;
+  int res;
+
+  res = amqp_time_tv_until(deadline, &tv, &timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  for (;;) {
+    amqp_frame_t frame;
+
+    res = amqp_simple_wait_frame_noblock(member->state, &frame, timeout);
+    if (AMQP_STATUS_TIMEOUT == res) {
+      if (timeout == &zero) {
+        res = AMQP_STATUS_OK;
+      }
+      break;
+    }
+    if (AMQP_STATUS_OK == res) {
+      res = handle_frame(pool, member, &frame);
+    }
+    if (AMQP_STATUS_OK != res) {
+      member_down(pool, member);
+      return res;
+    }
+    timeout = &zero;
+  }
+  amqp_maybe_release_buffers(member->state);
+  return res;
+}
+
+static void drain_members(amqp_producer_pool_t *pool) {
+  uint64_t now = amqp_get_monotonic_timestamp();
+  int i;
+
+  if (now < pool->next_drain_ns) {
+    return;
+  }
+  pool->next_drain_ns = now + AMQP_PRODUCER_POOL_DRAIN_INTERVAL_NS;
+  for (i = 0; i < pool->num_members; i++) {
+    if (NULL != pool->members[i].state) {
+      read_member(pool, &pool->members[i], amqp_time_immediate());
+    }
+  }
+}
+
+/* Picks the channel to publish on next, slots are numbered so consecutive
+ * ones are on different connections. Returns -1 if all members are down. */
+static int select_slot(amqp_producer_pool_t *pool) {
+  int num_slots = pool->num_members * pool->num_channels;
+  int best = -1;
+  uint64_t best_outstanding = 0;
+  int i;
+
+  for (i = 0; i < num_slots; i++) {
+    int slot = (int)((pool->cursor + (unsigned int)i) % (unsigned int)num_slots);
+    amqp_producer_pool_member_t *member =
+        &pool->members[slot % pool->num_members];
+    amqp_producer_pool_channel_t *channel;
+    uint64_t outstanding;
+
+    if (NULL == member->state) {
+      continue;
+    }
+    if (AMQP_PRODUCER_POOL_ROUND_ROBIN == pool->selection) {
+      best = slot;
+      break;
+    }
+    channel = &member->channels[slot / pool->num_members];
+    outstanding = channel->published - channel->confirmed;
+    if (-1 == best || outstanding < best_outstanding) {
+      best = slot;
+      best_outstanding = outstanding;
+      if (0 == outstanding) {
+        break;
+      }
+    }
+  }
+  if (-1 != best) {
+    pool->cursor = (unsigned int)(best + 1) % (unsigned int)num_slots;
+  }
+  return best;
+}
+
+amqp_producer_pool_t *amqp_producer_pool_new(
+    const struct amqp_connection_info *brokers, int num_brokers,
+    int num_connections, int channels_per_connection,
+    amqp_producer_pool_selection_enum selection,
+    const struct timeval *connect_timeout) {
+  amqp_producer_pool_t *pool;
+  int i;
+
+  if (NULL == brokers || num_brokers < 1 || num_connections < 1 ||
+      channels_per_connection < 1 ||
+      channels_per_connection > AMQP_DEFAULT_MAX_CHANNELS ||
+      (AMQP_PRODUCER_POOL_ROUND_ROBIN != selection &&
+       AMQP_PRODUCER_POOL_LEAST_OUTSTANDING != selection)) {
+    return NULL;
+  }
+  for (i = 0; i < num_brokers; i++) {
+    /* Only plain TCP is opened by the pool */
+    if (NULL == brokers[i].host || NULL == brokers[i].vhost ||
+        NULL == brokers[i].user || NULL == brokers[i].password ||
+        brokers[i].ssl) {
+      return NULL;
+    }
+  }
+
+  pool = calloc(1, sizeof(amqp_producer_pool_t));
+  if (NULL == pool) {
+    return NULL;
+  }
+  pool->num_brokers = num_brokers;
+  pool->num_members = num_connections;
+  pool->num_channels = channels_per_connection;
+  pool->selection = selection;
+  if (NULL != connect_timeout) {
+    pool->connect_timeout = *connect_timeout;
+    pool->connect_timeout_ptr = &pool->connect_timeout;
+  }
+
+  pool->brokers = calloc(num_brokers, sizeof(struct amqp_connection_info));
+  pool->members = calloc(num_connections, sizeof(amqp_producer_pool_member_t));
+  if (NULL == pool->brokers || NULL == pool->members) {
+    goto error_out;
+  }
+  for (i = 0; i < num_brokers; i++) {
+    struct amqp_connection_info *copy = &pool->brokers[i];
+    copy->user = strdup(brokers[i].user);
+    copy->password = strdup(brokers[i].password);
+    copy->host = strdup(brokers[i].host);
+    copy->vhost = strdup(brokers[i].vhost);
+    copy->port = brokers[i].port;
+    if (NULL == copy->user || NULL == copy->password || NULL == copy->host ||
+        NULL == copy->vhost) {
+      goto error_out;
+    }
+  }
+  for (i = 0; i < num_connections; i++) {
+    amqp_producer_pool_member_t *member = &pool->members[i];
+    member->channels = calloc(channels_per_connection,
+                              sizeof(amqp_producer_pool_channel_t));
+    if (NULL == member->channels) {
+      goto error_out;
+    }
+    /* Spread over the brokers from the start */
+    member->broker = i % num_brokers;
+    member->backoff_ms = AMQP_PRODUCER_POOL_MIN_BACKOFF_MS;
+  }
+
+  /* Members that can't connect now are retried when publishing */
+  revive_members(pool);
+  return pool;
+
+error_out:
+  amqp_producer_pool_destroy(pool);
+  return NULL;
+}
+
+int amqp_producer_pool_publish(amqp_producer_pool_t *pool,
+                               amqp_bytes_t exchange, amqp_bytes_t routing_key,
+                               amqp_boolean_t mandatory,
+                               amqp_boolean_t immediate,
+                               struct amqp_basic_properties_t_ const *properties,
+                               amqp_bytes_t body) {
+  int res = AMQP_STATUS_CONNECTION_CLOSED;
+  int attempts;
+
+  if (NULL == pool) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  revive_members(pool);
+  /* Also needed for round-robin, unread confirms would eventually stall the
+   * broker's writes and a closed channel would go unnoticed */
+  drain_members(pool);
+
+  /* A member that fails is replaced later, the message goes to the next */
+  for (attempts = 0; attempts < pool->num_members; attempts++) {
+    amqp_producer_pool_member_t *member;
+    amqp_producer_pool_channel_t *channel;
+    int slot = select_slot(pool);
+
+    if (-1 == slot) {
+      break;
+    }
+    member = &pool->members[slot % pool->num_members];
+    channel = &member->channels[slot / pool->num_members];
+    res = amqp_basic_publish(member->state,
+                             (amqp_channel_t)(slot / pool->num_members + 1),
+                             exchange, routing_key, mandatory, immediate,
+                             properties, body);
+    if (AMQP_STATUS_OK == res) {
+      channel->published++;
+      return res;
+    }
+    member_down(pool, member);
+  }
+  return res;
+}
+
+int amqp_producer_pool_wait_confirms(amqp_producer_pool_t *pool,
+                                     const struct timeval *timeout,
+                                     uint64_t *nacked) {
+  amqp_time_t deadline;
+  int res;
+  int i;
+
+  if (NULL == pool) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  /* Everything has to be confirmed, the members are waited for in turn */
+  for (i = 0; i < pool->num_members; i++) {
+    amqp_producer_pool_member_t *member = &pool->members[i];
+    for (;;) {
+      int j;
+      int pending = 0;
+
+      if (NULL == member->state) {
+        break;
+      }
+      for (j = 0; j < pool->num_channels; j++) {
+        if (member->channels[j].published != member->channels[j].confirmed) {
+          pending = 1;
+          break;
+        }
+      }
+      if (!pending) {
+        break;
+      }
+      res = read_member(pool, member, deadline);
+      if (AMQP_STATUS_TIMEOUT == res) {
+        return res;
+      }
+      res = AMQP_STATUS_OK;
+    }
+  }
+
+  if (NULL != nacked) {
+    *nacked = pool->nacked;
+  }
+  pool->nacked = 0;
+  return res;
+}
+
+int amqp_producer_pool_destroy(amqp_producer_pool_t *pool) {
+  int res = AMQP_STATUS_OK;
+  int i;
+
+  if (NULL == pool) {
+    return res;
+  }
+  if (NULL != pool->members) {
+    for (i = 0; i < pool->num_members; i++) {
+      amqp_producer_pool_member_t *member = &pool->members[i];
+      if (NULL != member->state) {
+        amqp_rpc_reply_t ret =
+            amqp_connection_close(member->state, AMQP_REPLY_SUCCESS);
+        if (AMQP_RESPONSE_NORMAL != ret.reply_type && AMQP_STATUS_OK == res) {
+          res = AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type
+                    ? ret.library_error
+                    : AMQP_STATUS_CONNECTION_CLOSED;
+        }
+        amqp_destroy_connection(member->state);
+      }
+      free(member->channels);
+    }
+    free(pool->members);
+  }
+  if (NULL != pool->brokers) {
+    for (i = 0; i < pool->num_brokers; i++) {
+      free(pool->brokers[i].user);
+      free(pool->brokers[i].password);
+      free(pool->brokers[i].host);
+      free(pool->brokers[i].vhost);
+    }
+    free(pool->brokers);
+  }
+  free(pool);
+  return res;
+}
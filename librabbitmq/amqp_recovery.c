@@ -0,0 +1,1099 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_socket.h"
+#include "amqp_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Wait after the first failed attempt to reconnect, doubled on every
+ * further one up to the maximum */
+#define AMQP_RECOVERY_MIN_BACKOFF_MS 100
+#define AMQP_RECOVERY_MAX_BACKOFF_MS 30000
+
+/* A recorded method, kept encoded so any arguments table is copied along */
+typedef struct amqp_recovery_entry_t_ {
+  struct amqp_recovery_entry_t_ *next;
+  amqp_channel_t channel;
+  amqp_method_number_t id;
+  amqp_bytes_t encoded;
+  /* What the entry is matched on: the exchange or queue declared; the
+   * destination, source and routing key of a binding; the queue and tag of
+   * a consumer. The queue of a server-named queue is the last name the
+   * broker gave it. */
+  amqp_bytes_t keys[3];
+  /* Recorded when sent, replayed once the broker has confirmed it */
+  int pending;
+} amqp_recovery_entry_t;
+
+typedef struct amqp_recovery_channel_t_ {
+  struct amqp_recovery_channel_t_ *next;
+  amqp_channel_t channel;
+  int confirm;
+  /* The last basic.qos, per consumer and channel wide */
+  amqp_recovery_entry_t *qos[2];
+  amqp_recovery_entry_t *consumers;
+  /* Delivery tags handed to the application continue from the highest one
+   * given out before the connection was replaced */
+  uint64_t last_tag;
+  uint64_t tag_offset;
+} amqp_recovery_channel_t;
+
+struct amqp_recovery_t_ {
+  struct amqp_connection_info info;
+  int channel_max;
+  int frame_max;
+  int heartbeat;
+  struct timeval timeout;
+  struct timeval *timeout_ptr;
+  /* Exchanges, queues and bindings in the order they were declared */
+  amqp_recovery_entry_t *topology;
+  amqp_recovery_channel_t *channels;
+  /* Set while methods are replayed, so they aren't recorded again */
+  int replaying;
+};
+
+static void free_entry(amqp_recovery_entry_t *entry) {
+  int i;
+  for (i = 0; i < 3; i++) {
+    amqp_bytes_free(entry->keys[i]);
+  }
+  amqp_bytes_free(entry->encoded);
+  free(entry);
+}
+
+static void free_entries(amqp_recovery_entry_t *entry) {
+  while (NULL != entry) {
+    amqp_recovery_entry_t *next = entry->next;
+    free_entry(entry);
+    entry = next;
+  }
+}
+
+static void free_channel(amqp_recovery_channel_t *channel) {
+  if (NULL != channel->qos[0]) {
+    free_entry(channel->qos[0]);
+  }
+  if (NULL != channel->qos[1]) {
+    free_entry(channel->qos[1]);
+  }
+  free_entries(channel->consumers);
+  free(channel);
+}
+
+static void forget_all(amqp_recovery_t *recovery) {
+  free_entries(recovery->topology);
+  recovery->topology = NULL;
+  while (NULL != recovery->channels) {
+    amqp_recovery_channel_t *channel = recovery->channels;
+    recovery->channels = channel->next;
+    free_channel(channel);
+  }
+}
+
+static int encode(amqp_recovery_entry_t *entry, void *decoded) {
+  size_t size;
+
+  /* The method may have been decoded from the blob being replaced. Argument
+   * tables may be large, the buffer grows until the method fits. */
+  for (size = 256; size <= AMQP_DEFAULT_FRAME_SIZE; size *= 2) {
+    amqp_bytes_t buffer = amqp_bytes_malloc(size);
+    int res;
+
+    if (NULL == buffer.bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    res = amqp_encode_method(entry->id, decoded, buffer);
+    if (res >= 0) {
+      buffer.len = (size_t)res;
+      amqp_bytes_free(entry->encoded);
+      entry->encoded = buffer;
+      return AMQP_STATUS_OK;
+    }
+    amqp_bytes_free(buffer);
+  }
+  return AMQP_STATUS_TABLE_TOO_BIG;
+}
+
+static int set_key(amqp_recovery_entry_t *entry, int i, amqp_bytes_t key) {
+  amqp_bytes_free(entry->keys[i]);
+  entry->keys[i] = amqp_empty_bytes;
+  if (0 == key.len) {
+    return AMQP_STATUS_OK;
+  }
+  entry->keys[i] = amqp_bytes_malloc_dup(key);
+  return NULL == entry->keys[i].bytes ? AMQP_STATUS_NO_MEMORY
+                                       : AMQP_STATUS_OK;
+}
+
+static amqp_recovery_entry_t *new_entry(amqp_channel_t channel,
+                                        amqp_method_number_t id, void *decoded,
+                                        amqp_bytes_t key0, amqp_bytes_t key1,
+                                        amqp_bytes_t key2) {
+  amqp_recovery_entry_t *entry = calloc(1, sizeof(amqp_recovery_entry_t));
+
+  if (NULL == entry) {
+    return NULL;
+  }
+  entry->channel = channel;
+  entry->id = id;
+  if (AMQP_STATUS_OK != encode(entry, decoded) ||
+      AMQP_STATUS_OK != set_key(entry, 0, key0) ||
+      AMQP_STATUS_OK != set_key(entry, 1, key1) ||
+      AMQP_STATUS_OK != set_key(entry, 2, key2)) {
+    free_entry(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+static void append(amqp_recovery_entry_t **list, amqp_recovery_entry_t *entry) {
+  while (NULL != *list) {
+    list = &(*list)->next;
+  }
+  *list = entry;
+}
+
+/* Removes the committed entries of type id whose key at index i is key, and
+ * with j >= 0 also the ones whose key at index j is key */
+static void remove_entries(amqp_recovery_entry_t **list,
+                           amqp_method_number_t id, int i, int j,
+                           amqp_bytes_t key) {
+  while (NULL != *list) {
+    amqp_recovery_entry_t *entry = *list;
+    if (id == entry->id && !entry->pending &&
+        (amqp_bytes_equal(entry->keys[i], key) ||
+         (j >= 0 && amqp_bytes_equal(entry->keys[j], key)))) {
+      *list = entry->next;
+      free_entry(entry);
+    } else {
+      list = &entry->next;
+    }
+  }
+}
+
+static void remove_binding(amqp_recovery_entry_t **list,
+                           amqp_method_number_t id, amqp_bytes_t key0,
+                           amqp_bytes_t key1, amqp_bytes_t key2) {
+  while (NULL != *list) {
+    amqp_recovery_entry_t *entry = *list;
+    if (id == entry->id && !entry->pending &&
+        amqp_bytes_equal(entry->keys[0], key0) &&
+        amqp_bytes_equal(entry->keys[1], key1) &&
+        amqp_bytes_equal(entry->keys[2], key2)) {
+      *list = entry->next;
+      free_entry(entry);
+    } else {
+      list = &entry->next;
+    }
+  }
+}
+
+static void remove_pending(amqp_recovery_entry_t **list,
+                           amqp_channel_t channel) {
+  while (NULL != *list) {
+    amqp_recovery_entry_t *entry = *list;
+    if (entry->pending && channel == entry->channel) {
+      *list = entry->next;
+      free_entry(entry);
+    } else {
+      list = &entry->next;
+    }
+  }
+}
+
+static amqp_recovery_entry_t *first_pending(amqp_recovery_entry_t *entry,
+                                            amqp_channel_t channel,
+                                            amqp_method_number_t id) {
+  for (; NULL != entry; entry = entry->next) {
+    if (entry->pending && channel == entry->channel && id == entry->id) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static amqp_recovery_channel_t *find_channel(amqp_recovery_t *recovery,
+                                             amqp_channel_t channel) {
+  amqp_recovery_channel_t *ch;
+  for (ch = recovery->channels; NULL != ch; ch = ch->next) {
+    if (ch->channel == channel) {
+      return ch;
+    }
+  }
+  return NULL;
+}
+
+/* Channels opened before recovery was set up are adopted on first use */
+static amqp_recovery_channel_t *get_channel(amqp_recovery_t *recovery,
+                                            amqp_channel_t channel) {
+  amqp_recovery_channel_t *ch = find_channel(recovery, channel);
+  if (NULL != ch) {
+    return ch;
+  }
+  ch = calloc(1, sizeof(amqp_recovery_channel_t));
+  if (NULL == ch) {
+    return NULL;
+  }
+  ch->channel = channel;
+  ch->next = recovery->channels;
+  recovery->channels = ch;
+  return ch;
+}
+
+static void remove_channel(amqp_recovery_t *recovery, amqp_channel_t channel) {
+  amqp_recovery_channel_t **prev;
+
+  remove_pending(&recovery->topology, channel);
+  for (prev = &recovery->channels; NULL != *prev; prev = &(*prev)->next) {
+    if ((*prev)->channel == channel) {
+      amqp_recovery_channel_t *ch = *prev;
+      *prev = ch->next;
+      free_channel(ch);
+      return;
+    }
+  }
+}
+
+static void remove_consumers_of(amqp_recovery_t *recovery,
+                                amqp_bytes_t queue) {
+  amqp_recovery_channel_t *ch;
+  for (ch = recovery->channels; NULL != ch; ch = ch->next) {
+    remove_entries(&ch->consumers, AMQP_BASIC_CONSUME_METHOD, 0, -1, queue);
+  }
+}
+
+/* Records a declaration or binding, replacing an earlier one of the same
+ * thing. It's pending until the broker replies unless nowait is set. */
+static int record_topology(amqp_recovery_t *recovery, amqp_channel_t channel,
+                           amqp_method_number_t id, void *decoded,
+                           amqp_bytes_t key0, amqp_bytes_t key1,
+                           amqp_bytes_t key2, amqp_boolean_t nowait) {
+  amqp_recovery_entry_t *entry =
+      new_entry(channel, id, decoded, key0, key1, key2);
+  if (NULL == entry) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  entry->pending = !nowait;
+  if (nowait) {
+    remove_binding(&recovery->topology, id, key0, key1, key2);
+  }
+  append(&recovery->topology, entry);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_recovery_before_method(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_method_number_t id, void *decoded) {
+  amqp_recovery_t *recovery = state->recovery;
+  amqp_recovery_channel_t *ch;
+
+  if (recovery->replaying) {
+    return AMQP_STATUS_OK;
+  }
+
+  switch (id) {
+    case AMQP_CHANNEL_OPEN_METHOD:
+      /* A channel number reused starts out without consumers or qos */
+      remove_channel(recovery, channel);
+      return NULL == get_channel(recovery, channel) ? AMQP_STATUS_NO_MEMORY
+                                                    : AMQP_STATUS_OK;
+
+    case AMQP_CHANNEL_CLOSE_METHOD:
+    case AMQP_CHANNEL_CLOSE_OK_METHOD:
+      remove_channel(recovery, channel);
+      return AMQP_STATUS_OK;
+
+    case AMQP_CONNECTION_CLOSE_METHOD:
+    case AMQP_CONNECTION_CLOSE_OK_METHOD:
+      forget_all(recovery);
+      return AMQP_STATUS_OK;
+
+    case AMQP_EXCHANGE_DECLARE_METHOD: {
+      amqp_exchange_declare_t *m = decoded;
+      if (m->passive) {
+        return AMQP_STATUS_OK;
+      }
+      return record_topology(recovery, channel, id, decoded, m->exchange,
+                             amqp_empty_bytes, amqp_empty_bytes, m->nowait);
+    }
+
+    case AMQP_EXCHANGE_DELETE_METHOD: {
+      amqp_exchange_delete_t *m = decoded;
+      remove_entries(&recovery->topology, AMQP_EXCHANGE_DECLARE_METHOD, 0, -1,
+                     m->exchange);
+      remove_entries(&recovery->topology, AMQP_EXCHANGE_BIND_METHOD, 0, 1,
+                     m->exchange);
+      remove_entries(&recovery->topology, AMQP_QUEUE_BIND_METHOD, 1, -1,
+                     m->exchange);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_EXCHANGE_BIND_METHOD: {
+      amqp_exchange_bind_t *m = decoded;
+      return record_topology(recovery, channel, id, decoded, m->destination,
+                             m->source, m->routing_key, m->nowait);
+    }
+
+    case AMQP_EXCHANGE_UNBIND_METHOD: {
+      amqp_exchange_unbind_t *m = decoded;
+      remove_binding(&recovery->topology, AMQP_EXCHANGE_BIND_METHOD,
+                     m->destination, m->source, m->routing_key);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_QUEUE_DECLARE_METHOD: {
+      amqp_queue_declare_t *m = decoded;
+      /* Without a reply the name of a server-named queue is never known */
+      if (m->passive || (0 == m->queue.len && m->nowait)) {
+        return AMQP_STATUS_OK;
+      }
+      return record_topology(recovery, channel, id, decoded, m->queue,
+                             amqp_empty_bytes, amqp_empty_bytes, m->nowait);
+    }
+
+    case AMQP_QUEUE_DELETE_METHOD: {
+      amqp_queue_delete_t *m = decoded;
+      remove_entries(&recovery->topology, AMQP_QUEUE_DECLARE_METHOD, 0, -1,
+                     m->queue);
+      remove_entries(&recovery->topology, AMQP_QUEUE_BIND_METHOD, 0, -1,
+                     m->queue);
+      remove_consumers_of(recovery, m->queue);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_QUEUE_BIND_METHOD: {
+      amqp_queue_bind_t *m = decoded;
+      return record_topology(recovery, channel, id, decoded, m->queue,
+                             m->exchange, m->routing_key, m->nowait);
+    }
+
+    case AMQP_QUEUE_UNBIND_METHOD: {
+      amqp_queue_unbind_t *m = decoded;
+      remove_binding(&recovery->topology, AMQP_QUEUE_BIND_METHOD, m->queue,
+                     m->exchange, m->routing_key);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_BASIC_QOS_METHOD: {
+      amqp_basic_qos_t *m = decoded;
+      amqp_recovery_entry_t *entry;
+      int global = m->global ? 1 : 0;
+
+      ch = get_channel(recovery, channel);
+      entry = new_entry(channel, id, decoded, amqp_empty_bytes,
+                        amqp_empty_bytes, amqp_empty_bytes);
+      if (NULL == ch || NULL == entry) {
+        if (NULL != entry) {
+          free_entry(entry);
+        }
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      if (NULL != ch->qos[global]) {
+        free_entry(ch->qos[global]);
+      }
+      ch->qos[global] = entry;
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_CONFIRM_SELECT_METHOD:
+      ch = get_channel(recovery, channel);
+      if (NULL == ch) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      ch->confirm = 1;
+      return AMQP_STATUS_OK;
+
+    case AMQP_BASIC_CONSUME_METHOD: {
+      amqp_basic_consume_t *m = decoded;
+      amqp_recovery_entry_t *entry;
+
+      if (0 == m->consumer_tag.len && m->nowait) {
+        return AMQP_STATUS_OK;
+      }
+      ch = get_channel(recovery, channel);
+      entry = new_entry(channel, id, decoded, m->queue, m->consumer_tag,
+                        amqp_empty_bytes);
+      if (NULL == ch || NULL == entry) {
+        if (NULL != entry) {
+          free_entry(entry);
+        }
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      entry->pending = !m->nowait;
+      append(&ch->consumers, entry);
+      return AMQP_STATUS_OK;
+    }
+
+    case AMQP_BASIC_CANCEL_METHOD: {
+      amqp_basic_cancel_t *m = decoded;
+      ch = find_channel(recovery, channel);
+      if (NULL != ch) {
+        remove_entries(&ch->consumers, AMQP_BASIC_CONSUME_METHOD, 1, -1,
+                       m->consumer_tag);
+      }
+      return AMQP_STATUS_OK;
+    }
+
+    default:
+      return AMQP_STATUS_OK;
+  }
+}
+
+/* Rewrites the field of a recorded method holding keys[i] */
+static int rewrite(amqp_recovery_entry_t *entry, int i, amqp_bytes_t to) {
+  amqp_pool_t pool;
+  void *decoded;
+  int res;
+
+  init_amqp_pool(&pool, 4096);
+  res = amqp_decode_method(entry->id, &pool, entry->encoded, &decoded);
+  if (AMQP_STATUS_OK == res) {
+    switch (entry->id) {
+      case AMQP_QUEUE_BIND_METHOD:
+        ((amqp_queue_bind_t *)decoded)->queue = to;
+        break;
+      case AMQP_BASIC_CONSUME_METHOD:
+        if (0 == i) {
+          ((amqp_basic_consume_t *)decoded)->queue = to;
+        } else {
+          ((amqp_basic_consume_t *)decoded)->consumer_tag = to;
+        }
+        break;
+      default:
+        break;
+    }
+    res = encode(entry, decoded);
+  }
+  empty_amqp_pool(&pool);
+  if (AMQP_STATUS_OK == res) {
+    res = set_key(entry, i, to);
+  }
+  return res;
+}
+
+/* A server-named queue got a name, bindings and consumers follow it */
+static int rename_queue(amqp_recovery_t *recovery, amqp_bytes_t from,
+                        amqp_bytes_t to) {
+  amqp_recovery_entry_t *entry;
+  amqp_recovery_channel_t *ch;
+  int res;
+
+  for (entry = recovery->topology; NULL != entry; entry = entry->next) {
+    if (AMQP_QUEUE_BIND_METHOD == entry->id &&
+        amqp_bytes_equal(entry->keys[0], from)) {
+      res = rewrite(entry, 0, to);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+  }
+  for (ch = recovery->channels; NULL != ch; ch = ch->next) {
+    for (entry = ch->consumers; NULL != entry; entry = entry->next) {
+      if (amqp_bytes_equal(entry->keys[0], from)) {
+        res = rewrite(entry, 0, to);
+        if (AMQP_STATUS_OK != res) {
+          return res;
+        }
+      }
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+void amqp_recovery_after_rpc(amqp_connection_state_t state,
+                             amqp_channel_t channel, amqp_method_t *reply) {
+  amqp_recovery_t *recovery = state->recovery;
+  amqp_recovery_entry_t *entry;
+  amqp_recovery_channel_t *ch;
+
+  if (recovery->replaying) {
+    return;
+  }
+
+  switch (reply->id) {
+    case AMQP_EXCHANGE_DECLARE_OK_METHOD:
+    case AMQP_EXCHANGE_BIND_OK_METHOD:
+    case AMQP_QUEUE_BIND_OK_METHOD: {
+      amqp_method_number_t id =
+          AMQP_EXCHANGE_DECLARE_OK_METHOD == reply->id
+              ? AMQP_EXCHANGE_DECLARE_METHOD
+              : AMQP_EXCHANGE_BIND_OK_METHOD == reply->id
+                    ? AMQP_EXCHANGE_BIND_METHOD
+                    : AMQP_QUEUE_BIND_METHOD;
+      entry = first_pending(recovery->topology, channel, id);
+      if (NULL != entry) {
+        /* Replaces an earlier declaration of the same thing. The new entry
+         * stays further down, after what it may depend on. */
+        remove_binding(&recovery->topology, id, entry->keys[0],
+                       entry->keys[1], entry->keys[2]);
+        entry->pending = 0;
+      }
+      break;
+    }
+
+    case AMQP_QUEUE_DECLARE_OK_METHOD: {
+      amqp_queue_declare_ok_t *m = reply->decoded;
+      entry =
+          first_pending(recovery->topology, channel, AMQP_QUEUE_DECLARE_METHOD);
+      if (NULL == entry) {
+        break;
+      }
+      if (0 == entry->keys[0].len) {
+        /* Server-named, the recorded declare keeps asking for a new name */
+        if (AMQP_STATUS_OK != set_key(entry, 0, m->queue)) {
+          break;
+        }
+      } else {
+        remove_entries(&recovery->topology, AMQP_QUEUE_DECLARE_METHOD, 0, -1,
+                       entry->keys[0]);
+      }
+      entry->pending = 0;
+      break;
+    }
+
+    case AMQP_BASIC_CONSUME_OK_METHOD: {
+      amqp_basic_consume_ok_t *m = reply->decoded;
+      ch = find_channel(recovery, channel);
+      if (NULL == ch) {
+        break;
+      }
+      entry = first_pending(ch->consumers, channel, AMQP_BASIC_CONSUME_METHOD);
+      if (NULL == entry) {
+        break;
+      }
+      /* A tag picked by the broker is asked for again on recovery, the
+       * application keeps using it */
+      if (0 == entry->keys[1].len &&
+          AMQP_STATUS_OK != rewrite(entry, 1, m->consumer_tag)) {
+        break;
+      }
+      entry->pending = 0;
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+static void number_delivery(amqp_connection_state_t state,
+                            amqp_channel_t channel, uint64_t *delivery_tag) {
+  amqp_recovery_channel_t *ch = find_channel(state->recovery, channel);
+
+  if (NULL == ch) {
+    return;
+  }
+  *delivery_tag += ch->tag_offset;
+  if (*delivery_tag > ch->last_tag) {
+    ch->last_tag = *delivery_tag;
+  }
+}
+
+void amqp_recovery_received(amqp_connection_state_t state,
+                            amqp_frame_t *frame) {
+  if (AMQP_FRAME_METHOD != frame->frame_type) {
+    return;
+  }
+
+  switch (frame->payload.method.id) {
+    case AMQP_BASIC_DELIVER_METHOD: {
+      amqp_basic_deliver_t *m = frame->payload.method.decoded;
+      number_delivery(state, frame->channel, &m->delivery_tag);
+      break;
+    }
+
+    case AMQP_BASIC_GET_OK_METHOD: {
+      amqp_basic_get_ok_t *m = frame->payload.method.decoded;
+      number_delivery(state, frame->channel, &m->delivery_tag);
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+int amqp_recovery_settle_tag(amqp_connection_state_t state,
+                             amqp_channel_t channel, uint64_t *delivery_tag) {
+  amqp_recovery_channel_t *ch = find_channel(state->recovery, channel);
+
+  /* 0 with multiple set settles everything outstanding */
+  if (NULL == ch || 0 == *delivery_tag) {
+    return 1;
+  }
+  if (*delivery_tag <= ch->tag_offset) {
+    return 0;
+  }
+  *delivery_tag -= ch->tag_offset;
+  return 1;
+}
+
+static void backoff_sleep(int ms) {
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  struct timespec ts;
+  ts.tv_sec = ms / AMQP_MS_PER_S;
+  ts.tv_nsec = (long)(ms % AMQP_MS_PER_S) * AMQP_NS_PER_MS;
+  nanosleep(&ts, NULL);
+#endif
+}
+
+static amqp_method_number_t reply_to(amqp_method_number_t id) {
+  switch (id) {
+    case AMQP_CHANNEL_OPEN_METHOD:
+      return AMQP_CHANNEL_OPEN_OK_METHOD;
+    case AMQP_CHANNEL_CLOSE_METHOD:
+      return AMQP_CHANNEL_CLOSE_OK_METHOD;
+    case AMQP_EXCHANGE_DECLARE_METHOD:
+      return AMQP_EXCHANGE_DECLARE_OK_METHOD;
+    case AMQP_EXCHANGE_BIND_METHOD:
+      return AMQP_EXCHANGE_BIND_OK_METHOD;
+    case AMQP_QUEUE_DECLARE_METHOD:
+      return AMQP_QUEUE_DECLARE_OK_METHOD;
+    case AMQP_QUEUE_BIND_METHOD:
+      return AMQP_QUEUE_BIND_OK_METHOD;
+    case AMQP_BASIC_QOS_METHOD:
+      return AMQP_BASIC_QOS_OK_METHOD;
+    case AMQP_CONFIRM_SELECT_METHOD:
+      return AMQP_CONFIRM_SELECT_OK_METHOD;
+    case AMQP_BASIC_CONSUME_METHOD:
+      return AMQP_BASIC_CONSUME_OK_METHOD;
+    default:
+      return 0;
+  }
+}
+
+static amqp_rpc_reply_t normal_reply(void) {
+  amqp_rpc_reply_t ret;
+  memset(&ret, 0, sizeof(ret));
+  ret.reply_type = AMQP_RESPONSE_NORMAL;
+  return ret;
+}
+
+/* Methods sent by replay() and not yet answered, answered in order as they
+ * are all on the same channel */
+typedef struct amqp_recovery_batch_t_ {
+  amqp_channel_t channel;
+  amqp_time_t deadline;
+  amqp_pool_t pool;
+  amqp_recovery_entry_t *sent[64];
+  amqp_method_number_t sent_ids[64];
+  int num_sent;
+} amqp_recovery_batch_t;
+
+/* Reads the replies to the methods of the batch. Deliveries to consumers
+ * already started are kept for the application. */
+static amqp_rpc_reply_t read_replies(amqp_connection_state_t state,
+                                     amqp_recovery_batch_t *batch) {
+  amqp_rpc_reply_t ret;
+  int i;
+
+  for (i = 0; i < batch->num_sent; i++) {
+    amqp_method_number_t expected = reply_to(batch->sent_ids[i]);
+    amqp_frame_t frame;
+    int res;
+
+    for (;;) {
+      res = amqp_wait_frame_unqueued(state, &frame, batch->deadline);
+      if (AMQP_STATUS_OK != res) {
+        return amqp_rpc_reply_error(res);
+      }
+      if (AMQP_FRAME_METHOD == frame.frame_type &&
+          ((frame.channel == batch->channel &&
+            (expected == frame.payload.method.id ||
+             AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id)) ||
+           (0 == frame.channel &&
+            AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id))) {
+        break;
+      }
+      res = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != res) {
+        return amqp_rpc_reply_error(res);
+      }
+    }
+
+    if (expected != frame.payload.method.id) {
+      memset(&ret, 0, sizeof(ret));
+      ret.reply_type = AMQP_RESPONSE_SERVER_EXCEPTION;
+      ret.reply = frame.payload.method;
+      return ret;
+    }
+    if (AMQP_QUEUE_DECLARE_OK_METHOD == expected && NULL != batch->sent[i]) {
+      amqp_queue_declare_ok_t *m = frame.payload.method.decoded;
+      amqp_recovery_entry_t *entry = batch->sent[i];
+      amqp_bytes_t old_name = entry->keys[0];
+
+      /* A server-named queue comes back under a new name */
+      if (!amqp_bytes_equal(old_name, m->queue)) {
+        res = rename_queue(state->recovery, old_name, m->queue);
+        if (AMQP_STATUS_OK == res) {
+          res = set_key(entry, 0, m->queue);
+        }
+        if (AMQP_STATUS_OK != res) {
+          return amqp_rpc_reply_error(res);
+        }
+      }
+    }
+  }
+  batch->num_sent = 0;
+  recycle_amqp_pool(&batch->pool);
+  return normal_reply();
+}
+
+/* Sends a method of the batch without waiting for the reply, the replies
+ * are read when the batch is full or flushed */
+static amqp_rpc_reply_t send_method(amqp_connection_state_t state,
+                                    amqp_recovery_batch_t *batch,
+                                    amqp_recovery_entry_t *entry,
+                                    amqp_method_number_t id, void *decoded) {
+  int res;
+
+  if ((int)(sizeof(batch->sent) / sizeof(batch->sent[0])) == batch->num_sent) {
+    amqp_rpc_reply_t ret = read_replies(state, batch);
+    if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+      return ret;
+    }
+  }
+
+  if (NULL != entry) {
+    res = amqp_decode_method(entry->id, &batch->pool, entry->encoded, &decoded);
+    if (AMQP_STATUS_OK != res) {
+      return amqp_rpc_reply_error(res);
+    }
+    id = entry->id;
+    /* Everything is confirmed so failures are noticed */
+    switch (id) {
+      case AMQP_EXCHANGE_DECLARE_METHOD:
+        ((amqp_exchange_declare_t *)decoded)->nowait = 0;
+        break;
+      case AMQP_EXCHANGE_BIND_METHOD:
+        ((amqp_exchange_bind_t *)decoded)->nowait = 0;
+        break;
+      case AMQP_QUEUE_DECLARE_METHOD:
+        ((amqp_queue_declare_t *)decoded)->nowait = 0;
+        break;
+      case AMQP_QUEUE_BIND_METHOD:
+        ((amqp_queue_bind_t *)decoded)->nowait = 0;
+        break;
+      case AMQP_BASIC_CONSUME_METHOD:
+        ((amqp_basic_consume_t *)decoded)->nowait = 0;
+        break;
+      default:
+        break;
+    }
+  }
+
+  res = amqp_send_method_inner(state, batch->channel, id, decoded,
+                               AMQP_SF_NONE, batch->deadline);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  batch->sent[batch->num_sent] = entry;
+  batch->sent_ids[batch->num_sent] = id;
+  batch->num_sent++;
+  return normal_reply();
+}
+
+static amqp_rpc_reply_t replay_topology(amqp_connection_state_t state,
+                                        amqp_recovery_batch_t *batch) {
+  amqp_recovery_t *recovery = state->recovery;
+  amqp_channel_open_t open;
+  amqp_channel_close_t close;
+  amqp_recovery_entry_t *entry;
+  amqp_rpc_reply_t ret;
+  int pass;
+
+  /* Declarations go on a channel of their own, the highest there is */
+  batch->channel = (amqp_channel_t)(0 == state->channel_max
+                                        ? 65535
+                                        : state->channel_max);
+  open.out_of_band = amqp_empty_bytes;
+  ret = send_method(state, batch, NULL, AMQP_CHANNEL_OPEN_METHOD, &open);
+
+  /* Exchanges and queues first, then the bindings between them */
+  for (pass = 0; pass < 2; pass++) {
+    for (entry = recovery->topology;
+         NULL != entry && AMQP_RESPONSE_NORMAL == ret.reply_type;
+         entry = entry->next) {
+      int binding = AMQP_EXCHANGE_BIND_METHOD == entry->id ||
+                    AMQP_QUEUE_BIND_METHOD == entry->id;
+      if (!entry->pending && binding == pass) {
+        ret = send_method(state, batch, entry, 0, NULL);
+      }
+    }
+    if (AMQP_RESPONSE_NORMAL == ret.reply_type) {
+      ret = read_replies(state, batch);
+    }
+  }
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+
+  close.reply_code = AMQP_REPLY_SUCCESS;
+  close.reply_text = amqp_empty_bytes;
+  close.class_id = 0;
+  close.method_id = 0;
+  ret = send_method(state, batch, NULL, AMQP_CHANNEL_CLOSE_METHOD, &close);
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+  return read_replies(state, batch);
+}
+
+static amqp_rpc_reply_t replay_channel(amqp_connection_state_t state,
+                                       amqp_recovery_batch_t *batch,
+                                       amqp_recovery_channel_t *ch) {
+  amqp_channel_open_t open;
+  amqp_confirm_select_t select;
+  amqp_recovery_entry_t *entry;
+  amqp_rpc_reply_t ret;
+
+  /* Deliveries from before the failure won't be settled, later ones are
+   * numbered on from them. They may arrive as soon as the first consumer is
+   * started, while the replies to the rest are still being read. */
+  ch->tag_offset = ch->last_tag;
+
+  batch->channel = ch->channel;
+  open.out_of_band = amqp_empty_bytes;
+  ret = send_method(state, batch, NULL, AMQP_CHANNEL_OPEN_METHOD, &open);
+  if (AMQP_RESPONSE_NORMAL == ret.reply_type && NULL != ch->qos[0]) {
+    ret = send_method(state, batch, ch->qos[0], 0, NULL);
+  }
+  if (AMQP_RESPONSE_NORMAL == ret.reply_type && NULL != ch->qos[1]) {
+    ret = send_method(state, batch, ch->qos[1], 0, NULL);
+  }
+  if (AMQP_RESPONSE_NORMAL == ret.reply_type && ch->confirm) {
+    select.nowait = 0;
+    ret = send_method(state, batch, NULL, AMQP_CONFIRM_SELECT_METHOD, &select);
+  }
+  for (entry = ch->consumers;
+       NULL != entry && AMQP_RESPONSE_NORMAL == ret.reply_type;
+       entry = entry->next) {
+    if (!entry->pending) {
+      ret = send_method(state, batch, entry, 0, NULL);
+    }
+  }
+  if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+    return ret;
+  }
+  return read_replies(state, batch);
+}
+
+static amqp_rpc_reply_t replay(amqp_connection_state_t state,
+                               amqp_time_t deadline) {
+  amqp_recovery_t *recovery = state->recovery;
+  amqp_recovery_batch_t batch;
+  amqp_recovery_channel_t *ch;
+  amqp_rpc_reply_t ret;
+
+  batch.deadline = deadline;
+  batch.num_sent = 0;
+  init_amqp_pool(&batch.pool, 4096);
+
+  ret = replay_topology(state, &batch);
+  for (ch = recovery->channels;
+       NULL != ch && AMQP_RESPONSE_NORMAL == ret.reply_type; ch = ch->next) {
+    ret = replay_channel(state, &batch, ch);
+  }
+  empty_amqp_pool(&batch.pool);
+  return ret;
+}
+
+static amqp_rpc_reply_t reconnect(amqp_connection_state_t state,
+                                  amqp_time_t deadline) {
+  amqp_recovery_t *recovery = state->recovery;
+  struct timeval tv;
+  struct timeval *tvp;
+  amqp_rpc_reply_t ret;
+  int res;
+
+  amqp_socket_close(state->socket, AMQP_SC_FORCE);
+  /* Acks recorded for coalescing refer to the old deliveries */
+  if (NULL != state->ack_windows) {
+    amqp_ack_windows_before_method(state, 0, AMQP_CONNECTION_CLOSE_OK_METHOD);
+  }
+  res = amqp_reset_connection(state);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+
+  res = amqp_time_tv_until(deadline, &tv, &tvp);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  res = amqp_socket_open_noblock(state->socket, recovery->info.host,
+                                 recovery->info.port, tvp);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+  res = amqp_event_loop_rearm(state);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+
+  recovery->replaying = 1;
+  ret = amqp_login(state, recovery->info.vhost, recovery->channel_max,
+                   recovery->frame_max, recovery->heartbeat,
+                   AMQP_SASL_METHOD_PLAIN, recovery->info.user,
+                   recovery->info.password);
+  if (AMQP_RESPONSE_NORMAL == ret.reply_type) {
+    ret = replay(state, deadline);
+  }
+  recovery->replaying = 0;
+  return ret;
+}
+
+amqp_rpc_reply_t amqp_recover_connection(amqp_connection_state_t state) {
+  amqp_time_t deadline;
+  amqp_rpc_reply_t ret;
+  int backoff_ms = AMQP_RECOVERY_MIN_BACKOFF_MS;
+  int res;
+
+  if (NULL == state || NULL == state->recovery || NULL == state->socket) {
+    return amqp_rpc_reply_error(AMQP_STATUS_INVALID_PARAMETER);
+  }
+  res = amqp_time_from_now(&deadline, state->recovery->timeout_ptr);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+
+  for (;;) {
+    int ms;
+
+    ret = reconnect(state, deadline);
+    if (AMQP_RESPONSE_NORMAL == ret.reply_type) {
+      return ret;
+    }
+    /* A declaration the broker now refuses won't be accepted next time */
+    if (AMQP_RESPONSE_SERVER_EXCEPTION == ret.reply_type &&
+        AMQP_CHANNEL_CLOSE_METHOD == ret.reply.id) {
+      return ret;
+    }
+    if (AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type &&
+        AMQP_STATUS_NO_MEMORY == ret.library_error) {
+      return ret;
+    }
+
+    ms = amqp_time_ms_until(deadline);
+    if (AMQP_STATUS_TIMEOUT == ms || 0 == ms) {
+      return ret;
+    }
+    backoff_sleep(-1 == ms || backoff_ms < ms ? backoff_ms : ms);
+    backoff_ms *= 2;
+    if (backoff_ms > AMQP_RECOVERY_MAX_BACKOFF_MS) {
+      backoff_ms = AMQP_RECOVERY_MAX_BACKOFF_MS;
+    }
+  }
+}
+
+static void free_info(struct amqp_connection_info *info) {
+  free(info->user);
+  free(info->password);
+  free(info->host);
+  free(info->vhost);
+  memset(info, 0, sizeof(*info));
+}
+
+int amqp_set_recovery(amqp_connection_state_t state,
+                      const struct amqp_connection_info *info,
+                      const struct timeval *timeout) {
+  amqp_recovery_t *recovery;
+
+  if (NULL == state) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  if (NULL == info) {
+    amqp_destroy_recovery(state);
+    return AMQP_STATUS_OK;
+  }
+  if (NULL == info->host || NULL == info->vhost || NULL == info->user ||
+      NULL == info->password || NULL == state->socket) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  recovery = state->recovery;
+  if (NULL == recovery) {
+    recovery = calloc(1, sizeof(amqp_recovery_t));
+    if (NULL == recovery) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  } else {
+    free_info(&recovery->info);
+  }
+  recovery->info.user = strdup(info->user);
+  recovery->info.password = strdup(info->password);
+  recovery->info.host = strdup(info->host);
+  recovery->info.vhost = strdup(info->vhost);
+  recovery->info.port = info->port;
+  if (NULL == recovery->info.user || NULL == recovery->info.password ||
+      NULL == recovery->info.host || NULL == recovery->info.vhost) {
+    free_info(&recovery->info);
+    if (NULL == state->recovery) {
+      free(recovery);
+    }
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  /* What was negotiated is asked for again */
+  recovery->channel_max = state->channel_max;
+  recovery->frame_max = state->frame_max;
+  recovery->heartbeat = state->heartbeat;
+  recovery->timeout_ptr = NULL;
+  if (NULL != timeout) {
+    recovery->timeout = *timeout;
+    recovery->timeout_ptr = &recovery->timeout;
+  }
+  state->recovery = recovery;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_destroy_recovery(amqp_connection_state_t state) {
+  amqp_recovery_t *recovery = state->recovery;
+
+  if (NULL == recovery) {
+    return;
+  }
+  forget_all(recovery);
+  free_info(&recovery->info);
+  free(recovery);
+  state->recovery = NULL;
+}
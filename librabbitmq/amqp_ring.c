@@ -0,0 +1,148 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "amqp_ring.h"
+#include "amqp.h"
+
+#include <stdlib.h>
+#ifdef AMQP_HAVE_THREADS
+#include <time.h>
+#endif
+
+#ifdef AMQP_HAVE_ATOMICS
+int amqp_spsc_ring_init(amqp_spsc_ring_t *ring, size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  ring->slots = calloc(size, sizeof(void *));
+  if (NULL == ring->slots) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  ring->mask = size - 1;
+  ring->head = 0;
+  ring->tail = 0;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_spsc_ring_destroy(amqp_spsc_ring_t *ring) {
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+int amqp_spsc_ring_push(amqp_spsc_ring_t *ring, void *item) {
+  /* The tail is only written by this thread, the head read with acquire so
+   * the consumer is done with the slot before it's reused */
+  size_t tail = ring->tail;
+  if (tail - amqp_atomic_load(&ring->head) > ring->mask) {
+    return 0;
+  }
+  ring->slots[tail & ring->mask] = item;
+  amqp_atomic_store(&ring->tail, tail + 1);
+  return 1;
+}
+
+void *amqp_spsc_ring_pop(amqp_spsc_ring_t *ring) {
+  size_t head = ring->head;
+  void *item;
+  if (head == amqp_atomic_load(&ring->tail)) {
+    return NULL;
+  }
+  item = ring->slots[head & ring->mask];
+  amqp_atomic_store(&ring->head, head + 1);
+  return item;
+}
+
+int amqp_spsc_ring_is_empty(amqp_spsc_ring_t *ring) {
+  return amqp_atomic_load(&ring->head) == amqp_atomic_load(&ring->tail);
+}
+
+int amqp_spsc_ring_is_full(amqp_spsc_ring_t *ring) {
+  return ring->tail - amqp_atomic_load(&ring->head) > ring->mask;
+}
+#endif
+
+#ifdef AMQP_HAVE_THREADS
+int amqp_waiter_init(amqp_waiter_t *waiter) {
+  if (0 != pthread_mutex_init(&waiter->mutex, NULL)) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  if (0 != pthread_cond_init(&waiter->cond, NULL)) {
+    pthread_mutex_destroy(&waiter->mutex);
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  waiter->waiting = 0;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_waiter_destroy(amqp_waiter_t *waiter) {
+  pthread_cond_destroy(&waiter->cond);
+  pthread_mutex_destroy(&waiter->mutex);
+}
+
+int amqp_waiter_wait(amqp_waiter_t *waiter, int (*ready)(void *), void *arg,
+                     amqp_time_t deadline) {
+  int res = AMQP_STATUS_OK;
+
+  pthread_mutex_lock(&waiter->mutex);
+  amqp_atomic_store(&waiter->waiting, 1);
+  /* Pairs with the fence in amqp_waiter_wake(): either the waker sees
+   * waiting set or ready() sees what it published */
+  amqp_atomic_fence();
+  while (!ready(arg)) {
+    int ms = amqp_time_ms_until(deadline);
+    struct timespec until;
+
+    if (-1 == ms) {
+      pthread_cond_wait(&waiter->cond, &waiter->mutex);
+      continue;
+    }
+    if (ms < 0 && AMQP_STATUS_TIMEOUT != ms) {
+      res = ms;
+      break;
+    }
+    if (AMQP_STATUS_TIMEOUT == ms || 0 == ms) {
+      res = AMQP_STATUS_TIMEOUT;
+      break;
+    }
+    /* Condition variables wait on the realtime clock, the remaining time is
+     * recomputed from the monotonic deadline on every wakeup */
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / AMQP_MS_PER_S;
+    until.tv_nsec += (ms % AMQP_MS_PER_S) * AMQP_NS_PER_MS;
+    if (until.tv_nsec >= AMQP_NS_PER_S) {
+      until.tv_sec++;
+      until.tv_nsec -= AMQP_NS_PER_S;
+    }
+    pthread_cond_timedwait(&waiter->cond, &waiter->mutex, &until);
+  }
+  amqp_atomic_store(&waiter->waiting, 0);
+  pthread_mutex_unlock(&waiter->mutex);
+  return res;
+}
+
+void amqp_waiter_wake(amqp_waiter_t *waiter) {
+  amqp_atomic_fence();
+  if (amqp_atomic_load(&waiter->waiting)) {
+    pthread_mutex_lock(&waiter->mutex);
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->mutex);
+  }
+}
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AMQP_RING_H
+#define AMQP_RING_H
+
+#include "amqp_time.h"
+
+#include <stddef.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AMQP_HAVE_ATOMICS
+#define amqp_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define amqp_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define amqp_atomic_exchange(p, v) \
+  __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define amqp_atomic_add_fetch(p, v) \
+  __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define amqp_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/* Tells the core a spin loop is waiting, easing the pipeline and leaving
+ * the other hyperthread more of it */
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define amqp_cpu_relax() __builtin_ia32_pause()
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+#define amqp_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define amqp_cpu_relax() _mm_pause()
+#else
+#define amqp_cpu_relax() ((void)0)
+#endif
+
+#if !defined(_WIN32) && defined(AMQP_HAVE_ATOMICS)
+#define AMQP_HAVE_THREADS
+#include <pthread.h>
+#endif
+
+/* Spacing that keeps the producer and consumer indices on separate cache
+ * lines */
+#define AMQP_CACHE_LINE_SIZE 64
+
+#ifdef AMQP_HAVE_ATOMICS
+/* Bounded single-producer single-consumer queue of pointers. Exactly one
+ * thread may push and exactly one thread may pop; neither side ever takes a
+ * lock. */
+typedef struct amqp_spsc_ring_t_ {
+  void **slots;
+  size_t mask;
+  char pad0[AMQP_CACHE_LINE_SIZE];
+  size_t head; /* next slot to pop, written by the consumer */
+  char pad1[AMQP_CACHE_LINE_SIZE];
+  size_t tail; /* next slot to push, written by the producer */
+  char pad2[AMQP_CACHE_LINE_SIZE];
+} amqp_spsc_ring_t;
+
+/* Allocates room for at least capacity items, rounded up to a power of two.
+ *
+ * Returns AMQP_STATUS_OK or AMQP_STATUS_NO_MEMORY.
+ */
+int amqp_spsc_ring_init(amqp_spsc_ring_t *ring, size_t capacity);
+
+void amqp_spsc_ring_destroy(amqp_spsc_ring_t *ring);
+
+/* Producer side. Returns 1 if item was queued, 0 if the ring is full */
+int amqp_spsc_ring_push(amqp_spsc_ring_t *ring, void *item);
+
+/* Consumer side. Returns NULL if the ring is empty */
+void *amqp_spsc_ring_pop(amqp_spsc_ring_t *ring);
+
+/* Either side. The answer may be stale by the time it's used */
+int amqp_spsc_ring_is_empty(amqp_spsc_ring_t *ring);
+
+/* Producer side. Stays false once it is, until the producer pushes */
+int amqp_spsc_ring_is_full(amqp_spsc_ring_t *ring);
+#endif /* AMQP_HAVE_ATOMICS */
+
+#ifdef AMQP_HAVE_THREADS
+/* Puts the consumer of a lock-free ring to sleep until the ring changes. The
+ * producer only takes the mutex when the consumer has announced that it is
+ * about to sleep, so an uncontended wake is a fence and a load. */
+typedef struct amqp_waiter_t_ {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int waiting;
+} amqp_waiter_t;
+
+/* Returns AMQP_STATUS_OK or AMQP_STATUS_NO_MEMORY */
+int amqp_waiter_init(amqp_waiter_t *waiter);
+
+void amqp_waiter_destroy(amqp_waiter_t *waiter);
+
+/* Sleeps until ready(arg) returns non-zero or deadline passes. ready() must
+ * only depend on state that is published before amqp_waiter_wake() is
+ * called.
+ *
+ * Returns AMQP_STATUS_OK once ready, AMQP_STATUS_TIMEOUT or
+ * AMQP_STATUS_TIMER_FAILURE.
+ */
+int amqp_waiter_wait(amqp_waiter_t *waiter, int (*ready)(void *), void *arg,
+                     amqp_time_t deadline);
+
+/* Wakes the waiter if it is sleeping. Called after publishing the change */
+void amqp_waiter_wake(amqp_waiter_t *waiter);
+#endif /* AMQP_HAVE_THREADS */
+
+#endif /* AMQP_RING_H */
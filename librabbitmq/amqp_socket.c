@@ -42,13 +42,16 @@
 #endif
 
 #include "amqp_private.h"
+#include "amqp_ring.h"
 #include "amqp_socket.h"
 #include "amqp_table.h"
 #include "amqp_time.h"
+#include "threads.h"
 
 #include <assert.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -74,6 +77,7 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #ifdef HAVE_POLL
 #include <poll.h>
 #endif
@@ -135,14 +139,25 @@ ssize_t amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len,
 int amqp_socket_open(amqp_socket_t *self, const char *host, int port) {
   assert(self);
   assert(self->klass->open);
-  return self->klass->open(self, host, port, NULL);
+  return self->klass->open(self, &host, &port, 1, NULL, NULL);
 }
 
 int amqp_socket_open_noblock(amqp_socket_t *self, const char *host, int port,
                              const struct timeval *timeout) {
   assert(self);
   assert(self->klass->open);
-  return self->klass->open(self, host, port, timeout);
+  return self->klass->open(self, &host, &port, 1, timeout, NULL);
+}
+
+int amqp_socket_open_any(amqp_socket_t *self, const char *const *hosts,
+                         const int *ports, int count,
+                         const struct timeval *timeout, int *connected) {
+  assert(self);
+  assert(self->klass->open);
+  if (NULL == hosts || NULL == ports || count <= 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  return self->klass->open(self, hosts, ports, count, timeout, connected);
 }
 
 int amqp_socket_close(amqp_socket_t *self, amqp_socket_close_enum force) {
@@ -164,6 +179,95 @@ int amqp_socket_get_sockfd(amqp_socket_t *self) {
   return self->klass->get_sockfd(self);
 }
 
+/* Size of amqp_socket_options_t as first released, the smallest accepted */
+#define AMQP_SOCKET_OPTIONS_MIN_SIZE \
+  (offsetof(amqp_socket_options_t, incoming_cpu) + sizeof(int))
+
+void amqp_socket_options_init(amqp_socket_options_t *options) {
+  options->struct_size = sizeof(amqp_socket_options_t);
+  options->send_buffer = -1;
+  options->recv_buffer = -1;
+  options->busy_poll_us = -1;
+  options->quick_ack = -1;
+  options->notsent_lowat = -1;
+  options->user_timeout_ms = -1;
+  options->priority = -1;
+  options->tos = -1;
+  options->incoming_cpu = -1;
+}
+
+int amqp_socket_set_options(amqp_socket_t *self,
+                            const amqp_socket_options_t *options) {
+  amqp_socket_options_t *target;
+  amqp_socket_options_t copy;
+
+  assert(self);
+  target = self->klass->get_options ? self->klass->get_options(self) : NULL;
+  if (NULL == target) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+
+  /* Fields the caller was built without keep their defaults */
+  amqp_socket_options_init(&copy);
+  if (NULL != options) {
+    if (AMQP_SOCKET_OPTIONS_MIN_SIZE > options->struct_size) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    if (sizeof(amqp_socket_options_t) < options->struct_size) {
+      return AMQP_STATUS_UNSUPPORTED;
+    }
+    memcpy(&copy, options, options->struct_size);
+    copy.struct_size = sizeof(amqp_socket_options_t);
+  }
+  options = &copy;
+
+  if (-1 > options->send_buffer || -1 > options->recv_buffer ||
+      -1 > options->busy_poll_us || -1 > options->quick_ack ||
+      1 < options->quick_ack || -1 > options->notsent_lowat ||
+      -1 > options->user_timeout_ms || -1 > options->priority ||
+      -1 > options->tos || -1 > options->incoming_cpu) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+#ifndef SO_BUSY_POLL
+  if (-1 != options->busy_poll_us) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+#endif
+#ifndef TCP_QUICKACK
+  if (-1 != options->quick_ack) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+  if (-1 != options->notsent_lowat) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+#endif
+#ifndef TCP_USER_TIMEOUT
+  if (-1 != options->user_timeout_ms) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+#endif
+#ifndef SO_PRIORITY
+  if (-1 != options->priority) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+#endif
+#ifndef IP_TOS
+  if (-1 != options->tos) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+#endif
+#ifndef SO_INCOMING_CPU
+  if (-1 != options->incoming_cpu) {
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+#endif
+
+  *target = *options;
+  return AMQP_STATUS_OK;
+}
+
 int amqp_poll(int fd, int event, amqp_time_t deadline) {
 #ifdef HAVE_POLL
   struct pollfd pfd;
@@ -262,6 +366,14 @@ start_select:
 #endif
 }
 
+int amqp_socket_wait(amqp_socket_t *self, int event, amqp_time_t deadline) {
+  assert(self);
+  if (self->klass->wait) {
+    return self->klass->wait(self, event, deadline);
+  }
+  return amqp_poll(amqp_socket_get_sockfd(self), event, deadline);
+}
+
 static ssize_t do_poll(amqp_connection_state_t state, ssize_t res,
                        amqp_time_t deadline) {
   int fd = amqp_get_sockfd(state);
@@ -270,10 +382,10 @@ static ssize_t do_poll(amqp_connection_state_t state, ssize_t res,
   }
   switch (res) {
     case AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD:
-      res = amqp_poll(fd, AMQP_SF_POLLIN, deadline);
+      res = amqp_socket_wait(state->socket, AMQP_SF_POLLIN, deadline);
       break;
     case AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE:
-      res = amqp_poll(fd, AMQP_SF_POLLOUT, deadline);
+      res = amqp_socket_wait(state->socket, AMQP_SF_POLLOUT, deadline);
       break;
   }
   return res;
@@ -321,8 +433,147 @@ int amqp_open_socket_noblock(char const *hostname, int portnumber,
   return amqp_open_socket_inner(hostname, portnumber, deadline);
 }
 
+/* An address to connect to, as resolved or as cached */
+typedef struct amqp_address_t_ {
+  int family;
+  int socktype;
+  int protocol;
+  size_t addrlen;
+  struct sockaddr_storage addr;
+} amqp_address_t;
+
+/* Time a connection attempt has to itself before the next address is tried
+ * alongside it, RFC 8305 section 5 */
+#define AMQP_CONNECT_ATTEMPT_DELAY_MS 250
+/* Connection attempts in flight at once */
+#define AMQP_MAX_CONNECT_ATTEMPTS 16
+
+static int set_int_option(int sockfd, int level, int name, int value) {
+  if (0 != setsockopt(sockfd, level, name, (const char *)&value,
+                      sizeof(value))) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Applies what amqp_socket_set_options() asked for, which the platform was
+ * checked to support there. Done before connecting, so the receive buffer
+ * size is reflected in the window scale. */
+static int apply_options(int sockfd, int family,
+                         const amqp_socket_options_t *options) {
+  int res = AMQP_STATUS_OK;
+
+  if (NULL == options) {
+    return AMQP_STATUS_OK;
+  }
+  if (-1 != options->send_buffer) {
+    res = set_int_option(sockfd, SOL_SOCKET, SO_SNDBUF, options->send_buffer);
+  }
+  if (AMQP_STATUS_OK == res && -1 != options->recv_buffer) {
+    res = set_int_option(sockfd, SOL_SOCKET, SO_RCVBUF, options->recv_buffer);
+  }
+#ifdef SO_BUSY_POLL
+  if (AMQP_STATUS_OK == res && -1 != options->busy_poll_us) {
+    res = set_int_option(sockfd, SOL_SOCKET, SO_BUSY_POLL,
+                         options->busy_poll_us);
+  }
+#endif
+#ifdef TCP_QUICKACK
+  if (AMQP_STATUS_OK == res && -1 != options->quick_ack) {
+    res = set_int_option(sockfd, IPPROTO_TCP, TCP_QUICKACK, options->quick_ack);
+  }
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+  if (AMQP_STATUS_OK == res && -1 != options->notsent_lowat) {
+    res = set_int_option(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                         options->notsent_lowat);
+  }
+#endif
+#ifdef TCP_USER_TIMEOUT
+  if (AMQP_STATUS_OK == res && -1 != options->user_timeout_ms) {
+    res = set_int_option(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                         options->user_timeout_ms);
+  }
+#endif
+#ifdef SO_PRIORITY
+  if (AMQP_STATUS_OK == res && -1 != options->priority) {
+    res = set_int_option(sockfd, SOL_SOCKET, SO_PRIORITY, options->priority);
+  }
+#endif
+#ifdef IP_TOS
+  if (AMQP_STATUS_OK == res && -1 != options->tos) {
+    if (AF_INET == family) {
+      res = set_int_option(sockfd, IPPROTO_IP, IP_TOS, options->tos);
+    }
+#ifdef IPV6_TCLASS
+    if (AF_INET6 == family) {
+      res = set_int_option(sockfd, IPPROTO_IPV6, IPV6_TCLASS, options->tos);
+    }
+#endif
+  }
+#endif
+#ifdef SO_INCOMING_CPU
+  if (AMQP_STATUS_OK == res && -1 != options->incoming_cpu) {
+    res = set_int_option(sockfd, SOL_SOCKET, SO_INCOMING_CPU,
+                         options->incoming_cpu);
+  }
+#endif
+  return res;
+}
+
+/* Frames needing fewer bytes than this arrive in a few segments anyway,
+ * they aren't worth the system calls of setting SO_RCVLOWAT */
+#define AMQP_RCVLOWAT_MIN 16384
+
+void amqp_set_rcvlowat(int sockfd, int *current, size_t bytes) {
+#ifdef SO_RCVLOWAT
+  int value = 1;
+
+  if (-1 == *current) {
+    return;
+  }
+  if (AMQP_RCVLOWAT_MIN <= bytes) {
+    int rcvbuf;
+    socklen_t len = sizeof(rcvbuf);
+
+    /* No more than half the receive buffer, the rest of the frame may not
+     * fit in the window */
+    if (0 != getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char *)&rcvbuf,
+                        &len)) {
+      *current = -1;
+      return;
+    }
+    value = rcvbuf / 2;
+    if ((size_t)value > bytes) {
+      value = (int)bytes;
+    }
+    if (AMQP_RCVLOWAT_MIN > value) {
+      value = 1;
+    }
+  }
+  if (value == (0 == *current ? 1 : *current)) {
+    return;
+  }
+  if (AMQP_STATUS_OK != set_int_option(sockfd, SOL_SOCKET, SO_RCVLOWAT,
+                                       value)) {
+    *current = -1;
+    return;
+  }
+  *current = value;
+#else
+  (void)sockfd;
+  (void)bytes;
+  *current = -1;
+#endif
+}
+
 #ifdef _WIN32
-static int connect_socket(struct addrinfo *addr, amqp_time_t deadline) {
+/* Starts connecting a socket to addr. Returns AMQP_STATUS_OK once connected,
+ * AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE while connecting, with the socket in
+ * *sockfd_out either way. */
+static int start_connect(const amqp_address_t *addr,
+                         const amqp_socket_options_t *options,
+                         int *sockfd_out) {
   int one = 1;
   SOCKET sockfd;
   int last_error;
@@ -332,7 +583,7 @@ static int connect_socket(struct addrinfo *addr, amqp_time_t deadline) {
    * http://stackoverflow.com/questions/1953639/is-it-safe-to-cast-socket-to-int-under-win64
    */
 
-  sockfd = (int)socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  sockfd = (int)socket(addr->family, addr->socktype, addr->protocol);
   if (INVALID_SOCKET == sockfd) {
     return AMQP_STATUS_SOCKET_ERROR;
   }
@@ -357,73 +608,77 @@ static int connect_socket(struct addrinfo *addr, amqp_time_t deadline) {
     goto err;
   }
 
-  if (SOCKET_ERROR != connect(sockfd, addr->ai_addr, (int)addr->ai_addrlen)) {
-    return (int)sockfd;
-  }
-
-  if (WSAEWOULDBLOCK != WSAGetLastError()) {
-    last_error = AMQP_STATUS_SOCKET_ERROR;
-    goto err;
-  }
-
-  last_error =
-      amqp_poll((int)sockfd, AMQP_SF_POLLOUT | AMQP_SF_POLLERR, deadline);
+  last_error = apply_options((int)sockfd, addr->family, options);
   if (AMQP_STATUS_OK != last_error) {
     goto err;
   }
 
-  {
-    int result;
-    int result_len = sizeof(result);
-
-    if (SOCKET_ERROR == getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
-                                   (char *)&result, &result_len) ||
-        result != 0) {
-      last_error = AMQP_STATUS_SOCKET_ERROR;
-      goto err;
-    }
+  *sockfd_out = (int)sockfd;
+  if (SOCKET_ERROR != connect(sockfd, (const struct sockaddr *)&addr->addr,
+                              (int)addr->addrlen)) {
+    return AMQP_STATUS_OK;
   }
 
-  return (int)sockfd;
+  if (WSAEWOULDBLOCK != WSAGetLastError()) {
+    last_error = AMQP_STATUS_SOCKET_ERROR;
+    goto err;
+  }
+  return AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE;
 
 err:
   closesocket(sockfd);
   return last_error;
 }
 #else
-static int connect_socket(struct addrinfo *addr, amqp_time_t deadline) {
-  int one = 1;
-  int sockfd;
+/* Sets the options every socket gets whatever its family */
+static int prepare_socket(int sockfd) {
   int flags;
-  int last_error;
-
-  sockfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-  if (-1 == sockfd) {
-    return AMQP_STATUS_SOCKET_ERROR;
-  }
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+#endif
 
   /* Enable CLOEXEC on socket */
   flags = fcntl(sockfd, F_GETFD);
   if (flags == -1 || fcntl(sockfd, F_SETFD, (long)(flags | FD_CLOEXEC)) == -1) {
-    last_error = AMQP_STATUS_SOCKET_ERROR;
-    goto err;
+    return AMQP_STATUS_SOCKET_ERROR;
   }
 
   /* Set the socket as non-blocking */
   flags = fcntl(sockfd, F_GETFL);
   if (flags == -1 || fcntl(sockfd, F_SETFL, (long)(flags | O_NONBLOCK)) == -1) {
-    last_error = AMQP_STATUS_SOCKET_ERROR;
-    goto err;
+    return AMQP_STATUS_SOCKET_ERROR;
   }
 
 #ifdef SO_NOSIGPIPE
   /* Turn off SIGPIPE on platforms that support it, BSD, MacOSX */
   if (0 != setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one))) {
-    last_error = AMQP_STATUS_SOCKET_ERROR;
-    goto err;
+    return AMQP_STATUS_SOCKET_ERROR;
   }
 #endif /* SO_NOSIGPIPE */
 
+  return AMQP_STATUS_OK;
+}
+
+/* Starts connecting a socket to addr. Returns AMQP_STATUS_OK once connected,
+ * AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE while connecting, with the socket in
+ * *sockfd_out either way. */
+static int start_connect(const amqp_address_t *addr,
+                         const amqp_socket_options_t *options,
+                         int *sockfd_out) {
+  int one = 1;
+  int sockfd;
+  int last_error;
+
+  sockfd = socket(addr->family, addr->socktype, addr->protocol);
+  if (-1 == sockfd) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+
+  last_error = prepare_socket(sockfd);
+  if (AMQP_STATUS_OK != last_error) {
+    goto err;
+  }
+
   /* Disable nagle */
   if (0 != setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
     last_error = AMQP_STATUS_SOCKET_ERROR;
@@ -436,51 +691,344 @@ static int connect_socket(struct addrinfo *addr, amqp_time_t deadline) {
     goto err;
   }
 
-  if (0 == connect(sockfd, addr->ai_addr, addr->ai_addrlen)) {
-    return sockfd;
+  last_error = apply_options(sockfd, addr->family, options);
+  if (AMQP_STATUS_OK != last_error) {
+    goto err;
+  }
+
+  *sockfd_out = sockfd;
+  if (0 == connect(sockfd, (const struct sockaddr *)&addr->addr,
+                   (socklen_t)addr->addrlen)) {
+    return AMQP_STATUS_OK;
   }
 
   if (EINPROGRESS != errno) {
     last_error = AMQP_STATUS_SOCKET_ERROR;
     goto err;
   }
+  return AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE;
 
-  last_error = amqp_poll(sockfd, AMQP_SF_POLLOUT, deadline);
-  if (AMQP_STATUS_OK != last_error) {
-    goto err;
+err:
+  close(sockfd);
+  return last_error;
+}
+#endif
+
+/* Whether a connection attempt that stopped being in progress succeeded */
+static int finish_connect(int sockfd) {
+  int result;
+  socklen_t result_len = sizeof(result);
+
+  if (-1 == getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (char *)&result,
+                       &result_len) ||
+      result != 0) {
+    return AMQP_STATUS_SOCKET_ERROR;
   }
+  return AMQP_STATUS_OK;
+}
 
-  {
-    int result;
-    socklen_t result_len = sizeof(result);
+/* Waits up to deadline for connection attempts to complete or fail, setting
+ * done[i] for each of fds that did */
+static int wait_connects(const int *fds, int count, int *done,
+                         amqp_time_t deadline) {
+#ifdef HAVE_POLL
+  struct pollfd pfds[AMQP_MAX_CONNECT_ATTEMPTS];
+  int timeout_ms;
+  int res;
+  int i;
 
-    if (-1 == getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &result, &result_len) ||
-        result != 0) {
-      last_error = AMQP_STATUS_SOCKET_ERROR;
-      goto err;
+  for (i = 0; i < count; i++) {
+    pfds[i].fd = fds[i];
+    pfds[i].events = POLLOUT;
+    pfds[i].revents = 0;
+  }
+
+start_poll:
+  timeout_ms = amqp_time_ms_until(deadline);
+  if (-1 > timeout_ms) {
+    return timeout_ms;
+  }
+  res = poll(pfds, (nfds_t)count, timeout_ms);
+  if (0 == res) {
+    return AMQP_STATUS_TIMEOUT;
+  }
+  if (0 > res) {
+    if (EINTR == amqp_os_socket_error()) {
+      goto start_poll;
     }
+    return AMQP_STATUS_SOCKET_ERROR;
   }
+  for (i = 0; i < count; i++) {
+    done[i] = 0 != pfds[i].revents;
+  }
+  return AMQP_STATUS_OK;
+#elif defined(HAVE_SELECT)
+  fd_set writefds;
+  fd_set exceptfds;
+  struct timeval tv;
+  struct timeval *tvp;
+  int maxfd = 0;
+  int res;
+  int i;
 
-  return sockfd;
+start_select:
+  FD_ZERO(&writefds);
+  FD_ZERO(&exceptfds);
+  for (i = 0; i < count; i++) {
+    /* On Win32 a failed connect() is reported through exceptfds */
+    FD_SET(fds[i], &writefds);
+    FD_SET(fds[i], &exceptfds);
+    if (fds[i] > maxfd) {
+      maxfd = fds[i];
+    }
+  }
 
-err:
-  close(sockfd);
-  return last_error;
-}
+  res = amqp_time_tv_until(deadline, &tv, &tvp);
+  if (res != AMQP_STATUS_OK) {
+    return res;
+  }
+  res = select(maxfd + 1, NULL, &writefds, &exceptfds, tvp);
+  if (0 == res) {
+    return AMQP_STATUS_TIMEOUT;
+  }
+  if (0 > res) {
+    if (EINTR == amqp_os_socket_error()) {
+      goto start_select;
+    }
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  for (i = 0; i < count; i++) {
+    done[i] = FD_ISSET(fds[i], &writefds) || FD_ISSET(fds[i], &exceptfds);
+  }
+  return AMQP_STATUS_OK;
+#else
+#error "poll() or select() is needed to compile rabbitmq-c"
 #endif
+}
 
-int amqp_open_socket_inner(char const *hostname, int portnumber,
-                           amqp_time_t deadline) {
+static void close_attempts(int *fds, int count, int keep) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (fds[i] != keep) {
+      amqp_os_socket_close(fds[i]);
+    }
+  }
+}
+
+/* Connects to one of addrs, preferring them in order: an attempt that
+ * doesn't complete within AMQP_CONNECT_ATTEMPT_DELAY_MS gets the next
+ * address tried alongside it, one that fails right away. The first to
+ * connect wins and the others are abandoned. */
+static int connect_any(const amqp_address_t *addrs, int num_addrs,
+                       const amqp_socket_options_t *options,
+                       amqp_time_t deadline, int *winner) {
+  static const struct timeval attempt_delay = {
+      0, AMQP_CONNECT_ATTEMPT_DELAY_MS * 1000};
+  int fds[AMQP_MAX_CONNECT_ATTEMPTS];
+  int indexes[AMQP_MAX_CONNECT_ATTEMPTS];
+  int done[AMQP_MAX_CONNECT_ATTEMPTS];
+  int num_attempts = 0;
+  int next = 0;
+  int last_error = AMQP_STATUS_SOCKET_ERROR;
+  amqp_time_t next_attempt = amqp_time_immediate();
+  int res;
+  int i;
+
+  for (;;) {
+    int can_start =
+        next < num_addrs && num_attempts < AMQP_MAX_CONNECT_ATTEMPTS;
+
+    if (can_start &&
+        (0 == num_attempts ||
+         AMQP_STATUS_TIMEOUT == amqp_time_has_past(next_attempt))) {
+      int sockfd;
+
+      res = start_connect(&addrs[next], options, &sockfd);
+      if (AMQP_STATUS_OK == res) {
+        close_attempts(fds, num_attempts, -1);
+        *winner = next;
+        return sockfd;
+      }
+      if (AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE == res) {
+        fds[num_attempts] = sockfd;
+        indexes[num_attempts] = next;
+        num_attempts++;
+        res = amqp_time_from_now(&next_attempt, &attempt_delay);
+        if (AMQP_STATUS_OK != res) {
+          close_attempts(fds, num_attempts, -1);
+          return res;
+        }
+      } else {
+        last_error = res;
+      }
+      next++;
+      continue;
+    }
+    if (0 == num_attempts) {
+      return last_error;
+    }
+
+    res = wait_connects(
+        fds, num_attempts, done,
+        can_start ? amqp_time_first(deadline, next_attempt) : deadline);
+    if (AMQP_STATUS_TIMEOUT == res &&
+        AMQP_STATUS_TIMEOUT != amqp_time_has_past(deadline)) {
+      continue;
+    }
+    if (AMQP_STATUS_OK != res) {
+      close_attempts(fds, num_attempts, -1);
+      return res;
+    }
+
+    for (i = 0; i < num_attempts;) {
+      if (!done[i]) {
+        i++;
+        continue;
+      }
+      res = finish_connect(fds[i]);
+      if (AMQP_STATUS_OK == res) {
+        int sockfd = fds[i];
+        close_attempts(fds, num_attempts, sockfd);
+        *winner = indexes[i];
+        return sockfd;
+      }
+      /* A failure makes way for the next address straight away */
+      last_error = res;
+      next_attempt = amqp_time_immediate();
+      amqp_os_socket_close(fds[i]);
+      num_attempts--;
+      fds[i] = fds[num_attempts];
+      indexes[i] = indexes[num_attempts];
+      done[i] = done[num_attempts];
+    }
+  }
+}
+
+/* Results of getaddrinfo() kept around for amqp_set_dns_cache_ttl() */
+typedef struct amqp_dns_entry_t_ {
+  struct amqp_dns_entry_t_ *next;
+  char *hostname;
+  int portnumber;
+  uint64_t expires_ns;
+  int num_addrs;
+  amqp_address_t *addrs;
+} amqp_dns_entry_t;
+
+static pthread_mutex_t dns_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static amqp_dns_entry_t *dns_cache = NULL;
+static uint64_t dns_cache_ttl_ns = 0;
+
+static void free_dns_entry(amqp_dns_entry_t *entry) {
+  free(entry->hostname);
+  free(entry->addrs);
+  free(entry);
+}
+
+/* Copies the cached addresses of a host, dropping expired entries along the
+ * way. Called with dns_cache_mutex held. */
+static int dns_cache_lookup(char const *hostname, int portnumber,
+                            amqp_address_t **addrs, int *num_addrs) {
+  amqp_dns_entry_t **prev = &dns_cache;
+  uint64_t now = amqp_get_monotonic_timestamp();
+
+  while (NULL != *prev) {
+    amqp_dns_entry_t *entry = *prev;
+    if (now >= entry->expires_ns) {
+      *prev = entry->next;
+      free_dns_entry(entry);
+      continue;
+    }
+    if (portnumber == entry->portnumber &&
+        0 == strcmp(hostname, entry->hostname)) {
+      *addrs = malloc(entry->num_addrs * sizeof(amqp_address_t));
+      if (NULL == *addrs) {
+        return 0;
+      }
+      memcpy(*addrs, entry->addrs, entry->num_addrs * sizeof(amqp_address_t));
+      *num_addrs = entry->num_addrs;
+      return 1;
+    }
+    prev = &entry->next;
+  }
+  return 0;
+}
+
+/* Called with dns_cache_mutex held */
+static void dns_cache_store(char const *hostname, int portnumber,
+                            const amqp_address_t *addrs, int num_addrs) {
+  amqp_dns_entry_t *entry = calloc(1, sizeof(amqp_dns_entry_t));
+
+  if (NULL == entry) {
+    return;
+  }
+  entry->hostname = strdup(hostname);
+  entry->addrs = malloc(num_addrs * sizeof(amqp_address_t));
+  if (NULL == entry->hostname || NULL == entry->addrs) {
+    free_dns_entry(entry);
+    return;
+  }
+  memcpy(entry->addrs, addrs, num_addrs * sizeof(amqp_address_t));
+  entry->num_addrs = num_addrs;
+  entry->portnumber = portnumber;
+  entry->expires_ns = amqp_get_monotonic_timestamp() + dns_cache_ttl_ns;
+  entry->next = dns_cache;
+  dns_cache = entry;
+}
+
+/* Addresses that couldn't be connected to are looked up again next time */
+static void dns_cache_forget(char const *hostname, int portnumber) {
+  amqp_dns_entry_t **prev;
+
+  pthread_mutex_lock(&dns_cache_mutex);
+  for (prev = &dns_cache; NULL != *prev;) {
+    amqp_dns_entry_t *entry = *prev;
+    if (portnumber == entry->portnumber &&
+        0 == strcmp(hostname, entry->hostname)) {
+      *prev = entry->next;
+      free_dns_entry(entry);
+    } else {
+      prev = &entry->next;
+    }
+  }
+  pthread_mutex_unlock(&dns_cache_mutex);
+}
+
+int amqp_set_dns_cache_ttl(int ttl_seconds) {
+  if (ttl_seconds < 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  pthread_mutex_lock(&dns_cache_mutex);
+  dns_cache_ttl_ns = (uint64_t)ttl_seconds * AMQP_NS_PER_S;
+  if (0 == ttl_seconds) {
+    while (NULL != dns_cache) {
+      amqp_dns_entry_t *entry = dns_cache;
+      dns_cache = entry->next;
+      free_dns_entry(entry);
+    }
+  }
+  pthread_mutex_unlock(&dns_cache_mutex);
+  return AMQP_STATUS_OK;
+}
+
+/* Resolves a host into a malloc'd array of addresses, alternating between
+ * address families starting with the one listed first, RFC 8305 section 4 */
+static int resolve(char const *hostname, int portnumber,
+                   amqp_address_t **addrs_out, int *num_addrs_out) {
   struct addrinfo hint;
   struct addrinfo *address_list;
   struct addrinfo *addr;
+  struct addrinfo *other;
   char portnumber_string[33];
-  int sockfd = -1;
-  int last_error;
-
-  last_error = amqp_os_socket_init();
-  if (AMQP_STATUS_OK != last_error) {
-    return last_error;
+  amqp_address_t *addrs;
+  int num_addrs = 0;
+  int cached;
+
+  pthread_mutex_lock(&dns_cache_mutex);
+  cached = 0 != dns_cache_ttl_ns &&
+           dns_cache_lookup(hostname, portnumber, addrs_out, num_addrs_out);
+  pthread_mutex_unlock(&dns_cache_mutex);
+  if (cached) {
+    return AMQP_STATUS_OK;
   }
 
   memset(&hint, 0, sizeof(hint));
@@ -490,28 +1038,203 @@ int amqp_open_socket_inner(char const *hostname, int portnumber,
 
   (void)sprintf(portnumber_string, "%d", portnumber);
 
-  last_error = getaddrinfo(hostname, portnumber_string, &hint, &address_list);
-  if (0 != last_error) {
+  if (0 != getaddrinfo(hostname, portnumber_string, &hint, &address_list)) {
     return AMQP_STATUS_HOSTNAME_RESOLUTION_FAILED;
   }
-
   for (addr = address_list; addr; addr = addr->ai_next) {
-    sockfd = connect_socket(addr, deadline);
+    num_addrs++;
+  }
+  addrs = calloc(num_addrs, sizeof(amqp_address_t));
+  if (NULL == addrs) {
+    freeaddrinfo(address_list);
+    return AMQP_STATUS_NO_MEMORY;
+  }
 
-    if (sockfd >= 0) {
-      last_error = AMQP_STATUS_OK;
-      break;
-    } else if (sockfd == AMQP_STATUS_TIMEOUT) {
-      last_error = sockfd;
-      break;
+  /* addr walks the addresses of the first family, other the rest */
+  num_addrs = 0;
+  addr = address_list;
+  other = address_list;
+  while (NULL != addr || NULL != other) {
+    int i;
+    for (i = 0; i < 2; i++) {
+      struct addrinfo **cursor = 0 == i ? &addr : &other;
+      while (NULL != *cursor &&
+             (0 == i) != ((*cursor)->ai_family == address_list->ai_family)) {
+        *cursor = (*cursor)->ai_next;
+      }
+      if (NULL != *cursor) {
+        amqp_address_t *a = &addrs[num_addrs++];
+        a->family = (*cursor)->ai_family;
+        a->socktype = (*cursor)->ai_socktype;
+        a->protocol = (*cursor)->ai_protocol;
+        a->addrlen = (*cursor)->ai_addrlen;
+        memcpy(&a->addr, (*cursor)->ai_addr, (*cursor)->ai_addrlen);
+        *cursor = (*cursor)->ai_next;
+      }
     }
   }
-
   freeaddrinfo(address_list);
-  if (last_error != AMQP_STATUS_OK || sockfd == -1) {
+
+  pthread_mutex_lock(&dns_cache_mutex);
+  if (0 != dns_cache_ttl_ns) {
+    dns_cache_store(hostname, portnumber, addrs, num_addrs);
+  }
+  pthread_mutex_unlock(&dns_cache_mutex);
+
+  *addrs_out = addrs;
+  *num_addrs_out = num_addrs;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_open_socket_any(char const *const *hostnames,
+                         const int *portnumbers, int count,
+                         amqp_time_t deadline, int *connected,
+                         const amqp_socket_options_t *options) {
+  amqp_address_t *addrs = NULL;
+  int *owners = NULL;
+  int num_addrs = 0;
+  int sockfd;
+  int winner;
+  int last_error;
+  int i;
+
+  last_error = amqp_os_socket_init();
+  if (AMQP_STATUS_OK != last_error) {
     return last_error;
   }
-  return sockfd;
+
+  /* Host names are looked up one after another, the addresses of all of
+   * them then race in the order the hosts are given */
+  for (i = 0; i < count; i++) {
+    amqp_address_t *host_addrs;
+    amqp_address_t *grown;
+    int *grown_owners;
+    int num_host_addrs;
+    int j;
+
+    last_error =
+        resolve(hostnames[i], portnumbers[i], &host_addrs, &num_host_addrs);
+    if (AMQP_STATUS_NO_MEMORY == last_error) {
+      goto out;
+    }
+    if (AMQP_STATUS_OK != last_error) {
+      continue;
+    }
+    grown = realloc(addrs, (num_addrs + num_host_addrs) * sizeof(*addrs));
+    if (NULL != grown) {
+      addrs = grown;
+    }
+    grown_owners =
+        realloc(owners, (num_addrs + num_host_addrs) * sizeof(*owners));
+    if (NULL != grown_owners) {
+      owners = grown_owners;
+    }
+    if (NULL == grown || NULL == grown_owners) {
+      free(host_addrs);
+      last_error = AMQP_STATUS_NO_MEMORY;
+      goto out;
+    }
+    memcpy(&addrs[num_addrs], host_addrs, num_host_addrs * sizeof(*addrs));
+    for (j = 0; j < num_host_addrs; j++) {
+      owners[num_addrs + j] = i;
+    }
+    num_addrs += num_host_addrs;
+    free(host_addrs);
+  }
+  if (0 == num_addrs) {
+    goto out;
+  }
+
+  sockfd = connect_any(addrs, num_addrs, options, deadline, &winner);
+  if (sockfd >= 0) {
+    if (NULL != connected) {
+      *connected = owners[winner];
+    }
+    last_error = sockfd;
+  } else {
+    last_error = sockfd;
+    for (i = 0; i < count; i++) {
+      dns_cache_forget(hostnames[i], portnumbers[i]);
+    }
+  }
+
+out:
+  free(addrs);
+  free(owners);
+  return last_error;
+}
+
+#ifndef _WIN32
+int amqp_open_unix_socket(const char *path, amqp_time_t deadline) {
+  struct sockaddr_un addr;
+  size_t len = strlen(path);
+  int sockfd;
+  int res;
+
+  if (0 == len || len >= sizeof(addr.sun_path)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, len);
+
+  sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (-1 == sockfd) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  res = prepare_socket(sockfd);
+  if (AMQP_STATUS_OK != res) {
+    goto err;
+  }
+
+  for (;;) {
+    if (0 == connect(sockfd, (const struct sockaddr *)&addr, sizeof(addr))) {
+      return sockfd;
+    }
+    switch (errno) {
+      case EINTR:
+        continue;
+      case EINPROGRESS:
+        /* Only some systems connect Unix sockets in the background */
+        res = amqp_poll(sockfd, AMQP_SF_POLLOUT, deadline);
+        if (AMQP_STATUS_OK == res) {
+          res = finish_connect(sockfd);
+        }
+        if (AMQP_STATUS_OK == res) {
+          return sockfd;
+        }
+        goto err;
+      case EAGAIN:
+        /* The listener's backlog is full, nothing can be polled for until
+         * it accepts */
+        res = amqp_time_has_past(deadline);
+        if (AMQP_STATUS_OK != res) {
+          goto err;
+        }
+#ifdef HAVE_POLL
+        poll(NULL, 0, 10);
+#else
+        {
+          struct timeval pause = {0, 10000};
+          select(0, NULL, NULL, NULL, &pause);
+        }
+#endif
+        continue;
+      default:
+        res = AMQP_STATUS_SOCKET_ERROR;
+        goto err;
+    }
+  }
+
+err:
+  close(sockfd);
+  return res;
+}
+#endif
+
+int amqp_open_socket_inner(char const *hostname, int portnumber,
+                           amqp_time_t deadline) {
+  return amqp_open_socket_any(&hostname, &portnumber, 1, deadline, NULL, NULL);
 }
 
 static int send_header_inner(amqp_connection_state_t state,
@@ -659,8 +1382,8 @@ amqp_boolean_t amqp_data_in_buffer(amqp_connection_state_t state) {
   return (state->sock_inbound_offset < state->sock_inbound_limit);
 }
 
-static int consume_one_frame(amqp_connection_state_t state,
-                             amqp_frame_t *decoded_frame) {
+int amqp_consume_one_frame(amqp_connection_state_t state,
+                           amqp_frame_t *decoded_frame) {
   int res;
 
   amqp_bytes_t buffer;
@@ -675,14 +1398,77 @@ static int consume_one_frame(amqp_connection_state_t state,
 
   state->sock_inbound_offset += res;
 
+  if (NULL != state->recovery) {
+    amqp_recovery_received(state, decoded_frame);
+  }
+  if (0 != state->consumers_count) {
+    amqp_consumers_received(state, decoded_frame);
+  }
   return AMQP_STATUS_OK;
 }
 
-static int recv_with_timeout(amqp_connection_state_t state,
-                             amqp_time_t timeout) {
+/* Most pause instructions between two reads of a backing off busy wait */
+#define AMQP_BUSY_WAIT_MAX_PAUSES 64
+
+/* Whether a read that found nothing should be retried rather than polled
+ * for, see amqp_set_busy_wait(). *spin_until is 0 until the spin starts. */
+static int keep_spinning(amqp_connection_state_t state, amqp_time_t deadline,
+                         uint64_t *spin_until, int *pauses) {
+  uint64_t now;
+  int i;
+
+  if (0 == state->busy_wait_ns) {
+    return 0;
+  }
+  now = amqp_get_monotonic_timestamp();
+  if (0 == now) {
+    return 0;
+  }
+  if (0 == *spin_until) {
+    *spin_until = now + state->busy_wait_ns;
+    if (*spin_until > deadline.time_point_ns) {
+      *spin_until = deadline.time_point_ns;
+    }
+  }
+  if (now >= *spin_until) {
+    return 0;
+  }
+  if (state->busy_wait_backoff) {
+    for (i = 0; i < *pauses; i++) {
+      amqp_cpu_relax();
+    }
+    if (AMQP_BUSY_WAIT_MAX_PAUSES > *pauses) {
+      *pauses *= 2;
+    }
+  }
+  return 1;
+}
+
+int amqp_recv_with_timeout(amqp_connection_state_t state,
+                           amqp_time_t timeout) {
   ssize_t res;
+  uint64_t spin_until = 0;
+  int pauses = 1;
   int fd;
 
+  if (NULL == state->sock_inbound_buffer.bytes) {
+    /* The buffer was released while the connection was idle, don't reacquire
+     * it until there is something to read */
+    fd = amqp_get_sockfd(state);
+    if (-1 == fd) {
+      return AMQP_STATUS_CONNECTION_CLOSED;
+    }
+    res = amqp_socket_wait(state->socket, AMQP_SF_POLLIN, timeout);
+    if (AMQP_STATUS_OK != res) {
+      return (int)res;
+    }
+    state->sock_inbound_buffer.bytes =
+        amqp_buffer_cache_alloc(state->sock_inbound_buffer.len);
+    if (NULL == state->sock_inbound_buffer.bytes) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+  }
+
 start_recv:
   res = amqp_socket_recv(state->socket, state->sock_inbound_buffer.bytes,
                          state->sock_inbound_buffer.len, 0);
@@ -696,10 +1482,21 @@ start_recv:
       default:
         return (int)res;
       case AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD:
-        res = amqp_poll(fd, AMQP_SF_POLLIN, timeout);
+        if (keep_spinning(state, timeout, &spin_until, &pauses)) {
+          goto start_recv;
+        }
+        if (state->socket->klass->recv_hint) {
+          /* All of the socket buffer has been parsed, what's left of a
+           * frame body has yet to arrive */
+          state->socket->klass->recv_hint(
+              state->socket, CONNECTION_STATE_BODY == state->state
+                                 ? state->target_size - state->inbound_offset
+                                 : 0);
+        }
+        res = amqp_socket_wait(state->socket, AMQP_SF_POLLIN, timeout);
         break;
       case AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE:
-        res = amqp_poll(fd, AMQP_SF_POLLOUT, timeout);
+        res = amqp_socket_wait(state->socket, AMQP_SF_POLLOUT, timeout);
         break;
     }
     if (AMQP_STATUS_OK == res) {
@@ -716,7 +1513,7 @@ start_recv:
   if (AMQP_STATUS_OK != res) {
     return (int)res;
   }
-  return AMQP_STATUS_OK;
+  return amqp_idle_touch(state);
 }
 
 int amqp_try_recv(amqp_connection_state_t state) {
@@ -724,45 +1521,22 @@ int amqp_try_recv(amqp_connection_state_t state) {
 
   while (amqp_data_in_buffer(state)) {
     amqp_frame_t frame;
-    int res = consume_one_frame(state, &frame);
+    int res = amqp_consume_one_frame(state, &frame);
 
     if (AMQP_STATUS_OK != res) {
       return res;
     }
 
     if (frame.frame_type != 0) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
-
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
-        return AMQP_STATUS_NO_MEMORY;
-      }
-
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
-        return AMQP_STATUS_NO_MEMORY;
-      }
-
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
+      res = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != res) {
+        return res;
       }
-      state->last_queued_frame = link;
     }
   }
   timeout = amqp_time_immediate();
 
-  return recv_with_timeout(state, timeout);
+  return amqp_recv_with_timeout(state, timeout);
 }
 
 static int wait_frame_inner(amqp_connection_state_t state,
@@ -773,7 +1547,7 @@ static int wait_frame_inner(amqp_connection_state_t state,
 
   for (;;) {
     while (amqp_data_in_buffer(state)) {
-      res = consume_one_frame(state, decoded_frame);
+      res = amqp_consume_one_frame(state, decoded_frame);
 
       if (AMQP_STATUS_OK != res) {
         return res;
@@ -791,6 +1565,15 @@ static int wait_frame_inner(amqp_connection_state_t state,
     }
 
   beginrecv:
+    /* Everything buffered has been handled, acks recorded for it go out
+     * before waiting for more */
+    if (NULL != state->ack_windows) {
+      res = amqp_flush_acks(state);
+      if (AMQP_STATUS_OK != res) {
+        return res;
+      }
+    }
+
     res = amqp_time_has_past(state->next_send_heartbeat);
     if (AMQP_STATUS_TIMER_FAILURE == res) {
       return res;
@@ -807,10 +1590,11 @@ static int wait_frame_inner(amqp_connection_state_t state,
     deadline = amqp_time_first(timeout_deadline,
                                amqp_time_first(state->next_recv_heartbeat,
                                                state->next_send_heartbeat));
+    deadline = amqp_time_first(deadline, state->next_idle);
 
     /* TODO this needs to wait for a _frame_ and not anything written from the
      * socket */
-    res = recv_with_timeout(state, deadline);
+    res = amqp_recv_with_timeout(state, deadline);
 
     if (AMQP_STATUS_TIMEOUT == res) {
       if (amqp_time_equal(deadline, state->next_recv_heartbeat)) {
@@ -819,7 +1603,11 @@ static int wait_frame_inner(amqp_connection_state_t state,
       } else if (amqp_time_equal(deadline, timeout_deadline)) {
         return AMQP_STATUS_TIMEOUT;
       } else if (amqp_time_equal(deadline, state->next_send_heartbeat)) {
-        /* send heartbeat happens before we do recv_with_timeout */
+        /* send heartbeat happens before we do amqp_recv_with_timeout */
+        goto beginrecv;
+      } else if (amqp_time_equal(deadline, state->next_idle)) {
+        amqp_release_idle_buffers(state);
+        state->next_idle = amqp_time_infinite();
         goto beginrecv;
       } else {
         amqp_abort("Internal error: unable to determine timeout reason");
@@ -835,15 +1623,15 @@ static amqp_link_t *amqp_create_link_for_frame(amqp_connection_state_t state,
   amqp_link_t *link;
   amqp_frame_t *frame_copy;
 
-  amqp_pool_t *channel_pool =
-      amqp_get_or_create_channel_pool(state, frame->channel);
+  amqp_pool_table_entry_t *entry =
+      amqp_get_or_create_channel_pool_entry(state, frame->channel);
 
-  if (NULL == channel_pool) {
+  if (NULL == entry) {
     return NULL;
   }
 
-  link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-  frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
+  link = amqp_pool_alloc(&entry->pool, sizeof(amqp_link_t));
+  frame_copy = amqp_pool_alloc(&entry->pool, sizeof(amqp_frame_t));
 
   if (NULL == link || NULL == frame_copy) {
     return NULL;
@@ -851,10 +1639,29 @@ static amqp_link_t *amqp_create_link_for_frame(amqp_connection_state_t state,
 
   *frame_copy = *frame;
   link->data = frame_copy;
+  entry->queued_frames++;
 
   return link;
 }
 
+/* Called whenever a frame is removed from the queued frame list, so the
+ * channel's pool can be recycled once all of its queued frames are consumed */
+static void amqp_frame_dequeued(amqp_connection_state_t state,
+                                amqp_frame_t *frame) {
+  amqp_pool_table_entry_t *entry =
+      amqp_get_channel_pool_entry(state, frame->channel);
+  if (NULL != entry) {
+    assert(entry->queued_frames > 0);
+    entry->queued_frames--;
+  }
+}
+
+int amqp_wait_frame_unqueued(amqp_connection_state_t state,
+                             amqp_frame_t *decoded_frame,
+                             amqp_time_t deadline) {
+  return wait_frame_inner(state, decoded_frame, deadline);
+}
+
 int amqp_queue_frame(amqp_connection_state_t state, amqp_frame_t *frame) {
   amqp_link_t *link = amqp_create_link_for_frame(state, frame);
   if (NULL == link) {
@@ -896,18 +1703,25 @@ int amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
                                       amqp_frame_t *decoded_frame) {
   amqp_frame_t *frame_ptr;
   amqp_link_t *cur;
+  amqp_link_t *prev = NULL;
   int res;
 
-  for (cur = state->first_queued_frame; NULL != cur; cur = cur->next) {
+  for (cur = state->first_queued_frame; NULL != cur;
+       prev = cur, cur = cur->next) {
     frame_ptr = cur->data;
 
     if (channel == frame_ptr->channel) {
-      state->first_queued_frame = cur->next;
-      if (NULL == state->first_queued_frame) {
-        state->last_queued_frame = NULL;
+      if (NULL == prev) {
+        state->first_queued_frame = cur->next;
+      } else {
+        prev->next = cur->next;
+      }
+      if (state->last_queued_frame == cur) {
+        state->last_queued_frame = prev;
       }
 
       *decoded_frame = *frame_ptr;
+      amqp_frame_dequeued(state, frame_ptr);
 
       return AMQP_STATUS_OK;
     }
@@ -953,6 +1767,7 @@ int amqp_simple_wait_frame_noblock(amqp_connection_state_t state,
       state->last_queued_frame = NULL;
     }
     *decoded_frame = *f;
+    amqp_frame_dequeued(state, f);
     return AMQP_STATUS_OK;
   } else {
     return wait_frame_inner(state, decoded_frame, deadline);
@@ -1016,6 +1831,22 @@ int amqp_send_method_inner(amqp_connection_state_t state,
                            void *decoded, int flags, amqp_time_t deadline) {
   amqp_frame_t frame;
 
+  if (NULL != state->ack_windows) {
+    int res = amqp_ack_windows_before_method(state, channel, id);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  if (NULL != state->prefetch) {
+    amqp_prefetch_before_method(state, channel, id);
+  }
+  if (NULL != state->recovery) {
+    int res = amqp_recovery_before_method(state, channel, id, decoded);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+
   frame.frame_type = AMQP_FRAME_METHOD;
   frame.channel = channel;
   frame.payload.method.id = id;
@@ -1075,34 +1906,11 @@ static amqp_rpc_reply_t simple_rpc_inner(
              (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD))) ||
            ((frame.channel == 0) &&
             (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))))) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
-
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
-        return amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
-      }
-
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
-        return amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
+      status = amqp_queue_frame(state, &frame);
+      if (AMQP_STATUS_OK != status) {
+        return amqp_rpc_reply_error(status);
       }
 
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
-
       goto retry;
     }
 
@@ -1112,6 +1920,10 @@ static amqp_rpc_reply_t simple_rpc_inner(
             : AMQP_RESPONSE_SERVER_EXCEPTION;
 
     result.reply = frame.payload.method;
+    if (NULL != state->recovery &&
+        AMQP_RESPONSE_NORMAL == result.reply_type) {
+      amqp_recovery_after_rpc(state, channel, &result.reply);
+    }
     return result;
   }
 }
@@ -53,11 +53,21 @@ int amqp_os_socket_close(int sockfd);
 /* Socket callbacks. */
 typedef ssize_t (*amqp_socket_send_fn)(void *, const void *, size_t, int);
 typedef ssize_t (*amqp_socket_recv_fn)(void *, void *, size_t, int);
-typedef int (*amqp_socket_open_fn)(void *, const char *, int,
-                                   const struct timeval *);
+/* Connects to the first of count hosts to answer, setting the index of it */
+typedef int (*amqp_socket_open_fn)(void *, const char *const *, const int *,
+                                   int, const struct timeval *, int *);
 typedef int (*amqp_socket_close_fn)(void *, amqp_socket_close_enum);
 typedef int (*amqp_socket_get_sockfd_fn)(void *);
 typedef void (*amqp_socket_delete_fn)(void *);
+/* Waits for the socket to become readable or writeable, for sockets whose
+ * readiness can't be polled on the file descriptor. May be NULL. */
+typedef int (*amqp_socket_wait_fn)(void *, int, amqp_time_t);
+/* The options applied when the socket connects, NULL for sockets that
+ * aren't TCP. May be NULL. */
+typedef amqp_socket_options_t *(*amqp_socket_get_options_fn)(void *);
+/* Tells the socket how many more bytes the frame being read needs before
+ * it waits for input, 0 between frames. May be NULL. */
+typedef void (*amqp_socket_recv_hint_fn)(void *, size_t);
 
 /** V-table for amqp_socket_t */
 struct amqp_socket_class_t {
@@ -67,6 +77,9 @@ struct amqp_socket_class_t {
   amqp_socket_close_fn close;
   amqp_socket_get_sockfd_fn get_sockfd;
   amqp_socket_delete_fn delete;
+  amqp_socket_wait_fn wait;
+  amqp_socket_get_options_fn get_options;
+  amqp_socket_recv_hint_fn recv_hint;
 };
 
 /** Abstract base class for amqp_socket_t */
@@ -163,10 +176,35 @@ int amqp_open_socket_noblock(char const *hostname, int portnumber,
 int amqp_open_socket_inner(char const *hostname, int portnumber,
                            amqp_time_t deadline);
 
+/* Connects to whichever of the hosts answers first, trying their addresses
+ * in parallel, with options applied to each attempt unless it's NULL. The
+ * index of the host connected to is stored at connected unless it's NULL.
+ * Returns the file descriptor, or an amqp_status_enum. */
+int amqp_open_socket_any(char const *const *hostnames,
+                         const int *portnumbers, int count,
+                         amqp_time_t deadline, int *connected,
+                         const amqp_socket_options_t *options);
+
+#ifndef _WIN32
+/* Connects to the Unix domain socket at path. Returns the file descriptor,
+ * or an amqp_status_enum. */
+int amqp_open_unix_socket(const char *path, amqp_time_t deadline);
+#endif
+
 /* Wait up to dealline for fd to become readable or writeable depending on
  * event (AMQP_SF_POLLIN, AMQP_SF_POLLOUT) */
 int amqp_poll(int fd, int event, amqp_time_t deadline);
 
+/* Like amqp_poll() on the socket's file descriptor, going through the
+ * socket's own wait when it has one */
+int amqp_socket_wait(amqp_socket_t *self, int event, amqp_time_t deadline);
+
+/* Raises SO_RCVLOWAT on sockfd so it doesn't poll as readable until most of
+ * the bytes a frame still needs have arrived, or puts it back to 1 when
+ * bytes is too few to be worth it. *current is the value last set, 0 for
+ * the default and -1 once the platform refused. */
+void amqp_set_rcvlowat(int sockfd, int *current, size_t bytes);
+
 int amqp_send_method_inner(amqp_connection_state_t state,
                            amqp_channel_t channel, amqp_method_number_t id,
                            void *decoded, int flags, amqp_time_t deadline);
@@ -77,7 +77,8 @@ void *AMQP_CALL amqp_ssl_socket_get_context(amqp_socket_t *self);
  * \param [in] cacert Path to the CA cert file in PEM format.
  *
  * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
- *  failure.
+ *  failure, AMQP_STATUS_INVALID_PARAMETER if the socket was made by
+ *  amqp_ssl_socket_new_with_context().
  *
  * \since v0.4.0
  */
@@ -93,7 +94,8 @@ int AMQP_CALL amqp_ssl_socket_set_cacert(amqp_socket_t *self,
  * \param [in] key Path to the client key in PEM format.
  *
  * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
- *  failure.
+ *  failure, AMQP_STATUS_INVALID_PARAMETER if the socket was made by
+ *  amqp_ssl_socket_new_with_context().
  *
  * \since v0.4.0
  */
@@ -110,7 +112,8 @@ int AMQP_CALL amqp_ssl_socket_set_key(amqp_socket_t *self, const char *cert,
  * \param [in] n The length of the buffer.
  *
  * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
- *  failure.
+ *  failure, AMQP_STATUS_INVALID_PARAMETER if the socket was made by
+ *  amqp_ssl_socket_new_with_context().
  *
  * \since v0.4.0
  */
@@ -184,7 +187,8 @@ typedef enum {
  * \param [in] max the maxmium acceptable TLS version
  * \returns AMQP_STATUS_OK on success, AMQP_STATUS_UNSUPPORTED if OpenSSL does
  * not support the requested TLS version, AMQP_STATUS_INVALID_PARAMETER if an
- * invalid combination of parameters is passed.
+ * invalid combination of parameters is passed or the socket was made by
+ * amqp_ssl_socket_new_with_context().
  *
  * \since v0.8.0
  */
@@ -193,6 +197,362 @@ int AMQP_CALL amqp_ssl_socket_set_ssl_versions(amqp_socket_t *self,
                                                amqp_tls_version_t min,
                                                amqp_tls_version_t max);
 
+/**
+ * Hand the record encryption of a socket to the kernel (kTLS).
+ *
+ * Once the handshake is done OpenSSL passes the negotiated keys to the Linux
+ * kernel, which then encrypts and decrypts the records itself. Frames are
+ * then sent and received with plain send() and recv() calls as on a TCP
+ * socket, without copying them through OpenSSL. Records that aren't
+ * application data, such as alerts and TLS 1.3 session tickets, are still
+ * handled by OpenSSL.
+ *
+ * The kernel needs the tls module loaded and supports only some ciphers
+ * (AES-GCM and, on newer kernels, ChaCha20-Poly1305). When offload isn't
+ * possible the socket works as it does without this setting;
+ * amqp_ssl_socket_get_ktls() tells which happened. OpenSSL 3.0 only offloads
+ * the receiving side of TLS 1.2 connections.
+ *
+ * Call before opening the socket.
+ *
+ * \param [in,out] self An SSL/TLS socket object.
+ * \param [in] enable Offload if possible when non-zero.
+ *
+ * OpenSSL's own socket BIO carries offloaded connections, so a SIGPIPE it
+ * raises writing to a closed connection is blocked during the call and
+ * discarded.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_UNSUPPORTED if the platform
+ * or OpenSSL lacks kTLS support.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_socket_set_ktls(amqp_socket_t *self,
+                                       amqp_boolean_t enable);
+
+/**
+ * Whether the kernel encrypts the records sent on an open socket.
+ *
+ * \sa amqp_ssl_socket_set_ktls()
+ *
+ * \param [in] self An SSL/TLS socket object.
+ *
+ * \return Non-zero if sending was offloaded to the kernel.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t AMQP_CALL amqp_ssl_socket_get_ktls(amqp_socket_t *self);
+
+/**
+ * A cache of TLS sessions to resume, shared by any number of SSL/TLS sockets
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_ssl_session_cache_t_ amqp_ssl_session_cache_t;
+
+/**
+ * Create an empty TLS session cache.
+ *
+ * \return A new session cache or NULL if an error occurred.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_ssl_session_cache_t *AMQP_CALL amqp_ssl_session_cache_new(void);
+
+/**
+ * Release a TLS session cache.
+ *
+ * Sockets the cache was given to keep using it, it is freed along with the
+ * last of them.
+ *
+ * \param [in] cache The session cache, may be NULL.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void AMQP_CALL amqp_ssl_session_cache_free(amqp_ssl_session_cache_t *cache);
+
+/**
+ * Resume TLS sessions from a cache.
+ *
+ * When the socket is opened, a session the broker handed out to any socket
+ * sharing the cache is offered back to it, filed under the host name and
+ * port the socket connects to. If the broker accepts it the handshake skips
+ * the key exchange and certificate transfer. Sessions the broker hands out
+ * on this socket are added to the cache, replacing the one before. A
+ * session from a broker that fails verification is dropped.
+ *
+ * Call before opening the socket. The cache may be used from several
+ * threads at once.
+ *
+ * \param [in,out] self An SSL/TLS socket object.
+ * \param [in] cache The session cache, NULL to stop using one.
+ *
+ * \return AMQP_STATUS_OK on success.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_socket_set_session_cache(
+    amqp_socket_t *self, amqp_ssl_session_cache_t *cache);
+
+/**
+ * Write the sessions of a cache that haven't expired to a file.
+ *
+ * The file holds the secrets of the sessions, it is created readable by its
+ * owner only.
+ *
+ * \param [in] cache The session cache.
+ * \param [in] path The file to write, replaced if it exists.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_SSL_ERROR if the file
+ * couldn't be written.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_session_cache_save(amqp_ssl_session_cache_t *cache,
+                                          const char *path);
+
+/**
+ * Add the sessions written by amqp_ssl_session_cache_save() to a cache.
+ *
+ * Sessions that have expired since are left out. A file that doesn't exist
+ * leaves the cache as it is.
+ *
+ * \param [in] cache The session cache.
+ * \param [in] path The file to read.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_SSL_ERROR if the file
+ * couldn't be parsed.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_session_cache_load(amqp_ssl_session_cache_t *cache,
+                                          const char *path);
+
+/**
+ * An OpenSSL context holding the CA certificates, client certificate and
+ * TLS settings of any number of SSL/TLS sockets.
+ *
+ * Each socket made by amqp_ssl_socket_new() parses its certificates into a
+ * context of its own. A process opening many connections to the same
+ * brokers can load them once into an amqp_ssl_context_t and create its
+ * sockets with amqp_ssl_socket_new_with_context() instead.
+ *
+ * \since v0.11.0
+ */
+typedef struct amqp_ssl_context_t_ amqp_ssl_context_t;
+
+/**
+ * Create a TLS context, with the same defaults as amqp_ssl_socket_new().
+ *
+ * Calling this function may result in the underlying SSL library being
+ * initialized.
+ * \sa amqp_set_initialize_ssl_library()
+ *
+ * \return A new context or NULL if an error occurred.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_ssl_context_t *AMQP_CALL amqp_ssl_context_new(void);
+
+/**
+ * Release a TLS context.
+ *
+ * Sockets created from the context keep using it, it is freed along with
+ * the last of them.
+ *
+ * \param [in] context The context, may be NULL.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void AMQP_CALL amqp_ssl_context_free(amqp_ssl_context_t *context);
+
+/**
+ * Get the OpenSSL context wrapped by a TLS context. Caveat emptor.
+ *
+ * \param [in] context The context.
+ *
+ * \return A pointer to the OpenSSL context. This should be cast to
+ * <tt>SSL_CTX*</tt>.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void *AMQP_CALL amqp_ssl_context_get_context(amqp_ssl_context_t *context);
+
+/**
+ * Create a new SSL/TLS socket object sharing a TLS context.
+ *
+ * The socket is owned by \p state as with amqp_ssl_socket_new(). It starts
+ * out with the peer and hostname verification settings of the context.
+ *
+ * The context is not copied, so it is only set up through the
+ * amqp_ssl_context_set_*() functions: amqp_ssl_socket_set_cacert(),
+ * amqp_ssl_socket_set_key(), amqp_ssl_socket_set_key_buffer() and
+ * amqp_ssl_socket_set_ssl_versions() return AMQP_STATUS_INVALID_PARAMETER
+ * for the socket. amqp_ssl_socket_set_verify_peer() and
+ * amqp_ssl_socket_set_verify_hostname() still work, they only change this
+ * socket's copy of the settings. The context should be set up before the
+ * sockets are opened and not changed while any of them is in use from
+ * another thread.
+ *
+ * \param [in,out] state The connection object that owns the SSL/TLS socket
+ * \param [in] context The TLS context.
+ *
+ * \return A new socket object or NULL if an error occurred.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_socket_t *AMQP_CALL amqp_ssl_socket_new_with_context(
+    amqp_connection_state_t state, amqp_ssl_context_t *context);
+
+/**
+ * Set the CA certificate of a TLS context.
+ *
+ * \sa amqp_ssl_socket_set_cacert()
+ *
+ * \param [in,out] context The context.
+ * \param [in] cacert Path to the CA cert file in PEM format.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_context_set_cacert(amqp_ssl_context_t *context,
+                                          const char *cacert);
+
+/**
+ * Set the client key and certificate chain of a TLS context.
+ *
+ * \sa amqp_ssl_socket_set_key()
+ *
+ * \param [in,out] context The context.
+ * \param [in] cert Path to the client certificate in PEM format.
+ * \param [in] key Path to the client key in PEM format.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_context_set_key(amqp_ssl_context_t *context,
+                                       const char *cert, const char *key);
+
+/**
+ * Set the client key of a TLS context from a buffer.
+ *
+ * \sa amqp_ssl_socket_set_key_buffer()
+ *
+ * \param [in,out] context The context.
+ * \param [in] cert Path to the client certificate in PEM format.
+ * \param [in] key A buffer containing client key in PEM format.
+ * \param [in] n The length of the buffer.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_context_set_key_buffer(amqp_ssl_context_t *context,
+                                              const char *cert,
+                                              const void *key, size_t n);
+
+/**
+ * Set the client certificate chain of a TLS context.
+ *
+ * \sa amqp_ssl_socket_set_cert()
+ *
+ * \param [in,out] context The context.
+ * \param [in] cert Path to the client certificate in PEM format.
+ *
+ * \return \ref AMQP_STATUS_OK on success an \ref amqp_status_enum value on
+ *  failure.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_context_set_cert(amqp_ssl_context_t *context,
+                                        const char *cert);
+
+/**
+ * Set the minimum and maximum TLS versions of a TLS context.
+ *
+ * \sa amqp_ssl_socket_set_ssl_versions()
+ *
+ * \param [in,out] context The context.
+ * \param [in] min the minimum acceptable TLS version
+ * \param [in] max the maximum acceptable TLS version
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_UNSUPPORTED if OpenSSL does
+ * not support the requested TLS version, AMQP_STATUS_INVALID_PARAMETER if an
+ * invalid combination of parameters is passed.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_context_set_ssl_versions(amqp_ssl_context_t *context,
+                                                amqp_tls_version_t min,
+                                                amqp_tls_version_t max);
+
+/**
+ * Set the cipher suites a TLS context offers for TLS 1.2 and below.
+ *
+ * \param [in,out] context The context.
+ * \param [in] ciphers An OpenSSL cipher list, e.g. "HIGH:!aNULL".
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_SSL_ERROR if no cipher in
+ * the list is usable.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_context_set_ciphers(amqp_ssl_context_t *context,
+                                           const char *ciphers);
+
+/**
+ * Set whether sockets created from a TLS context verify the peer
+ * certificate.
+ *
+ * Only sockets created afterwards are affected,
+ * amqp_ssl_socket_set_verify_peer() changes a single socket.
+ *
+ * \param [in,out] context The context.
+ * \param [in] verify verify the peer certificate if non-zero
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void AMQP_CALL amqp_ssl_context_set_verify_peer(amqp_ssl_context_t *context,
+                                                amqp_boolean_t verify);
+
+/**
+ * Set whether sockets created from a TLS context verify the peer hostname.
+ *
+ * Only sockets created afterwards are affected,
+ * amqp_ssl_socket_set_verify_hostname() changes a single socket.
+ *
+ * \param [in,out] context The context.
+ * \param [in] verify verify the hostname if non-zero
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+void AMQP_CALL amqp_ssl_context_set_verify_hostname(
+    amqp_ssl_context_t *context, amqp_boolean_t verify);
+
 /**
  * Sets whether rabbitmq-c will initialize OpenSSL.
  *
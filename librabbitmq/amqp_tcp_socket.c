@@ -46,6 +46,9 @@ struct amqp_tcp_socket_t {
   int sockfd;
   int internal_error;
   int state;
+  amqp_socket_options_t options;
+  /* SO_RCVLOWAT as last set, see amqp_set_rcvlowat() */
+  int rcvlowat;
 };
 
 static ssize_t amqp_tcp_socket_send(void *base, const void *buf, size_t len,
@@ -162,13 +165,22 @@ start:
   return ret;
 }
 
-static int amqp_tcp_socket_open(void *base, const char *host, int port,
-                                const struct timeval *timeout) {
+static int amqp_tcp_socket_open(void *base, const char *const *hosts,
+                                const int *ports, int count,
+                                const struct timeval *timeout,
+                                int *connected) {
   struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  amqp_time_t deadline;
+  int res;
   if (-1 != self->sockfd) {
     return AMQP_STATUS_SOCKET_INUSE;
   }
-  self->sockfd = amqp_open_socket_noblock(host, port, timeout);
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  self->sockfd = amqp_open_socket_any(hosts, ports, count, deadline, connected,
+                                      &self->options);
   if (0 > self->sockfd) {
     int err = self->sockfd;
     self->sockfd = -1;
@@ -188,6 +200,7 @@ static int amqp_tcp_socket_close(void *base,
     return AMQP_STATUS_SOCKET_ERROR;
   }
   self->sockfd = -1;
+  self->rcvlowat = 0;
 
   return AMQP_STATUS_OK;
 }
@@ -197,6 +210,18 @@ static int amqp_tcp_socket_get_sockfd(void *base) {
   return self->sockfd;
 }
 
+static amqp_socket_options_t *amqp_tcp_socket_get_options(void *base) {
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  return &self->options;
+}
+
+static void amqp_tcp_socket_recv_hint(void *base, size_t bytes) {
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  if (-1 != self->sockfd) {
+    amqp_set_rcvlowat(self->sockfd, &self->rcvlowat, bytes);
+  }
+}
+
 static void amqp_tcp_socket_delete(void *base) {
   struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
 
@@ -207,12 +232,15 @@ static void amqp_tcp_socket_delete(void *base) {
 }
 
 static const struct amqp_socket_class_t amqp_tcp_socket_class = {
-    amqp_tcp_socket_send,       /* send */
-    amqp_tcp_socket_recv,       /* recv */
-    amqp_tcp_socket_open,       /* open */
-    amqp_tcp_socket_close,      /* close */
-    amqp_tcp_socket_get_sockfd, /* get_sockfd */
-    amqp_tcp_socket_delete      /* delete */
+    amqp_tcp_socket_send,        /* send */
+    amqp_tcp_socket_recv,        /* recv */
+    amqp_tcp_socket_open,        /* open */
+    amqp_tcp_socket_close,       /* close */
+    amqp_tcp_socket_get_sockfd,  /* get_sockfd */
+    amqp_tcp_socket_delete,      /* delete */
+    NULL,                        /* wait */
+    amqp_tcp_socket_get_options, /* get_options */
+    amqp_tcp_socket_recv_hint    /* recv_hint */
 };
 
 amqp_socket_t *amqp_tcp_socket_new(amqp_connection_state_t state) {
@@ -222,6 +250,7 @@ amqp_socket_t *amqp_tcp_socket_new(amqp_connection_state_t state) {
   }
   self->klass = &amqp_tcp_socket_class;
   self->sockfd = -1;
+  amqp_socket_options_init(&self->options);
 
   amqp_set_socket(state, (amqp_socket_t *)self);
 
@@ -235,4 +264,5 @@ void amqp_tcp_socket_set_sockfd(amqp_socket_t *base, int sockfd) {
   }
   self = (struct amqp_tcp_socket_t *)base;
   self->sockfd = sockfd;
+  self->rcvlowat = 0;
 }
@@ -0,0 +1,197 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_unix_socket.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct amqp_unix_socket_t {
+  const struct amqp_socket_class_t *klass;
+  int sockfd;
+  int internal_error;
+};
+
+static ssize_t amqp_unix_socket_send(void *base, const void *buf, size_t len,
+                                     AMQP_UNUSED int flags) {
+  struct amqp_unix_socket_t *self = (struct amqp_unix_socket_t *)base;
+  ssize_t res;
+  int flagz = 0;
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+#ifdef MSG_NOSIGNAL
+  flagz |= MSG_NOSIGNAL;
+#endif
+
+start:
+  res = send(self->sockfd, buf, len, flagz);
+
+  if (res < 0) {
+    self->internal_error = errno;
+    switch (self->internal_error) {
+      case EINTR:
+        goto start;
+      case EWOULDBLOCK:
+#if defined(EAGAIN) && EAGAIN != EWOULDBLOCK
+      case EAGAIN:
+#endif
+        res = AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE;
+        break;
+      default:
+        res = AMQP_STATUS_SOCKET_ERROR;
+    }
+  } else {
+    self->internal_error = 0;
+  }
+
+  return res;
+}
+
+static ssize_t amqp_unix_socket_recv(void *base, void *buf, size_t len,
+                                     int flags) {
+  struct amqp_unix_socket_t *self = (struct amqp_unix_socket_t *)base;
+  ssize_t ret;
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+start:
+  ret = recv(self->sockfd, buf, len, flags);
+
+  if (0 > ret) {
+    self->internal_error = errno;
+    switch (self->internal_error) {
+      case EINTR:
+        goto start;
+      case EWOULDBLOCK:
+#if defined(EAGAIN) && EAGAIN != EWOULDBLOCK
+      case EAGAIN:
+#endif
+        ret = AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD;
+        break;
+      default:
+        ret = AMQP_STATUS_SOCKET_ERROR;
+    }
+  } else if (0 == ret) {
+    ret = AMQP_STATUS_CONNECTION_CLOSED;
+  }
+
+  return ret;
+}
+
+/* The hosts are socket paths, tried in turn */
+static int amqp_unix_socket_open(void *base, const char *const *hosts,
+                                 AMQP_UNUSED const int *ports, int count,
+                                 const struct timeval *timeout,
+                                 int *connected) {
+  struct amqp_unix_socket_t *self = (struct amqp_unix_socket_t *)base;
+  amqp_time_t deadline;
+  int res;
+  int i;
+  if (-1 != self->sockfd) {
+    return AMQP_STATUS_SOCKET_INUSE;
+  }
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  if (0 >= count) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  for (i = 0; i < count; i++) {
+    res = amqp_open_unix_socket(hosts[i], deadline);
+    if (0 <= res) {
+      self->sockfd = res;
+      if (NULL != connected) {
+        *connected = i;
+      }
+      return AMQP_STATUS_OK;
+    }
+    if (AMQP_STATUS_TIMEOUT == res) {
+      break;
+    }
+  }
+  return res;
+}
+
+static int amqp_unix_socket_close(void *base,
+                                  AMQP_UNUSED amqp_socket_close_enum force) {
+  struct amqp_unix_socket_t *self = (struct amqp_unix_socket_t *)base;
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+  if (close(self->sockfd)) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  self->sockfd = -1;
+
+  return AMQP_STATUS_OK;
+}
+
+static int amqp_unix_socket_get_sockfd(void *base) {
+  struct amqp_unix_socket_t *self = (struct amqp_unix_socket_t *)base;
+  return self->sockfd;
+}
+
+static void amqp_unix_socket_delete(void *base) {
+  struct amqp_unix_socket_t *self = (struct amqp_unix_socket_t *)base;
+
+  if (self) {
+    amqp_unix_socket_close(self, AMQP_SC_NONE);
+    free(self);
+  }
+}
+
+static const struct amqp_socket_class_t amqp_unix_socket_class = {
+    amqp_unix_socket_send,       /* send */
+    amqp_unix_socket_recv,       /* recv */
+    amqp_unix_socket_open,       /* open */
+    amqp_unix_socket_close,      /* close */
+    amqp_unix_socket_get_sockfd, /* get_sockfd */
+    amqp_unix_socket_delete,     /* delete */
+    NULL,                        /* wait */
+    NULL,                        /* get_options */
+    NULL                         /* recv_hint */
+};
+
+amqp_socket_t *amqp_unix_socket_new(amqp_connection_state_t state) {
+  struct amqp_unix_socket_t *self = calloc(1, sizeof(*self));
+  if (!self) {
+    return NULL;
+  }
+  self->klass = &amqp_unix_socket_class;
+  self->sockfd = -1;
+
+  amqp_set_socket(state, (amqp_socket_t *)self);
+
+  return (amqp_socket_t *)self;
+}
@@ -0,0 +1,54 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * A Unix domain socket connection.
+ */
+
+#ifndef AMQP_UNIX_SOCKET_H
+#define AMQP_UNIX_SOCKET_H
+
+#include <amqp.h>
+
+AMQP_BEGIN_DECLS
+
+/**
+ * Create a new Unix domain socket.
+ *
+ * The socket connects to a broker, or a local relay, listening on a stream
+ * socket in the file system. The host name given to amqp_socket_open() and
+ * its variants is the path of the socket, the port is ignored. URLs of the
+ * form amqp+unix:///path/to/socket parsed by amqp_parse_url() give the
+ * path as amqp_connection_info::host, with the port set to 0.
+ *
+ * Call amqp_connection_close() to release socket resources.
+ *
+ * \param [in,out] state The connection object that owns the socket.
+ *
+ * \return A new socket object or NULL if an error occurred.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_socket_t *AMQP_CALL amqp_unix_socket_new(amqp_connection_state_t state);
+
+AMQP_END_DECLS
+
+#endif /* AMQP_UNIX_SOCKET_H */
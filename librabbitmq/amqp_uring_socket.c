@@ -0,0 +1,713 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_uring_socket.h"
+
+#ifdef HAVE_IO_URING
+
+#include "amqp_ring.h"
+#include "amqp_socket.h"
+#include "amqp_time.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Submission queue entries; only a receive, a send and a timeout are ever
+ * queued at once */
+#define AMQP_URING_ENTRIES 16
+
+/* Provided receive buffers, a power of two */
+#define AMQP_URING_BUFFERS 16
+#define AMQP_URING_BUFFER_SIZE 16384
+#define AMQP_URING_BUFFER_GROUP 0
+
+/* Outbound frames are gathered here until a send is released */
+#define AMQP_URING_SEND_SIZE 131072
+
+/* Tags for user_data, timeouts carry their sequence number above them */
+#define AMQP_URING_RECV 1
+#define AMQP_URING_SEND 2
+#define AMQP_URING_TIMEOUT 3
+#define AMQP_URING_TAG_BITS 2
+
+struct amqp_uring_buffer_t {
+  unsigned short bid;
+  unsigned len;
+};
+
+struct amqp_uring_socket_t {
+  const struct amqp_socket_class_t *klass;
+  int sockfd;
+  int internal_error;
+  amqp_socket_options_t options;
+
+  int ring_fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Provided buffers, and the received ones waiting to be read */
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *buffers;
+  unsigned short buf_tail;
+  struct amqp_uring_buffer_t ready[AMQP_URING_BUFFERS];
+  unsigned ready_head;
+  unsigned ready_count;
+  unsigned ready_offset;
+  amqp_boolean_t recv_armed;
+  amqp_boolean_t multishot;
+  int recv_error;
+
+  /* [out_sent, out_flush) is released to the kernel, [out_flush, out_len)
+   * is waiting for the rest of its batch */
+  char *out;
+  size_t out_sent;
+  size_t out_flush;
+  size_t out_len;
+  amqp_boolean_t send_armed;
+  int send_error;
+
+  struct __kernel_timespec timeout;
+  uint64_t timeout_seq;
+  amqp_boolean_t timed_out;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+                          unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Hands the queued entries to the kernel, waiting for wait_nr completions.
+ * Returns AMQP_STATUS_OK, or AMQP_STATUS_SOCKET_ERROR with internal_error
+ * set. An interrupted wait returns AMQP_STATUS_OK too. */
+static int uring_submit(struct amqp_uring_socket_t *self, unsigned wait_nr) {
+  unsigned to_submit;
+  int res;
+
+  amqp_atomic_store(self->sq_tail, self->sq_local_tail);
+  to_submit = self->sq_local_tail - amqp_atomic_load(self->sq_head);
+  if (0 == to_submit && 0 == wait_nr) {
+    return AMQP_STATUS_OK;
+  }
+  res = uring_enter(self->ring_fd, to_submit, wait_nr,
+                    wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  if (0 > res) {
+    switch (errno) {
+      case EINTR:
+      case EAGAIN:
+      case EBUSY:
+        return AMQP_STATUS_OK;
+      default:
+        self->internal_error = errno;
+        return AMQP_STATUS_SOCKET_ERROR;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct amqp_uring_socket_t *self) {
+  struct io_uring_sqe *sqe;
+  unsigned index;
+
+  if (self->sq_local_tail - amqp_atomic_load(self->sq_head) >=
+      self->sq_entries) {
+    if (AMQP_STATUS_OK != uring_submit(self, 0) ||
+        self->sq_local_tail - amqp_atomic_load(self->sq_head) >=
+            self->sq_entries) {
+      return NULL;
+    }
+  }
+  index = self->sq_local_tail & self->sq_mask;
+  sqe = &self->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  self->sq_array[index] = index;
+  self->sq_local_tail++;
+  return sqe;
+}
+
+static void give_buffer(struct amqp_uring_socket_t *self, unsigned short bid) {
+  struct io_uring_buf *buf =
+      &self->buf_ring->bufs[self->buf_tail & (AMQP_URING_BUFFERS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(self->buffers +
+                                    (size_t)bid * AMQP_URING_BUFFER_SIZE);
+  buf->len = AMQP_URING_BUFFER_SIZE;
+  buf->bid = bid;
+  self->buf_tail++;
+  amqp_atomic_store(&self->buf_ring->tail, self->buf_tail);
+}
+
+static int arm_recv(struct amqp_uring_socket_t *self) {
+  struct io_uring_sqe *sqe;
+
+  if (self->recv_armed || self->recv_error) {
+    return AMQP_STATUS_OK;
+  }
+  sqe = uring_get_sqe(self);
+  if (NULL == sqe) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = self->sockfd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = AMQP_URING_BUFFER_GROUP;
+  if (self->multishot) {
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  } else {
+    sqe->len = AMQP_URING_BUFFER_SIZE;
+  }
+  sqe->user_data = AMQP_URING_RECV;
+  self->recv_armed = 1;
+  return uring_submit(self, 0);
+}
+
+/* Releases everything sent so far and starts a send if none is running */
+static int flush_out(struct amqp_uring_socket_t *self) {
+  struct io_uring_sqe *sqe;
+
+  if (self->send_armed || self->send_error ||
+      self->out_sent == self->out_flush) {
+    return AMQP_STATUS_OK;
+  }
+  sqe = uring_get_sqe(self);
+  if (NULL == sqe) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = self->sockfd;
+  sqe->addr = (uint64_t)(uintptr_t)(self->out + self->out_sent);
+  sqe->len = (unsigned)(self->out_flush - self->out_sent);
+  /* Asks the kernel to retry a short send itself; one that still comes
+   * back short is resubmitted from out_sent by the next reap */
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = AMQP_URING_SEND;
+  self->send_armed = 1;
+  return uring_submit(self, 0);
+}
+
+static void handle_cqe(struct amqp_uring_socket_t *self,
+                       const struct io_uring_cqe *cqe) {
+  switch (cqe->user_data & ((1 << AMQP_URING_TAG_BITS) - 1)) {
+    case AMQP_URING_RECV:
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        self->recv_armed = 0;
+      }
+      if (0 < cqe->res && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        struct amqp_uring_buffer_t *slot =
+            &self->ready[(self->ready_head + self->ready_count) &
+                         (AMQP_URING_BUFFERS - 1)];
+        slot->bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        slot->len = (unsigned)cqe->res;
+        self->ready_count++;
+      } else if (0 == cqe->res) {
+        self->recv_error = AMQP_STATUS_CONNECTION_CLOSED;
+      } else if (-EINVAL == cqe->res && self->multishot) {
+        /* Multishot receive isn't supported by this kernel */
+        self->multishot = 0;
+      } else if (-ENOBUFS != cqe->res && -EINTR != cqe->res &&
+                 -EAGAIN != cqe->res && 0 > cqe->res) {
+        self->internal_error = -cqe->res;
+        self->recv_error = AMQP_STATUS_SOCKET_ERROR;
+      }
+      /* Without buffers the receive is rearmed once one is returned */
+      break;
+    case AMQP_URING_SEND:
+      self->send_armed = 0;
+      if (0 <= cqe->res) {
+        self->out_sent += (size_t)cqe->res;
+      } else if (-EINTR != cqe->res && -EAGAIN != cqe->res) {
+        self->internal_error = -cqe->res;
+        self->send_error = AMQP_STATUS_SOCKET_ERROR;
+      }
+      break;
+    case AMQP_URING_TIMEOUT:
+      if ((cqe->user_data >> AMQP_URING_TAG_BITS) == self->timeout_seq &&
+          -ETIME == cqe->res) {
+        self->timed_out = 1;
+      }
+      break;
+  }
+}
+
+/* Processes the completions posted so far, then restarts whatever they
+ * finished */
+static int reap(struct amqp_uring_socket_t *self) {
+  unsigned head = *self->cq_head;
+  unsigned tail = amqp_atomic_load(self->cq_tail);
+  int res;
+
+  while (head != tail) {
+    handle_cqe(self, &self->cqes[head & self->cq_mask]);
+    head++;
+  }
+  amqp_atomic_store(self->cq_head, head);
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_OK;
+  }
+  res = flush_out(self);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  if (self->ready_count < AMQP_URING_BUFFERS) {
+    return arm_recv(self);
+  }
+  return AMQP_STATUS_OK;
+}
+
+static ssize_t amqp_uring_socket_send(void *base, const void *buf, size_t len,
+                                      int flags) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+  size_t room;
+  int res;
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+  res = reap(self);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  if (self->send_error) {
+    return self->send_error;
+  }
+
+  if (!self->send_armed && 0 < self->out_sent) {
+    memmove(self->out, self->out + self->out_sent,
+            self->out_len - self->out_sent);
+    self->out_len -= self->out_sent;
+    self->out_flush -= self->out_sent;
+    self->out_sent = 0;
+  }
+  room = AMQP_URING_SEND_SIZE - self->out_len;
+  if (0 == room) {
+    self->out_flush = self->out_len;
+    res = flush_out(self);
+    return AMQP_STATUS_OK == res ? AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE : res;
+  }
+  if (len > room) {
+    len = room;
+    flags &= ~AMQP_SF_MORE;
+  }
+  memcpy(self->out + self->out_len, buf, len);
+  self->out_len += len;
+  if (!(flags & AMQP_SF_MORE)) {
+    self->out_flush = self->out_len;
+    res = flush_out(self);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return (ssize_t)len;
+}
+
+static ssize_t amqp_uring_socket_recv(void *base, void *buf, size_t len,
+                                      AMQP_UNUSED int flags) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+  size_t copied = 0;
+  int res;
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+  /* Whoever reads is waiting on what was sent */
+  self->out_flush = self->out_len;
+  res = reap(self);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  while (copied < len && 0 < self->ready_count) {
+    struct amqp_uring_buffer_t *slot = &self->ready[self->ready_head];
+    size_t n = slot->len - self->ready_offset;
+    if (n > len - copied) {
+      n = len - copied;
+    }
+    memcpy((char *)buf + copied,
+           self->buffers + (size_t)slot->bid * AMQP_URING_BUFFER_SIZE +
+               self->ready_offset,
+           n);
+    copied += n;
+    self->ready_offset += (unsigned)n;
+    if (self->ready_offset == slot->len) {
+      give_buffer(self, slot->bid);
+      self->ready_head = (self->ready_head + 1) & (AMQP_URING_BUFFERS - 1);
+      self->ready_count--;
+      self->ready_offset = 0;
+    }
+  }
+
+  if (0 < copied) {
+    res = arm_recv(self);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    return (ssize_t)copied;
+  }
+  if (self->recv_error) {
+    return self->recv_error;
+  }
+  return AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD;
+}
+
+static int is_ready(struct amqp_uring_socket_t *self, int event) {
+  if (AMQP_SF_POLLIN == event) {
+    return 0 < self->ready_count || self->recv_error;
+  }
+  return self->send_error || self->out_len < AMQP_URING_SEND_SIZE ||
+         (!self->send_armed && 0 < self->out_sent);
+}
+
+static int amqp_uring_socket_wait(void *base, int event,
+                                  amqp_time_t deadline) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+  struct io_uring_sqe *sqe;
+  int timeout_ms;
+  int res;
+
+  if (-1 == self->sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+  self->out_flush = self->out_len;
+
+  for (;;) {
+    res = reap(self);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    if (is_ready(self, event)) {
+      return AMQP_STATUS_OK;
+    }
+    if (self->timed_out) {
+      self->timed_out = 0;
+      return AMQP_STATUS_TIMEOUT;
+    }
+
+    timeout_ms = amqp_time_ms_until(deadline);
+    if (0 > timeout_ms && -1 != timeout_ms) {
+      return timeout_ms;
+    }
+    if (0 == timeout_ms) {
+      return AMQP_STATUS_TIMEOUT;
+    }
+    if (-1 != timeout_ms) {
+      /* Completes with the next completion or the deadline, whichever is
+       * first, so it never needs removing; a stale one is ignored by its
+       * sequence number */
+      sqe = uring_get_sqe(self);
+      if (NULL == sqe) {
+        return AMQP_STATUS_SOCKET_ERROR;
+      }
+      self->timeout.tv_sec = timeout_ms / 1000;
+      self->timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+      self->timeout_seq++;
+      self->timed_out = 0;
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = (uint64_t)(uintptr_t)&self->timeout;
+      sqe->len = 1;
+      sqe->off = 1;
+      sqe->user_data =
+          AMQP_URING_TIMEOUT | (self->timeout_seq << AMQP_URING_TAG_BITS);
+    }
+    res = uring_submit(self, 1);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+}
+
+static int amqp_uring_socket_open(void *base, const char *const *hosts,
+                                  const int *ports, int count,
+                                  const struct timeval *timeout,
+                                  int *connected) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+  amqp_time_t deadline;
+  int res;
+  if (-1 != self->sockfd) {
+    return AMQP_STATUS_SOCKET_INUSE;
+  }
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  self->sockfd = amqp_open_socket_any(hosts, ports, count, deadline, connected,
+                                      &self->options);
+  if (0 > self->sockfd) {
+    int err = self->sockfd;
+    self->sockfd = -1;
+    return err;
+  }
+  return arm_recv(self);
+}
+
+static int amqp_uring_socket_close(void *base,
+                                   amqp_socket_close_enum force) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+  int sockfd = self->sockfd;
+  if (-1 == sockfd) {
+    return AMQP_STATUS_SOCKET_CLOSED;
+  }
+
+  /* Whatever is still gathered or in flight would be lost with the socket,
+   * where a plain socket would have handed it to the kernel already. A
+   * forced close follows an error, so there is nobody to send it to. */
+  if (AMQP_SC_NONE == force) {
+    self->out_flush = self->out_len;
+    while (self->out_sent < self->out_len && !self->send_error) {
+      if (AMQP_STATUS_OK != flush_out(self) ||
+          AMQP_STATUS_OK != uring_submit(self, 1) ||
+          AMQP_STATUS_OK != reap(self)) {
+        break;
+      }
+    }
+  }
+
+  /* The kernel still points into our buffers until the receive and send
+   * have completed; shutting the socket down finishes them */
+  self->sockfd = -1;
+  shutdown(sockfd, SHUT_RDWR);
+  while (self->recv_armed || self->send_armed) {
+    if (AMQP_STATUS_OK != uring_submit(self, 1)) {
+      break;
+    }
+    reap(self);
+  }
+  while (0 < self->ready_count) {
+    give_buffer(self, self->ready[self->ready_head].bid);
+    self->ready_head = (self->ready_head + 1) & (AMQP_URING_BUFFERS - 1);
+    self->ready_count--;
+  }
+  self->ready_offset = 0;
+  self->recv_armed = 0;
+  self->recv_error = 0;
+  self->out_sent = self->out_flush = self->out_len = 0;
+  self->send_armed = 0;
+  self->send_error = 0;
+
+  if (close(sockfd)) {
+    return AMQP_STATUS_SOCKET_ERROR;
+  }
+  return AMQP_STATUS_OK;
+}
+
+static int amqp_uring_socket_get_sockfd(void *base) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+  return self->sockfd;
+}
+
+static amqp_socket_options_t *amqp_uring_socket_get_options(void *base) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+  return &self->options;
+}
+
+static void uring_destroy(struct amqp_uring_socket_t *self) {
+  if (-1 != self->ring_fd) {
+    close(self->ring_fd);
+  }
+  if (self->buf_ring) {
+    munmap(self->buf_ring, self->buf_ring_size);
+  }
+  if (self->sqes) {
+    munmap(self->sqes, self->sqes_size);
+  }
+  if (self->cq_ring && self->cq_ring != self->sq_ring) {
+    munmap(self->cq_ring, self->cq_ring_size);
+  }
+  if (self->sq_ring) {
+    munmap(self->sq_ring, self->sq_ring_size);
+  }
+  free(self->buffers);
+  free(self->out);
+  free(self);
+}
+
+static void amqp_uring_socket_delete(void *base) {
+  struct amqp_uring_socket_t *self = (struct amqp_uring_socket_t *)base;
+
+  if (self) {
+    amqp_uring_socket_close(self, AMQP_SC_NONE);
+    uring_destroy(self);
+  }
+}
+
+static const struct amqp_socket_class_t amqp_uring_socket_class = {
+    amqp_uring_socket_send,        /* send */
+    amqp_uring_socket_recv,        /* recv */
+    amqp_uring_socket_open,        /* open */
+    amqp_uring_socket_close,       /* close */
+    amqp_uring_socket_get_sockfd,  /* get_sockfd */
+    amqp_uring_socket_delete,      /* delete */
+    amqp_uring_socket_wait,        /* wait */
+    amqp_uring_socket_get_options, /* get_options */
+    NULL                           /* recv_hint */
+};
+
+/* Sets up the rings and registers the receive buffers. Returns 0, or -1 if
+ * the kernel lacks anything needed */
+static int uring_init(struct amqp_uring_socket_t *self) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  char *sq;
+  char *cq;
+  unsigned short i;
+
+  memset(&p, 0, sizeof(p));
+  self->ring_fd = uring_setup(AMQP_URING_ENTRIES, &p);
+  if (0 > self->ring_fd) {
+    self->ring_fd = -1;
+    return -1;
+  }
+
+  self->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  self->cq_ring_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (self->cq_ring_size > self->sq_ring_size) {
+      self->sq_ring_size = self->cq_ring_size;
+    }
+    self->cq_ring_size = self->sq_ring_size;
+  }
+  sq = mmap(NULL, self->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, self->ring_fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == sq) {
+    return -1;
+  }
+  self->sq_ring = sq;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq = sq;
+  } else {
+    cq = mmap(NULL, self->cq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, self->ring_fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == cq) {
+      return -1;
+    }
+  }
+  self->cq_ring = cq;
+  self->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, self->ring_fd, IORING_OFF_SQES);
+  if (MAP_FAILED == self->sqes) {
+    self->sqes = NULL;
+    return -1;
+  }
+
+  self->sq_head = (unsigned *)(sq + p.sq_off.head);
+  self->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  self->sq_array = (unsigned *)(sq + p.sq_off.array);
+  self->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  self->sq_entries = p.sq_entries;
+  self->sq_local_tail = *self->sq_tail;
+  self->cq_head = (unsigned *)(cq + p.cq_off.head);
+  self->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  self->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  self->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* The buffer ring must be page aligned */
+  self->buf_ring_size = AMQP_URING_BUFFERS * sizeof(struct io_uring_buf);
+  self->buf_ring = mmap(NULL, self->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == self->buf_ring) {
+    self->buf_ring = NULL;
+    return -1;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)self->buf_ring;
+  reg.ring_entries = AMQP_URING_BUFFERS;
+  reg.bgid = AMQP_URING_BUFFER_GROUP;
+  if (0 > uring_register(self->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    return -1;
+  }
+
+  self->buffers = malloc((size_t)AMQP_URING_BUFFERS * AMQP_URING_BUFFER_SIZE);
+  self->out = malloc(AMQP_URING_SEND_SIZE);
+  if (NULL == self->buffers || NULL == self->out) {
+    return -1;
+  }
+  for (i = 0; i < AMQP_URING_BUFFERS; i++) {
+    give_buffer(self, i);
+  }
+  self->multishot = 1;
+  return 0;
+}
+
+amqp_socket_t *amqp_uring_socket_new(amqp_connection_state_t state) {
+  struct amqp_uring_socket_t *self = calloc(1, sizeof(*self));
+  if (!self) {
+    return NULL;
+  }
+  self->klass = &amqp_uring_socket_class;
+  self->sockfd = -1;
+  self->ring_fd = -1;
+  amqp_socket_options_init(&self->options);
+  if (0 != uring_init(self)) {
+    uring_destroy(self);
+    return NULL;
+  }
+
+  amqp_set_socket(state, (amqp_socket_t *)self);
+
+  return (amqp_socket_t *)self;
+}
+
+#else
+
+amqp_socket_t *amqp_uring_socket_new(AMQP_UNUSED amqp_connection_state_t
+                                         state) {
+  return NULL;
+}
+
+#endif /* HAVE_IO_URING */
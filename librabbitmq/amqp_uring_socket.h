@@ -0,0 +1,61 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/**
+ * A TCP connection driven through io_uring.
+ */
+
+#ifndef AMQP_URING_SOCKET_H
+#define AMQP_URING_SOCKET_H
+
+#include <amqp.h>
+
+AMQP_BEGIN_DECLS
+
+/**
+ * Create a new TCP socket that does its I/O through an io_uring.
+ *
+ * Inbound data is received by a single multishot receive into buffers
+ * owned by the ring, so reading a frame normally costs no system call.
+ * Frames sent with AMQP_SF_MORE are gathered and handed to the kernel as
+ * one send once the last frame of the batch arrives, and waiting for the
+ * socket uses a timeout on the ring rather than poll(2).
+ *
+ * Readiness of this socket can't be observed on its file descriptor, so it
+ * must not be used with amqp_event_loop_t or amqp_mux_t, which poll the
+ * descriptor themselves. Everything else behaves as with
+ * amqp_tcp_socket_new().
+ *
+ * Call amqp_connection_close() to release socket resources.
+ *
+ * \param [in,out] state The connection object that owns the socket.
+ *
+ * \return A new socket object, or NULL if an error occurred or io_uring
+ *         (with multishot receive and provided buffer rings) isn't
+ *         available, in which case amqp_tcp_socket_new() is the fallback.
+ *
+ * \since v0.11.0
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_socket_t *AMQP_CALL amqp_uring_socket_new(amqp_connection_state_t state);
+
+AMQP_END_DECLS
+
+#endif /* AMQP_URING_SOCKET_H */
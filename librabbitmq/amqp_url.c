@@ -58,6 +58,19 @@ void amqp_default_connection_info(struct amqp_connection_info *ci) {
   ci->ssl = 0;
 }
 
+/* Decodes the %XX at from into *val, returns 0 if it isn't one */
+static int decode_percent(const char *from, char *val) {
+  unsigned int v;
+  int chars;
+  int res = sscanf(from, "%2x%n", &v, &chars);
+
+  if (res == EOF || res < 1 || chars != 2 || v > CHAR_MAX) {
+    return 0;
+  }
+  *val = (char)v;
+  return 1;
+}
+
 /* Scan for the next delimiter, handling percent-encodings on the way. */
 static char find_delim(char **pp, int colon_and_at_sign_are_delims) {
   char *from = *pp;
@@ -85,22 +98,17 @@ static char find_delim(char **pp, int colon_and_at_sign_are_delims) {
         *pp = from;
         return ch;
 
-      case '%': {
-        unsigned int val;
-        int chars;
-        int res = sscanf(from, "%2x%n", &val, &chars);
-
-        if (res == EOF || res < 1 || chars != 2 || val > CHAR_MAX)
+      case '%':
+        if (!decode_percent(from, to))
         /* Return a surprising delimiter to
            force an error. */
         {
           return '%';
         }
 
-        *to++ = (char)val;
+        to++;
         from += 2;
         break;
-      }
 
       default:
         *to++ = ch;
@@ -109,6 +117,79 @@ static char find_delim(char **pp, int colon_and_at_sign_are_delims) {
   }
 }
 
+/* As find_delim(), for a socket path, which takes in slashes and brackets */
+static char find_path_end(char **pp) {
+  char *from = *pp;
+  char *to = from;
+
+  for (;;) {
+    char ch = *from++;
+
+    switch (ch) {
+      case 0:
+      case '?':
+      case '#':
+        *to = 0;
+        *pp = from;
+        return ch;
+
+      case '%':
+        if (!decode_percent(from, to)) {
+          return '%';
+        }
+        to++;
+        from += 2;
+        break;
+
+      default:
+        *to++ = ch;
+        break;
+    }
+  }
+}
+
+static int parse_unix_url(char *url, struct amqp_connection_info *parsed) {
+  char delim;
+  char *user;
+  char *password = NULL;
+
+  parsed->port = 0;
+
+  if ('/' != *url) {
+    /* Userinfo, the path can't come before it */
+    user = url;
+    delim = find_delim(&url, 1);
+    if (delim == ':') {
+      password = url;
+      delim = find_delim(&url, 1);
+    }
+    if (delim != '@') {
+      return AMQP_STATUS_BAD_URL;
+    }
+    parsed->user = user;
+    if (password) {
+      parsed->password = password;
+    }
+  }
+
+  if ('/' != *url) {
+    return AMQP_STATUS_BAD_URL;
+  }
+  parsed->host = url;
+  delim = find_path_end(&url);
+
+  if (delim == '?') {
+    if (strncmp(url, "vhost=", 6)) {
+      return AMQP_STATUS_BAD_URL;
+    }
+    url += 6;
+    parsed->vhost = url;
+    delim = find_delim(&url, 0);
+  }
+
+  return delim == 0 ? AMQP_STATUS_OK : AMQP_STATUS_BAD_URL;
+}
+
 /* Parse an AMQP URL into its component parts. */
 int amqp_parse_url(char *url, struct amqp_connection_info *parsed) {
   int res = AMQP_STATUS_BAD_URL;
@@ -125,6 +206,8 @@ int amqp_parse_url(char *url, struct amqp_connection_info *parsed) {
   } else if (!strncmp(url, "amqps://", 8)) {
     parsed->port = 5671;
     parsed->ssl = 1;
+  } else if (!strncmp(url, "amqp+unix://", 12)) {
+    return parse_unix_url(url + 12, parsed);
   } else {
     goto out;
   }
@@ -0,0 +1,470 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp.h"
+#include "amqp_private.h"
+#include "amqp_ring.h"
+#include "amqp_socket.h"
+#include "amqp_time.h"
+
+#include <stdlib.h>
+
+#ifdef AMQP_HAVE_THREADS
+
+#define AMQP_WORKER_POOL_DEFAULT_QUEUE_DEPTH 64
+
+/* While deliveries are being processed the IO thread wakes up at least this
+ * often to send the acks the workers have posted */
+#define AMQP_WORKER_POOL_ACK_INTERVAL_US 1000
+
+typedef struct amqp_worker_t_ amqp_worker_t;
+
+/* A delivery on its way through a worker. The envelope comes first so the
+ * pointer handed to the callback leads back to the job. */
+typedef struct amqp_worker_job_t_ {
+  amqp_envelope_t envelope;
+  amqp_worker_t *worker;
+  amqp_method_number_t ack_method; /* 0 if the callback didn't settle it */
+  amqp_boolean_t requeue;
+  struct amqp_worker_job_t_ *next;
+} amqp_worker_job_t;
+
+struct amqp_worker_t_ {
+  amqp_worker_pool_t *pool;
+  pthread_t thread;
+  amqp_spsc_ring_t jobs; /* IO thread -> worker */
+  amqp_spsc_ring_t done; /* worker -> IO thread, carries the acks */
+  amqp_waiter_t waiter;
+  /* Jobs handed over and not yet returned, IO thread only. Kept below the
+   * ring capacity so the worker never finds the done ring full. */
+  size_t outstanding;
+  int started;
+};
+
+struct amqp_worker_pool_t_ {
+  amqp_connection_state_t state;
+  amqp_worker_callback_t on_delivery;
+  amqp_worker_key_callback_t key;
+  void *user_data;
+  size_t capacity;
+  int num_workers;
+  amqp_worker_t *workers;
+  amqp_waiter_t io_waiter;
+  int stopping;
+  /* IO thread only */
+  size_t in_flight;
+  amqp_worker_job_t *free_jobs;
+};
+
+static int worker_has_work(void *arg) {
+  amqp_worker_t *worker = arg;
+  return !amqp_spsc_ring_is_empty(&worker->jobs) ||
+         amqp_atomic_load(&worker->pool->stopping);
+}
+
+static int worker_has_returned(void *arg) {
+  amqp_worker_t *worker = arg;
+  return !amqp_spsc_ring_is_empty(&worker->done);
+}
+
+static void *worker_main(void *arg) {
+  amqp_worker_t *worker = arg;
+  amqp_worker_pool_t *pool = worker->pool;
+
+  for (;;) {
+    amqp_worker_job_t *job = amqp_spsc_ring_pop(&worker->jobs);
+    if (NULL == job) {
+      /* Queued deliveries are finished before stopping */
+      if (amqp_atomic_load(&pool->stopping)) {
+        break;
+      }
+      amqp_waiter_wait(&worker->waiter, worker_has_work, worker,
+                       amqp_time_infinite());
+      continue;
+    }
+
+    pool->on_delivery(pool, &job->envelope, pool->user_data);
+
+    /* channel and delivery_tag survive for the ack */
+    amqp_destroy_envelope(&job->envelope);
+    amqp_spsc_ring_push(&worker->done, job);
+    amqp_waiter_wake(&pool->io_waiter);
+  }
+  return NULL;
+}
+
+static uint32_t worker_key_hash(amqp_bytes_t key) {
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < key.len; ++i) {
+    hash ^= ((unsigned char *)key.bytes)[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Collects every job the workers have returned, then sends their acks as one
+ * corked write */
+static int collect_returned(amqp_worker_pool_t *pool) {
+  amqp_worker_job_t *first = NULL;
+  amqp_worker_job_t **last = &first;
+  amqp_worker_job_t *job;
+  int res = AMQP_STATUS_OK;
+  int i;
+
+  for (i = 0; i < pool->num_workers; ++i) {
+    amqp_worker_t *worker = &pool->workers[i];
+    while (NULL != (job = amqp_spsc_ring_pop(&worker->done))) {
+      worker->outstanding--;
+      pool->in_flight--;
+      if (0 != job->ack_method && NULL != pool->state->prefetch) {
+        amqp_prefetch_settled(pool->state, job->envelope.channel,
+                              job->envelope.delivery_tag, 0);
+      }
+      /* Deliveries from before a recovery are dropped, the tags of later
+       * ones are turned back into the broker's */
+      if (0 == job->ack_method ||
+          (NULL != pool->state->recovery &&
+           !amqp_recovery_settle_tag(pool->state, job->envelope.channel,
+                                     &job->envelope.delivery_tag))) {
+        job->next = pool->free_jobs;
+        pool->free_jobs = job;
+      } else {
+        *last = job;
+        last = &job->next;
+      }
+    }
+  }
+  *last = NULL;
+
+  while (NULL != (job = first)) {
+    first = job->next;
+    if (AMQP_STATUS_OK == res) {
+      int sf = NULL == first ? AMQP_SF_NONE : AMQP_SF_MORE;
+      if (AMQP_BASIC_ACK_METHOD == job->ack_method) {
+        amqp_basic_ack_t m;
+        m.delivery_tag = job->envelope.delivery_tag;
+        m.multiple = 0;
+        res = amqp_send_method_inner(pool->state, job->envelope.channel,
+                                     AMQP_BASIC_ACK_METHOD, &m, sf,
+                                     amqp_time_infinite());
+      } else {
+        amqp_basic_reject_t m;
+        m.delivery_tag = job->envelope.delivery_tag;
+        m.requeue = job->requeue;
+        res = amqp_send_method_inner(pool->state, job->envelope.channel,
+                                     AMQP_BASIC_REJECT_METHOD, &m, sf,
+                                     amqp_time_infinite());
+      }
+    }
+    job->next = pool->free_jobs;
+    pool->free_jobs = job;
+  }
+  return res;
+}
+
+static void stop_workers(amqp_worker_pool_t *pool) {
+  int i;
+  amqp_atomic_store(&pool->stopping, 1);
+  for (i = 0; i < pool->num_workers; ++i) {
+    if (pool->workers[i].started) {
+      amqp_waiter_wake(&pool->workers[i].waiter);
+    }
+  }
+  for (i = 0; i < pool->num_workers; ++i) {
+    if (pool->workers[i].started) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
+  }
+}
+
+static void free_pool(amqp_worker_pool_t *pool) {
+  int i;
+  for (i = 0; i < pool->num_workers; ++i) {
+    amqp_worker_t *worker = &pool->workers[i];
+    if (NULL != worker->jobs.slots) {
+      amqp_spsc_ring_destroy(&worker->jobs);
+    }
+    if (NULL != worker->done.slots) {
+      amqp_spsc_ring_destroy(&worker->done);
+      amqp_waiter_destroy(&worker->waiter);
+    }
+  }
+  while (NULL != pool->free_jobs) {
+    amqp_worker_job_t *job = pool->free_jobs;
+    pool->free_jobs = job->next;
+    free(job);
+  }
+  amqp_waiter_destroy(&pool->io_waiter);
+  free(pool->workers);
+  free(pool);
+}
+
+amqp_worker_pool_t *amqp_worker_pool_new(amqp_connection_state_t state,
+                                         int num_workers, int queue_depth,
+                                         amqp_worker_callback_t on_delivery,
+                                         amqp_worker_key_callback_t key,
+                                         void *user_data) {
+  amqp_worker_pool_t *pool;
+  int i;
+
+  if (NULL == state || NULL == on_delivery || num_workers < 1 ||
+      queue_depth < 0) {
+    return NULL;
+  }
+
+  pool = calloc(1, sizeof(amqp_worker_pool_t));
+  if (NULL == pool) {
+    return NULL;
+  }
+  pool->workers = calloc(num_workers, sizeof(amqp_worker_t));
+  if (NULL == pool->workers || AMQP_STATUS_OK != amqp_waiter_init(&pool->io_waiter)) {
+    free(pool->workers);
+    free(pool);
+    return NULL;
+  }
+  pool->state = state;
+  pool->on_delivery = on_delivery;
+  pool->key = key;
+  pool->user_data = user_data;
+  pool->num_workers = num_workers;
+
+  for (i = 0; i < num_workers; ++i) {
+    amqp_worker_t *worker = &pool->workers[i];
+    worker->pool = pool;
+    if (AMQP_STATUS_OK !=
+            amqp_spsc_ring_init(&worker->jobs,
+                                queue_depth
+                                    ? (size_t)queue_depth
+                                    : AMQP_WORKER_POOL_DEFAULT_QUEUE_DEPTH) ||
+        AMQP_STATUS_OK != amqp_waiter_init(&worker->waiter)) {
+      goto error;
+    }
+    /* Both rings have the same rounded up size */
+    pool->capacity = worker->jobs.mask + 1;
+    if (AMQP_STATUS_OK != amqp_spsc_ring_init(&worker->done, pool->capacity)) {
+      amqp_waiter_destroy(&worker->waiter);
+      goto error;
+    }
+  }
+
+  for (i = 0; i < num_workers; ++i) {
+    if (0 != pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                            &pool->workers[i])) {
+      goto error;
+    }
+    pool->workers[i].started = 1;
+  }
+  return pool;
+
+error:
+  stop_workers(pool);
+  free_pool(pool);
+  return NULL;
+}
+
+static int wait_for_room(amqp_worker_pool_t *pool, amqp_worker_t *worker) {
+  while (worker->outstanding >= pool->capacity) {
+    int res;
+    amqp_waiter_wait(&pool->io_waiter, worker_has_returned, worker,
+                     amqp_time_infinite());
+    res = collect_returned(pool);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+
+amqp_rpc_reply_t amqp_worker_pool_dispatch(amqp_worker_pool_t *pool,
+                                           const struct timeval *timeout,
+                                           AMQP_UNUSED int flags) {
+  amqp_worker_job_t *job;
+  amqp_worker_t *worker;
+  amqp_time_t deadline;
+  amqp_bytes_t key;
+  amqp_rpc_reply_t ret;
+  int res;
+
+  res = amqp_time_from_now(&deadline, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return amqp_rpc_reply_error(res);
+  }
+
+  job = pool->free_jobs;
+  if (NULL != job) {
+    pool->free_jobs = job->next;
+  } else {
+    job = malloc(sizeof(amqp_worker_job_t));
+    if (NULL == job) {
+      return amqp_rpc_reply_error(AMQP_STATUS_NO_MEMORY);
+    }
+  }
+
+  for (;;) {
+    amqp_time_t wait = deadline;
+    struct timeval tv;
+    struct timeval *tvp;
+
+    res = collect_returned(pool);
+    if (AMQP_STATUS_OK != res) {
+      ret = amqp_rpc_reply_error(res);
+      goto error;
+    }
+
+    /* Acks posted by the workers can't interrupt the read, so it's done in
+     * slices while any are expected */
+    if (pool->in_flight > 0) {
+      struct timeval interval;
+      amqp_time_t next;
+      interval.tv_sec = 0;
+      interval.tv_usec = AMQP_WORKER_POOL_ACK_INTERVAL_US;
+      res = amqp_time_from_now(&next, &interval);
+      if (AMQP_STATUS_OK != res) {
+        ret = amqp_rpc_reply_error(res);
+        goto error;
+      }
+      wait = amqp_time_first(deadline, next);
+    }
+    res = amqp_time_tv_until(wait, &tv, &tvp);
+    if (AMQP_STATUS_OK != res) {
+      ret = amqp_rpc_reply_error(res);
+      goto error;
+    }
+
+    ret = amqp_consume_message(pool->state, &job->envelope, tvp, 0);
+    if (AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type &&
+        AMQP_STATUS_TIMEOUT == ret.library_error &&
+        !amqp_time_equal(wait, deadline)) {
+      continue;
+    }
+    if (AMQP_RESPONSE_NORMAL != ret.reply_type) {
+      goto error;
+    }
+    break;
+  }
+
+  key = NULL != pool->key ? pool->key(&job->envelope, pool->user_data)
+                          : job->envelope.routing_key;
+  worker = &pool->workers[worker_key_hash(key) % (uint32_t)pool->num_workers];
+
+  res = wait_for_room(pool, worker);
+  if (AMQP_STATUS_OK != res) {
+    amqp_destroy_envelope(&job->envelope);
+    ret = amqp_rpc_reply_error(res);
+    goto error;
+  }
+
+  job->worker = worker;
+  job->ack_method = 0;
+  job->requeue = 0;
+  worker->outstanding++;
+  pool->in_flight++;
+  amqp_spsc_ring_push(&worker->jobs, job);
+  amqp_waiter_wake(&worker->waiter);
+  return ret;
+
+error:
+  job->next = pool->free_jobs;
+  pool->free_jobs = job;
+  return ret;
+}
+
+static int settle(amqp_worker_pool_t *pool, amqp_envelope_t *envelope,
+                  amqp_method_number_t method, amqp_boolean_t requeue) {
+  amqp_worker_job_t *job = (amqp_worker_job_t *)envelope;
+  if (NULL == pool || NULL == envelope || job->worker->pool != pool) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  job->ack_method = method;
+  job->requeue = requeue;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_worker_pool_ack(amqp_worker_pool_t *pool, amqp_envelope_t *envelope) {
+  return settle(pool, envelope, AMQP_BASIC_ACK_METHOD, 0);
+}
+
+int amqp_worker_pool_reject(amqp_worker_pool_t *pool,
+                            amqp_envelope_t *envelope,
+                            amqp_boolean_t requeue) {
+  return settle(pool, envelope, AMQP_BASIC_REJECT_METHOD, requeue);
+}
+
+int amqp_worker_pool_flush(amqp_worker_pool_t *pool) {
+  return collect_returned(pool);
+}
+
+int amqp_worker_pool_destroy(amqp_worker_pool_t *pool) {
+  int res;
+  if (NULL == pool) {
+    return AMQP_STATUS_OK;
+  }
+  stop_workers(pool);
+  res = collect_returned(pool);
+  free_pool(pool);
+  return res;
+}
+
+#else
+
+amqp_worker_pool_t *amqp_worker_pool_new(
+    AMQP_UNUSED amqp_connection_state_t state, AMQP_UNUSED int num_workers,
+    AMQP_UNUSED int queue_depth, AMQP_UNUSED amqp_worker_callback_t on_delivery,
+    AMQP_UNUSED amqp_worker_key_callback_t key, AMQP_UNUSED void *user_data) {
+  return NULL;
+}
+
+amqp_rpc_reply_t amqp_worker_pool_dispatch(
+    AMQP_UNUSED amqp_worker_pool_t *pool,
+    AMQP_UNUSED const struct timeval *timeout, AMQP_UNUSED int flags) {
+  return amqp_rpc_reply_error(AMQP_STATUS_UNSUPPORTED);
+}
+
+int amqp_worker_pool_ack(AMQP_UNUSED amqp_worker_pool_t *pool,
+                         AMQP_UNUSED amqp_envelope_t *envelope) {
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int amqp_worker_pool_reject(AMQP_UNUSED amqp_worker_pool_t *pool,
+                            AMQP_UNUSED amqp_envelope_t *envelope,
+                            AMQP_UNUSED amqp_boolean_t requeue) {
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int amqp_worker_pool_flush(AMQP_UNUSED amqp_worker_pool_t *pool) {
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int amqp_worker_pool_destroy(AMQP_UNUSED amqp_worker_pool_t *pool) {
+  return AMQP_STATUS_OK;
+}
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "test_helpers.h"
+
+#include <stddef.h>
+
+static amqp_connection_state_t conn, broker;
+
+static void expect_ack(uint64_t tag, amqp_boolean_t multiple) {
+  amqp_basic_ack_t *ack = expect_method(broker, 1, AMQP_BASIC_ACK_METHOD);
+  check(ack->delivery_tag == tag, "wrong delivery tag");
+  check(ack->multiple == multiple, "wrong multiple flag");
+}
+
+static void expect_nothing(void) {
+  struct timeval timeout = {0, 0};
+  amqp_frame_t frame;
+  check(amqp_simple_wait_frame_noblock(broker, &frame, &timeout) ==
+            AMQP_STATUS_TIMEOUT,
+        "unexpected frame");
+}
+
+static void ack(uint64_t tag) {
+  check(amqp_basic_ack(conn, 1, tag, 0) == AMQP_STATUS_OK,
+        "amqp_basic_ack failed");
+}
+
+int main(void) {
+  struct timeval no_delay = {0, 0};
+  struct timeval timeout = {0, 1000};
+  amqp_channel_open_t open;
+  amqp_channel_close_t close;
+  amqp_channel_close_ok_t close_ok;
+  amqp_frame_t frame;
+  uint64_t tag;
+
+  connection_pair(&conn, &broker);
+
+  check(amqp_set_ack_coalescing(conn, 0, 4, NULL) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "coalescing enabled on channel 0");
+  check(amqp_set_ack_coalescing(conn, 1, 4, NULL) == AMQP_STATUS_OK,
+        "amqp_set_ack_coalescing failed");
+
+  /* Four acks in order become one */
+  for (tag = 1; tag <= 3; ++tag) {
+    ack(tag);
+  }
+  expect_nothing();
+  ack(4);
+  expect_ack(4, 1);
+  expect_nothing();
+
+  /* Acks past an unsettled delivery can't be combined with it */
+  ack(6);
+  ack(7);
+  check(amqp_flush_acks(conn) == AMQP_STATUS_OK, "amqp_flush_acks failed");
+  expect_ack(6, 0);
+  expect_ack(7, 0);
+  ack(5);
+  check(amqp_flush_acks(conn) == AMQP_STATUS_OK, "amqp_flush_acks failed");
+  expect_ack(5, 0);
+  expect_nothing();
+
+  /* Rejects are sent at once and fill their gap */
+  check(amqp_basic_reject(conn, 1, 8, 1) == AMQP_STATUS_OK,
+        "amqp_basic_reject failed");
+  expect_method(broker, 1, AMQP_BASIC_REJECT_METHOD);
+  ack(9);
+  ack(10);
+  expect_nothing();
+  check(amqp_flush_acks(conn) == AMQP_STATUS_OK, "amqp_flush_acks failed");
+  expect_ack(10, 1);
+
+  /* Recorded acks go out before a blocking read */
+  ack(11);
+  expect_nothing();
+  check(amqp_simple_wait_frame_noblock(conn, &frame, &timeout) ==
+            AMQP_STATUS_TIMEOUT,
+        "unexpected frame for the client");
+  expect_ack(11, 0);
+
+  /* A nack covering several deliveries flushes what's recorded first */
+  ack(12);
+  check(amqp_basic_nack(conn, 1, 13, 1, 0) == AMQP_STATUS_OK,
+        "amqp_basic_nack failed");
+  expect_ack(12, 0);
+  expect_method(broker, 1, AMQP_BASIC_NACK_METHOD);
+
+  /* An ack held longer than max_delay is sent with the next one */
+  check(amqp_set_ack_coalescing(conn, 1, 100, &no_delay) == AMQP_STATUS_OK,
+        "amqp_set_ack_coalescing failed");
+  ack(14);
+  expect_ack(14, 0);
+  check(amqp_set_ack_coalescing(conn, 1, 100, NULL) == AMQP_STATUS_OK,
+        "amqp_set_ack_coalescing failed");
+
+  /* Closing the channel sends what's recorded first */
+  ack(15);
+  ack(16);
+  close.reply_code = AMQP_REPLY_SUCCESS;
+  close.reply_text = amqp_empty_bytes;
+  close.class_id = 0;
+  close.method_id = 0;
+  check(amqp_send_method(conn, 1, AMQP_CHANNEL_CLOSE_METHOD, &close) ==
+            AMQP_STATUS_OK,
+        "close not sent");
+  expect_ack(16, 1);
+  expect_method(broker, 1, AMQP_CHANNEL_CLOSE_METHOD);
+
+  /* Tags start over on the reopened channel, and acks recorded when the
+   * broker closes it are dropped */
+  open.out_of_band = amqp_empty_bytes;
+  check(amqp_send_method(conn, 1, AMQP_CHANNEL_OPEN_METHOD, &open) ==
+            AMQP_STATUS_OK,
+        "open not sent");
+  expect_method(broker, 1, AMQP_CHANNEL_OPEN_METHOD);
+  ack(1);
+  ack(2);
+  check(amqp_send_method(conn, 1, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok) ==
+            AMQP_STATUS_OK,
+        "close-ok not sent");
+  expect_method(broker, 1, AMQP_CHANNEL_CLOSE_OK_METHOD);
+  expect_nothing();
+
+  /* Disabling coalescing sends acks as they come again */
+  check(amqp_send_method(conn, 1, AMQP_CHANNEL_OPEN_METHOD, &open) ==
+            AMQP_STATUS_OK,
+        "open not sent");
+  expect_method(broker, 1, AMQP_CHANNEL_OPEN_METHOD);
+  ack(1);
+  check(amqp_set_ack_coalescing(conn, 1, 0, NULL) == AMQP_STATUS_OK,
+        "amqp_set_ack_coalescing failed");
+  expect_ack(1, 0);
+  ack(2);
+  expect_ack(2, 0);
+
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(broker);
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "test_helpers.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* Deliveries processed in 1ms, then in 50ms */
+#define FAST_DELIVERIES 200
+#define SLOW_DELIVERIES 10
+#define NUM_DELIVERIES (FAST_DELIVERIES + SLOW_DELIVERIES)
+/* Delay before the broker answers a basic.qos */
+#define RTT_US 20000
+#define MAX_QOS 16
+
+/* Written by the broker thread, read after it's joined */
+static int qos_counts[MAX_QOS];
+static int num_qos;
+static int qos_not_global;
+
+/* Plays a broker that honours the prefetch count */
+static void *broker_main(void *arg) {
+  amqp_connection_state_t broker = arg;
+  uint64_t sent = 0;
+  int unacked = 0;
+  int prefetch = 0;
+  int acked = 0;
+
+  while (acked < NUM_DELIVERIES) {
+    amqp_frame_t frame;
+
+    check(amqp_simple_wait_frame(broker, &frame) == AMQP_STATUS_OK,
+          "broker read failed");
+    check(AMQP_FRAME_METHOD == frame.frame_type && 1 == frame.channel,
+          "not a method on channel 1");
+
+    if (AMQP_BASIC_QOS_METHOD == frame.payload.method.id) {
+      amqp_basic_qos_t *qos = frame.payload.method.decoded;
+      amqp_basic_qos_ok_t ok;
+      check(num_qos < MAX_QOS, "too many basic.qos");
+      qos_counts[num_qos++] = qos->prefetch_count;
+      if (!qos->global) {
+        qos_not_global = 1;
+      }
+      prefetch = qos->prefetch_count;
+      usleep(RTT_US);
+      check(amqp_send_method(broker, 1, AMQP_BASIC_QOS_OK_METHOD, &ok) ==
+                AMQP_STATUS_OK,
+            "qos-ok not sent");
+    } else {
+      amqp_basic_ack_t *ack = frame.payload.method.decoded;
+      check(AMQP_BASIC_ACK_METHOD == frame.payload.method.id, "not an ack");
+      check(!ack->multiple, "multiple ack");
+      unacked--;
+      acked++;
+    }
+
+    while (unacked < prefetch && sent < NUM_DELIVERIES) {
+      deliver(broker, 1, "ctag", ++sent, "key", NULL);
+      unacked++;
+    }
+    amqp_maybe_release_buffers(broker);
+  }
+  return NULL;
+}
+
+int main(void) {
+  amqp_connection_state_t conn, broker;
+  pthread_t broker_thread;
+  amqp_envelope_t envelope;
+  amqp_rpc_reply_t reply;
+  int i;
+
+  connection_pair(&conn, &broker);
+
+  check(amqp_set_adaptive_prefetch(conn, 1, 0, 10).library_error ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "minimum of 0 accepted");
+  check(amqp_set_adaptive_prefetch(conn, 1, 10, 5).library_error ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "minimum above maximum accepted");
+
+  check(pthread_create(&broker_thread, NULL, broker_main, broker) == 0,
+        "pthread_create failed");
+  reply = amqp_set_adaptive_prefetch(conn, 1, 1, 100);
+  check(reply.reply_type == AMQP_RESPONSE_NORMAL,
+        "amqp_set_adaptive_prefetch failed");
+
+  for (i = 0; i < NUM_DELIVERIES; ++i) {
+    reply = amqp_consume_message(conn, &envelope, NULL, 0);
+    check(reply.reply_type == AMQP_RESPONSE_NORMAL, "no delivery");
+    usleep(i < FAST_DELIVERIES ? 1000 : 50000);
+    check(amqp_basic_ack(conn, 1, envelope.delivery_tag, 0) ==
+              AMQP_STATUS_OK,
+          "amqp_basic_ack failed");
+    amqp_destroy_envelope(&envelope);
+  }
+  pthread_join(broker_thread, NULL);
+
+  check(!qos_not_global, "basic.qos not channel wide");
+  check(num_qos >= 3, "prefetch not adjusted twice");
+  check(1 == qos_counts[0], "didn't start at the minimum");
+  /* A 20ms round trip over 1ms messages wants about 26 */
+  for (i = 1; i < num_qos && qos_counts[i] < 10; ++i) {
+  }
+  check(i < num_qos, "prefetch not raised for fast processing");
+  check(qos_counts[num_qos - 1] <= 4,
+        "prefetch not lowered for slow processing");
+
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(broker);
+  return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_private.h"
+#include "test_helpers.h"
+
+#include <string.h>
+
+/* The sizes of a new connection's pool pages and socket buffers */
+#define PAGE_SIZE 65536
+#define INBOUND_SIZE 131072
+#define NUM_STALE 8
+
+static amqp_connection_state_t new_connection(void) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_bytes_t input;
+  amqp_frame_t frame;
+
+  check(conn != NULL, "amqp_new_connection failed");
+  input.bytes = (void *)protocol_header;
+  input.len = sizeof(protocol_header);
+  check(amqp_handle_input(conn, input, &frame) == (int)input.len,
+        "protocol header not consumed");
+  return conn;
+}
+
+/* Wraps payload in a frame and feeds it through the decoder */
+static void feed(amqp_connection_state_t conn, uint8_t type,
+                 amqp_channel_t channel, const void *payload, size_t len,
+                 amqp_frame_t *frame) {
+  unsigned char raw[512];
+  amqp_bytes_t input;
+
+  check(len + 8 <= sizeof(raw), "frame too large");
+  raw[0] = type;
+  raw[1] = (unsigned char)(channel >> 8);
+  raw[2] = (unsigned char)channel;
+  raw[3] = (unsigned char)(len >> 24);
+  raw[4] = (unsigned char)(len >> 16);
+  raw[5] = (unsigned char)(len >> 8);
+  raw[6] = (unsigned char)len;
+  memcpy(raw + 7, payload, len);
+  raw[7 + len] = AMQP_FRAME_END;
+  input.bytes = raw;
+  input.len = len + 8;
+  check(amqp_handle_input(conn, input, frame) == (int)input.len,
+        "frame not consumed");
+}
+
+/* Decodes a delivery with a header table and checks every field, which
+ * would show up anything left over in the memory it was decoded into */
+static void decode_delivery(amqp_connection_state_t conn) {
+  unsigned char payload[256];
+  amqp_basic_deliver_t deliver;
+  amqp_basic_properties_t properties;
+  amqp_table_entry_t entry;
+  amqp_basic_deliver_t *d;
+  amqp_basic_properties_t *p;
+  amqp_bytes_t encoded;
+  amqp_frame_t frame;
+  int len;
+
+  deliver.consumer_tag = amqp_cstring_bytes("ctag");
+  deliver.delivery_tag = 42;
+  deliver.redelivered = 1;
+  deliver.exchange = amqp_cstring_bytes("exchange");
+  deliver.routing_key = amqp_cstring_bytes("key");
+  payload[0] = 0;
+  payload[1] = 60;
+  payload[2] = 0;
+  payload[3] = 60;
+  encoded.bytes = payload + 4;
+  encoded.len = sizeof(payload) - 4;
+  len = amqp_encode_method(AMQP_BASIC_DELIVER_METHOD, &deliver, encoded);
+  check(len > 0, "amqp_encode_method failed");
+  feed(conn, AMQP_FRAME_METHOD, 1, payload, 4 + len, &frame);
+  check(AMQP_FRAME_METHOD == frame.frame_type &&
+            AMQP_BASIC_DELIVER_METHOD == frame.payload.method.id,
+        "method not decoded");
+  d = frame.payload.method.decoded;
+  check(bytes_is(d->consumer_tag, "ctag") && 42 == d->delivery_tag &&
+            1 == d->redelivered && bytes_is(d->exchange, "exchange") &&
+            bytes_is(d->routing_key, "key"),
+        "method decoded wrongly");
+
+  entry.key = amqp_cstring_bytes("x-count");
+  entry.value.kind = AMQP_FIELD_KIND_I32;
+  entry.value.value.i32 = 7;
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG;
+  properties.content_type = amqp_cstring_bytes("text/plain");
+  properties.headers.num_entries = 1;
+  properties.headers.entries = &entry;
+  memset(payload, 0, 12);
+  payload[1] = 60;
+  payload[11] = 4;
+  encoded.bytes = payload + 12;
+  encoded.len = sizeof(payload) - 12;
+  len = amqp_encode_properties(AMQP_BASIC_CLASS, &properties, encoded);
+  check(len > 0, "amqp_encode_properties failed");
+  feed(conn, AMQP_FRAME_HEADER, 1, payload, 12 + len, &frame);
+  check(AMQP_FRAME_HEADER == frame.frame_type &&
+            4 == frame.payload.properties.body_size,
+        "header not decoded");
+  p = frame.payload.properties.decoded;
+  check((AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG) ==
+                p->_flags &&
+            bytes_is(p->content_type, "text/plain") &&
+            1 == p->headers.num_entries &&
+            bytes_is(p->headers.entries[0].key, "x-count") &&
+            AMQP_FIELD_KIND_I32 == p->headers.entries[0].value.kind &&
+            7 == p->headers.entries[0].value.value.i32,
+        "properties decoded wrongly");
+
+  feed(conn, AMQP_FRAME_BODY, 1, "body", 4, &frame);
+  check(AMQP_FRAME_BODY == frame.frame_type &&
+            bytes_is(frame.payload.body_fragment, "body"),
+        "body decoded wrongly");
+}
+
+/* Fills cached blocks of size with garbage */
+static void poison_cache(size_t size) {
+  void *blocks[NUM_STALE];
+  int i;
+
+  for (i = 0; i < NUM_STALE; i++) {
+    blocks[i] = amqp_buffer_cache_alloc(size);
+    check(blocks[i] != NULL, "amqp_buffer_cache_alloc failed");
+    memset(blocks[i], 0xA5, size);
+  }
+  for (i = 0; i < NUM_STALE; i++) {
+    amqp_buffer_cache_free(blocks[i], size);
+  }
+}
+
+int main(void) {
+  amqp_connection_state_t conn;
+  void *page;
+
+  if (amqp_set_thread_buffer_cache(4 * 1024 * 1024) != AMQP_STATUS_OK) {
+    /* No thread-local storage */
+    return 0;
+  }
+
+  /* The pages of a destroyed connection are picked up by the next one */
+  conn = new_connection();
+  decode_delivery(conn);
+  amqp_destroy_connection(conn);
+  page = amqp_buffer_cache_alloc(PAGE_SIZE);
+  check(page != NULL, "amqp_buffer_cache_alloc failed");
+  amqp_buffer_cache_free(page, PAGE_SIZE);
+  check(amqp_buffer_cache_alloc(PAGE_SIZE) == page, "page not cached");
+  amqp_buffer_cache_free(page, PAGE_SIZE);
+
+  /* Reused pages and buffers hold whatever was last written to them */
+  poison_cache(PAGE_SIZE);
+  poison_cache(INBOUND_SIZE);
+  conn = new_connection();
+  decode_delivery(conn);
+  amqp_maybe_release_buffers(conn);
+  decode_delivery(conn);
+  amqp_destroy_connection(conn);
+
+  check(amqp_set_thread_buffer_cache(0) == AMQP_STATUS_OK,
+        "cache not emptied");
+  return 0;
+}
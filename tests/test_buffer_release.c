@@ -0,0 +1,119 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "test_helpers.h"
+
+static amqp_connection_state_t new_connection(void) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_bytes_t input;
+  amqp_frame_t frame;
+
+  check(conn != NULL, "amqp_new_connection failed");
+
+  input.bytes = (void *)protocol_header;
+  input.len = sizeof(protocol_header);
+  check(amqp_handle_input(conn, input, &frame) == (int)input.len,
+        "protocol header not consumed");
+  return conn;
+}
+
+/* Feed a 4-byte body frame on channel through the decoder, return a pointer
+ * to the decoded payload */
+static void *feed_body_frame(amqp_connection_state_t conn,
+                             amqp_channel_t channel) {
+  unsigned char raw[] = {AMQP_FRAME_BODY, 0, 0, 0, 0, 0, 4,
+                         'b', 'o', 'd', 'y', AMQP_FRAME_END};
+  amqp_bytes_t input;
+  amqp_frame_t frame;
+
+  raw[1] = (unsigned char)(channel >> 8);
+  raw[2] = (unsigned char)(channel & 0xFF);
+  input.bytes = raw;
+  input.len = sizeof(raw);
+
+  check(amqp_handle_input(conn, input, &frame) == (int)input.len,
+        "body frame not consumed");
+  check(frame.frame_type == AMQP_FRAME_BODY, "body frame not decoded");
+  return frame.payload.body_fragment.bytes;
+}
+
+static void test_no_policy(void) {
+  amqp_connection_state_t conn = new_connection();
+  void *first = feed_body_frame(conn, 1);
+
+  feed_body_frame(conn, 1);
+  check(feed_body_frame(conn, 1) != first,
+        "memory recycled without a release policy");
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_frame_threshold(void) {
+  amqp_connection_state_t conn = new_connection();
+  void *first;
+
+  check(amqp_set_buffer_release_policy(conn, 0, -1) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "negative frame threshold accepted");
+  check(amqp_set_buffer_release_policy(conn, 0, 2) == AMQP_STATUS_OK,
+        "amqp_set_buffer_release_policy failed");
+
+  first = feed_body_frame(conn, 1);
+  check(feed_body_frame(conn, 2) != first, "channels share a pool");
+  check(feed_body_frame(conn, 1) != first, "recycled before threshold");
+  check(feed_body_frame(conn, 1) == first, "not recycled at threshold");
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_queued_frames_pin_pool(void) {
+  amqp_connection_state_t conn = new_connection();
+  amqp_frame_t frame;
+  void *first;
+
+  first = feed_body_frame(conn, 1);
+
+  frame.frame_type = AMQP_FRAME_HEARTBEAT;
+  frame.channel = 1;
+  check(amqp_queue_frame(conn, &frame) == AMQP_STATUS_OK,
+        "amqp_queue_frame failed");
+
+  amqp_maybe_release_buffers_on_channel(conn, 1);
+  check(feed_body_frame(conn, 1) != first, "recycled with a queued frame");
+
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK,
+        "queued frame not returned");
+  check(frame.channel == 1, "wrong queued frame returned");
+
+  amqp_maybe_release_buffers_on_channel(conn, 1);
+  check(feed_body_frame(conn, 1) == first, "not recycled once drained");
+
+  amqp_destroy_connection(conn);
+}
+
+int main(void) {
+  test_no_policy();
+  test_frame_threshold();
+  test_queued_frames_pin_pool();
+  return 0;
+}
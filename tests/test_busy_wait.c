@@ -0,0 +1,99 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "amqp_time.h"
+#include <amqp.h>
+#include <amqp_tcp_socket.h>
+#include "test_helpers.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const unsigned char body[] = {
+    AMQP_FRAME_BODY, 0, 1, 0, 0, 0, 4, 'b', 'o', 'd', 'y', AMQP_FRAME_END};
+
+/* Sends a body frame once the reader has started spinning */
+static void *late_writer(void *arg) {
+  usleep(20000);
+  write_all(*(int *)arg, body, sizeof(body));
+  return NULL;
+}
+
+static void expect_late_frame(amqp_connection_state_t conn, int peer) {
+  amqp_frame_t frame;
+  pthread_t writer;
+
+  check(pthread_create(&writer, NULL, late_writer, &peer) == 0,
+        "pthread_create failed");
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK &&
+            AMQP_FRAME_BODY == frame.frame_type &&
+            4 == frame.payload.body_fragment.len,
+        "frame not received while spinning");
+  check(pthread_join(writer, NULL) == 0, "pthread_join failed");
+}
+
+int main(void) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket = amqp_tcp_socket_new(conn);
+  struct timeval timeout = {0, 50000};
+  amqp_frame_t frame;
+  uint64_t start;
+  int sv[2];
+
+  check(socket != NULL, "amqp_tcp_socket_new failed");
+  check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+  check(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0, "fcntl failed");
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  write_all(sv[1], protocol_header, sizeof(protocol_header));
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK,
+        "protocol header not read");
+
+  check(amqp_set_busy_wait(conn, -1, 0) == AMQP_STATUS_INVALID_PARAMETER,
+        "negative spin accepted");
+
+  /* Frames arriving during the spin are read, with or without backoff */
+  check(amqp_set_busy_wait(conn, 2000000, 0) == AMQP_STATUS_OK,
+        "amqp_set_busy_wait failed");
+  expect_late_frame(conn, sv[1]);
+  check(amqp_set_busy_wait(conn, 2000000, 1) == AMQP_STATUS_OK,
+        "amqp_set_busy_wait failed");
+  expect_late_frame(conn, sv[1]);
+
+  /* The spin ends with the timeout of the call */
+  start = amqp_get_monotonic_timestamp();
+  check(amqp_simple_wait_frame_noblock(conn, &frame, &timeout) ==
+            AMQP_STATUS_TIMEOUT,
+        "frame out of nowhere");
+  check(amqp_get_monotonic_timestamp() - start <
+            1000 * (uint64_t)AMQP_NS_PER_MS,
+        "spin outlasted the timeout");
+
+  /* Turned off, the frame is polled for */
+  check(amqp_set_busy_wait(conn, 0, 0) == AMQP_STATUS_OK,
+        "amqp_set_busy_wait failed");
+  expect_late_frame(conn, sv[1]);
+
+  amqp_destroy_connection(conn);
+  close(sv[1]);
+  return 0;
+}
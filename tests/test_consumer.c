@@ -0,0 +1,204 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "test_helpers.h"
+
+typedef struct consumer_t_ {
+  const char *tag;
+  int deliveries;
+  uint64_t last_delivery_tag;
+  int cancels;
+} consumer_t;
+
+static amqp_connection_state_t conn, broker;
+
+static void AMQP_CALL on_delivery(AMQP_UNUSED amqp_connection_state_t state,
+                                  amqp_envelope_t *envelope,
+                                  void *user_data) {
+  consumer_t *consumer = user_data;
+  check(bytes_is(envelope->consumer_tag, consumer->tag),
+        "delivered to the wrong consumer");
+  check(bytes_is(envelope->routing_key, "key") &&
+            bytes_is(envelope->message.body, "body"),
+        "delivery read wrongly");
+  consumer->deliveries++;
+  consumer->last_delivery_tag = envelope->delivery_tag;
+}
+
+static void AMQP_CALL on_cancel(AMQP_UNUSED amqp_connection_state_t state,
+                                AMQP_UNUSED amqp_channel_t channel,
+                                amqp_bytes_t consumer_tag, void *user_data) {
+  consumer_t *consumer = user_data;
+  check(bytes_is(consumer_tag, consumer->tag), "wrong consumer cancelled");
+  consumer->cancels++;
+}
+
+/* The broker's replies are written first, the socket pair holds them until
+ * the client's RPC reads them */
+static void consume(amqp_channel_t channel, consumer_t *consumer) {
+  amqp_basic_consume_ok_t ok;
+
+  ok.consumer_tag = amqp_cstring_bytes(consumer->tag);
+  send_method(broker, channel, AMQP_BASIC_CONSUME_OK_METHOD, &ok);
+  check(amqp_basic_consume_cb(conn, channel, amqp_cstring_bytes("queue"),
+                              amqp_cstring_bytes(consumer->tag), 0, 0, 0,
+                              amqp_empty_table, on_delivery, on_cancel,
+                              consumer) != NULL,
+        "amqp_basic_consume_cb failed");
+  expect_method(broker, channel, AMQP_BASIC_CONSUME_METHOD);
+}
+
+static void dispatch(void) {
+  struct timeval timeout = {5, 0};
+  check(amqp_consume_dispatch(conn, &timeout, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "nothing dispatched");
+}
+
+/* The next frame has no handler, it's read with amqp_simple_wait_frame()
+ * instead */
+static void expect_undispatched(amqp_method_number_t id) {
+  struct timeval timeout = {5, 0};
+  amqp_rpc_reply_t ret = amqp_consume_dispatch(conn, &timeout, 0);
+  amqp_frame_t frame;
+
+  check(AMQP_RESPONSE_LIBRARY_EXCEPTION == ret.reply_type &&
+            AMQP_STATUS_UNEXPECTED_STATE == ret.library_error,
+        "frame dispatched without a handler");
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK &&
+            AMQP_FRAME_METHOD == frame.frame_type &&
+            id == frame.payload.method.id,
+        "frame not put back");
+  if (AMQP_BASIC_DELIVER_METHOD == id) {
+    amqp_message_t message;
+    check(amqp_read_message(conn, frame.channel, &message, 0).reply_type ==
+              AMQP_RESPONSE_NORMAL,
+          "message not read");
+    amqp_destroy_message(&message);
+  }
+}
+
+int main(void) {
+  consumer_t a1 = {"a", 0, 0, 0};
+  consumer_t b1 = {"b", 0, 0, 0};
+  consumer_t a2 = {"a", 0, 0, 0};
+  consumer_t c1 = {"c", 0, 0, 0};
+  consumer_t d3 = {"d", 0, 0, 0};
+  amqp_basic_cancel_t cancel;
+  amqp_basic_cancel_ok_t cancel_ok;
+  amqp_basic_cancel_ok_t *sent_ok;
+  amqp_channel_open_ok_t open_ok;
+  amqp_channel_close_t close;
+  amqp_channel_close_ok_t close_ok;
+  amqp_connection_close_t connection_close;
+
+  connection_pair(&conn, &broker);
+
+  /* Deliveries go to the consumer with their channel and tag */
+  consume(1, &a1);
+  consume(1, &b1);
+  consume(2, &a2);
+  deliver(broker, 1, "b", 1, "key", "body");
+  deliver(broker, 1, "a", 2, "key", "body");
+  deliver(broker, 2, "a", 1, "key", "body");
+  dispatch();
+  dispatch();
+  dispatch();
+  check(1 == a1.deliveries && 2 == a1.last_delivery_tag &&
+            1 == b1.deliveries && 1 == b1.last_delivery_tag &&
+            1 == a2.deliveries && 1 == a2.last_delivery_tag,
+        "deliveries not routed by channel and consumer tag");
+
+  /* A delivery that overtook the cancel still reaches the consumer, later
+   * ones don't */
+  deliver(broker, 1, "b", 3, "key", "body");
+  cancel_ok.consumer_tag = amqp_cstring_bytes("b");
+  send_method(broker, 1, AMQP_BASIC_CANCEL_OK_METHOD, &cancel_ok);
+  check(amqp_basic_cancel_cb(conn, 1, amqp_cstring_bytes("b")) != NULL,
+        "amqp_basic_cancel_cb failed");
+  expect_method(broker, 1, AMQP_BASIC_CANCEL_METHOD);
+  dispatch();
+  check(2 == b1.deliveries && 3 == b1.last_delivery_tag,
+        "delivery before the cancel-ok lost");
+  deliver(broker, 1, "b", 4, "key", "body");
+  expect_undispatched(AMQP_BASIC_DELIVER_METHOD);
+  check(2 == b1.deliveries && 0 == b1.cancels,
+        "cancelled consumer still dispatched to");
+
+  /* A cancel from the broker is answered and reported */
+  cancel.consumer_tag = amqp_cstring_bytes("a");
+  cancel.nowait = 0;
+  send_method(broker, 2, AMQP_BASIC_CANCEL_METHOD, &cancel);
+  dispatch();
+  check(1 == a2.cancels && 0 == a1.cancels, "cancel not reported");
+  sent_ok = expect_method(broker, 2, AMQP_BASIC_CANCEL_OK_METHOD);
+  check(bytes_is(sent_ok->consumer_tag, "a"), "wrong cancel-ok");
+  deliver(broker, 2, "a", 2, "key", "body");
+  expect_undispatched(AMQP_BASIC_DELIVER_METHOD);
+  check(1 == a2.deliveries, "cancelled consumer still dispatched to");
+
+  /* The broker closing a channel drops its consumers */
+  close.reply_code = AMQP_PRECONDITION_FAILED;
+  close.reply_text = amqp_cstring_bytes("PRECONDITION_FAILED");
+  close.class_id = 0;
+  close.method_id = 0;
+  send_method(broker, 1, AMQP_CHANNEL_CLOSE_METHOD, &close);
+  expect_undispatched(AMQP_CHANNEL_CLOSE_METHOD);
+  send_method(conn, 1, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+  expect_method(broker, 1, AMQP_CHANNEL_CLOSE_OK_METHOD);
+  open_ok.channel_id = amqp_empty_bytes;
+  send_method(broker, 1, AMQP_CHANNEL_OPEN_OK_METHOD, &open_ok);
+  check(amqp_channel_open(conn, 1) != NULL, "amqp_channel_open failed");
+  expect_method(broker, 1, AMQP_CHANNEL_OPEN_METHOD);
+  deliver(broker, 1, "a", 1, "key", "body");
+  expect_undispatched(AMQP_BASIC_DELIVER_METHOD);
+  check(1 == a1.deliveries && 0 == a1.cancels,
+        "consumer of a closed channel still dispatched to");
+
+  /* So does the client closing it */
+  consume(1, &c1);
+  send_method(broker, 1, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+  check(amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_channel_close failed");
+  expect_method(broker, 1, AMQP_CHANNEL_CLOSE_METHOD);
+  deliver(broker, 1, "c", 1, "key", "body");
+  expect_undispatched(AMQP_BASIC_DELIVER_METHOD);
+  check(0 == c1.deliveries, "consumer of a closed channel still dispatched to");
+
+  /* And the broker closing the connection drops them all */
+  consume(3, &d3);
+  check(1 == conn->consumers_count, "consumer not registered");
+  connection_close.reply_code = AMQP_CONNECTION_FORCED;
+  connection_close.reply_text = amqp_cstring_bytes("CONNECTION_FORCED");
+  connection_close.class_id = 0;
+  connection_close.method_id = 0;
+  send_method(broker, 0, AMQP_CONNECTION_CLOSE_METHOD, &connection_close);
+  expect_undispatched(AMQP_CONNECTION_CLOSE_METHOD);
+  check(0 == conn->consumers_count && 0 == d3.cancels,
+        "consumers kept after the connection closed");
+
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(broker);
+  return 0;
+}
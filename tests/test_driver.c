@@ -0,0 +1,150 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "amqp_driver.h"
+#include "amqp_socket.h"
+#include "test_helpers.h"
+
+static void push(amqp_connection_state_t conn, const void *data, size_t len) {
+  amqp_bytes_t input;
+  input.bytes = (void *)data;
+  input.len = len;
+  check(amqp_driver_push_input(conn, input) == AMQP_STATUS_OK,
+        "amqp_driver_push_input failed");
+}
+
+static void test_frames(amqp_connection_state_t conn) {
+  static const unsigned char body[] = {
+      AMQP_FRAME_BODY, 0, 1, 0, 0, 0, 4, 'b', 'o', 'd', 'y', AMQP_FRAME_END};
+  static const unsigned char heartbeat[] = {
+      AMQP_FRAME_HEARTBEAT, 0, 0, 0, 0, 0, 0, AMQP_FRAME_END};
+  amqp_frame_t frames[2];
+
+  check(amqp_driver_pull_frames(conn, frames, 2) == 0, "phantom frames");
+
+  /* Frames split across pushes are reassembled, heartbeats are swallowed */
+  push(conn, body, 5);
+  check(amqp_driver_pull_frames(conn, frames, 2) == 0, "partial frame pulled");
+  push(conn, body + 5, sizeof(body) - 5);
+  push(conn, heartbeat, sizeof(heartbeat));
+  push(conn, body, sizeof(body));
+
+  check(amqp_driver_pull_frames(conn, frames, 1) == 1, "frame not pulled");
+  check(amqp_driver_pull_frames(conn, frames + 1, 1) == 1,
+        "second frame not pulled");
+  check(amqp_driver_pull_frames(conn, frames, 2) == 0, "heartbeat pulled");
+  check(frames[0].frame_type == AMQP_FRAME_BODY && frames[0].channel == 1 &&
+            frames[0].payload.body_fragment.len == 4 &&
+            0 == memcmp(frames[1].payload.body_fragment.bytes, "body", 4),
+        "frame decoded wrongly");
+}
+
+static void test_output(amqp_connection_state_t conn) {
+  amqp_bytes_t output;
+
+  check(amqp_driver_peek_output(conn).len == 0, "phantom output");
+  check(amqp_send_header(conn) == AMQP_STATUS_OK, "amqp_send_header failed");
+  check(amqp_send_header(conn) == AMQP_STATUS_OK, "amqp_send_header failed");
+
+  output = amqp_driver_peek_output(conn);
+  check(output.len == 2 * sizeof(protocol_header) &&
+            0 == memcmp(output.bytes, protocol_header,
+                        sizeof(protocol_header)),
+        "protocol header not queued");
+
+  check(amqp_driver_consume_output(conn, output.len + 1) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "consumed more than pending");
+  check(amqp_driver_consume_output(conn, 3) == AMQP_STATUS_OK,
+        "amqp_driver_consume_output failed");
+  output = amqp_driver_peek_output(conn);
+  check(output.len == 2 * sizeof(protocol_header) - 3 &&
+            0 == memcmp(output.bytes, protocol_header + 3, 5),
+        "partial write not accounted for");
+  check(amqp_driver_consume_output(conn, output.len) == AMQP_STATUS_OK,
+        "amqp_driver_consume_output failed");
+  check(amqp_driver_peek_output(conn).len == 0, "output not drained");
+}
+
+static void test_heartbeats(amqp_connection_state_t conn) {
+  static const unsigned char heartbeat[] = {
+      AMQP_FRAME_HEARTBEAT, 0, 0, 0, 0, 0, 0, AMQP_FRAME_END};
+  amqp_bytes_t output;
+  uint64_t next;
+
+  check(amqp_tune_connection(conn, 0, 131072, 1) == AMQP_STATUS_OK,
+        "amqp_tune_connection failed");
+
+  check(amqp_driver_tick(conn, 1000, &next) == AMQP_STATUS_OK && 2000 == next,
+        "wrong first deadline");
+  check(amqp_driver_peek_output(conn).len == 0, "heartbeat sent early");
+
+  check(amqp_driver_tick(conn, 2000, &next) == AMQP_STATUS_OK, "tick failed");
+  output = amqp_driver_peek_output(conn);
+  check(output.len == sizeof(heartbeat) &&
+            0 == memcmp(output.bytes, heartbeat, sizeof(heartbeat)),
+        "heartbeat not sent");
+  check(amqp_driver_consume_output(conn, output.len) == AMQP_STATUS_OK,
+        "amqp_driver_consume_output failed");
+  check(3000 == next, "wrong deadline after heartbeat");
+
+  /* Traffic is accounted to the tick that follows it */
+  push(conn, heartbeat, sizeof(heartbeat));
+  check(amqp_driver_tick(conn, 2500, &next) == AMQP_STATUS_OK && 3500 == next,
+        "wrong deadline after traffic");
+  check(amqp_driver_tick(conn, 3500, &next) == AMQP_STATUS_OK, "tick failed");
+  check(amqp_driver_peek_output(conn).len == sizeof(heartbeat),
+        "heartbeat not sent");
+
+  /* Output the transport hasn't taken yet stands in for the next heartbeat,
+   * the deadline doesn't fall behind the clock while it waits */
+  push(conn, heartbeat, sizeof(heartbeat));
+  check(amqp_driver_tick(conn, 4600, &next) == AMQP_STATUS_OK && 5600 == next,
+        "wrong deadline with output pending");
+  check(amqp_driver_peek_output(conn).len == sizeof(heartbeat),
+        "heartbeat queued behind pending output");
+  check(amqp_driver_consume_output(conn, amqp_driver_peek_output(conn).len) ==
+            AMQP_STATUS_OK,
+        "amqp_driver_consume_output failed");
+  check(amqp_driver_tick(conn, 5600, &next) == AMQP_STATUS_OK && 6600 == next,
+        "wrong deadline after writing output");
+  check(amqp_driver_peek_output(conn).len == 0, "heartbeat sent early");
+  check(amqp_driver_tick(conn, 6600, &next) == AMQP_STATUS_HEARTBEAT_TIMEOUT,
+        "missed heartbeats not detected");
+}
+
+int main(void) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_frame_t frame;
+
+  check(amqp_driver_socket_new(conn) != NULL, "amqp_driver_socket_new failed");
+
+  test_frames(conn);
+  test_output(conn);
+  test_heartbeats(conn);
+
+  check(amqp_simple_wait_frame(conn, &frame) < 0,
+        "blocking wait on a driver socket");
+  amqp_destroy_connection(conn);
+  return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "amqp_socket.h"
+#include "amqp_tcp_socket.h"
+#include "test_helpers.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+  int body_frames;
+  int status;
+  int flows;
+} test_counts_t;
+
+/* A connection reading from one end of a socket pair, past the protocol
+ * header. The other end is returned in peer. */
+static amqp_connection_state_t new_connection(int *peer) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+  int sv[2];
+
+  check(conn != NULL, "amqp_new_connection failed");
+  socket = amqp_tcp_socket_new(conn);
+  check(socket != NULL, "amqp_tcp_socket_new failed");
+  check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+  check(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0, "fcntl failed");
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+
+  write_all(sv[1], protocol_header, sizeof(protocol_header));
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK,
+        "protocol header not read");
+
+  *peer = sv[1];
+  return conn;
+}
+
+static void AMQP_CALL count_frames(amqp_event_loop_t *loop,
+                                   amqp_connection_state_t state,
+                                   const amqp_frame_t *frame, int status,
+                                   void *user_data) {
+  test_counts_t *counts = user_data;
+  (void)loop;
+  (void)state;
+
+  if (NULL == frame) {
+    counts->status = status;
+  } else if (AMQP_FRAME_BODY == frame->frame_type) {
+    counts->body_frames++;
+  }
+}
+
+static void test_dispatch(amqp_event_loop_t *loop) {
+  static const unsigned char body[] = {
+      AMQP_FRAME_BODY, 0, 1, 0, 0, 0, 4, 'b', 'o', 'd', 'y', AMQP_FRAME_END};
+  struct timeval timeout = {1, 0};
+  amqp_connection_state_t conn1, conn2;
+  test_counts_t counts1 = {0, 0, 0}, counts2 = {0, 0, 0};
+  int peer1, peer2;
+  int i;
+
+  conn1 = new_connection(&peer1);
+  conn2 = new_connection(&peer2);
+  check(amqp_event_loop_add(loop, conn1, count_frames, &counts1) ==
+            AMQP_STATUS_OK,
+        "amqp_event_loop_add failed");
+  check(amqp_event_loop_add(loop, conn2, count_frames, &counts2) ==
+            AMQP_STATUS_OK,
+        "amqp_event_loop_add failed");
+  check(amqp_event_loop_add(loop, conn2, count_frames, &counts2) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "connection added twice");
+
+  write_all(peer1, body, sizeof(body));
+  write_all(peer2, body, sizeof(body));
+  write_all(peer2, body, sizeof(body));
+
+  for (i = 0; i < 10 && counts1.body_frames + counts2.body_frames < 3; ++i) {
+    check(amqp_event_loop_run_once(loop, &timeout) == AMQP_STATUS_OK,
+          "amqp_event_loop_run_once failed");
+  }
+  check(counts1.body_frames == 1 && counts2.body_frames == 2,
+        "frames not dispatched to their connection");
+
+  close(peer2);
+  check(amqp_event_loop_run_once(loop, &timeout) == AMQP_STATUS_OK,
+        "closed socket not reported");
+  check(counts2.status == AMQP_STATUS_CONNECTION_CLOSED,
+        "wrong status for closed socket");
+  check(amqp_event_loop_remove(loop, conn2) == AMQP_STATUS_INVALID_PARAMETER,
+        "failed connection still in the loop");
+
+  amqp_destroy_connection(conn2);
+  amqp_destroy_connection(conn1);
+  close(peer1);
+}
+
+static void test_heartbeat(amqp_event_loop_t *loop) {
+  static const unsigned char heartbeat[] = {
+      AMQP_FRAME_HEARTBEAT, 0, 0, 0, 0, 0, 0, AMQP_FRAME_END};
+  struct timeval timeout = {0, 200000};
+  struct timeval recv_timeout = {0, 300000};
+  unsigned char sent[sizeof(heartbeat)];
+  amqp_connection_state_t conn;
+  test_counts_t counts = {0, 0, 0};
+  int peer;
+  int i;
+
+  conn = new_connection(&peer);
+  /* Due to send a heartbeat now, and to give up on the peer shortly */
+  conn->heartbeat = 1;
+  conn->next_send_heartbeat = amqp_time_immediate();
+  check(amqp_time_from_now(&conn->next_recv_heartbeat, &recv_timeout) ==
+            AMQP_STATUS_OK,
+        "amqp_time_from_now failed");
+
+  check(amqp_event_loop_add(loop, conn, count_frames, &counts) ==
+            AMQP_STATUS_OK,
+        "amqp_event_loop_add failed");
+  for (i = 0; i < 10 && 0 == counts.status; ++i) {
+    amqp_event_loop_run_once(loop, &timeout);
+  }
+
+  check(read(peer, sent, sizeof(sent)) == sizeof(sent) &&
+            0 == memcmp(sent, heartbeat, sizeof(sent)),
+        "heartbeat not sent");
+  check(counts.status == AMQP_STATUS_HEARTBEAT_TIMEOUT,
+        "missed heartbeats not detected");
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+static void send_flow(amqp_connection_state_t broker, amqp_boolean_t active) {
+  amqp_channel_flow_t flow;
+  flow.active = active;
+  send_method(broker, 1, AMQP_CHANNEL_FLOW_METHOD, &flow);
+}
+
+/* Plays the broker for a connection that is recovered when told to stop the
+ * flow, then sends on the recovered connection */
+static void *recovery_broker(void *arg) {
+  int listen_fd = *(int *)arg;
+  amqp_connection_state_t broker, recovered;
+  amqp_channel_open_ok_t open_ok;
+  amqp_channel_close_ok_t channel_close_ok;
+  amqp_connection_close_ok_t close_ok;
+
+  broker = connection_on(accept(listen_fd, NULL, NULL));
+  handshake(broker);
+  send_flow(broker, 0);
+
+  /* Recovery replays the (empty) topology on a channel of its own */
+  recovered = connection_on(accept(listen_fd, NULL, NULL));
+  handshake(recovered);
+  expect_method(recovered, 65535, AMQP_CHANNEL_OPEN_METHOD);
+  open_ok.channel_id = amqp_empty_bytes;
+  send_method(recovered, 65535, AMQP_CHANNEL_OPEN_OK_METHOD, &open_ok);
+  expect_method(recovered, 65535, AMQP_CHANNEL_CLOSE_METHOD);
+  send_method(recovered, 65535, AMQP_CHANNEL_CLOSE_OK_METHOD,
+              &channel_close_ok);
+  send_flow(recovered, 1);
+  expect_method(recovered, 0, AMQP_CONNECTION_CLOSE_METHOD);
+  send_method(recovered, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &close_ok);
+
+  amqp_destroy_connection(recovered);
+  amqp_destroy_connection(broker);
+  return NULL;
+}
+
+static void AMQP_CALL recover_on_flow(amqp_event_loop_t *loop,
+                                      amqp_connection_state_t state,
+                                      const amqp_frame_t *frame, int status,
+                                      void *user_data) {
+  test_counts_t *counts = user_data;
+  (void)loop;
+
+  if (NULL == frame) {
+    counts->status = status;
+  } else if (AMQP_FRAME_METHOD == frame->frame_type &&
+             AMQP_CHANNEL_FLOW_METHOD == frame->payload.method.id) {
+    amqp_channel_flow_t *flow = frame->payload.method.decoded;
+    if (!flow->active) {
+      check(amqp_recover_connection(state).reply_type == AMQP_RESPONSE_NORMAL,
+            "amqp_recover_connection failed");
+    } else {
+      counts->flows++;
+    }
+  }
+}
+
+/* A connection recovered from its callback is watched on its new socket,
+ * which likely reuses the descriptor number of the old one */
+static void test_recovery(amqp_event_loop_t *loop) {
+  struct amqp_connection_info info;
+  struct timeval timeout = {5, 0};
+  struct timeval wait = {1, 0};
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  test_counts_t counts = {0, 0, 0};
+  pthread_t broker_thread;
+  int listen_fd;
+  int port;
+  int i;
+
+  listen_fd = listen_on(1, &port);
+  check(pthread_create(&broker_thread, NULL, recovery_broker, &listen_fd) == 0,
+        "pthread_create failed");
+
+  amqp_default_connection_info(&info);
+  info.host = "127.0.0.1";
+  info.port = port;
+
+  conn = amqp_new_connection();
+  check(conn != NULL, "amqp_new_connection failed");
+  socket = amqp_tcp_socket_new(conn);
+  check(socket != NULL, "amqp_tcp_socket_new failed");
+  check(amqp_socket_open_noblock(socket, info.host, info.port, &timeout) ==
+            AMQP_STATUS_OK,
+        "amqp_socket_open_noblock failed");
+  check(amqp_login(conn, info.vhost, 0, AMQP_DEFAULT_FRAME_SIZE, 0,
+                   AMQP_SASL_METHOD_PLAIN, info.user, info.password)
+                .reply_type == AMQP_RESPONSE_NORMAL,
+        "amqp_login failed");
+  check(amqp_set_recovery(conn, &info, &timeout) == AMQP_STATUS_OK,
+        "amqp_set_recovery failed");
+
+  check(amqp_event_loop_add(loop, conn, recover_on_flow, &counts) ==
+            AMQP_STATUS_OK,
+        "amqp_event_loop_add failed");
+  for (i = 0; i < 10 && 0 == counts.flows && 0 == counts.status; ++i) {
+    amqp_event_loop_run_once(loop, &wait);
+  }
+  check(counts.flows == 1 && counts.status == 0,
+        "recovered connection not watched");
+
+  check(amqp_event_loop_remove(loop, conn) == AMQP_STATUS_OK,
+        "amqp_event_loop_remove failed");
+  check(amqp_connection_close(conn, AMQP_REPLY_SUCCESS).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_connection_close failed");
+  amqp_destroy_connection(conn);
+  pthread_join(broker_thread, NULL);
+  close(listen_fd);
+}
+
+int main(void) {
+  amqp_event_loop_t *loop = amqp_event_loop_new();
+  if (NULL == loop) {
+    /* No epoll on this platform */
+    return 0;
+  }
+
+  test_dispatch(loop);
+  test_heartbeat(loop);
+  test_recovery(loop);
+
+  amqp_event_loop_destroy(loop);
+  return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "test_helpers.h"
+#include <amqp_tcp_socket.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+const char protocol_header[8] = {'A', 'M', 'Q', 'P', 0, 0, 9, 1};
+
+void check(int cond, const char *what) {
+  if (!cond) {
+    fprintf(stderr, "%s\n", what);
+    abort();
+  }
+}
+
+int bytes_is(amqp_bytes_t bytes, const char *s) {
+  return bytes.len == strlen(s) && 0 == memcmp(bytes.bytes, s, bytes.len);
+}
+
+void *expect_method(amqp_connection_state_t broker, amqp_channel_t channel,
+                    amqp_method_number_t id) {
+  struct timeval timeout = {5, 0};
+  amqp_frame_t frame;
+
+  check(amqp_simple_wait_frame_noblock(broker, &frame, &timeout) ==
+            AMQP_STATUS_OK,
+        "nothing received");
+  check(AMQP_FRAME_METHOD == frame.frame_type && channel == frame.channel,
+        "not a method on the expected channel");
+  check(id == frame.payload.method.id, "unexpected method");
+  return frame.payload.method.decoded;
+}
+
+void send_method(amqp_connection_state_t broker, amqp_channel_t channel,
+                 amqp_method_number_t id, void *decoded) {
+  check(amqp_send_method(broker, channel, id, decoded) == AMQP_STATUS_OK,
+        "method not sent");
+}
+
+void handshake(amqp_connection_state_t broker) {
+  amqp_connection_start_t start;
+  amqp_connection_tune_t tune;
+  amqp_connection_open_ok_t open_ok;
+  amqp_frame_t frame;
+
+  check(amqp_simple_wait_frame(broker, &frame) == AMQP_STATUS_OK &&
+            AMQP_PSEUDOFRAME_PROTOCOL_HEADER == frame.frame_type,
+        "no protocol header");
+
+  start.version_major = 0;
+  start.version_minor = 9;
+  start.server_properties = amqp_empty_table;
+  start.mechanisms = amqp_cstring_bytes("PLAIN");
+  start.locales = amqp_cstring_bytes("en_US");
+  send_method(broker, 0, AMQP_CONNECTION_START_METHOD, &start);
+  expect_method(broker, 0, AMQP_CONNECTION_START_OK_METHOD);
+
+  tune.channel_max = 0;
+  tune.frame_max = AMQP_DEFAULT_FRAME_SIZE;
+  tune.heartbeat = 0;
+  send_method(broker, 0, AMQP_CONNECTION_TUNE_METHOD, &tune);
+  expect_method(broker, 0, AMQP_CONNECTION_TUNE_OK_METHOD);
+  expect_method(broker, 0, AMQP_CONNECTION_OPEN_METHOD);
+
+  open_ok.known_hosts = amqp_empty_bytes;
+  send_method(broker, 0, AMQP_CONNECTION_OPEN_OK_METHOD, &open_ok);
+}
+
+int answer_routine(amqp_connection_state_t broker, const amqp_frame_t *frame) {
+  if (AMQP_FRAME_METHOD != frame->frame_type) {
+    return 0;
+  }
+
+  switch (frame->payload.method.id) {
+    case AMQP_CHANNEL_OPEN_METHOD: {
+      amqp_channel_open_ok_t ok;
+      ok.channel_id = amqp_empty_bytes;
+      send_method(broker, frame->channel, AMQP_CHANNEL_OPEN_OK_METHOD, &ok);
+      return 1;
+    }
+
+    case AMQP_CHANNEL_CLOSE_METHOD: {
+      amqp_channel_close_ok_t ok;
+      send_method(broker, frame->channel, AMQP_CHANNEL_CLOSE_OK_METHOD, &ok);
+      return 1;
+    }
+
+    case AMQP_CONFIRM_SELECT_METHOD: {
+      amqp_confirm_select_ok_t ok;
+      send_method(broker, frame->channel, AMQP_CONFIRM_SELECT_OK_METHOD, &ok);
+      return 1;
+    }
+
+    case AMQP_CONNECTION_CLOSE_METHOD: {
+      amqp_connection_close_ok_t ok;
+      send_method(broker, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &ok);
+      return 1;
+    }
+
+    default:
+      return 0;
+  }
+}
+
+void deliver(amqp_connection_state_t broker, amqp_channel_t channel,
+             const char *consumer_tag, uint64_t delivery_tag,
+             const char *routing_key, const char *body) {
+  amqp_basic_properties_t properties;
+  amqp_basic_deliver_t method;
+  amqp_frame_t frame;
+
+  method.consumer_tag = amqp_cstring_bytes(consumer_tag);
+  method.delivery_tag = delivery_tag;
+  method.redelivered = 0;
+  method.exchange = amqp_cstring_bytes("exchange");
+  method.routing_key = amqp_cstring_bytes(routing_key);
+  send_method(broker, channel, AMQP_BASIC_DELIVER_METHOD, &method);
+
+  properties._flags = 0;
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = channel;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = NULL == body ? 0 : strlen(body);
+  frame.payload.properties.decoded = &properties;
+  check(amqp_send_frame(broker, &frame) == AMQP_STATUS_OK,
+        "header not sent");
+  if (NULL == body) {
+    return;
+  }
+
+  frame.frame_type = AMQP_FRAME_BODY;
+  frame.payload.body_fragment = amqp_cstring_bytes(body);
+  check(amqp_send_frame(broker, &frame) == AMQP_STATUS_OK, "body not sent");
+}
+
+#ifndef _WIN32
+void write_all(int fd, const void *buf, size_t len) {
+  check(write(fd, buf, len) == (ssize_t)len, "write failed");
+}
+
+int listen_on(int backlog, int *port) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  check(fd >= 0, "socket failed");
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  check(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "bind failed");
+  check(listen(fd, backlog) == 0, "listen failed");
+  check(getsockname(fd, (struct sockaddr *)&addr, &len) == 0,
+        "getsockname failed");
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+amqp_connection_state_t connection_on(int fd) {
+  amqp_connection_state_t state = amqp_new_connection();
+  amqp_socket_t *socket;
+
+  check(state != NULL, "amqp_new_connection failed");
+  socket = amqp_tcp_socket_new(state);
+  check(socket != NULL, "amqp_tcp_socket_new failed");
+  check(fcntl(fd, F_SETFL, O_NONBLOCK) == 0, "fcntl failed");
+  amqp_tcp_socket_set_sockfd(socket, fd);
+  return state;
+}
+
+void connection_pair(amqp_connection_state_t *conn,
+                     amqp_connection_state_t *broker) {
+  amqp_frame_t frame;
+  int sv[2];
+
+  check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+  *conn = connection_on(sv[0]);
+  *broker = connection_on(sv[1]);
+  write_all(sv[1], protocol_header, sizeof(protocol_header));
+  check(amqp_simple_wait_frame(*conn, &frame) == AMQP_STATUS_OK,
+        "protocol header not read");
+}
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Fixtures shared by the tests that play a broker over a socket */
+
+#ifndef TEST_HELPERS_H
+#define TEST_HELPERS_H
+
+#include <amqp.h>
+
+#include <stddef.h>
+
+/* The bytes a broker reads first on a new connection */
+extern const char protocol_header[8];
+
+/* Aborts with what on stderr unless cond holds */
+void check(int cond, const char *what);
+
+int bytes_is(amqp_bytes_t bytes, const char *s);
+
+/* Reads a method on channel, waiting up to five seconds, and returns its
+ * decoded form, which lives until the connection's buffers are released */
+void *expect_method(amqp_connection_state_t broker, amqp_channel_t channel,
+                    amqp_method_number_t id);
+
+void send_method(amqp_connection_state_t broker, amqp_channel_t channel,
+                 amqp_method_number_t id, void *decoded);
+
+/* Plays the broker's part of connection.start through connection.open-ok */
+void handshake(amqp_connection_state_t broker);
+
+/* Answers channel.open, channel.close, confirm.select and connection.close
+ * the way a broker would, returns 0 for any other frame */
+int answer_routine(amqp_connection_state_t broker, const amqp_frame_t *frame);
+
+/* Sends a basic.deliver with its header and, unless body is NULL, one body
+ * frame */
+void deliver(amqp_connection_state_t broker, amqp_channel_t channel,
+             const char *consumer_tag, uint64_t delivery_tag,
+             const char *routing_key, const char *body);
+
+#ifndef _WIN32
+void write_all(int fd, const void *buf, size_t len);
+
+/* A TCP socket listening on the loopback address, its port in port */
+int listen_on(int backlog, int *port);
+
+/* A connection over the non-blocking TCP socket fd */
+amqp_connection_state_t connection_on(int fd);
+
+/* Connects conn to broker over a socket pair, with conn past the protocol
+ * header */
+void connection_pair(amqp_connection_state_t *conn,
+                     amqp_connection_state_t *broker);
+#endif
+
+#endif /* TEST_HELPERS_H */
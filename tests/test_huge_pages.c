@@ -0,0 +1,109 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_private.h"
+#include "test_helpers.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 16384
+/* More than two 2MB chunks' worth */
+#define NUM_BLOCKS 300
+
+static void *blocks[NUM_BLOCKS];
+
+static void *allocate_all(void *arg) {
+  int i;
+  (void)arg;
+
+  for (i = 0; i < NUM_BLOCKS; i++) {
+    blocks[i] = amqp_buffer_cache_alloc(BLOCK_SIZE);
+    check(blocks[i] != NULL, "amqp_buffer_cache_alloc failed");
+    memset(blocks[i], i, BLOCK_SIZE);
+  }
+  return NULL;
+}
+
+static int is_mapped(void *p) {
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned char vec;
+  void *base = (void *)((uintptr_t)p & ~(uintptr_t)(page - 1));
+  return 0 == mincore(base, page, &vec) || ENOMEM != errno;
+}
+
+int main(void) {
+  pthread_t thread;
+  void *from_malloc[2];
+  void *first;
+  void *last;
+  int i;
+
+  /* Buffers of connections created before huge pages are enabled */
+  from_malloc[0] = amqp_buffer_cache_alloc(BLOCK_SIZE);
+  from_malloc[1] = amqp_buffer_cache_alloc(131072);
+  check(from_malloc[0] != NULL && from_malloc[1] != NULL,
+        "amqp_buffer_cache_alloc failed");
+
+  if (amqp_enable_huge_page_buffers() != AMQP_STATUS_OK) {
+    /* Not supported on this platform */
+    amqp_buffer_cache_free(from_malloc[0], BLOCK_SIZE);
+    amqp_buffer_cache_free(from_malloc[1], 131072);
+    return 0;
+  }
+
+  /* Blocks outlive the thread that allocated them */
+  check(pthread_create(&thread, NULL, allocate_all, NULL) == 0,
+        "pthread_create failed");
+  pthread_join(thread, NULL);
+  first = blocks[0];
+  last = blocks[NUM_BLOCKS - 1];
+
+  /* Blocks from before go back to malloc, leaving the chunks alone */
+  amqp_buffer_cache_free(from_malloc[0], BLOCK_SIZE);
+  amqp_buffer_cache_free(from_malloc[1], 131072);
+
+  /* A block released on another thread is handed out again */
+  amqp_buffer_cache_free(blocks[1], BLOCK_SIZE);
+  check(amqp_buffer_cache_alloc(BLOCK_SIZE) == blocks[1],
+        "released block not reused");
+
+  /* A chunk goes back to the system with its last block, except the one
+   * blocks are carved from */
+  for (i = 0; i < NUM_BLOCKS; i++) {
+    amqp_buffer_cache_free(blocks[i], BLOCK_SIZE);
+  }
+  check(!is_mapped(first), "empty chunk not unmapped");
+  check(is_mapped(last), "current chunk unmapped");
+
+  /* Which is reused from its start */
+  first = amqp_buffer_cache_alloc(BLOCK_SIZE);
+  check(((uintptr_t)first ^ (uintptr_t)last) < 2 * 1024 * 1024 &&
+            first <= last,
+        "current chunk not reused");
+  amqp_buffer_cache_free(first, BLOCK_SIZE);
+  return 0;
+}
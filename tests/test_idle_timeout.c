@@ -0,0 +1,148 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_private.h"
+#include "test_helpers.h"
+
+
+static amqp_connection_state_t conn, broker;
+
+static void send_flow(amqp_connection_state_t from, amqp_boolean_t active) {
+  amqp_channel_flow_t flow;
+  flow.active = active;
+  send_method(from, 1, AMQP_CHANNEL_FLOW_METHOD, &flow);
+}
+
+static void expect_flow(amqp_connection_state_t to, amqp_boolean_t active) {
+  amqp_channel_flow_t *flow = expect_method(to, 1, AMQP_CHANNEL_FLOW_METHOD);
+  check(flow->active == active, "flow read wrongly");
+}
+
+/* Wait long enough for the idle timeout to fire with nothing to read */
+static void wait_idle(void) {
+  struct timeval timeout = {0, 100000};
+  amqp_frame_t frame;
+  check(amqp_simple_wait_frame_noblock(conn, &frame, &timeout) ==
+            AMQP_STATUS_TIMEOUT,
+        "frame read from a quiet connection");
+}
+
+static int released(void) {
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(conn, 1);
+  return NULL == conn->sock_inbound_buffer.bytes &&
+         NULL == conn->outbound_buffer.bytes && NULL != entry &&
+         0 == entry->pool.pages.num_blocks &&
+         0 == entry->header_pool.pages.num_blocks;
+}
+
+static void test_settings(void) {
+  struct timeval negative = {-1, 0};
+  struct timeval timeout = {0, 10000};
+
+  check(amqp_get_idle_timeout(conn) == NULL, "idle timeout enabled by default");
+  check(amqp_set_idle_timeout(conn, &negative) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "negative idle timeout accepted");
+  check(amqp_set_idle_timeout(conn, &timeout) == AMQP_STATUS_OK,
+        "amqp_set_idle_timeout failed");
+  check(amqp_get_idle_timeout(conn)->tv_sec == 0 &&
+            amqp_get_idle_timeout(conn)->tv_usec == 10000,
+        "idle timeout not kept");
+}
+
+/* Buffers are released once the connection goes quiet, and reacquired by the
+ * next read and the next send */
+static void test_release_and_reacquire(void) {
+  send_flow(broker, 1);
+  expect_flow(conn, 1);
+  check(amqp_get_channel_pool_entry(conn, 1)->pool.pages.num_blocks != 0,
+        "frame not decoded into the channel pool");
+
+  wait_idle();
+  check(released(), "idle buffers kept");
+
+  send_flow(broker, 0);
+  expect_flow(conn, 0);
+  check(NULL != conn->sock_inbound_buffer.bytes,
+        "inbound buffer not reacquired");
+
+  send_flow(conn, 1);
+  check(NULL != conn->outbound_buffer.bytes, "outbound buffer not reacquired");
+  expect_flow(broker, 1);
+
+  wait_idle();
+  check(released(), "idle buffers kept after reacquiring them");
+}
+
+/* A partly read frame keeps its buffers until the rest arrives */
+static void test_partial_frame(void) {
+  char frame[64];
+  size_t len = 0;
+  amqp_frame_t encoded;
+  amqp_channel_flow_t flow;
+  amqp_bytes_t buffer;
+  amqp_bytes_t out;
+
+  flow.active = 1;
+  encoded.frame_type = AMQP_FRAME_METHOD;
+  encoded.channel = 1;
+  encoded.payload.method.id = AMQP_CHANNEL_FLOW_METHOD;
+  encoded.payload.method.decoded = &flow;
+  buffer.bytes = frame;
+  buffer.len = sizeof(frame);
+  check(amqp_frame_to_bytes(&encoded, buffer, &out) == AMQP_STATUS_OK,
+        "frame not encoded");
+  len = out.len;
+
+  write_all(amqp_get_sockfd(broker), frame, len / 2);
+  wait_idle();
+  check(NULL != conn->sock_inbound_buffer.bytes,
+        "buffers released with a frame half read");
+
+  write_all(amqp_get_sockfd(broker), frame + len / 2, len - len / 2);
+  expect_flow(conn, 1);
+}
+
+static void test_disable(void) {
+  check(amqp_set_idle_timeout(conn, NULL) == AMQP_STATUS_OK,
+        "idle timeout not disabled");
+  check(amqp_get_idle_timeout(conn) == NULL, "idle timeout still enabled");
+
+  send_flow(broker, 0);
+  expect_flow(conn, 0);
+  wait_idle();
+  check(NULL != conn->sock_inbound_buffer.bytes,
+        "buffers released with the idle timeout disabled");
+}
+
+int main(void) {
+  connection_pair(&conn, &broker);
+
+  test_settings();
+  test_release_and_reacquire();
+  test_partial_frame();
+  test_disable();
+
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(broker);
+  return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "test_helpers.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_PUBLISHERS 4
+#define NUM_PUBLISHES 500
+/* More than a channel handle queues before the IO thread holds them back */
+#define NUM_DELIVERIES 600
+#define CONSUMER_CHANNEL (NUM_PUBLISHERS + 1)
+
+static amqp_mux_t *mux;
+
+/* Only touched by the broker thread until it is joined */
+static int published[NUM_PUBLISHERS + 1];
+static int out_of_order;
+static int acked;
+static int closed;
+
+/* Plays the broker until every channel is closed */
+static void *broker_main(void *arg) {
+  amqp_connection_state_t broker = arg;
+  amqp_frame_t frame;
+  int i;
+
+  for (;;) {
+    amqp_channel_t channel;
+    check(amqp_simple_wait_frame(broker, &frame) == AMQP_STATUS_OK,
+          "broker read failed");
+    check(AMQP_FRAME_METHOD == frame.frame_type, "not a method");
+    channel = frame.channel;
+
+    if (answer_routine(broker, &frame)) {
+      if (AMQP_CHANNEL_CLOSE_METHOD == frame.payload.method.id &&
+          ++closed == NUM_PUBLISHERS + 1) {
+        return NULL;
+      }
+      continue;
+    }
+
+    switch (frame.payload.method.id) {
+      case AMQP_BASIC_PUBLISH_METHOD: {
+        amqp_message_t message;
+        char body[8];
+        check(amqp_read_message(broker, channel, &message, 0).reply_type ==
+                  AMQP_RESPONSE_NORMAL,
+              "message not read");
+        if (CONSUMER_CHANNEL == channel) {
+          /* Unroutable, sent back as is */
+          amqp_basic_return_t ret;
+          amqp_frame_t header;
+          ret.reply_code = AMQP_NO_ROUTE;
+          ret.reply_text = amqp_cstring_bytes("NO_ROUTE");
+          ret.exchange = amqp_cstring_bytes("exchange");
+          ret.routing_key = amqp_cstring_bytes("nowhere");
+          send_method(broker, channel, AMQP_BASIC_RETURN_METHOD, &ret);
+          header.frame_type = AMQP_FRAME_HEADER;
+          header.channel = channel;
+          header.payload.properties.class_id = AMQP_BASIC_CLASS;
+          header.payload.properties.body_size = message.body.len;
+          header.payload.properties.decoded = &message.properties;
+          check(amqp_send_frame(broker, &header) == AMQP_STATUS_OK,
+                "header not sent");
+          header.frame_type = AMQP_FRAME_BODY;
+          header.payload.body_fragment = message.body;
+          check(amqp_send_frame(broker, &header) == AMQP_STATUS_OK,
+                "body not sent");
+          amqp_destroy_message(&message);
+          break;
+        }
+        check(channel >= 1 && channel <= NUM_PUBLISHERS,
+              "publish on the wrong channel");
+        check(message.body.len < sizeof(body), "body too long");
+        memcpy(body, message.body.bytes, message.body.len);
+        body[message.body.len] = '\0';
+        if (atoi(body) != published[channel]) {
+          out_of_order = 1;
+        }
+        published[channel]++;
+        amqp_destroy_message(&message);
+        break;
+      }
+
+      case AMQP_BASIC_CONSUME_METHOD: {
+        amqp_basic_consume_ok_t ok;
+        ok.consumer_tag = amqp_cstring_bytes("ctag");
+        send_method(broker, channel, AMQP_BASIC_CONSUME_OK_METHOD, &ok);
+        for (i = 0; i < NUM_DELIVERIES; ++i) {
+          char body[8];
+          sprintf(body, "%d", i);
+          deliver(broker, CONSUMER_CHANNEL, "ctag", i + 1, "key", body);
+        }
+        break;
+      }
+
+      case AMQP_BASIC_ACK_METHOD: {
+        amqp_basic_ack_t *ack = frame.payload.method.decoded;
+        check(ack->delivery_tag == (uint64_t)acked + 1, "wrong ack");
+        if (++acked == NUM_DELIVERIES) {
+          /* Closed from the broker's end this time */
+          amqp_channel_close_t close;
+          close.reply_code = 406;
+          close.reply_text = amqp_cstring_bytes("PRECONDITION_FAILED");
+          close.class_id = 0;
+          close.method_id = 0;
+          check(amqp_send_method(broker, channel, AMQP_CHANNEL_CLOSE_METHOD,
+                                 &close) == AMQP_STATUS_OK,
+                "close not sent");
+        }
+        break;
+      }
+
+      case AMQP_CHANNEL_CLOSE_OK_METHOD:
+        check(CONSUMER_CHANNEL == channel, "close-ok on the wrong channel");
+        if (++closed == NUM_PUBLISHERS + 1) {
+          return NULL;
+        }
+        break;
+
+      default:
+        check(0, "unexpected method");
+    }
+    amqp_maybe_release_buffers(broker);
+  }
+}
+
+static void *publisher_main(void *arg) {
+  amqp_channel_t channel = (amqp_channel_t)(size_t)arg;
+  amqp_mux_channel_t *ch = amqp_mux_channel_new(mux, channel);
+  char body[8];
+  int i;
+
+  check(ch != NULL, "amqp_mux_channel_new failed");
+  check(amqp_mux_channel_open(ch).reply_type == AMQP_RESPONSE_NORMAL,
+        "channel not opened");
+  for (i = 0; i < NUM_PUBLISHES; ++i) {
+    sprintf(body, "%d", i);
+    check(amqp_mux_basic_publish(ch, amqp_cstring_bytes("exchange"),
+                                 amqp_cstring_bytes("key"), 0, 0, NULL,
+                                 amqp_cstring_bytes(body)) == AMQP_STATUS_OK,
+          "amqp_mux_basic_publish failed");
+  }
+  /* The close is queued behind the publishes */
+  check(amqp_mux_channel_close(ch, AMQP_REPLY_SUCCESS).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "channel not closed");
+  amqp_mux_channel_destroy(ch);
+  return NULL;
+}
+
+int main(void) {
+  amqp_method_number_t consume_ok[] = {AMQP_BASIC_CONSUME_OK_METHOD, 0};
+  pthread_t publishers[NUM_PUBLISHERS];
+  pthread_t broker_thread;
+  amqp_connection_state_t conn, broker;
+  amqp_mux_channel_t *ch;
+  amqp_basic_consume_t consume;
+  amqp_envelope_t envelope;
+  amqp_rpc_reply_t reply;
+  int i;
+
+  connection_pair(&conn, &broker);
+
+  mux = amqp_mux_new(conn);
+  if (NULL == mux) {
+    /* No thread support on this platform */
+    return 0;
+  }
+  check(pthread_create(&broker_thread, NULL, broker_main, broker) == 0,
+        "pthread_create failed");
+
+  check(amqp_mux_channel_new(mux, 0) == NULL, "channel 0 registered");
+  ch = amqp_mux_channel_new(mux, CONSUMER_CHANNEL);
+  check(ch != NULL, "amqp_mux_channel_new failed");
+  check(amqp_mux_channel_new(mux, CONSUMER_CHANNEL) == NULL,
+        "channel registered twice");
+  check(amqp_mux_basic_ack(ch, 1, 0) == AMQP_STATUS_UNEXPECTED_STATE,
+        "ack sent before the channel was opened");
+
+  for (i = 0; i < NUM_PUBLISHERS; ++i) {
+    check(pthread_create(&publishers[i], NULL, publisher_main,
+                         (void *)(size_t)(i + 1)) == 0,
+          "pthread_create failed");
+  }
+
+  check(amqp_mux_channel_open(ch).reply_type == AMQP_RESPONSE_NORMAL,
+        "consumer channel not opened");
+
+  /* A mandatory message nothing takes comes back to the channel's owner */
+  check(amqp_mux_basic_publish(ch, amqp_cstring_bytes("exchange"),
+                               amqp_cstring_bytes("nowhere"), 1, 0, NULL,
+                               amqp_cstring_bytes("returned")) ==
+            AMQP_STATUS_OK,
+        "amqp_mux_basic_publish failed");
+  reply = amqp_mux_consume_message(ch, &envelope, NULL, 0);
+  check(reply.reply_type == AMQP_RESPONSE_NORMAL &&
+            reply.reply.id == AMQP_BASIC_RETURN_METHOD,
+        "return not reported");
+  check(AMQP_NO_ROUTE ==
+                ((amqp_basic_return_t *)reply.reply.decoded)->reply_code &&
+            bytes_is(envelope.routing_key, "nowhere") &&
+            bytes_is(envelope.message.body, "returned"),
+        "wrong return");
+  amqp_destroy_envelope(&envelope);
+
+  memset(&consume, 0, sizeof(consume));
+  consume.queue = amqp_cstring_bytes("queue");
+  reply = amqp_mux_simple_rpc(ch, AMQP_BASIC_CONSUME_METHOD, &consume,
+                              consume_ok);
+  check(reply.reply_type == AMQP_RESPONSE_NORMAL, "consume failed");
+  check(reply.reply.id == AMQP_BASIC_CONSUME_OK_METHOD, "wrong reply");
+
+  for (i = 0; i < NUM_DELIVERIES; ++i) {
+    char body[8];
+    reply = amqp_mux_consume_message(ch, &envelope, NULL, 0);
+    check(reply.reply_type == AMQP_RESPONSE_NORMAL &&
+              reply.reply.id == AMQP_BASIC_DELIVER_METHOD,
+          "no delivery");
+    check(envelope.channel == CONSUMER_CHANNEL, "wrong channel");
+    check(envelope.message.body.len < sizeof(body), "body too long");
+    memcpy(body, envelope.message.body.bytes, envelope.message.body.len);
+    body[envelope.message.body.len] = '\0';
+    check(atoi(body) == i, "deliveries out of order");
+    check(amqp_mux_basic_ack(ch, envelope.delivery_tag, 0) == AMQP_STATUS_OK,
+          "amqp_mux_basic_ack failed");
+    amqp_destroy_envelope(&envelope);
+  }
+
+  /* The broker closes the channel once everything is acked */
+  reply = amqp_mux_consume_message(ch, &envelope, NULL, 0);
+  check(reply.reply_type == AMQP_RESPONSE_SERVER_EXCEPTION,
+        "channel close not reported");
+  check(reply.reply.id == AMQP_CHANNEL_CLOSE_METHOD, "not a channel close");
+  check(amqp_mux_basic_ack(ch, 1, 0) == AMQP_STATUS_UNEXPECTED_STATE,
+        "ack sent on a closed channel");
+
+  for (i = 0; i < NUM_PUBLISHERS; ++i) {
+    pthread_join(publishers[i], NULL);
+  }
+  pthread_join(broker_thread, NULL);
+  amqp_mux_channel_destroy(ch);
+  check(amqp_mux_destroy(mux) == AMQP_STATUS_OK, "IO thread failed");
+
+  check(!out_of_order, "publishes out of order");
+  for (i = 1; i <= NUM_PUBLISHERS; ++i) {
+    check(published[i] == NUM_PUBLISHES, "publishes missing");
+  }
+  check(acked == NUM_DELIVERIES, "acks missing");
+
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(broker);
+  return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_time.h"
+#include <amqp.h>
+#include <amqp_tcp_socket.h>
+#include "test_helpers.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* A port nothing listens on, connecting to it is refused */
+static int closed_port(void) {
+  int port;
+  close(listen_on(1, &port));
+  return port;
+}
+
+static int open_any(const char *const *hosts, const int *ports, int count,
+                    int *connected) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket;
+  struct timeval timeout = {5, 0};
+  int res;
+
+  check(conn != NULL, "amqp_new_connection failed");
+  socket = amqp_tcp_socket_new(conn);
+  check(socket != NULL, "amqp_tcp_socket_new failed");
+  res = amqp_socket_open_any(socket, hosts, ports, count, &timeout, connected);
+  amqp_destroy_connection(conn);
+  return res;
+}
+
+static int get_int_option(int fd, int level, int name) {
+  int value = -1;
+  socklen_t len = sizeof(value);
+  check(getsockopt(fd, level, name, &value, &len) == 0, "getsockopt failed");
+  return value;
+}
+
+/* The tuning asked for is on the socket once it's connected */
+static void check_options(const char *host, int port) {
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket = amqp_tcp_socket_new(conn);
+  amqp_socket_options_t options;
+  int fd;
+
+  amqp_socket_options_init(&options);
+  options.send_buffer = -2;
+  check(amqp_socket_set_options(socket, &options) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "negative buffer size accepted");
+  options.send_buffer = 65536;
+  options.struct_size = 0;
+  check(amqp_socket_set_options(socket, &options) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "options without a size accepted");
+  options.struct_size = sizeof(options) + sizeof(int);
+  check(amqp_socket_set_options(socket, &options) == AMQP_STATUS_UNSUPPORTED,
+        "options from a newer version accepted");
+  options.struct_size = sizeof(options);
+  options.recv_buffer = 65536;
+#ifdef TCP_USER_TIMEOUT
+  options.user_timeout_ms = 5000;
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+  options.notsent_lowat = 16384;
+#endif
+  check(amqp_socket_set_options(socket, &options) == AMQP_STATUS_OK,
+        "amqp_socket_set_options failed");
+  check(amqp_socket_open(socket, host, port) == AMQP_STATUS_OK,
+        "open with options failed");
+  fd = amqp_socket_get_sockfd(socket);
+  /* Linux doubles buffer sizes for its bookkeeping */
+  check(get_int_option(fd, SOL_SOCKET, SO_SNDBUF) >= 65536,
+        "send buffer not set");
+  check(get_int_option(fd, SOL_SOCKET, SO_RCVBUF) >= 65536,
+        "receive buffer not set");
+  check(get_int_option(fd, IPPROTO_TCP, TCP_NODELAY) != 0,
+        "nagle not disabled");
+#ifdef TCP_USER_TIMEOUT
+  check(get_int_option(fd, IPPROTO_TCP, TCP_USER_TIMEOUT) == 5000,
+        "user timeout not set");
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+  check(get_int_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT) == 16384,
+        "not sent low water mark not set");
+#endif
+  amqp_destroy_connection(conn);
+}
+
+int main(void) {
+  const char *hosts[3] = {"127.0.0.1", "127.0.0.1", "localhost"};
+  int ports[3];
+  int connected = -1;
+  int filler[4];
+  int stalled_fd;
+  int good_fd;
+  uint64_t start;
+  int i;
+
+  good_fd = listen_on(16, &ports[1]);
+  ports[2] = ports[1];
+
+  /* A refused host gives way to the next one */
+  ports[0] = closed_port();
+  check(open_any(hosts, ports, 2, &connected) == AMQP_STATUS_OK,
+        "no connection past a refused host");
+  check(1 == connected, "wrong host connected to");
+  check(open_any(hosts, ports, 1, NULL) == AMQP_STATUS_SOCKET_ERROR,
+        "refused host connected to");
+  check(open_any(hosts, ports, 0, NULL) == AMQP_STATUS_INVALID_PARAMETER,
+        "no hosts accepted");
+
+  /* A host whose accept queue is full doesn't answer; the next host is
+   * tried without waiting for it to time out */
+  stalled_fd = listen_on(0, &ports[0]);
+  for (i = 0; i < 4; i++) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)ports[0]);
+    filler[i] = socket(AF_INET, SOCK_STREAM, 0);
+    check(filler[i] >= 0, "socket failed");
+    check(fcntl(filler[i], F_SETFL, O_NONBLOCK) == 0, "fcntl failed");
+    connect(filler[i], (struct sockaddr *)&addr, sizeof(addr));
+  }
+  start = amqp_get_monotonic_timestamp();
+  connected = -1;
+  check(open_any(hosts, ports, 2, &connected) == AMQP_STATUS_OK,
+        "no connection past a stalled host");
+  check(1 == connected, "wrong host connected to");
+  check(amqp_get_monotonic_timestamp() - start <
+            900 * (uint64_t)AMQP_NS_PER_MS,
+        "next host waited for the stalled one");
+
+  /* The second lookup comes from the cache */
+  check(amqp_set_dns_cache_ttl(-1) == AMQP_STATUS_INVALID_PARAMETER,
+        "negative ttl accepted");
+  check(amqp_set_dns_cache_ttl(60) == AMQP_STATUS_OK,
+        "amqp_set_dns_cache_ttl failed");
+  for (i = 0; i < 2; i++) {
+    connected = -1;
+    check(open_any(&hosts[2], &ports[2], 1, &connected) == AMQP_STATUS_OK &&
+              0 == connected,
+          "no connection with the cache");
+  }
+  check(amqp_set_dns_cache_ttl(0) == AMQP_STATUS_OK,
+        "amqp_set_dns_cache_ttl failed");
+
+  check_options(hosts[1], ports[1]);
+
+  for (i = 0; i < 4; i++) {
+    close(filler[i]);
+  }
+  close(stalled_fd);
+  close(good_fd);
+  return 0;
+}
@@ -86,6 +86,30 @@ static void parse_success(const char *url, const char *user,
   free(s);
 }
 
+static void parse_unix_success(const char *url, const char *user,
+                               const char *password, const char *path,
+                               const char *vhost) {
+  char *s = strdup(url);
+  struct amqp_connection_info ci;
+  int res;
+
+  res = amqp_parse_url(s, &ci);
+  if (res) {
+    fprintf(stderr, "Expected to successfully parse URL, but didn't: %s (%s)\n",
+            url, amqp_error_string2(res));
+    abort();
+  }
+
+  match_string("user", user, ci.user);
+  match_string("password", password, ci.password);
+  match_string("path", path, ci.host);
+  match_int("port", 0, ci.port);
+  match_string("vhost", vhost, ci.vhost);
+  match_int("ssl", 0, ci.ssl);
+
+  free(s);
+}
+
 static void parse_fail(const char *url) {
   char *s = strdup(url);
   struct amqp_connection_info ci;
@@ -216,5 +240,23 @@ int main(void) {
   parse_fail("amqp://foo%xy");
   parse_fail("amqps://foo%xy");
 
+  /* Unix domain sockets */
+  parse_unix_success("amqp+unix:///var/run/rabbitmq.sock", "guest", "guest",
+                     "/var/run/rabbitmq.sock", "/");
+  parse_unix_success("amqp+unix://user:pass@/tmp/a.sock?vhost=v%2fhost",
+                     "user", "pass", "/tmp/a.sock", "v/host");
+  parse_unix_success("amqp+unix://user@/tmp/a%3fb:c@[d].sock", "user", "guest",
+                     "/tmp/a?b:c@[d].sock", "/");
+  parse_unix_success("amqp+unix:///tmp/a.sock?vhost=", "guest", "guest",
+                     "/tmp/a.sock", "");
+
+  parse_fail("amqp+unix://");
+  parse_fail("amqp+unix://tmp/a.sock");
+  parse_fail("amqp+unix://user:pass/tmp/a.sock");
+  parse_fail("amqp+unix:///tmp/a.sock?vhost=a/b");
+  parse_fail("amqp+unix:///tmp/a.sock?v=a");
+  parse_fail("amqp+unix:///tmp/a.sock#x");
+  parse_fail("amqp+unix:///tmp/a%1x.sock");
+
   return 0;
 }
@@ -0,0 +1,268 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "test_helpers.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_CONNECTIONS 8
+#define NUM_CHANNELS 2
+/* The first connection of the second pool dies on this publish, before
+ * confirming it */
+#define VICTIM 2
+#define KILL_AFTER 5
+/* The broker closes the channel of a publish to this exchange */
+#define MISSING_EXCHANGE "missing"
+
+/* Each broker thread writes its own entries, read after it's joined */
+static int received[MAX_CONNECTIONS][NUM_CHANNELS + 1];
+static int acked[MAX_CONNECTIONS];
+static int channel_closes[MAX_CONNECTIONS];
+static amqp_connection_state_t brokers[MAX_CONNECTIONS];
+static pthread_t broker_threads[MAX_CONNECTIONS];
+static int num_accepted;
+static int listen_fd;
+
+/* Plays a broker for one connection of the pool, confirming every publish */
+static void *serve(void *arg) {
+  int n = (int)(long)arg;
+  amqp_connection_state_t broker = brokers[n];
+  uint64_t seq[NUM_CHANNELS + 1] = {0};
+  int closing[NUM_CHANNELS + 1] = {0};
+  int total = 0;
+
+  handshake(broker);
+  for (;;) {
+    amqp_frame_t frame;
+
+    check(amqp_simple_wait_frame(broker, &frame) == AMQP_STATUS_OK,
+          "broker read failed");
+    check(AMQP_FRAME_METHOD == frame.frame_type, "not a method");
+    check(frame.channel <= NUM_CHANNELS, "channel out of range");
+
+    if (answer_routine(broker, &frame)) {
+      if (AMQP_CONNECTION_CLOSE_METHOD == frame.payload.method.id) {
+        amqp_destroy_connection(broker);
+        return NULL;
+      }
+      continue;
+    }
+
+    switch (frame.payload.method.id) {
+      case AMQP_BASIC_PUBLISH_METHOD: {
+        amqp_basic_publish_t *publish = frame.payload.method.decoded;
+        amqp_basic_ack_t ack;
+        amqp_message_t message;
+        int missing = bytes_is(publish->exchange, MISSING_EXCHANGE);
+        check(amqp_read_message(broker, frame.channel, &message, 0)
+                      .reply_type == AMQP_RESPONSE_NORMAL,
+              "message not read");
+        amqp_destroy_message(&message);
+        /* A closing channel drops what's published on it */
+        if (closing[frame.channel]) {
+          break;
+        }
+        if (missing) {
+          amqp_channel_close_t close;
+          close.reply_code = AMQP_NOT_FOUND;
+          close.reply_text = amqp_cstring_bytes("NOT_FOUND - no exchange");
+          close.class_id = AMQP_BASIC_PUBLISH_METHOD >> 16;
+          close.method_id = AMQP_BASIC_PUBLISH_METHOD & 0xFFFF;
+          send_method(broker, frame.channel, AMQP_CHANNEL_CLOSE_METHOD,
+                      &close);
+          closing[frame.channel] = 1;
+          break;
+        }
+        received[n][frame.channel]++;
+        if (VICTIM == n && ++total == KILL_AFTER) {
+          amqp_destroy_connection(broker);
+          return NULL;
+        }
+        ack.delivery_tag = ++seq[frame.channel];
+        ack.multiple = 0;
+        send_method(broker, frame.channel, AMQP_BASIC_ACK_METHOD, &ack);
+        acked[n]++;
+        break;
+      }
+
+      case AMQP_CHANNEL_CLOSE_OK_METHOD:
+        check(closing[frame.channel], "channel wasn't closing");
+        closing[frame.channel] = 0;
+        seq[frame.channel] = 0;
+        channel_closes[n]++;
+        break;
+
+      default:
+        check(0, "unexpected method");
+    }
+    amqp_maybe_release_buffers(broker);
+  }
+}
+
+static void *acceptor_main(void *arg) {
+  int fd;
+  (void)arg;
+
+  while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+    check(num_accepted < MAX_CONNECTIONS, "too many connections");
+    brokers[num_accepted] = connection_on(fd);
+    check(pthread_create(&broker_threads[num_accepted], NULL, serve,
+                         (void *)(long)num_accepted) == 0,
+          "pthread_create failed");
+    num_accepted++;
+  }
+  return NULL;
+}
+
+static void publish_to(amqp_producer_pool_t *pool, const char *exchange,
+                       int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    check(amqp_producer_pool_publish(pool, amqp_cstring_bytes(exchange),
+                                     amqp_cstring_bytes("key"), 0, 0, NULL,
+                                     amqp_cstring_bytes("body")) ==
+              AMQP_STATUS_OK,
+          "amqp_producer_pool_publish failed");
+  }
+}
+
+static void publish(amqp_producer_pool_t *pool, int count) {
+  publish_to(pool, "exchange", count);
+}
+
+int main(void) {
+  struct amqp_connection_info broker;
+  struct timeval timeout = {5, 0};
+  pthread_t acceptor;
+  amqp_producer_pool_t *pool;
+  uint64_t nacked;
+  uint64_t total_nacked;
+  int total_acked;
+  int port;
+  int i;
+
+  listen_fd = listen_on(MAX_CONNECTIONS, &port);
+  check(pthread_create(&acceptor, NULL, acceptor_main, NULL) == 0,
+        "pthread_create failed");
+
+  amqp_default_connection_info(&broker);
+  broker.host = "127.0.0.1";
+  broker.port = port;
+
+  broker.ssl = 1;
+  check(NULL == amqp_producer_pool_new(&broker, 1, 2, NUM_CHANNELS,
+                                       AMQP_PRODUCER_POOL_ROUND_ROBIN,
+                                       &timeout),
+        "TLS accepted");
+  broker.ssl = 0;
+  check(NULL == amqp_producer_pool_new(&broker, 1, 0, NUM_CHANNELS,
+                                       AMQP_PRODUCER_POOL_ROUND_ROBIN,
+                                       &timeout),
+        "no connections accepted");
+
+  /* Round-robin puts consecutive messages on different connections and
+   * cycles through every channel */
+  pool = amqp_producer_pool_new(&broker, 1, 2, NUM_CHANNELS,
+                                AMQP_PRODUCER_POOL_ROUND_ROBIN, &timeout);
+  check(pool != NULL, "amqp_producer_pool_new failed");
+  publish(pool, 8);
+  check(amqp_producer_pool_wait_confirms(pool, &timeout, &nacked) ==
+                AMQP_STATUS_OK &&
+            0 == nacked,
+        "round-robin publishes not confirmed");
+  check(amqp_producer_pool_destroy(pool) == AMQP_STATUS_OK,
+        "amqp_producer_pool_destroy failed");
+  pthread_join(broker_threads[0], NULL);
+  pthread_join(broker_threads[1], NULL);
+  for (i = 0; i < 2; i++) {
+    check(2 == received[i][1] && 2 == received[i][2],
+          "round-robin publishes not spread evenly");
+  }
+
+  /* The first connection of this pool dies; what it hadn't confirmed is
+   * reported lost, the rest is confirmed and it gets replaced */
+  pool = amqp_producer_pool_new(&broker, 1, 2, NUM_CHANNELS,
+                                AMQP_PRODUCER_POOL_LEAST_OUTSTANDING,
+                                &timeout);
+  check(pool != NULL, "amqp_producer_pool_new failed");
+  publish(pool, 100);
+  check(amqp_producer_pool_wait_confirms(pool, &timeout, &nacked) ==
+            AMQP_STATUS_OK,
+        "publishes not confirmed");
+  total_nacked = nacked;
+  check(total_nacked >= 1, "lost publish not reported");
+
+  usleep(150000);
+  publish(pool, 10);
+  check(amqp_producer_pool_wait_confirms(pool, &timeout, &nacked) ==
+            AMQP_STATUS_OK,
+        "publishes not confirmed");
+  total_nacked += nacked;
+  check(amqp_producer_pool_destroy(pool) == AMQP_STATUS_OK,
+        "amqp_producer_pool_destroy failed");
+
+  /* A channel the broker closes is reopened on the same connection; only
+   * its own publish is lost */
+  pool = amqp_producer_pool_new(&broker, 1, 1, NUM_CHANNELS,
+                                AMQP_PRODUCER_POOL_ROUND_ROBIN, &timeout);
+  check(pool != NULL, "amqp_producer_pool_new failed");
+  publish(pool, 2);
+  publish_to(pool, MISSING_EXCHANGE, 1);
+  check(amqp_producer_pool_wait_confirms(pool, &timeout, &nacked) ==
+                AMQP_STATUS_OK &&
+            1 == nacked,
+        "publish on the closed channel not reported lost");
+  publish(pool, 4);
+  check(amqp_producer_pool_wait_confirms(pool, &timeout, &nacked) ==
+                AMQP_STATUS_OK &&
+            0 == nacked,
+        "publishes after reopening not confirmed");
+  check(amqp_producer_pool_destroy(pool) == AMQP_STATUS_OK,
+        "amqp_producer_pool_destroy failed");
+
+  shutdown(listen_fd, SHUT_RDWR);
+  pthread_join(acceptor, NULL);
+  for (i = 0; i < num_accepted; i++) {
+    pthread_join(broker_threads[i], NULL);
+  }
+  close(listen_fd);
+
+  check(VICTIM + 4 == num_accepted,
+        "failed connection not replaced, or closed channel's dropped");
+  check(1 == channel_closes[VICTIM + 3] && 3 == received[VICTIM + 3][1] &&
+            3 == received[VICTIM + 3][2],
+        "closed channel not reopened");
+  total_acked = 0;
+  for (i = VICTIM; i < VICTIM + 3; i++) {
+    total_acked += acked[i];
+  }
+  check(received[VICTIM + 2][1] + received[VICTIM + 2][2] > 0,
+        "replacement not used");
+  /* Confirms the dead connection sent but the pool didn't read count as
+   * both */
+  check((uint64_t)total_acked + total_nacked >= 110,
+        "publishes neither confirmed nor reported lost");
+  return 0;
+}
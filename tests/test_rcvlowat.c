@@ -0,0 +1,118 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <amqp.h>
+#include <amqp_tcp_socket.h>
+#include "test_helpers.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Within the frame_max in effect before tuning, 64KB */
+#define BODY_SIZE 60000
+#define PARTIAL_SIZE 1000
+
+static int rcvlowat(int fd) {
+  int value = -1;
+  socklen_t len = sizeof(value);
+  check(getsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &value, &len) == 0,
+        "getsockopt failed");
+  return value;
+}
+
+/* Connects a client and server over loopback TCP, returns the client */
+static int connect_pair(int *server) {
+  struct sockaddr_in addr;
+  int port;
+  int listen_fd = listen_on(1, &port);
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+
+  check(client >= 0, "socket failed");
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  check(connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+        "connect failed");
+  *server = accept(listen_fd, NULL, NULL);
+  check(*server >= 0, "accept failed");
+  close(listen_fd);
+  check(fcntl(client, F_SETFL, O_NONBLOCK) == 0, "fcntl failed");
+  return client;
+}
+
+int main(void) {
+  static const unsigned char frame_header[] = {
+      AMQP_FRAME_BODY,           0, 1, 0, (BODY_SIZE >> 16) & 0xff,
+      (BODY_SIZE >> 8) & 0xff, BODY_SIZE & 0xff};
+  static const unsigned char frame_end = AMQP_FRAME_END;
+  struct timeval timeout = {0, 100000};
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket = amqp_tcp_socket_new(conn);
+  amqp_frame_t frame;
+  char *body;
+  int client;
+  int server;
+  int value;
+
+  check(socket != NULL, "amqp_tcp_socket_new failed");
+  client = connect_pair(&server);
+  amqp_tcp_socket_set_sockfd(socket, client);
+  write_all(server, protocol_header, sizeof(protocol_header));
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK,
+        "protocol header not read");
+
+  body = calloc(1, BODY_SIZE);
+  check(body != NULL, "calloc failed");
+
+  /* Waiting on the rest of a large frame doesn't wake for every segment */
+  write_all(server, frame_header, sizeof(frame_header));
+  write_all(server, body, PARTIAL_SIZE);
+  check(amqp_simple_wait_frame_noblock(conn, &frame, &timeout) ==
+            AMQP_STATUS_TIMEOUT,
+        "partial frame returned");
+  value = rcvlowat(client);
+  check(value > 1 && value <= BODY_SIZE - PARTIAL_SIZE + 1,
+        "low water mark not raised to what the frame needs");
+
+  write_all(server, body + PARTIAL_SIZE, BODY_SIZE - PARTIAL_SIZE);
+  write_all(server, &frame_end, 1);
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK &&
+            AMQP_FRAME_BODY == frame.frame_type &&
+            BODY_SIZE == frame.payload.body_fragment.len,
+        "large frame not read");
+
+  /* Between frames any byte wakes the connection again */
+  check(amqp_simple_wait_frame_noblock(conn, &frame, &timeout) ==
+            AMQP_STATUS_TIMEOUT,
+        "frame out of nowhere");
+  check(rcvlowat(client) == 1, "low water mark not reset when idle");
+
+  free(body);
+  amqp_destroy_connection(conn);
+  close(server);
+  return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_private.h"
+#include "test_helpers.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MESSAGES 50
+
+static amqp_connection_state_t conn, broker;
+
+/* Like deliver(), with a content type and an index header in the properties */
+static void send_message(uint64_t delivery_tag, const char *body) {
+  amqp_basic_properties_t properties;
+  amqp_basic_deliver_t method;
+  amqp_table_entry_t header;
+  amqp_frame_t frame;
+
+  method.consumer_tag = amqp_cstring_bytes("tag");
+  method.delivery_tag = delivery_tag;
+  method.redelivered = 0;
+  method.exchange = amqp_cstring_bytes("exchange");
+  method.routing_key = amqp_cstring_bytes("key");
+  send_method(broker, 1, AMQP_BASIC_DELIVER_METHOD, &method);
+
+  header.key = amqp_cstring_bytes("index");
+  header.value.kind = AMQP_FIELD_KIND_I64;
+  header.value.value.i64 = (int64_t)delivery_tag;
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG;
+  properties.content_type = amqp_cstring_bytes("text/plain");
+  properties.headers.num_entries = 1;
+  properties.headers.entries = &header;
+
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = 1;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = strlen(body);
+  frame.payload.properties.decoded = &properties;
+  check(amqp_send_frame(broker, &frame) == AMQP_STATUS_OK, "header not sent");
+
+  frame.frame_type = AMQP_FRAME_BODY;
+  frame.payload.body_fragment = amqp_cstring_bytes((char *)body);
+  check(amqp_send_frame(broker, &frame) == AMQP_STATUS_OK, "body not sent");
+}
+
+static void check_message(amqp_message_t *message, uint64_t delivery_tag,
+                          const char *body) {
+  amqp_basic_properties_t *properties = &message->properties;
+
+  check(properties->_flags ==
+                (AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG) &&
+            bytes_is(properties->content_type, "text/plain"),
+        "content type read wrongly");
+  check(properties->headers.num_entries == 1 &&
+            bytes_is(properties->headers.entries[0].key, "index") &&
+            properties->headers.entries[0].value.kind == AMQP_FIELD_KIND_I64 &&
+            properties->headers.entries[0].value.value.i64 ==
+                (int64_t)delivery_tag,
+        "headers read wrongly");
+  check(bytes_is(message->body, body), "body read wrongly");
+}
+
+static int in_pool(amqp_pool_t *pool, const void *p) {
+  int i;
+  for (i = 0; i < pool->pages.num_blocks; i++) {
+    const char *page = pool->pages.blocklist[i];
+    if ((const char *)p >= page && (const char *)p < page + pool->pagesize) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void consume(amqp_envelope_t *envelope) {
+  struct timeval timeout = {5, 0};
+  check(amqp_consume_message(conn, envelope, &timeout, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_consume_message failed");
+}
+
+/* The message takes the channel's header pool over, and keeps its properties
+ * while the channel's pools are recycled under it */
+static void test_handover(void) {
+  amqp_pool_table_entry_t *entry;
+  amqp_envelope_t first;
+  amqp_envelope_t envelope;
+  char body[32];
+  int i;
+
+  send_message(1, "first");
+  consume(&first);
+  check_message(&first.message, 1, "first");
+
+  entry = amqp_get_channel_pool_entry(conn, 1);
+  check(entry->header_frames == 0 && entry->header_pool.pages.num_blocks == 0,
+        "header pool not handed over");
+  check(in_pool(&first.message.pool,
+                first.message.properties.content_type.bytes),
+        "properties not in the message pool");
+
+  for (i = 2; i <= MESSAGES; i++) {
+    sprintf(body, "body %d", i);
+    send_message(i, body);
+    consume(&envelope);
+    check_message(&envelope.message, i, body);
+    amqp_destroy_envelope(&envelope);
+    amqp_maybe_release_buffers(conn);
+  }
+
+  check_message(&first.message, 1, "first");
+  amqp_destroy_envelope(&first);
+}
+
+/* With another header frame in the channel's header pool the properties are
+ * copied instead, and the pool stays with the channel */
+static void test_clone(void) {
+  amqp_pool_table_entry_t *entry;
+  amqp_message_t message;
+  amqp_frame_t frame;
+  int i;
+
+  send_message(1, "read by hand");
+  for (i = 0; i < 3; i++) {
+    check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK,
+          "frame not read");
+  }
+
+  send_message(2, "second");
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK &&
+            frame.frame_type == AMQP_FRAME_METHOD &&
+            frame.payload.method.id == AMQP_BASIC_DELIVER_METHOD,
+        "deliver not read");
+  check(amqp_read_message(conn, 1, &message, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_read_message failed");
+  check_message(&message, 2, "second");
+
+  entry = amqp_get_channel_pool_entry(conn, 1);
+  check(entry->header_frames == 2 && entry->header_pool.pages.num_blocks != 0,
+        "shared header pool handed over");
+  check(in_pool(&message.pool, message.properties.content_type.bytes),
+        "properties not copied into the message pool");
+
+  amqp_maybe_release_buffers(conn);
+  check(entry->header_frames == 0, "header pool not recycled");
+  check_message(&message, 2, "second");
+  amqp_destroy_message(&message);
+}
+
+int main(void) {
+  connection_pair(&conn, &broker);
+
+  test_handover();
+  test_clone();
+
+  amqp_destroy_connection(conn);
+  amqp_destroy_connection(broker);
+  return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "amqp_tcp_socket.h"
+#include "test_helpers.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int listen_fd;
+
+static amqp_connection_state_t accept_connection(void) {
+  int fd = accept(listen_fd, NULL, NULL);
+  check(fd >= 0, "accept failed");
+  return connection_on(fd);
+}
+
+static void open_channel(amqp_connection_state_t broker,
+                         amqp_channel_t channel) {
+  amqp_channel_open_ok_t ok;
+  expect_method(broker, channel, AMQP_CHANNEL_OPEN_METHOD);
+  ok.channel_id = amqp_empty_bytes;
+  send_method(broker, channel, AMQP_CHANNEL_OPEN_OK_METHOD, &ok);
+}
+
+static void declare_queue(amqp_connection_state_t broker,
+                          amqp_channel_t channel, const char *asked,
+                          const char *name) {
+  amqp_queue_declare_t *m =
+      expect_method(broker, channel, AMQP_QUEUE_DECLARE_METHOD);
+  amqp_queue_declare_ok_t ok;
+
+  check(bytes_is(m->queue, asked), "wrong queue declared");
+  ok.queue = amqp_cstring_bytes(name);
+  ok.message_count = 0;
+  ok.consumer_count = 0;
+  send_method(broker, channel, AMQP_QUEUE_DECLARE_OK_METHOD, &ok);
+}
+
+static void bind_queue(amqp_connection_state_t broker, amqp_channel_t channel,
+                       const char *queue) {
+  amqp_queue_bind_t *m = expect_method(broker, channel, AMQP_QUEUE_BIND_METHOD);
+  amqp_queue_bind_ok_t ok;
+
+  check(bytes_is(m->queue, queue) && bytes_is(m->exchange, "exchange") &&
+            bytes_is(m->routing_key, "key"),
+        "wrong binding");
+  send_method(broker, channel, AMQP_QUEUE_BIND_OK_METHOD, &ok);
+}
+
+static void consume(amqp_connection_state_t broker, const char *queue,
+                    const char *asked) {
+  amqp_basic_consume_t *m = expect_method(broker, 1, AMQP_BASIC_CONSUME_METHOD);
+  amqp_basic_consume_ok_t ok;
+
+  check(bytes_is(m->queue, queue) && bytes_is(m->consumer_tag, asked),
+        "wrong consumer");
+  ok.consumer_tag = amqp_cstring_bytes("ctag-1");
+  send_method(broker, 1, AMQP_BASIC_CONSUME_OK_METHOD, &ok);
+}
+
+static void qos(amqp_connection_state_t broker) {
+  amqp_basic_qos_t *m = expect_method(broker, 1, AMQP_BASIC_QOS_METHOD);
+  amqp_basic_qos_ok_t ok;
+
+  check(10 == m->prefetch_count, "wrong prefetch count");
+  send_method(broker, 1, AMQP_BASIC_QOS_OK_METHOD, &ok);
+}
+
+/* Answers a basic.get with an empty message */
+static void get_ok(amqp_connection_state_t broker, uint64_t tag) {
+  amqp_basic_properties_t properties;
+  amqp_basic_get_ok_t ok;
+  amqp_frame_t frame;
+
+  expect_method(broker, 1, AMQP_BASIC_GET_METHOD);
+  ok.delivery_tag = tag;
+  ok.redelivered = 0;
+  ok.exchange = amqp_cstring_bytes("exchange");
+  ok.routing_key = amqp_cstring_bytes("key");
+  ok.message_count = 0;
+  send_method(broker, 1, AMQP_BASIC_GET_OK_METHOD, &ok);
+
+  properties._flags = 0;
+  frame.frame_type = AMQP_FRAME_HEADER;
+  frame.channel = 1;
+  frame.payload.properties.class_id = AMQP_BASIC_CLASS;
+  frame.payload.properties.body_size = 0;
+  frame.payload.properties.decoded = &properties;
+  check(amqp_send_frame(broker, &frame) == AMQP_STATUS_OK,
+        "header not sent");
+}
+
+static void expect_ack(amqp_connection_state_t broker, uint64_t tag) {
+  amqp_basic_ack_t *m = expect_method(broker, 1, AMQP_BASIC_ACK_METHOD);
+  check(tag == m->delivery_tag && !m->multiple, "wrong ack");
+}
+
+/* Plays the broker for the connection set up by the application, which it
+ * drops after two deliveries, then for the recovered one */
+static void *broker_main(void *arg) {
+  amqp_connection_state_t broker;
+  amqp_exchange_declare_ok_t declare_ok;
+  amqp_queue_delete_ok_t delete_ok;
+  amqp_channel_close_ok_t close_ok;
+  amqp_connection_close_ok_t connection_close_ok;
+  (void)arg;
+
+  broker = accept_connection();
+  handshake(broker);
+  open_channel(broker, 1);
+  expect_method(broker, 1, AMQP_EXCHANGE_DECLARE_METHOD);
+  send_method(broker, 1, AMQP_EXCHANGE_DECLARE_OK_METHOD, &declare_ok);
+  declare_queue(broker, 1, "", "amq.gen-1");
+  bind_queue(broker, 1, "amq.gen-1");
+  declare_queue(broker, 1, "deleted", "deleted");
+  expect_method(broker, 1, AMQP_QUEUE_DELETE_METHOD);
+  delete_ok.message_count = 0;
+  send_method(broker, 1, AMQP_QUEUE_DELETE_OK_METHOD, &delete_ok);
+  qos(broker);
+  consume(broker, "amq.gen-1", "");
+  deliver(broker, 1, "ctag-1", 1, "key", NULL);
+  deliver(broker, 1, "ctag-1", 2, "key", NULL);
+  expect_ack(broker, 1);
+  amqp_destroy_connection(broker);
+
+  /* Topology on a channel of its own: the deleted queue is gone, the
+   * server-named queue is declared anew and bound under its new name */
+  broker = accept_connection();
+  handshake(broker);
+  open_channel(broker, 65535);
+  expect_method(broker, 65535, AMQP_EXCHANGE_DECLARE_METHOD);
+  send_method(broker, 65535, AMQP_EXCHANGE_DECLARE_OK_METHOD, &declare_ok);
+  declare_queue(broker, 65535, "", "amq.gen-2");
+  bind_queue(broker, 65535, "amq.gen-2");
+  expect_method(broker, 65535, AMQP_CHANNEL_CLOSE_METHOD);
+  send_method(broker, 65535, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+
+  /* The consumer keeps the tag the broker gave it */
+  open_channel(broker, 1);
+  qos(broker);
+  consume(broker, "amq.gen-2", "ctag-1");
+  deliver(broker, 1, "ctag-1", 1, "key", NULL);
+  expect_ack(broker, 1);
+
+  /* Deliveries that don't go through amqp_consume_message() are numbered
+   * the same way */
+  get_ok(broker, 2);
+  expect_ack(broker, 2);
+  deliver(broker, 1, "ctag-1", 3, "key", NULL);
+  expect_ack(broker, 3);
+  expect_method(broker, 0, AMQP_CONNECTION_CLOSE_METHOD);
+  send_method(broker, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &connection_close_ok);
+  amqp_destroy_connection(broker);
+  return NULL;
+}
+
+/* Starts a consumer under the tag the application asked for */
+static void consume_as(amqp_connection_state_t broker, const char *queue,
+                       const char *tag) {
+  amqp_basic_consume_t *m = expect_method(broker, 1, AMQP_BASIC_CONSUME_METHOD);
+  amqp_basic_consume_ok_t ok;
+
+  check(bytes_is(m->queue, queue) && bytes_is(m->consumer_tag, tag),
+        "wrong consumer");
+  ok.consumer_tag = amqp_cstring_bytes(tag);
+  send_method(broker, 1, AMQP_BASIC_CONSUME_OK_METHOD, &ok);
+}
+
+/* Plays the broker for a channel with two consumers, the first of which gets
+ * a delivery on the recovered connection before the second is started */
+static void *two_consumers_broker_main(void *arg) {
+  amqp_connection_state_t broker;
+  amqp_channel_close_ok_t close_ok;
+  amqp_connection_close_ok_t connection_close_ok;
+  (void)arg;
+
+  broker = accept_connection();
+  handshake(broker);
+  open_channel(broker, 1);
+  consume_as(broker, "q1", "c1");
+  consume_as(broker, "q2", "c2");
+  deliver(broker, 1, "c1", 1, "key", NULL);
+  amqp_destroy_connection(broker);
+
+  broker = accept_connection();
+  handshake(broker);
+  open_channel(broker, 65535);
+  expect_method(broker, 65535, AMQP_CHANNEL_CLOSE_METHOD);
+  send_method(broker, 65535, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+  open_channel(broker, 1);
+  consume_as(broker, "q1", "c1");
+  deliver(broker, 1, "c1", 1, "key", NULL);
+  consume_as(broker, "q2", "c2");
+  expect_ack(broker, 1);
+  expect_method(broker, 0, AMQP_CONNECTION_CLOSE_METHOD);
+  send_method(broker, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &connection_close_ok);
+  amqp_destroy_connection(broker);
+  return NULL;
+}
+
+static uint64_t consume_one(amqp_connection_state_t conn) {
+  struct timeval timeout = {5, 0};
+  amqp_envelope_t envelope;
+  uint64_t tag;
+
+  check(amqp_consume_message(conn, &envelope, &timeout, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_consume_message failed");
+  check(1 == envelope.channel && bytes_is(envelope.consumer_tag, "ctag-1"),
+        "wrong delivery");
+  tag = envelope.delivery_tag;
+  amqp_destroy_envelope(&envelope);
+  return tag;
+}
+
+static void test_two_consumers(struct amqp_connection_info *info) {
+  struct timeval timeout = {5, 0};
+  pthread_t broker_thread;
+  amqp_connection_state_t conn;
+  amqp_socket_t *client_socket;
+  amqp_envelope_t envelope;
+  int i;
+
+  check(pthread_create(&broker_thread, NULL, two_consumers_broker_main,
+                       NULL) == 0,
+        "pthread_create failed");
+
+  conn = amqp_new_connection();
+  check(conn != NULL, "amqp_new_connection failed");
+  client_socket = amqp_tcp_socket_new(conn);
+  check(client_socket != NULL, "amqp_tcp_socket_new failed");
+  check(amqp_socket_open_noblock(client_socket, info->host, info->port,
+                                 &timeout) == AMQP_STATUS_OK,
+        "amqp_socket_open_noblock failed");
+  check(amqp_login(conn, info->vhost, 0, AMQP_DEFAULT_FRAME_SIZE, 0,
+                   AMQP_SASL_METHOD_PLAIN, info->user, info->password)
+                .reply_type == AMQP_RESPONSE_NORMAL,
+        "amqp_login failed");
+  check(amqp_set_recovery(conn, info, &timeout) == AMQP_STATUS_OK,
+        "amqp_set_recovery failed");
+  check(amqp_channel_open(conn, 1) != NULL, "amqp_channel_open failed");
+  check(amqp_basic_consume(conn, 1, amqp_cstring_bytes("q1"),
+                           amqp_cstring_bytes("c1"), 0, 0, 0,
+                           amqp_empty_table) != NULL,
+        "amqp_basic_consume failed");
+  check(amqp_basic_consume(conn, 1, amqp_cstring_bytes("q2"),
+                           amqp_cstring_bytes("c2"), 0, 0, 0,
+                           amqp_empty_table) != NULL,
+        "amqp_basic_consume failed");
+
+  /* The delivery that arrives while the consumers are being replayed is
+   * numbered on from the one before the failure, and its ack goes out */
+  for (i = 1; i <= 2; i++) {
+    check(amqp_consume_message(conn, &envelope, &timeout, 0).reply_type ==
+              AMQP_RESPONSE_NORMAL,
+          "amqp_consume_message failed");
+    check(bytes_is(envelope.consumer_tag, "c1") &&
+              (uint64_t)i == envelope.delivery_tag,
+          "delivery numbered wrongly");
+    amqp_destroy_envelope(&envelope);
+  }
+  check(amqp_basic_ack(conn, 1, 2, 0) == AMQP_STATUS_OK,
+        "amqp_basic_ack failed");
+
+  check(amqp_connection_close(conn, AMQP_REPLY_SUCCESS).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_connection_close failed");
+  check(amqp_destroy_connection(conn) == AMQP_STATUS_OK,
+        "amqp_destroy_connection failed");
+  pthread_join(broker_thread, NULL);
+}
+
+int main(void) {
+  struct amqp_connection_info info;
+  struct timeval timeout = {5, 0};
+  pthread_t broker_thread;
+  amqp_connection_state_t conn;
+  amqp_socket_t *client_socket;
+  amqp_queue_declare_ok_t *declared;
+  amqp_bytes_t queue;
+  amqp_rpc_reply_t reply;
+  amqp_message_t message;
+  amqp_frame_t frame;
+  int port;
+
+  listen_fd = listen_on(1, &port);
+  check(pthread_create(&broker_thread, NULL, broker_main, NULL) == 0,
+        "pthread_create failed");
+
+  amqp_default_connection_info(&info);
+  info.host = "127.0.0.1";
+  info.port = port;
+
+  conn = amqp_new_connection();
+  check(conn != NULL, "amqp_new_connection failed");
+  check(amqp_set_recovery(conn, &info, &timeout) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "recovery set up without a socket");
+  client_socket = amqp_tcp_socket_new(conn);
+  check(client_socket != NULL, "amqp_tcp_socket_new failed");
+  check(amqp_socket_open_noblock(client_socket, info.host, info.port, &timeout) ==
+            AMQP_STATUS_OK,
+        "amqp_socket_open_noblock failed");
+  check(amqp_login(conn, info.vhost, 0, AMQP_DEFAULT_FRAME_SIZE, 0,
+                   AMQP_SASL_METHOD_PLAIN, info.user, info.password)
+                .reply_type == AMQP_RESPONSE_NORMAL,
+        "amqp_login failed");
+  check(amqp_set_recovery(conn, &info, &timeout) == AMQP_STATUS_OK,
+        "amqp_set_recovery failed");
+
+  check(amqp_channel_open(conn, 1) != NULL, "amqp_channel_open failed");
+  check(amqp_exchange_declare(conn, 1, amqp_cstring_bytes("exchange"),
+                              amqp_cstring_bytes("direct"), 0, 0, 0, 0,
+                              amqp_empty_table) != NULL,
+        "amqp_exchange_declare failed");
+  declared = amqp_queue_declare(conn, 1, amqp_empty_bytes, 0, 0, 1, 1,
+                                amqp_empty_table);
+  check(declared != NULL, "amqp_queue_declare failed");
+  queue = amqp_bytes_malloc_dup(declared->queue);
+  check(amqp_queue_bind(conn, 1, queue, amqp_cstring_bytes("exchange"),
+                        amqp_cstring_bytes("key"), amqp_empty_table) != NULL,
+        "amqp_queue_bind failed");
+  check(amqp_queue_declare(conn, 1, amqp_cstring_bytes("deleted"), 0, 0, 0, 0,
+                           amqp_empty_table) != NULL,
+        "amqp_queue_declare failed");
+  check(amqp_queue_delete(conn, 1, amqp_cstring_bytes("deleted"), 0, 0) !=
+            NULL,
+        "amqp_queue_delete failed");
+  check(amqp_basic_qos(conn, 1, 0, 10, 0) != NULL, "amqp_basic_qos failed");
+  check(amqp_basic_consume(conn, 1, queue, amqp_empty_bytes, 0, 0, 0,
+                           amqp_empty_table) != NULL,
+        "amqp_basic_consume failed");
+  amqp_bytes_free(queue);
+
+  check(1 == consume_one(conn) && 2 == consume_one(conn),
+        "wrong delivery tags");
+  check(amqp_basic_ack(conn, 1, 1, 0) == AMQP_STATUS_OK,
+        "amqp_basic_ack failed");
+
+  /* The broker drops the connection; the delivery after recovery is
+   * numbered on, and only its ack reaches the broker */
+  check(3 == consume_one(conn), "delivery tag not continued");
+  check(amqp_basic_ack(conn, 1, 2, 0) == AMQP_STATUS_OK,
+        "stale ack failed");
+  check(amqp_basic_ack(conn, 1, 3, 0) == AMQP_STATUS_OK,
+        "amqp_basic_ack failed");
+
+  reply = amqp_basic_get(conn, 1, amqp_cstring_bytes("amq.gen-2"), 0);
+  check(AMQP_RESPONSE_NORMAL == reply.reply_type &&
+            AMQP_BASIC_GET_OK_METHOD == reply.reply.id,
+        "amqp_basic_get failed");
+  check(4 == ((amqp_basic_get_ok_t *)reply.reply.decoded)->delivery_tag,
+        "basic.get tag not continued");
+  check(amqp_read_message(conn, 1, &message, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_read_message failed");
+  amqp_destroy_message(&message);
+  check(amqp_basic_ack(conn, 1, 4, 0) == AMQP_STATUS_OK,
+        "amqp_basic_ack failed");
+
+  check(amqp_simple_wait_frame(conn, &frame) == AMQP_STATUS_OK &&
+            AMQP_FRAME_METHOD == frame.frame_type &&
+            AMQP_BASIC_DELIVER_METHOD == frame.payload.method.id,
+        "no delivery");
+  check(5 == ((amqp_basic_deliver_t *)frame.payload.method.decoded)
+                 ->delivery_tag,
+        "tag of a frame read by hand not continued");
+  check(amqp_read_message(conn, 1, &message, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_read_message failed");
+  amqp_destroy_message(&message);
+  check(amqp_basic_ack(conn, 1, 5, 0) == AMQP_STATUS_OK,
+        "amqp_basic_ack failed");
+
+  check(amqp_connection_close(conn, AMQP_REPLY_SUCCESS).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_connection_close failed");
+  check(amqp_destroy_connection(conn) == AMQP_STATUS_OK,
+        "amqp_destroy_connection failed");
+  pthread_join(broker_thread, NULL);
+
+  test_two_consumers(&info);
+  close(listen_fd);
+  return 0;
+}
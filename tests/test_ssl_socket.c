@@ -0,0 +1,535 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "test_helpers.h"
+#include <amqp_ssl_socket.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The most a TLS record holds */
+#define RECORD_SIZE 16384
+#define MAX_STEPS 8
+#define CHURN_THREADS 4
+#define CHURN_SOCKETS 200
+
+/* Plays the broker for one connection. Each step reads the given number of
+ * bytes, counts the records they came in and answers with one byte. */
+typedef struct server_t_ {
+  int resume;
+  /* Closes the connection after the last step */
+  int hang_up;
+  const size_t *steps;
+  int num_steps;
+  int accepted;
+  int reused;
+  int app_records;
+  int records[MAX_STEPS];
+  pthread_t thread;
+} server_t;
+
+static SSL_CTX *resuming_ctx;
+static SSL_CTX *fresh_ctx;
+static int listen_fd;
+static int port;
+static char cert_path[] = "/tmp/amqp_test_ssl_cert_XXXXXX";
+static char session_path[] = "/tmp/amqp_test_ssl_sessions_XXXXXX";
+
+static void count_record(int write_p, AMQP_UNUSED int version,
+                         int content_type, const void *buf, size_t len,
+                         AMQP_UNUSED SSL *ssl, void *arg) {
+  server_t *server = arg;
+  if (!write_p && SSL3_RT_HEADER == content_type && len >= 1 &&
+      SSL3_RT_APPLICATION_DATA == ((const unsigned char *)buf)[0]) {
+    server->app_records++;
+  }
+}
+
+static void *serve(void *arg) {
+  server_t *server = arg;
+  static char buf[4 * RECORD_SIZE];
+  int fd = accept(listen_fd, NULL, NULL);
+  SSL *ssl;
+  int i;
+
+  check(fd >= 0, "accept failed");
+  ssl = SSL_new(server->resume ? resuming_ctx : fresh_ctx);
+  check(ssl != NULL, "SSL_new failed");
+  SSL_set_fd(ssl, fd);
+  SSL_set_msg_callback(ssl, count_record);
+  SSL_set_msg_callback_arg(ssl, server);
+
+  if (1 == SSL_accept(ssl)) {
+    server->accepted = 1;
+    server->reused = (int)SSL_session_reused(ssl);
+    server->app_records = 0;
+    for (i = 0; i < server->num_steps; i++) {
+      size_t got = 0;
+      while (got < server->steps[i]) {
+        int res = SSL_read(ssl, buf, sizeof(buf));
+        check(res > 0, "server read failed");
+        got += (size_t)res;
+      }
+      check(got == server->steps[i], "more sent than expected");
+      server->records[i] = server->app_records;
+      server->app_records = 0;
+      check(1 == SSL_write(ssl, "k", 1), "server write failed");
+    }
+    /* Until the client closes */
+    while (!server->hang_up && SSL_read(ssl, buf, sizeof(buf)) > 0) {
+    }
+  }
+  SSL_free(ssl);
+  close(fd);
+  return NULL;
+}
+
+static void launch_server(server_t *server) {
+  check(pthread_create(&server->thread, NULL, serve, server) == 0,
+        "pthread_create failed");
+}
+
+static void start_server(server_t *server, int resume, const size_t *steps,
+                         int num_steps) {
+  memset(server, 0, sizeof(*server));
+  server->resume = resume;
+  server->steps = steps;
+  server->num_steps = num_steps;
+  launch_server(server);
+}
+
+static void join_server(server_t *server) {
+  check(pthread_join(server->thread, NULL) == 0, "pthread_join failed");
+}
+
+/* A self-signed certificate for localhost, written to cert_path */
+static void make_certificate(EVP_PKEY **key, X509 **cert) {
+  EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+  X509V3_CTX v3;
+  X509_EXTENSION *ext;
+  X509_NAME *name;
+  FILE *file;
+  int fd;
+
+  *key = NULL;
+  check(kctx != NULL && EVP_PKEY_keygen_init(kctx) > 0 &&
+            EVP_PKEY_CTX_set_rsa_keygen_bits(kctx, 2048) > 0 &&
+            EVP_PKEY_keygen(kctx, key) > 0,
+        "key not generated");
+  EVP_PKEY_CTX_free(kctx);
+
+  *cert = X509_new();
+  check(*cert != NULL, "X509_new failed");
+  X509_set_version(*cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(*cert), -60);
+  X509_gmtime_adj(X509_getm_notAfter(*cert), 3600);
+  X509_set_pubkey(*cert, *key);
+  name = X509_get_subject_name(*cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(*cert, name);
+  X509V3_set_ctx_nodb(&v3);
+  X509V3_set_ctx(&v3, *cert, *cert, NULL, NULL, 0);
+  ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, "DNS:localhost");
+  check(ext != NULL && X509_add_ext(*cert, ext, -1), "SAN not added");
+  X509_EXTENSION_free(ext);
+  check(X509_sign(*cert, *key, EVP_sha256()) > 0, "certificate not signed");
+
+  fd = mkstemp(cert_path);
+  check(fd >= 0, "mkstemp failed");
+  file = fdopen(fd, "w");
+  check(file != NULL && PEM_write_X509(file, *cert), "certificate not written");
+  fclose(file);
+}
+
+/* Sessions are handed out during the handshake up to TLS 1.2, which is what
+ * the cache is checked against */
+static SSL_CTX *server_ctx(EVP_PKEY *key, X509 *cert, int resume) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  check(ctx != NULL, "SSL_CTX_new failed");
+  check(SSL_CTX_use_certificate(ctx, cert) == 1 &&
+            SSL_CTX_use_PrivateKey(ctx, key) == 1,
+        "server certificate not set");
+  SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+  if (!resume) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+  }
+  return ctx;
+}
+
+static amqp_socket_t *new_socket(amqp_connection_state_t *conn,
+                                 amqp_ssl_session_cache_t *cache,
+                                 int with_cacert) {
+  amqp_socket_t *socket;
+
+  *conn = amqp_new_connection();
+  check(*conn != NULL, "amqp_new_connection failed");
+  socket = amqp_ssl_socket_new(*conn);
+  check(socket != NULL, "amqp_ssl_socket_new failed");
+  if (with_cacert) {
+    check(amqp_ssl_socket_set_cacert(socket, cert_path) == AMQP_STATUS_OK,
+          "amqp_ssl_socket_set_cacert failed");
+  }
+  if (NULL != cache) {
+    check(amqp_ssl_socket_set_session_cache(socket, cache) == AMQP_STATUS_OK,
+          "amqp_ssl_socket_set_session_cache failed");
+  }
+  return socket;
+}
+
+/* Connects to a server and closes again, returning whether the server
+ * resumed a session */
+static int connect_once(amqp_ssl_session_cache_t *cache) {
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket = new_socket(&conn, cache, 1);
+  server_t server;
+
+  start_server(&server, 1, NULL, 0);
+  check(amqp_socket_open(socket, "localhost", port) == AMQP_STATUS_OK,
+        "amqp_socket_open failed");
+  amqp_destroy_connection(conn);
+  join_server(&server);
+  check(server.accepted, "handshake failed");
+  return server.reused;
+}
+
+static void test_session_cache(void) {
+  amqp_ssl_session_cache_t *cache = amqp_ssl_session_cache_new();
+  amqp_ssl_session_cache_t *loaded = amqp_ssl_session_cache_new();
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  server_t server;
+  int fd;
+
+  check(cache != NULL && loaded != NULL, "amqp_ssl_session_cache_new failed");
+
+  /* Without a cache every handshake is a full one */
+  check(!connect_once(NULL) && !connect_once(NULL), "session resumed");
+
+  /* The session of the first handshake is offered by the next socket */
+  check(!connect_once(cache), "session resumed from an empty cache");
+  check(connect_once(cache), "cached session not resumed");
+
+  /* It survives being written out and read back */
+  fd = mkstemp(session_path);
+  check(fd >= 0, "mkstemp failed");
+  close(fd);
+  check(amqp_ssl_session_cache_save(cache, session_path) == AMQP_STATUS_OK,
+        "amqp_ssl_session_cache_save failed");
+  check(amqp_ssl_session_cache_load(loaded, session_path) == AMQP_STATUS_OK,
+        "amqp_ssl_session_cache_load failed");
+  check(connect_once(loaded), "loaded session not resumed");
+  check(amqp_ssl_session_cache_load(loaded, cert_path) ==
+            AMQP_STATUS_SSL_ERROR,
+        "garbage loaded");
+
+  /* A broker that fails verification loses its session */
+  socket = new_socket(&conn, cache, 0);
+  start_server(&server, 0, NULL, 0);
+  check(amqp_socket_open(socket, "localhost", port) ==
+            AMQP_STATUS_SSL_PEER_VERIFY_FAILED,
+        "unverified broker accepted");
+  amqp_destroy_connection(conn);
+  join_server(&server);
+  check(!connect_once(cache), "session of an unverified broker resumed");
+  check(connect_once(cache), "new session not cached");
+
+  /* Sockets keep the cache they were given */
+  socket = new_socket(&conn, cache, 1);
+  amqp_ssl_session_cache_free(cache);
+  start_server(&server, 1, NULL, 0);
+  check(amqp_socket_open(socket, "localhost", port) == AMQP_STATUS_OK,
+        "amqp_socket_open failed");
+  amqp_destroy_connection(conn);
+  join_server(&server);
+  check(server.reused, "released cache not used by its socket");
+
+  amqp_ssl_session_cache_free(loaded);
+  unlink(session_path);
+}
+
+static void test_shared_context(void) {
+  amqp_ssl_context_t *context = amqp_ssl_context_new();
+  amqp_connection_state_t conns[2];
+  amqp_socket_t *sockets[2];
+  server_t server;
+  int i;
+
+  check(context != NULL, "amqp_ssl_context_new failed");
+  check(amqp_ssl_context_set_cacert(context, cert_path) == AMQP_STATUS_OK,
+        "amqp_ssl_context_set_cacert failed");
+  for (i = 0; i < 2; i++) {
+    conns[i] = amqp_new_connection();
+    sockets[i] = amqp_ssl_socket_new_with_context(conns[i], context);
+    check(sockets[i] != NULL, "amqp_ssl_socket_new_with_context failed");
+    check(amqp_ssl_socket_get_context(sockets[i]) ==
+              amqp_ssl_context_get_context(context),
+          "context not shared");
+  }
+
+  /* The shared context is only changed through the context */
+  check(amqp_ssl_socket_set_cacert(sockets[0], cert_path) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "shared context changed through a socket");
+  check(amqp_ssl_socket_set_ssl_versions(sockets[0], AMQP_TLSv1_2,
+                                         AMQP_TLSvLATEST) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "shared context changed through a socket");
+
+  /* The sockets hold on to it once the application lets go */
+  amqp_ssl_context_free(context);
+  check(amqp_uninitialize_ssl_library() == AMQP_STATUS_SOCKET_INUSE,
+        "OpenSSL torn down under its sockets");
+  for (i = 0; i < 2; i++) {
+    start_server(&server, 1, NULL, 0);
+    check(amqp_socket_open(sockets[i], "localhost", port) == AMQP_STATUS_OK,
+          "socket sharing a released context failed to open");
+    amqp_destroy_connection(conns[i]);
+    join_server(&server);
+    check(server.accepted, "handshake failed");
+  }
+
+  /* A context counts as a user of OpenSSL too */
+  context = amqp_ssl_context_new();
+  check(context != NULL, "amqp_ssl_context_new failed");
+  check(amqp_uninitialize_ssl_library() == AMQP_STATUS_SOCKET_INUSE,
+        "OpenSSL torn down under a context");
+  amqp_ssl_context_free(context);
+}
+
+/* Sends all of buf, waiting while the socket is full */
+static void send_all(amqp_socket_t *socket, const char *buf, size_t len,
+                     int flags) {
+  while (len > 0) {
+    ssize_t res = amqp_socket_send(socket, buf, len, flags);
+    if (AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE == res) {
+      check(amqp_socket_wait(socket, AMQP_SF_POLLOUT, amqp_time_infinite()) ==
+                AMQP_STATUS_OK,
+            "wait failed");
+      continue;
+    }
+    check(res > 0, "send failed");
+    buf += res;
+    len -= (size_t)res;
+  }
+}
+
+/* Waits for the server to take in a step */
+static void read_reply(amqp_socket_t *socket) {
+  char reply;
+  for (;;) {
+    ssize_t res = amqp_socket_recv(socket, &reply, 1, 0);
+    if (AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD == res) {
+      check(amqp_socket_wait(socket, AMQP_SF_POLLIN, amqp_time_infinite()) ==
+                AMQP_STATUS_OK,
+            "wait failed");
+      continue;
+    }
+    check(1 == res && 'k' == reply, "no reply");
+    return;
+  }
+}
+
+static void test_staging(void) {
+  static const size_t steps[] = {6,     2,           20100,
+                                 20100, RECORD_SIZE, RECORD_SIZE + 1};
+  static char data[2 * RECORD_SIZE];
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket = new_socket(&conn, NULL, 1);
+  server_t server;
+
+  start_server(&server, 1, steps, sizeof(steps) / sizeof(steps[0]));
+  check(amqp_socket_open(socket, "localhost", port) == AMQP_STATUS_OK,
+        "amqp_socket_open failed");
+
+  /* Frames sent with more to come go out as one record */
+  send_all(socket, "ab", 2, AMQP_SF_MORE);
+  send_all(socket, "cd", 2, AMQP_SF_MORE);
+  send_all(socket, "ef", 2, 0);
+  read_reply(socket);
+
+  /* Reading sends what's held back */
+  send_all(socket, "gh", 2, AMQP_SF_MORE);
+  read_reply(socket);
+
+  /* A frame that doesn't fit behind the held ones sends them first */
+  send_all(socket, data, 10000, AMQP_SF_MORE);
+  send_all(socket, data, 10000, AMQP_SF_MORE);
+  send_all(socket, data, 100, 0);
+  read_reply(socket);
+
+  /* A frame larger than a record isn't held back */
+  send_all(socket, data, 100, AMQP_SF_MORE);
+  send_all(socket, data, 20000, 0);
+  read_reply(socket);
+
+  /* Frames filling a record exactly share it */
+  send_all(socket, data, RECORD_SIZE - 1, AMQP_SF_MORE);
+  send_all(socket, data, 1, 0);
+  read_reply(socket);
+
+  /* A whole record with more to come is sent at once */
+  send_all(socket, data, RECORD_SIZE, AMQP_SF_MORE);
+  send_all(socket, data, 1, 0);
+  read_reply(socket);
+
+  amqp_destroy_connection(conn);
+  join_server(&server);
+  check(1 == server.records[0], "batch not sent as one record");
+  check(1 == server.records[1], "held frame not sent before reading");
+  check(2 == server.records[2], "records not split where a frame overflows");
+  check(3 == server.records[3], "large frame not sent on its own");
+  check(1 == server.records[4], "full record split");
+  check(2 == server.records[5], "whole record held back");
+}
+
+static void *churn(AMQP_UNUSED void *arg) {
+  int i;
+  for (i = 0; i < CHURN_SOCKETS; i++) {
+    amqp_connection_state_t conn = amqp_new_connection();
+    check(amqp_ssl_socket_new(conn) != NULL, "amqp_ssl_socket_new failed");
+    amqp_destroy_connection(conn);
+  }
+  return NULL;
+}
+
+/* Sockets created and deleted on several threads at once are all counted,
+ * OpenSSL can be torn down once they're gone and set up again */
+static void test_churn(void) {
+  pthread_t threads[CHURN_THREADS];
+  amqp_connection_state_t conn;
+  int i;
+
+  for (i = 0; i < CHURN_THREADS; i++) {
+    check(pthread_create(&threads[i], NULL, churn, NULL) == 0,
+          "pthread_create failed");
+  }
+  for (i = 0; i < CHURN_THREADS; i++) {
+    check(pthread_join(threads[i], NULL) == 0, "pthread_join failed");
+  }
+  check(amqp_uninitialize_ssl_library() == AMQP_STATUS_OK,
+        "sockets still counted");
+  conn = amqp_new_connection();
+  check(amqp_ssl_socket_new(conn) != NULL, "OpenSSL not set up again");
+  amqp_destroy_connection(conn);
+  check(amqp_uninitialize_ssl_library() == AMQP_STATUS_OK,
+        "socket still counted");
+}
+
+/* Without the tls module or a cipher the kernel knows the socket falls back
+ * to OpenSSL, the traffic is the same either way */
+static void test_ktls(void) {
+  static const size_t steps[] = {6};
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket = new_socket(&conn, NULL, 1);
+  server_t server;
+  int res;
+
+  check(amqp_ssl_socket_set_ktls(socket, 0) == AMQP_STATUS_OK,
+        "turning kTLS off failed");
+  res = amqp_ssl_socket_set_ktls(socket, 1);
+  check(AMQP_STATUS_OK == res || AMQP_STATUS_UNSUPPORTED == res,
+        "amqp_ssl_socket_set_ktls failed");
+  check(!amqp_ssl_socket_get_ktls(socket), "offloaded before opening");
+
+  start_server(&server, 1, steps, 1);
+  check(amqp_socket_open(socket, "localhost", port) == AMQP_STATUS_OK,
+        "amqp_socket_open failed");
+  if (AMQP_STATUS_UNSUPPORTED == res) {
+    check(!amqp_ssl_socket_get_ktls(socket), "offloaded without support");
+  }
+  send_all(socket, "ab", 2, AMQP_SF_MORE);
+  send_all(socket, "cdef", 4, 0);
+  read_reply(socket);
+  amqp_destroy_connection(conn);
+  join_server(&server);
+  check(server.accepted, "handshake failed");
+}
+
+/* A broker hanging up doesn't take the client down with SIGPIPE */
+static void test_ktls_hang_up(void) {
+  static const size_t steps[] = {1};
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket = new_socket(&conn, NULL, 1);
+  server_t server;
+  ssize_t res = 0;
+  int i;
+
+  amqp_ssl_socket_set_ktls(socket, 1);
+  memset(&server, 0, sizeof(server));
+  server.resume = 1;
+  server.hang_up = 1;
+  server.steps = steps;
+  server.num_steps = 1;
+  launch_server(&server);
+  check(amqp_socket_open(socket, "localhost", port) == AMQP_STATUS_OK,
+        "amqp_socket_open failed");
+  send_all(socket, "a", 1, 0);
+  read_reply(socket);
+  join_server(&server);
+
+  for (i = 0; i < 100; i++) {
+    res = amqp_socket_send(socket, "b", 1, 0);
+    if (res < 0 && AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE != res) {
+      break;
+    }
+    usleep(10000);
+  }
+  check(res < 0, "sending to a closed connection went on");
+  amqp_destroy_connection(conn);
+}
+
+int main(void) {
+  EVP_PKEY *key;
+  X509 *cert;
+
+  make_certificate(&key, &cert);
+  resuming_ctx = server_ctx(key, cert, 1);
+  fresh_ctx = server_ctx(key, cert, 0);
+  listen_fd = listen_on(4, &port);
+
+  test_session_cache();
+  test_shared_context();
+  test_staging();
+  test_ktls();
+  test_ktls_hang_up();
+
+  close(listen_fd);
+  SSL_CTX_free(resuming_ctx);
+  SSL_CTX_free(fresh_ctx);
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  unlink(cert_path);
+
+  test_churn();
+  return 0;
+}
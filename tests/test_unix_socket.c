@@ -0,0 +1,138 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include <amqp.h>
+#include <amqp_unix_socket.h>
+#include "test_helpers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int listen_at(const char *path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  check(fd >= 0, "socket failed");
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  check(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "bind failed");
+  check(listen(fd, 4) == 0, "listen failed");
+  return fd;
+}
+
+static ssize_t recv_all(amqp_socket_t *socket, char *buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t res = amqp_socket_recv(socket, buf + got, len - got, 0);
+    if (AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD == res) {
+      check(amqp_poll(amqp_socket_get_sockfd(socket), AMQP_SF_POLLIN,
+                      amqp_time_infinite()) == AMQP_STATUS_OK,
+            "poll failed");
+      continue;
+    }
+    if (res <= 0) {
+      return res;
+    }
+    got += (size_t)res;
+  }
+  return (ssize_t)got;
+}
+
+int main(void) {
+  char dir[] = "/tmp/amqp-unix-XXXXXX";
+  char path[64];
+  char missing[64];
+  char url[128];
+  char buf[16];
+  char long_path[200];
+  const char *paths[2];
+  int ports[2] = {0, 0};
+  struct amqp_connection_info ci;
+  amqp_connection_state_t conn;
+  amqp_socket_t *client;
+  int listen_fd;
+  int server_fd;
+  int connected = -1;
+
+  check(mkdtemp(dir) != NULL, "mkdtemp failed");
+  sprintf(path, "%s/broker.sock", dir);
+  sprintf(missing, "%s/missing.sock", dir);
+  listen_fd = listen_at(path);
+
+  conn = amqp_new_connection();
+  client = amqp_unix_socket_new(conn);
+  check(client != NULL, "amqp_unix_socket_new failed");
+
+  /* No one listens there */
+  check(amqp_socket_open(client, missing, 0) == AMQP_STATUS_SOCKET_ERROR,
+        "missing socket connected to");
+  memset(long_path, 'a', sizeof(long_path) - 1);
+  long_path[sizeof(long_path) - 1] = 0;
+  check(amqp_socket_open(client, long_path, 0) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "overlong path accepted");
+
+  /* The next path is tried */
+  paths[0] = missing;
+  paths[1] = path;
+  check(amqp_socket_open_any(client, paths, ports, 2, NULL, &connected) ==
+                AMQP_STATUS_OK &&
+            1 == connected,
+        "no connection past a missing socket");
+  server_fd = accept(listen_fd, NULL, NULL);
+  check(server_fd >= 0, "accept failed");
+
+  check(amqp_socket_send(client, "ping", 4, 0) == 4, "send failed");
+  check(read(server_fd, buf, 4) == 4 && !memcmp(buf, "ping", 4),
+        "wrong bytes received");
+  check(write(server_fd, "pong", 4) == 4, "write failed");
+  check(recv_all(client, buf, 4) == 4 && !memcmp(buf, "pong", 4),
+        "wrong bytes sent");
+  close(server_fd);
+  check(recv_all(client, buf, 1) == AMQP_STATUS_CONNECTION_CLOSED,
+        "closed connection not noticed");
+  amqp_destroy_connection(conn);
+
+  /* A parsed URL opens the same way */
+  sprintf(url, "amqp+unix://%s", path);
+  check(amqp_parse_url(url, &ci) == AMQP_STATUS_OK && 0 == ci.port,
+        "amqp_parse_url failed");
+  conn = amqp_new_connection();
+  client = amqp_unix_socket_new(conn);
+  check(amqp_socket_open(client, ci.host, ci.port) == AMQP_STATUS_OK,
+        "no connection to the parsed path");
+  server_fd = accept(listen_fd, NULL, NULL);
+  check(server_fd >= 0, "accept failed");
+  close(server_fd);
+  amqp_destroy_connection(conn);
+
+  close(listen_fd);
+  unlink(path);
+  rmdir(dir);
+  return 0;
+}
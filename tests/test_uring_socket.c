@@ -0,0 +1,235 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "amqp_socket.h"
+#include <amqp.h>
+#include <amqp_uring_socket.h>
+#include "test_helpers.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Larger than all the receive buffers together, and than the send buffer */
+#define BULK_SIZE (1024 * 1024)
+
+/* Nearly fills the gathered output */
+#define CLOSE_SIZE (120 * 1024)
+
+static void AMQP_CALL on_frame(AMQP_UNUSED amqp_event_loop_t *loop,
+                               AMQP_UNUSED amqp_connection_state_t state,
+                               AMQP_UNUSED const amqp_frame_t *frame,
+                               AMQP_UNUSED int status,
+                               AMQP_UNUSED void *user_data) {}
+
+static char pattern(size_t i) { return (char)(i * 7 + i / 251); }
+
+static ssize_t recv_all(amqp_socket_t *socket, char *buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t res = amqp_socket_recv(socket, buf + got, len - got, 0);
+    if (AMQP_PRIVATE_STATUS_SOCKET_NEEDREAD == res) {
+      check(amqp_socket_wait(socket, AMQP_SF_POLLIN, amqp_time_infinite()) ==
+                AMQP_STATUS_OK,
+            "wait failed");
+      continue;
+    }
+    if (res <= 0) {
+      return res;
+    }
+    got += (size_t)res;
+  }
+  return (ssize_t)got;
+}
+
+static void send_all(amqp_socket_t *socket, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t res = amqp_socket_send(socket, buf, len, 0);
+    if (AMQP_PRIVATE_STATUS_SOCKET_NEEDWRITE == res) {
+      check(amqp_socket_wait(socket, AMQP_SF_POLLOUT, amqp_time_infinite()) ==
+                AMQP_STATUS_OK,
+            "wait failed");
+      continue;
+    }
+    check(res > 0, "send failed");
+    buf += res;
+    len -= (size_t)res;
+  }
+}
+
+static int read_all(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t res = read(fd, buf, len);
+    if (res <= 0) {
+      return -1;
+    }
+    buf += res;
+    len -= (size_t)res;
+  }
+  return 0;
+}
+
+/* Writes the pattern while the client drains it, then reads it back */
+static void *bulk_peer(void *arg) {
+  int fd = *(int *)arg;
+  char *buf = malloc(BULK_SIZE);
+  size_t i;
+
+  check(buf != NULL, "malloc failed");
+  for (i = 0; i < BULK_SIZE; i++) {
+    buf[i] = pattern(i);
+  }
+  check(write(fd, buf, BULK_SIZE) == BULK_SIZE, "write failed");
+  memset(buf, 0, BULK_SIZE);
+  check(read_all(fd, buf, BULK_SIZE) == 0, "read failed");
+  for (i = 0; i < BULK_SIZE; i++) {
+    check(buf[i] == pattern(i), "wrong bytes sent");
+  }
+  free(buf);
+  return NULL;
+}
+
+/* Reads everything sent before the client closed, then the end of it */
+static void *close_peer(void *arg) {
+  int fd = *(int *)arg;
+  char *buf = malloc(CLOSE_SIZE);
+  size_t i;
+
+  check(buf != NULL, "malloc failed");
+  check(read_all(fd, buf, CLOSE_SIZE) == 0, "sent bytes lost on close");
+  for (i = 0; i < CLOSE_SIZE; i++) {
+    check(buf[i] == pattern(i), "wrong bytes sent");
+  }
+  check(read(fd, buf, 1) == 0, "socket not closed");
+  free(buf);
+  return NULL;
+}
+
+int main(void) {
+  amqp_connection_state_t conn;
+  amqp_socket_t *client;
+  amqp_event_loop_t *loop;
+  amqp_time_t deadline;
+  struct timeval timeout = {0, 50000};
+  pthread_t peer;
+  char buf[16];
+  char *bulk;
+  int listen_fd;
+  int server_fd;
+  int port;
+  size_t i;
+
+  conn = amqp_new_connection();
+  client = amqp_uring_socket_new(conn);
+  if (NULL == client) {
+    printf("io_uring isn't available, skipping\n");
+    amqp_destroy_connection(conn);
+    return 0;
+  }
+  listen_fd = listen_on(4, &port);
+  check(amqp_socket_open(client, "127.0.0.1", port) == AMQP_STATUS_OK,
+        "open failed");
+  server_fd = accept(listen_fd, NULL, NULL);
+  check(server_fd >= 0, "accept failed");
+
+  /* Readiness can't be polled for on the descriptor */
+  check(NULL == amqp_mux_new(conn), "multiplexed");
+  loop = amqp_event_loop_new();
+  check(loop != NULL, "amqp_event_loop_new failed");
+  check(amqp_event_loop_add(loop, conn, on_frame, NULL) ==
+            AMQP_STATUS_INVALID_PARAMETER,
+        "added to an event loop");
+  amqp_event_loop_destroy(loop);
+
+  /* A batch goes out once its last frame is sent */
+  check(amqp_socket_send(client, "ab", 2, AMQP_SF_MORE) == 2, "send failed");
+  check(amqp_socket_send(client, "cd", 2, AMQP_SF_MORE) == 2, "send failed");
+  check(amqp_socket_send(client, "ef", 2, 0) == 2, "send failed");
+  check(read_all(server_fd, buf, 6) == 0 && !memcmp(buf, "abcdef", 6),
+        "wrong batch received");
+
+  /* Waiting for a reply releases an unfinished batch, and times out */
+  check(amqp_socket_send(client, "gh", 2, AMQP_SF_MORE) == 2, "send failed");
+  check(amqp_time_from_now(&deadline, &timeout) == AMQP_STATUS_OK,
+        "amqp_time_from_now failed");
+  check(amqp_socket_wait(client, AMQP_SF_POLLIN, deadline) ==
+            AMQP_STATUS_TIMEOUT,
+        "wait didn't time out");
+  check(read_all(server_fd, buf, 2) == 0 && !memcmp(buf, "gh", 2),
+        "unfinished batch not released");
+
+  /* More than fits in the receive and send buffers, both ways */
+  bulk = malloc(BULK_SIZE);
+  check(bulk != NULL, "malloc failed");
+  check(pthread_create(&peer, NULL, bulk_peer, &server_fd) == 0,
+        "pthread_create failed");
+  check(recv_all(client, bulk, BULK_SIZE) == BULK_SIZE, "recv failed");
+  for (i = 0; i < BULK_SIZE; i++) {
+    check(bulk[i] == pattern(i), "wrong bytes received");
+  }
+  send_all(client, bulk, BULK_SIZE);
+  check(pthread_join(peer, NULL) == 0, "pthread_join failed");
+  free(bulk);
+
+  close(server_fd);
+  check(recv_all(client, buf, 1) == AMQP_STATUS_CONNECTION_CLOSED,
+        "closed connection not noticed");
+
+  /* The socket can be opened again once closed */
+  check(amqp_socket_close(client, AMQP_SC_NONE) == AMQP_STATUS_OK,
+        "close failed");
+  check(amqp_socket_open(client, "127.0.0.1", port) == AMQP_STATUS_OK,
+        "reopen failed");
+  server_fd = accept(listen_fd, NULL, NULL);
+  check(server_fd >= 0, "accept failed");
+  check(write(server_fd, "ping", 4) == 4, "write failed");
+  check(recv_all(client, buf, 4) == 4 && !memcmp(buf, "ping", 4),
+        "nothing received after reopening");
+
+  /* Closing straight after sending still delivers everything, including
+   * an unfinished batch */
+  bulk = malloc(CLOSE_SIZE);
+  check(bulk != NULL, "malloc failed");
+  for (i = 0; i < CLOSE_SIZE; i++) {
+    bulk[i] = pattern(i);
+  }
+  check(amqp_socket_send(client, bulk, CLOSE_SIZE / 2, 0) == CLOSE_SIZE / 2,
+        "send failed");
+  check(amqp_socket_send(client, bulk + CLOSE_SIZE / 2, CLOSE_SIZE / 2,
+                         AMQP_SF_MORE) == CLOSE_SIZE / 2,
+        "send failed");
+  check(pthread_create(&peer, NULL, close_peer, &server_fd) == 0,
+        "pthread_create failed");
+  check(amqp_socket_close(client, AMQP_SC_NONE) == AMQP_STATUS_OK,
+        "close failed");
+  check(pthread_join(peer, NULL) == 0, "pthread_join failed");
+  free(bulk);
+  close(server_fd);
+
+  amqp_destroy_connection(conn);
+  close(listen_fd);
+  return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "amqp_socket.h"
+#include "amqp_tcp_socket.h"
+#include "test_helpers.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define NUM_KEYS 4
+#define NUM_DELIVERIES 200
+#define BATCH 10
+
+typedef struct {
+  int count;
+  int last_seq;
+  int out_of_order;
+  int moved;
+  pthread_t thread;
+} key_state_t;
+
+static key_state_t keys[NUM_KEYS];
+
+/* Sends a delivery from the broker's end: the routing key picks one of the
+ * keys, the body is its sequence number */
+static void deliver_seq(amqp_connection_state_t broker, int seq) {
+  char routing_key[8];
+  char body[8];
+
+  sprintf(routing_key, "key%d", seq % NUM_KEYS);
+  sprintf(body, "%d", seq);
+  deliver(broker, 1, "ctag", seq + 1, routing_key, body);
+}
+
+static void AMQP_CALL process(amqp_worker_pool_t *pool,
+                              amqp_envelope_t *envelope, void *user_data) {
+  char body[8];
+  key_state_t *key;
+  int seq;
+
+  (void)user_data;
+  memcpy(body, envelope->message.body.bytes, envelope->message.body.len);
+  body[envelope->message.body.len] = '\0';
+  seq = atoi(body);
+  key = &keys[seq % NUM_KEYS];
+
+  /* Every key is owned by a single worker, so its state needs no lock */
+  if (0 == key->count) {
+    key->thread = pthread_self();
+  } else if (!pthread_equal(key->thread, pthread_self())) {
+    key->moved = 1;
+  }
+  if (key->count > 0 && seq <= key->last_seq) {
+    key->out_of_order = 1;
+  }
+  key->last_seq = seq;
+  key->count++;
+
+  if (seq % 5 == 0) {
+    usleep(1000);
+  }
+
+  if (seq % 2 == 0) {
+    check(amqp_worker_pool_ack(pool, envelope) == AMQP_STATUS_OK,
+          "amqp_worker_pool_ack failed");
+  } else {
+    check(amqp_worker_pool_reject(pool, envelope, 1) == AMQP_STATUS_OK,
+          "amqp_worker_pool_reject failed");
+  }
+}
+
+/* Reads one ack or reject on the broker's end, returns 0 on timeout */
+static int read_settlement(amqp_connection_state_t broker,
+                           struct timeval *timeout, char *settled) {
+  amqp_frame_t frame;
+  uint64_t tag;
+  int res = amqp_simple_wait_frame_noblock(broker, &frame, timeout);
+
+  if (AMQP_STATUS_TIMEOUT == res) {
+    return 0;
+  }
+  check(AMQP_STATUS_OK == res, "ack not received");
+  check(AMQP_FRAME_METHOD == frame.frame_type, "not a method");
+  if (AMQP_BASIC_ACK_METHOD == frame.payload.method.id) {
+    amqp_basic_ack_t *ack = frame.payload.method.decoded;
+    tag = ack->delivery_tag;
+    check(tag % 2 == 1 && !ack->multiple, "wrong delivery acked");
+  } else {
+    amqp_basic_reject_t *reject = frame.payload.method.decoded;
+    check(AMQP_BASIC_REJECT_METHOD == frame.payload.method.id,
+          "neither ack nor reject");
+    tag = reject->delivery_tag;
+    check(tag % 2 == 0 && reject->requeue, "wrong delivery rejected");
+  }
+  check(tag >= 1 && tag <= NUM_DELIVERIES && !settled[tag - 1],
+        "delivery settled twice");
+  settled[tag - 1] = 1;
+  return 1;
+}
+
+static volatile int recovered;
+
+/* Holds the delivery from before the failure until the connection has been
+ * recovered, so that its ack is collected afterwards */
+static void AMQP_CALL ack_after_recovery(amqp_worker_pool_t *pool,
+                                         amqp_envelope_t *envelope,
+                                         void *user_data) {
+  (void)user_data;
+  while (bytes_is(envelope->message.body, "before") && !recovered) {
+    usleep(1000);
+  }
+  check(amqp_worker_pool_ack(pool, envelope) == AMQP_STATUS_OK,
+        "amqp_worker_pool_ack failed");
+}
+
+static void start_consumer(amqp_connection_state_t broker) {
+  amqp_channel_open_ok_t open_ok;
+  amqp_basic_consume_ok_t consume_ok;
+
+  expect_method(broker, 1, AMQP_CHANNEL_OPEN_METHOD);
+  open_ok.channel_id = amqp_empty_bytes;
+  send_method(broker, 1, AMQP_CHANNEL_OPEN_OK_METHOD, &open_ok);
+  expect_method(broker, 1, AMQP_BASIC_CONSUME_METHOD);
+  consume_ok.consumer_tag = amqp_cstring_bytes("ctag");
+  send_method(broker, 1, AMQP_BASIC_CONSUME_OK_METHOD, &consume_ok);
+}
+
+/* Delivers one message and drops the connection, then delivers one on the
+ * recovered connection and expects only its ack, under the broker's tag */
+static void *recovery_broker(void *arg) {
+  int listen_fd = *(int *)arg;
+  amqp_connection_state_t broker;
+  amqp_channel_open_ok_t open_ok;
+  amqp_channel_close_ok_t close_ok;
+  amqp_connection_close_ok_t connection_close_ok;
+  amqp_basic_ack_t *ack;
+
+  broker = connection_on(accept(listen_fd, NULL, NULL));
+  handshake(broker);
+  start_consumer(broker);
+  deliver(broker, 1, "ctag", 1, "key", "before");
+  amqp_destroy_connection(broker);
+
+  /* Recovery replays the (empty) topology on a channel of its own */
+  broker = connection_on(accept(listen_fd, NULL, NULL));
+  handshake(broker);
+  expect_method(broker, 65535, AMQP_CHANNEL_OPEN_METHOD);
+  open_ok.channel_id = amqp_empty_bytes;
+  send_method(broker, 65535, AMQP_CHANNEL_OPEN_OK_METHOD, &open_ok);
+  expect_method(broker, 65535, AMQP_CHANNEL_CLOSE_METHOD);
+  send_method(broker, 65535, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+  start_consumer(broker);
+  deliver(broker, 1, "ctag", 1, "key", "after");
+
+  ack = expect_method(broker, 1, AMQP_BASIC_ACK_METHOD);
+  check(1 == ack->delivery_tag, "ack not under the broker's tag");
+  expect_method(broker, 0, AMQP_CONNECTION_CLOSE_METHOD);
+  send_method(broker, 0, AMQP_CONNECTION_CLOSE_OK_METHOD, &connection_close_ok);
+  amqp_destroy_connection(broker);
+  return NULL;
+}
+
+static void test_recovery(void) {
+  struct amqp_connection_info info;
+  struct timeval timeout = {5, 0};
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  amqp_worker_pool_t *pool;
+  pthread_t broker_thread;
+  int listen_fd;
+  int port;
+
+  listen_fd = listen_on(1, &port);
+  check(pthread_create(&broker_thread, NULL, recovery_broker, &listen_fd) == 0,
+        "pthread_create failed");
+  amqp_default_connection_info(&info);
+  info.host = "127.0.0.1";
+  info.port = port;
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new(conn);
+  check(socket != NULL, "amqp_tcp_socket_new failed");
+  check(amqp_socket_open_noblock(socket, info.host, info.port, &timeout) ==
+            AMQP_STATUS_OK,
+        "amqp_socket_open_noblock failed");
+  check(amqp_login(conn, info.vhost, 0, AMQP_DEFAULT_FRAME_SIZE, 0,
+                   AMQP_SASL_METHOD_PLAIN, info.user, info.password)
+                .reply_type == AMQP_RESPONSE_NORMAL,
+        "amqp_login failed");
+  check(amqp_set_recovery(conn, &info, &timeout) == AMQP_STATUS_OK,
+        "amqp_set_recovery failed");
+  check(amqp_channel_open(conn, 1) != NULL, "amqp_channel_open failed");
+  check(amqp_basic_consume(conn, 1, amqp_cstring_bytes("queue"),
+                           amqp_cstring_bytes("ctag"), 0, 0, 0,
+                           amqp_empty_table) != NULL,
+        "amqp_basic_consume failed");
+
+  pool = amqp_worker_pool_new(conn, 1, 0, ack_after_recovery, NULL, NULL);
+  check(pool != NULL, "amqp_worker_pool_new failed");
+  check(amqp_worker_pool_dispatch(pool, &timeout, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "delivery before the failure not dispatched");
+  check(amqp_worker_pool_dispatch(pool, &timeout, 0).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "delivery after recovery not dispatched");
+  recovered = 1;
+  check(amqp_worker_pool_destroy(pool) == AMQP_STATUS_OK,
+        "amqp_worker_pool_destroy failed");
+
+  check(amqp_connection_close(conn, AMQP_REPLY_SUCCESS).reply_type ==
+            AMQP_RESPONSE_NORMAL,
+        "amqp_connection_close failed");
+  amqp_destroy_connection(conn);
+  pthread_join(broker_thread, NULL);
+  close(listen_fd);
+}
+
+int main(void) {
+  char settled[NUM_DELIVERIES];
+  amqp_connection_state_t conn, broker;
+  amqp_worker_pool_t *pool;
+  struct timeval immediate = {0, 0};
+  int acks = 0;
+  int i;
+
+  connection_pair(&conn, &broker);
+
+  check(amqp_worker_pool_new(conn, 0, 0, process, NULL, NULL) == NULL,
+        "pool without workers created");
+  /* Small queues so the IO thread has to wait for the workers */
+  pool = amqp_worker_pool_new(conn, 3, 2, process, NULL, NULL);
+  if (NULL == pool) {
+    /* No thread support on this platform */
+    return 0;
+  }
+
+  /* Deliveries and acks are exchanged in batches, a socket pair only
+   * buffers so much */
+  memset(settled, 0, sizeof(settled));
+  for (i = 0; i < NUM_DELIVERIES; i += BATCH) {
+    int j;
+    for (j = i; j < i + BATCH; ++j) {
+      deliver_seq(broker, j);
+    }
+    for (j = i; j < i + BATCH; ++j) {
+      amqp_rpc_reply_t ret = amqp_worker_pool_dispatch(pool, NULL, 0);
+      check(AMQP_RESPONSE_NORMAL == ret.reply_type,
+            "amqp_worker_pool_dispatch failed");
+    }
+    while (read_settlement(broker, &immediate, settled)) {
+      acks++;
+    }
+  }
+  check(amqp_worker_pool_destroy(pool) == AMQP_STATUS_OK,
+        "amqp_worker_pool_destroy failed");
+  while (acks < NUM_DELIVERIES) {
+    check(read_settlement(broker, NULL, settled), "ack not received");
+    acks++;
+  }
+
+  for (i = 0; i < NUM_KEYS; ++i) {
+    check(keys[i].count == NUM_DELIVERIES / NUM_KEYS, "delivery lost");
+    check(!keys[i].out_of_order, "deliveries of a key reordered");
+    check(!keys[i].moved, "key processed by several workers");
+  }
+
+  amqp_destroy_connection(broker);
+  amqp_destroy_connection(conn);
+
+  test_recovery();
+  return 0;
+}
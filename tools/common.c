@@ -42,6 +42,9 @@
 #include <amqp_ssl_socket.h>
 #endif
 #include <amqp_tcp_socket.h>
+#ifndef _WIN32
+#include <amqp_unix_socket.h>
+#endif
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
@@ -295,7 +298,16 @@ amqp_connection_state_t make_connection(void) {
 
   init_connection_info(&ci);
   conn = amqp_new_connection();
-  if (ci.ssl) {
+  if ('/' == ci.host[0] && 0 == ci.port) {
+#ifndef _WIN32
+    socket = amqp_unix_socket_new(conn);
+    if (!socket) {
+      die("creating Unix domain socket (out of memory)");
+    }
+#else
+    die("Unix domain sockets are not supported on this platform");
+#endif
+  } else if (ci.ssl) {
 #ifdef WITH_SSL
     socket = amqp_ssl_socket_new(conn);
     if (!socket) {
@@ -318,6 +330,9 @@ amqp_connection_state_t make_connection(void) {
   }
   status = amqp_socket_open(socket, ci.host, ci.port);
   if (status) {
+    if (0 == ci.port) {
+      die("opening socket to %s", ci.host);
+    }
     die("opening socket to %s:%d", ci.host, ci.port);
   }
   die_rpc(amqp_login(conn, ci.vhost, 0, 131072, amqp_heartbeat,